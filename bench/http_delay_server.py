@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+#
+# HTTP server which delays a fraction of the requests, used to
+# simulate a mirror with a long latency tail (see bench/README).
+#
+# usage: http_delay_server.py port dir [slow_fraction [slow_delay_s]]
+#
+import http.server
+import os
+import random
+import sys
+import time
+
+port = int(sys.argv[1])
+root = sys.argv[2]
+slow_fraction = float(sys.argv[3]) if len(sys.argv) > 3 else 0.0
+slow_delay = float(sys.argv[4]) if len(sys.argv) > 4 else 0.4
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def send_head(self):
+        # base latency of a nearby server
+        time.sleep(0.002)
+        if random.random() < slow_fraction:
+            time.sleep(slow_delay)
+        return super().send_head()
+
+    def copyfile(self, source, outputfile):
+        # the client cancels the losing transfer of a hedged request
+        try:
+            super().copyfile(source, outputfile)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+    def log_message(self, *args):
+        pass
+
+os.chdir(root)
+http.server.ThreadingHTTPServer(('127.0.0.1', port),
+                                Handler).serve_forever()
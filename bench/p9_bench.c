@@ -0,0 +1,691 @@
+/*
+ * 9P filesystem device benchmark
+ *
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "cutils.h"
+#include "iomem.h"
+#include "virtio.h"
+
+/* The benchmark plays the role of the guest driver: it builds the 9P
+   requests in the guest RAM and submits them to the virtio-mmio 9P
+   device backed by fs_disk. The reply buffer of a request is a chain
+   of 4 KB descriptors, as with Linux. With '-f', its pages are taken
+   in a random order so that the guest buffers are not host
+   contiguous. */
+
+#define RAM_BASE 0x80000000
+#define RAM_SIZE (64 << 20)
+#define DEV_BASE 0x40000000
+
+#define QUEUE_NUM 1024
+#define DESC_OFFSET  0x000000
+#define AVAIL_OFFSET 0x004000
+#define USED_OFFSET  0x008000
+#define REQ_OFFSET   0x100000 /* request, at most msize bytes */
+#define REPLY_OFFSET 0x400000 /* contiguous reply pages */
+#define POOL_OFFSET  0x1000000 /* reply pages used with '-f' */
+
+#define PAGE_SIZE 4096
+#define MSIZE_MAX (1 << 20)
+#define REPLY_PAGES (MSIZE_MAX / PAGE_SIZE)
+
+#define VIRTIO_MMIO_QUEUE_SEL       0x030
+#define VIRTIO_MMIO_QUEUE_NUM       0x038
+#define VIRTIO_MMIO_QUEUE_READY     0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY    0x050
+#define VIRTIO_MMIO_STATUS          0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW  0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW 0x090
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW  0x0a0
+#define VIRTIO_MMIO_QUEUE_USED_HIGH 0x0a4
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2
+
+#define BULK_FILE_SIZE (64 << 20)
+#define SMALL_FILE_COUNT 2000
+#define TREE_DIRS 20
+#define TREE_SUBDIRS 10
+#define TREE_FILES 10
+
+#define ROOT_FID 1
+
+static PhysMemoryRange *dev_range;
+static uint8_t *ram;
+static uint16_t avail_idx, used_idx;
+static int msize;
+static BOOL fragmented;
+static int reply_pages[REPLY_PAGES];
+static int next_fid;
+
+static uint8_t *req_ptr;
+static int req_len;
+static uint8_t reply[MSIZE_MAX];
+
+/* dummy audio output used by virtio-input */
+void beep(int freq)
+{
+}
+
+static int64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
+}
+
+static void dummy_set_irq(void *opaque, int irq_num, int level)
+{
+}
+
+static void dev_write(uint32_t offset, uint32_t val)
+{
+    dev_range->write_func(dev_range->opaque, offset, val, 2);
+}
+
+static void set_desc(int idx, uint64_t addr, uint32_t len, int flags,
+                     int next)
+{
+    uint8_t *p = ram + DESC_OFFSET + idx * 16;
+    put_le64(p, addr);
+    put_le32(p + 8, len);
+    put_le16(p + 12, flags);
+    put_le16(p + 14, next);
+}
+
+/* offset in RAM of the reply page 'i' */
+static uint32_t get_reply_page(int i)
+{
+    if (fragmented && i > 0)
+        return POOL_OFFSET + reply_pages[i] * PAGE_SIZE;
+    else
+        return REPLY_OFFSET + i * PAGE_SIZE;
+}
+
+static void put_u8(int v)
+{
+    req_ptr[req_len++] = v;
+}
+
+static void put_u16(int v)
+{
+    put_le16(req_ptr + req_len, v);
+    req_len += 2;
+}
+
+static void put_u32(uint32_t v)
+{
+    put_le32(req_ptr + req_len, v);
+    req_len += 4;
+}
+
+static void put_u64(uint64_t v)
+{
+    put_le64(req_ptr + req_len, v);
+    req_len += 8;
+}
+
+static void put_str(const char *str)
+{
+    int len = strlen(str);
+    put_u16(len);
+    memcpy(req_ptr + req_len, str, len);
+    req_len += len;
+}
+
+static void req_start(int id)
+{
+    req_ptr = ram + REQ_OFFSET;
+    req_len = 0;
+    put_u32(0);
+    put_u8(id);
+    put_u16(1); /* tag */
+}
+
+/* Submit the current request with a reply buffer of 'reply_size'
+   bytes and copy the first 'copy_len' bytes of the reply to
+   'reply'. Return the reply length or -errno for Rlerror. */
+static int req_submit(int reply_size, int copy_len)
+{
+    int i, l, nb_desc, reply_len;
+    uint8_t *p;
+
+    put_le32(req_ptr, req_len);
+    set_desc(0, RAM_BASE + REQ_OFFSET, req_len, VRING_DESC_F_NEXT, 1);
+    nb_desc = 1;
+    for(i = 0; i < reply_size; i += PAGE_SIZE) {
+        l = min_int(reply_size - i, PAGE_SIZE);
+        set_desc(nb_desc, RAM_BASE + get_reply_page(i / PAGE_SIZE), l,
+                 VRING_DESC_F_WRITE |
+                 (i + l < reply_size ? VRING_DESC_F_NEXT : 0),
+                 nb_desc + 1);
+        nb_desc++;
+    }
+    put_le16(ram + AVAIL_OFFSET + 4 + (avail_idx % QUEUE_NUM) * 2, 0);
+    avail_idx++;
+    put_le16(ram + AVAIL_OFFSET + 2, avail_idx);
+    dev_write(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+
+    /* fs_disk replies synchronously */
+    if (get_le16(ram + USED_OFFSET + 2) != (uint16_t)(used_idx + 1)) {
+        fprintf(stderr, "9p request not completed\n");
+        exit(1);
+    }
+    p = ram + USED_OFFSET + 4 + (used_idx % QUEUE_NUM) * 8;
+    used_idx++;
+    reply_len = get_le32(p + 4);
+    copy_len = min_int(copy_len, reply_len);
+    for(i = 0; i < copy_len; i += PAGE_SIZE) {
+        l = min_int(copy_len - i, PAGE_SIZE);
+        memcpy(reply + i, ram + get_reply_page(i / PAGE_SIZE), l);
+    }
+    if (reply[4] == 7) /* Rlerror */
+        return -get_le32(reply + 7);
+    return reply_len;
+}
+
+static int p9_walk(int fid, int newfid, const char *name)
+{
+    req_start(110);
+    put_u32(fid);
+    put_u32(newfid);
+    if (name) {
+        put_u16(1);
+        put_str(name);
+    } else {
+        put_u16(0);
+    }
+    return req_submit(PAGE_SIZE, PAGE_SIZE);
+}
+
+static int p9_lopen(int fid, int flags)
+{
+    req_start(12);
+    put_u32(fid);
+    put_u32(flags);
+    return req_submit(PAGE_SIZE, PAGE_SIZE);
+}
+
+static int p9_getattr(int fid)
+{
+    req_start(24);
+    put_u32(fid);
+    put_u64(0x3fff);
+    return req_submit(PAGE_SIZE, PAGE_SIZE);
+}
+
+static void p9_clunk(int fid)
+{
+    req_start(120);
+    put_u32(fid);
+    req_submit(PAGE_SIZE, PAGE_SIZE);
+}
+
+/* read (id = 116) or readdir (id = 40). Return the number of bytes,
+   of which the first 'copy_len' are at 'reply + 11'. */
+static int p9_read(int id, int fid, uint64_t offset, int count,
+                   int copy_len)
+{
+    int ret;
+    req_start(id);
+    put_u32(fid);
+    put_u64(offset);
+    put_u32(count);
+    ret = req_submit(count + 11, copy_len + 11);
+    if (ret < 0)
+        return ret;
+    return get_le32(reply + 7);
+}
+
+static int p9_write(int fid, uint64_t offset, const uint8_t *buf, int count)
+{
+    int ret;
+    req_start(118);
+    put_u32(fid);
+    put_u64(offset);
+    put_u32(count);
+    memcpy(req_ptr + req_len, buf, count);
+    req_len += count;
+    ret = req_submit(PAGE_SIZE, PAGE_SIZE);
+    if (ret < 0)
+        return ret;
+    return get_le32(reply + 7);
+}
+
+static void p9_init(const char *root_path)
+{
+    PhysMemoryMap *mem_map;
+    PhysMemoryRange *ram_range;
+    IRQSignal irq;
+    VIRTIOBusDef bus;
+    FSDevice *fs;
+    uint32_t a;
+    int i, j, tmp;
+
+    mem_map = phys_mem_map_init();
+    ram_range = cpu_register_ram(mem_map, RAM_BASE, RAM_SIZE, 0);
+    ram = ram_range->phys_mem;
+    irq_init(&irq, dummy_set_irq, NULL, 0);
+    memset(&bus, 0, sizeof(bus));
+    bus.mem_map = mem_map;
+    bus.addr = DEV_BASE;
+    bus.irq = &irq;
+    fs = fs_disk_init(root_path);
+    if (!fs) {
+        fprintf(stderr, "%s: cannot open the directory\n", root_path);
+        exit(1);
+    }
+    virtio_9p_init(&bus, fs, "root");
+    dev_range = get_phys_mem_range(mem_map, DEV_BASE);
+
+    dev_write(VIRTIO_MMIO_QUEUE_SEL, 0);
+    dev_write(VIRTIO_MMIO_QUEUE_NUM, QUEUE_NUM);
+    a = RAM_BASE + DESC_OFFSET;
+    dev_write(VIRTIO_MMIO_QUEUE_DESC_LOW, a);
+    dev_write(VIRTIO_MMIO_QUEUE_DESC_HIGH, 0);
+    a = RAM_BASE + AVAIL_OFFSET;
+    dev_write(VIRTIO_MMIO_QUEUE_AVAIL_LOW, a);
+    dev_write(VIRTIO_MMIO_QUEUE_AVAIL_HIGH, 0);
+    a = RAM_BASE + USED_OFFSET;
+    dev_write(VIRTIO_MMIO_QUEUE_USED_LOW, a);
+    dev_write(VIRTIO_MMIO_QUEUE_USED_HIGH, 0);
+    dev_write(VIRTIO_MMIO_QUEUE_READY, 1);
+    dev_write(VIRTIO_MMIO_STATUS, 0xf);
+
+    /* random permutation of the reply pages */
+    srand(1);
+    for(i = 0; i < REPLY_PAGES; i++)
+        reply_pages[i] = i;
+    for(i = REPLY_PAGES - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = reply_pages[i];
+        reply_pages[i] = reply_pages[j];
+        reply_pages[j] = tmp;
+    }
+
+    req_start(100); /* version */
+    put_u32(msize);
+    put_str("9P2000.L");
+    if (req_submit(PAGE_SIZE, PAGE_SIZE) < 0) {
+        fprintf(stderr, "9p version failed\n");
+        exit(1);
+    }
+    msize = get_le32(reply + 7);
+
+    req_start(104); /* attach */
+    put_u32(ROOT_FID);
+    put_u32(~0);
+    put_str("root");
+    put_str("");
+    put_u32(0);
+    if (req_submit(PAGE_SIZE, PAGE_SIZE) < 0) {
+        fprintf(stderr, "9p attach failed\n");
+        exit(1);
+    }
+    next_fid = ROOT_FID + 1;
+}
+
+static int get_file_byte(int i, uint64_t pos)
+{
+    return (i * 31 + pos * 7 + (pos >> 12)) & 0xff;
+}
+
+static int get_small_file_size(int i)
+{
+    return 1000 + i;
+}
+
+static void write_file(const char *filename, int i, int size)
+{
+    FILE *f;
+    int j;
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    for(j = 0; j < size; j++)
+        fputc(get_file_byte(i, j), f);
+    fclose(f);
+}
+
+static void generate_files(const char *dir)
+{
+    char filename[1024];
+    int i, j, k;
+
+    mkdir(dir, 0755);
+    snprintf(filename, sizeof(filename), "%s/bulk", dir);
+    write_file(filename, 0, BULK_FILE_SIZE);
+    snprintf(filename, sizeof(filename), "%s/small", dir);
+    mkdir(filename, 0755);
+    for(i = 0; i < SMALL_FILE_COUNT; i++) {
+        snprintf(filename, sizeof(filename), "%s/small/f%d", dir, i);
+        write_file(filename, i, get_small_file_size(i));
+    }
+    snprintf(filename, sizeof(filename), "%s/tree", dir);
+    mkdir(filename, 0755);
+    for(i = 0; i < TREE_DIRS; i++) {
+        snprintf(filename, sizeof(filename), "%s/tree/d%d", dir, i);
+        mkdir(filename, 0755);
+        for(j = 0; j < TREE_SUBDIRS; j++) {
+            snprintf(filename, sizeof(filename), "%s/tree/d%d/e%d",
+                     dir, i, j);
+            mkdir(filename, 0755);
+            for(k = 0; k < TREE_FILES; k++) {
+                snprintf(filename, sizeof(filename), "%s/tree/d%d/e%d/f%d",
+                         dir, i, j, k);
+                write_file(filename, k, 100);
+            }
+        }
+    }
+}
+
+static void walk_to(int newfid, const char *name)
+{
+    if (p9_walk(ROOT_FID, newfid, name) < 0) {
+        fprintf(stderr, "%s: not found\n", name);
+        exit(1);
+    }
+}
+
+static void check_data(int i, uint64_t offset, const uint8_t *buf, int len)
+{
+    int j;
+    for(j = 0; j < len; j++) {
+        if (buf[j] != get_file_byte(i, offset + j)) {
+            fprintf(stderr, "data mismatch at offset %" PRIu64 "\n",
+                    offset + j);
+            exit(1);
+        }
+    }
+}
+
+/* 4 sequential reads of a 64 MB file, the first one is checked */
+static void bench_read(void)
+{
+    int64_t t0, total;
+    uint64_t offset;
+    int pass, n, fid;
+
+    t0 = get_time_us();
+    total = 0;
+    fid = next_fid++;
+    for(pass = 0; pass < 4; pass++) {
+        walk_to(fid, "bulk");
+        p9_lopen(fid, 0);
+        offset = 0;
+        for(;;) {
+            n = p9_read(116, fid, offset, msize - 11,
+                        pass == 0 ? msize - 11 : 0);
+            if (n <= 0)
+                break;
+            if (pass == 0)
+                check_data(0, offset, reply + 11, n);
+            offset += n;
+            total += n;
+        }
+        if (offset != BULK_FILE_SIZE) {
+            fprintf(stderr, "short read\n");
+            exit(1);
+        }
+        p9_clunk(fid);
+    }
+    t0 = get_time_us() - t0;
+    printf("read:  %4" PRId64 " MB in %.3f s = %6.0f MB/s\n",
+           total >> 20, t0 / 1e6, (double)total / t0);
+}
+
+/* 64 MB written to a new file with writes of msize - 23 bytes,
+   checked afterwards */
+static void bench_write(const char *root_path)
+{
+    char filename[1024];
+    uint8_t *buf;
+    int64_t t0, total;
+    int i, j, n, count, nb_writes, fid;
+    FILE *f;
+
+    snprintf(filename, sizeof(filename), "%s/wout", root_path);
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
+    count = msize - 23;
+    nb_writes = BULK_FILE_SIZE / count;
+    buf = malloc(count);
+    for(j = 0; j < count; j++)
+        buf[j] = get_file_byte(1, j);
+    fid = next_fid++;
+    walk_to(fid, "wout");
+    p9_lopen(fid, 2);
+    t0 = get_time_us();
+    total = 0;
+    for(i = 0; i < nb_writes; i++) {
+        n = p9_write(fid, (uint64_t)i * count, buf, count);
+        if (n != count) {
+            fprintf(stderr, "write error\n");
+            exit(1);
+        }
+        total += n;
+    }
+    t0 = get_time_us() - t0;
+    p9_clunk(fid);
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    for(i = 0; i < nb_writes; i++) {
+        if (fread(buf, 1, count, f) != count) {
+            fprintf(stderr, "short write\n");
+            exit(1);
+        }
+        check_data(1, 0, buf, count);
+    }
+    fclose(f);
+    unlink(filename);
+    free(buf);
+    printf("write: %4" PRId64 " MB in %.3f s = %6.0f MB/s\n",
+           total >> 20, t0 / 1e6, (double)total / t0);
+}
+
+/* walk, lopen, read and clunk of small files */
+static void bench_small(void)
+{
+    char name[64];
+    int64_t t0;
+    int pass, i, n, fid, nb_files;
+
+    fid = next_fid++;
+    nb_files = 0;
+    t0 = get_time_us();
+    for(pass = 0; pass < 10; pass++) {
+        for(i = 0; i < SMALL_FILE_COUNT; i++) {
+            snprintf(name, sizeof(name), "f%d", i);
+            req_start(110);
+            put_u32(ROOT_FID);
+            put_u32(fid);
+            put_u16(2);
+            put_str("small");
+            put_str(name);
+            if (req_submit(PAGE_SIZE, PAGE_SIZE) < 0) {
+                fprintf(stderr, "small/%s: not found\n", name);
+                exit(1);
+            }
+            p9_lopen(fid, 0);
+            n = p9_read(116, fid, 0, msize - 11, PAGE_SIZE);
+            if (n != get_small_file_size(i)) {
+                fprintf(stderr, "small/%s: bad length\n", name);
+                exit(1);
+            }
+            p9_clunk(fid);
+            nb_files++;
+        }
+    }
+    t0 = get_time_us() - t0;
+    printf("small: %d files in %.3f s = %6.0f files/s\n",
+           nb_files, t0 / 1e6, nb_files * 1e6 / t0);
+}
+
+/* readdir, walk, getattr and clunk of each entry, as 'find -ls' */
+static int find_dir(int dir_fid, uint8_t *dir_buf)
+{
+    uint64_t offset;
+    uint8_t *p;
+    char name[256];
+    int n, pos, len, type, fid, fid1, nb_entries;
+
+    fid = next_fid++;
+    p9_walk(dir_fid, fid, NULL);
+    p9_lopen(fid, 0x10000); /* O_DIRECTORY */
+    offset = 0;
+    nb_entries = 0;
+    for(;;) {
+        n = p9_read(40, fid, offset, msize - 11, msize - 11);
+        if (n <= 0)
+            break;
+        memcpy(dir_buf, reply + 11, n);
+        for(pos = 0; pos < n; pos += 24 + len) {
+            p = dir_buf + pos;
+            type = p[0]; /* qid type */
+            offset = get_le64(p + 13);
+            len = get_le16(p + 22);
+            memcpy(name, p + 24, len);
+            name[len] = '\0';
+            if (!strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+            nb_entries++;
+            fid1 = next_fid++;
+            if (p9_walk(fid, fid1, name) < 0) {
+                fprintf(stderr, "%s: not found\n", name);
+                exit(1);
+            }
+            p9_getattr(fid1);
+            if (type & 0x80)
+                nb_entries += find_dir(fid1, dir_buf + n);
+            p9_clunk(fid1);
+        }
+    }
+    p9_clunk(fid);
+    return nb_entries;
+}
+
+static void bench_find(void)
+{
+    uint8_t *dir_buf;
+    int64_t t0;
+    int pass, fid, nb_entries;
+
+    /* one directory buffer per level */
+    dir_buf = malloc(8 * MSIZE_MAX);
+    fid = next_fid++;
+    walk_to(fid, "tree");
+    nb_entries = 0;
+    t0 = get_time_us();
+    for(pass = 0; pass < 20; pass++)
+        nb_entries += find_dir(fid, dir_buf);
+    t0 = get_time_us() - t0;
+    p9_clunk(fid);
+    free(dir_buf);
+    printf("find:  %d entries in %.3f s = %6.0f entries/s\n",
+           nb_entries, t0 / 1e6, nb_entries * 1e6 / t0);
+}
+
+static void help(void)
+{
+    printf("usage: p9_bench [-m msize] [-f] dir [workload...]\n"
+           "       p9_bench -g dir\n"
+           "\n"
+           "Run the workloads on the virtio 9P device exporting 'dir'.\n"
+           "\n"
+           "options are:\n"
+           "-m msize    maximum message size (default: 131072)\n"
+           "-f          fragmented guest buffers\n"
+           "-g dir      generate the files in 'dir'\n"
+           "\n"
+           "workloads: read write small find (default: all)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *root_path, *workload;
+    int c, i;
+
+    msize = 128 * 1024;
+    for(;;) {
+        c = getopt(argc, argv, "hm:fg:");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'm':
+            msize = strtoul(optarg, NULL, 0);
+            if (msize < PAGE_SIZE || msize > MSIZE_MAX) {
+                fprintf(stderr, "invalid msize\n");
+                exit(1);
+            }
+            break;
+        case 'f':
+            fragmented = TRUE;
+            break;
+        case 'g':
+            generate_files(optarg);
+            return 0;
+        default:
+            help();
+        }
+    }
+    if (optind >= argc)
+        help();
+    root_path = argv[optind++];
+
+    p9_init(root_path);
+    printf("msize %d, %s guest buffers\n", msize,
+           fragmented ? "fragmented" : "contiguous");
+    for(i = optind; i < argc || i == optind; i++) {
+        workload = i < argc ? argv[i] : NULL;
+        if (!workload || !strcmp(workload, "read"))
+            bench_read();
+        if (!workload || !strcmp(workload, "write"))
+            bench_write(root_path);
+        if (!workload || !strcmp(workload, "small"))
+            bench_small();
+        if (!workload || !strcmp(workload, "find"))
+            bench_find();
+    }
+    return 0;
+}
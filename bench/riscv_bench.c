@@ -0,0 +1,523 @@
+/*
+ * RISC-V interpreter benchmark
+ *
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+/* Each workload is a bare metal program loaded as BIOS. It runs a loop
+   a fixed number of times, checks its result, prints 'P' (or 'F') on
+   the HTIF console and powers off. The run time of the temu process is
+   measured, so the emulator startup (a few ms) is included. A trap
+   (e.g. an instruction not supported by the selected ISA) prints
+   'F'. */
+
+#define HTIF_BASE 0x40008000
+#define BIOS_BASE 0x80000000
+
+enum {
+    R_ZERO = 0, R_T0 = 5, R_T1 = 6, R_T2 = 7, R_S0 = 8, R_S1 = 9,
+    R_A0 = 10, R_A1 = 11, R_A2 = 12, R_A3 = 13,
+};
+
+#define MAX_CODE 256
+#define MAX_LABELS 8
+#define MAX_FIXUPS 16
+
+/* labels used by the prolog and the epilog */
+enum { L_START = MAX_LABELS - 4, L_FAIL, L_END, L_HANG };
+
+typedef struct {
+    uint32_t code[MAX_CODE];
+    int len;
+    int labels[MAX_LABELS];
+    struct {
+        int pos;
+        int label;
+    } fixups[MAX_FIXUPS];
+    int n_fixups;
+} Asm;
+
+static void emit(Asm *a, uint32_t insn)
+{
+    if (a->len >= MAX_CODE) {
+        fprintf(stderr, "code too large\n");
+        exit(1);
+    }
+    a->code[a->len++] = insn;
+}
+
+static void label(Asm *a, int l)
+{
+    a->labels[l] = a->len;
+}
+
+static void i_type(Asm *a, int opc, int funct3, int rd, int rs1, int imm)
+{
+    emit(a, ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) |
+         (rd << 7) | opc);
+}
+
+static void r_type(Asm *a, int opc, int funct3, int funct7,
+                   int rd, int rs1, int rs2)
+{
+    emit(a, (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+         (rd << 7) | opc);
+}
+
+static void s_type(Asm *a, int funct3, int rs2, int rs1, int imm)
+{
+    emit(a, (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) |
+         (funct3 << 12) | ((imm & 0x1f) << 7) | 0x23);
+}
+
+static void addi(Asm *a, int rd, int rs1, int imm)
+{
+    i_type(a, 0x13, 0, rd, rs1, imm);
+}
+
+static void andi(Asm *a, int rd, int rs1, int imm)
+{
+    i_type(a, 0x13, 7, rd, rs1, imm);
+}
+
+static void add(Asm *a, int rd, int rs1, int rs2)
+{
+    r_type(a, 0x33, 0, 0, rd, rs1, rs2);
+}
+
+static void xor(Asm *a, int rd, int rs1, int rs2)
+{
+    r_type(a, 0x33, 4, 0, rd, rs1, rs2);
+}
+
+static void mul(Asm *a, int rd, int rs1, int rs2)
+{
+    r_type(a, 0x33, 0, 1, rd, rs1, rs2);
+}
+
+static void ld(Asm *a, int rd, int rs1, int imm)
+{
+    i_type(a, 0x03, 3, rd, rs1, imm);
+}
+
+static void sd(Asm *a, int rs2, int rs1, int imm)
+{
+    s_type(a, 3, rs2, rs1, imm);
+}
+
+static void sw(Asm *a, int rs2, int rs1, int imm)
+{
+    s_type(a, 2, rs2, rs1, imm);
+}
+
+static void csrw(Asm *a, int csr, int rs1)
+{
+    i_type(a, 0x73, 1, 0, rs1, csr);
+}
+
+static void csrs(Asm *a, int csr, int rs1)
+{
+    i_type(a, 0x73, 2, 0, rs1, csr);
+}
+
+/* fadd.d/fmul.d/fcvt.d.l/fcvt.l.d with dynamic rounding */
+static void fop_d(Asm *a, int funct7, int rd, int rs1, int rs2)
+{
+    r_type(a, 0x53, 7, funct7, rd, rs1, rs2);
+}
+
+/* load a 32 bit value, zero extended */
+static void li(Asm *a, int rd, uint32_t val)
+{
+    int32_t hi, lo;
+    hi = ((int32_t)val + 0x800) >> 12;
+    lo = (int32_t)val - (hi << 12);
+    if (hi != 0) {
+        emit(a, ((hi & 0xfffff) << 12) | (rd << 7) | 0x37); /* lui */
+        addi(a, rd, rd, lo);
+    } else {
+        addi(a, rd, R_ZERO, lo);
+    }
+    if (val & 0x80000000) {
+        i_type(a, 0x13, 1, rd, rd, 32); /* slli */
+        i_type(a, 0x13, 5, rd, rd, 32); /* srli */
+    }
+}
+
+/* branch (funct3 = 0: beq, 1: bne) or jal x0 (funct3 = -1) to a label */
+static void branch(Asm *a, int funct3, int rs1, int rs2, int l)
+{
+    if (a->n_fixups >= MAX_FIXUPS) {
+        fprintf(stderr, "too many fixups\n");
+        exit(1);
+    }
+    a->fixups[a->n_fixups].pos = a->len;
+    a->fixups[a->n_fixups].label = l;
+    a->n_fixups++;
+    if (funct3 < 0)
+        emit(a, 0x6f);
+    else
+        emit(a, (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | 0x63);
+}
+
+static void bne(Asm *a, int rs1, int rs2, int l)
+{
+    branch(a, 1, rs1, rs2, l);
+}
+
+static void j(Asm *a, int l)
+{
+    branch(a, -1, 0, 0, l);
+}
+
+static void resolve(Asm *a)
+{
+    int i, pos, off;
+    uint32_t insn;
+
+    for(i = 0; i < a->n_fixups; i++) {
+        pos = a->fixups[i].pos;
+        off = (a->labels[a->fixups[i].label] - pos) * 4;
+        insn = a->code[pos];
+        if ((insn & 0x7f) == 0x6f) {
+            insn |= (((off >> 20) & 1) << 31) | (((off >> 1) & 0x3ff) << 21) |
+                (((off >> 11) & 1) << 20) | (((off >> 12) & 0xff) << 12);
+        } else {
+            insn |= (((off >> 12) & 1) << 31) | (((off >> 5) & 0x3f) << 25) |
+                (((off >> 1) & 0xf) << 8) | (((off >> 11) & 1) << 7);
+        }
+        a->code[pos] = insn;
+    }
+}
+
+/* the trap vector is the second instruction of the program */
+static void emit_prolog(Asm *a)
+{
+    j(a, L_START);
+    j(a, L_FAIL);
+    label(a, L_START);
+    li(a, R_T0, BIOS_BASE + 4);
+    csrw(a, 0x305, R_T0); /* mtvec */
+}
+
+/* print 'P' if a0 == expected, 'F' otherwise, then power off */
+static void emit_epilog(Asm *a, int32_t expected)
+{
+    li(a, R_T2, expected);
+    bne(a, R_A0, R_T2, L_FAIL);
+    li(a, R_T1, 'P');
+    j(a, L_END);
+    label(a, L_FAIL);
+    li(a, R_T1, 'F');
+    label(a, L_END);
+    li(a, R_T0, HTIF_BASE);
+    sw(a, R_T1, R_T0, 0);
+    li(a, R_T1, 0x01010000);
+    sw(a, R_T1, R_T0, 4);
+    li(a, R_T1, 1);
+    sw(a, R_T1, R_T0, 0);
+    sw(a, R_ZERO, R_T0, 4);
+    label(a, L_HANG);
+    j(a, L_HANG);
+}
+
+typedef struct {
+    const char *name;
+    const char *descr;
+    /* return the number of executed instructions per iteration */
+    double (*gen)(Asm *a, int n_iter);
+} Workload;
+
+/* taken branches and jumps: if (i & 1) a0++; else a1++; */
+static double gen_branch(Asm *a, int n_iter)
+{
+    enum { L_LOOP, L_ODD, L_NEXT };
+    li(a, R_S1, n_iter);
+    li(a, R_A0, 0);
+    li(a, R_A1, 0);
+    label(a, L_LOOP);
+    andi(a, R_T0, R_S1, 1);
+    bne(a, R_T0, R_ZERO, L_ODD);
+    addi(a, R_A1, R_A1, 1);
+    j(a, L_NEXT);
+    label(a, L_ODD);
+    addi(a, R_A0, R_A0, 1);
+    label(a, L_NEXT);
+    addi(a, R_S1, R_S1, -1);
+    bne(a, R_S1, R_ZERO, L_LOOP);
+    emit_epilog(a, n_iter / 2);
+    return 5.5;
+}
+
+/* integer ALU, multiply and memory accesses */
+static double gen_int(Asm *a, int n_iter)
+{
+    enum { L_LOOP };
+    li(a, R_S1, n_iter);
+    li(a, R_S0, 0x80100000);
+    li(a, R_A0, 0);
+    li(a, R_A1, 3);
+    label(a, L_LOOP);
+    add(a, R_A0, R_A0, R_A1);
+    mul(a, R_T0, R_A0, R_A1);
+    sd(a, R_T0, R_S0, 0);
+    ld(a, R_T1, R_S0, 0);
+    xor(a, R_A2, R_A2, R_T1);
+    addi(a, R_S1, R_S1, -1);
+    bne(a, R_S1, R_ZERO, L_LOOP);
+    emit_epilog(a, n_iter * 3);
+    return 7;
+}
+
+/* double precision adds and multiplies */
+static double gen_fp(Asm *a, int n_iter)
+{
+    enum { L_LOOP };
+    li(a, R_T0, 1 << 13); /* mstatus.FS = initial */
+    csrs(a, 0x300, R_T0);
+    li(a, R_S1, n_iter);
+    li(a, R_T0, 1);
+    fop_d(a, 0x69, 1, R_T0, 2); /* fcvt.d.l f1, t0 */
+    fop_d(a, 0x69, 2, R_ZERO, 2); /* f2 = 0 */
+    fop_d(a, 0x69, 3, R_T0, 2); /* f3 = 1 */
+    label(a, L_LOOP);
+    fop_d(a, 0x01, 2, 2, 1); /* fadd.d f2, f2, f1 */
+    fop_d(a, 0x09, 3, 3, 1); /* fmul.d f3, f3, f1 */
+    fop_d(a, 0x01, 4, 2, 3); /* fadd.d f4, f2, f3 */
+    addi(a, R_S1, R_S1, -1);
+    bne(a, R_S1, R_ZERO, L_LOOP);
+    fop_d(a, 0x61, R_A0, 2, 2); /* fcvt.l.d a0, f2 */
+    emit_epilog(a, n_iter);
+    return 5;
+}
+
+static const Workload workloads[] = {
+    { "branch", "taken branches and jumps", gen_branch },
+    { "int", "ALU, mul, load/store", gen_int },
+    { "fp", "double precision add/mul", gen_fp },
+};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void write_file(const char *filename, const void *buf, int len)
+{
+    FILE *f;
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fwrite(buf, 1, len, f);
+    fclose(f);
+}
+
+/* run temu and return the time in seconds or -1 if the check failed
+   or if it did not finish within 'timeout' seconds */
+static double run_temu(const char *temu_path, const char *cfg_filename,
+                       int timeout)
+{
+    int pipe_fds[2], status, len, pos, delay;
+    char buf[256];
+    double t0, t1;
+    struct pollfd pfd;
+    int timed_out;
+    pid_t pid;
+
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    t0 = get_time();
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_RDONLY);
+        dup2(fd, 0);
+        dup2(pipe_fds[1], 1);
+        close(pipe_fds[0]);
+        execl(temu_path, temu_path, cfg_filename, NULL);
+        perror(temu_path);
+        _exit(1);
+    }
+    close(pipe_fds[1]);
+    pos = 0;
+    timed_out = 0;
+    while (pos < sizeof(buf) - 1) {
+        delay = (int)((t0 + timeout - get_time()) * 1000);
+        pfd.fd = pipe_fds[0];
+        pfd.events = POLLIN;
+        if (delay <= 0 || poll(&pfd, 1, delay) == 0) {
+            timed_out = 1;
+            kill(pid, SIGKILL);
+            break;
+        }
+        len = read(pipe_fds[0], buf + pos, sizeof(buf) - 1 - pos);
+        if (len <= 0)
+            break;
+        pos += len;
+    }
+    buf[pos] = '\0';
+    close(pipe_fds[0]);
+    waitpid(pid, &status, 0);
+    t1 = get_time();
+    if (timed_out) {
+        fprintf(stderr, "%s: timeout after %d s\n", temu_path, timeout);
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        buf[0] != 'P')
+        return -1;
+    return t1 - t0;
+}
+
+static void help(void)
+{
+    int i;
+    printf("usage: riscv_bench [options] [workload...]\n"
+           "\n"
+           "Run bare metal RISC-V workloads with temu and print the speed\n"
+           "of the interpreter.\n"
+           "\n"
+           "options are:\n"
+           "-t temu      path of the emulator (default: ./temu)\n"
+           "-n n         number of loop iterations (default: 30000000)\n"
+           "-r n         number of runs, the fastest is kept (default: 3)\n"
+           "-i isa       value of the 'isa' option in the VM configuration\n"
+           "-w sec       time limit of a run (default: 60)\n"
+           "\n"
+           "workloads:\n");
+    for(i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        printf("%-12s %s\n", workloads[i].name, workloads[i].descr);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *temu_path, *isa;
+    int c, i, k, n_iter, n_runs, timeout;
+    char bin_filename[64], cfg_filename[64], cfg[256];
+    const Workload *w;
+    double insn_per_iter, t, best;
+    Asm a;
+
+    temu_path = "./temu";
+    isa = NULL;
+    n_iter = 30000000;
+    n_runs = 3;
+    timeout = 60;
+    for(;;) {
+        c = getopt(argc, argv, "ht:n:r:i:w:");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 't':
+            temu_path = optarg;
+            break;
+        case 'n':
+            n_iter = strtoul(optarg, NULL, 0) & ~1;
+            break;
+        case 'r':
+            n_runs = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            isa = optarg;
+            break;
+        case 'w':
+            timeout = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            help();
+        }
+    }
+    if (n_iter <= 0 || n_runs <= 0 || timeout <= 0)
+        help();
+
+    snprintf(bin_filename, sizeof(bin_filename),
+             "/tmp/riscv_bench-%d.bin", getpid());
+    snprintf(cfg_filename, sizeof(cfg_filename),
+             "/tmp/riscv_bench-%d.cfg", getpid());
+    if (isa) {
+        snprintf(cfg, sizeof(cfg), "{ version: 1, machine: \"riscv64\", "
+                 "memory_size: 16, bios: \"%s\", isa: \"%s\" }\n",
+                 bin_filename, isa);
+    } else {
+        snprintf(cfg, sizeof(cfg), "{ version: 1, machine: \"riscv64\", "
+                 "memory_size: 16, bios: \"%s\" }\n", bin_filename);
+    }
+    write_file(cfg_filename, cfg, strlen(cfg));
+
+    printf("%-8s %-10s %8s %8s\n", "workload", "isa", "time(s)", "MIPS");
+    for(i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        w = &workloads[i];
+        if (optind < argc) {
+            for(k = optind; k < argc; k++) {
+                if (!strcmp(argv[k], w->name))
+                    break;
+            }
+            if (k == argc)
+                continue;
+        }
+        memset(&a, 0, sizeof(a));
+        emit_prolog(&a);
+        insn_per_iter = w->gen(&a, n_iter);
+        resolve(&a);
+        write_file(bin_filename, a.code, a.len * 4);
+        best = -1;
+        for(k = 0; k < n_runs; k++) {
+            t = run_temu(temu_path, cfg_filename, timeout);
+            if (t < 0) {
+                best = -1;
+                break;
+            }
+            if (best < 0 || t < best)
+                best = t;
+        }
+        if (best < 0) {
+            printf("%-8s %-10s %8s\n", w->name, isa ? isa : "default",
+                   "failed");
+        } else {
+            printf("%-8s %-10s %8.3f %8.1f\n", w->name,
+                   isa ? isa : "default", best,
+                   insn_per_iter * n_iter / best * 1e-6);
+        }
+    }
+    unlink(bin_filename);
+    unlink(cfg_filename);
+    return 0;
+}
@@ -0,0 +1,846 @@
+/*
+ * Slirp user mode network benchmark
+ *
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cutils.h"
+#include "slirp/libslirp.h"
+
+/* The benchmark plays the role of the guest: it builds the Ethernet
+   frames given to slirp_input() and parses the frames returned by
+   slirp_output(). The host side is an echo server running in a child
+   process on 127.0.0.1, reached by the guest at 10.0.2.2. */
+
+#define GUEST_ADDR 0x0a00020f /* 10.0.2.15 */
+#define HOST_ADDR  0x0a000202 /* 10.0.2.2 */
+#define GUEST_PORT 12345
+
+/* number of frames given to slirp_input() between two polls, as in
+   one virtio-net notification */
+#define TX_BURST 16
+/* maximum number of UDP datagrams in flight */
+#define UDP_WINDOW 256
+/* a datagram without answer after this delay is lost */
+#define UDP_LOSS_DELAY 0.2
+/* size of the messages sent on each TCP connection */
+#define TCP_MSG_SIZE 64
+
+static const uint8_t guest_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t host_mac[6] = { 0x52, 0x55, 0x0a, 0x00, 0x02, 0x02 };
+
+static Slirp *slirp;
+static pid_t server_pid;
+
+/* UDP statistics */
+static int64_t udp_rx_count;
+static int64_t udp_rx_errors;
+
+/* guest side of a TCP connection, from the guest port GUEST_PORT + i */
+typedef enum {
+    TCP_CONN_SYN_SENT,
+    TCP_CONN_ESTABLISHED,
+    TCP_CONN_FIN_SENT,
+    TCP_CONN_CLOSED,
+    TCP_CONN_RESET,
+} TCPConnStateEnum;
+
+typedef struct {
+    TCPConnStateEnum state;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    int64_t rx_bytes;
+    BOOL ack_pending;
+} TCPConn;
+
+static TCPConn *tcp_conns;
+static int tcp_conn_count;
+static uint16_t tcp_server_port;
+/* connections with a received segment to acknowledge */
+static int *tcp_ack_list, *tcp_ack_list1;
+static int tcp_ack_count;
+
+/* TCP statistics */
+static int tcp_established_count;
+static int tcp_closed_count;
+static int64_t tcp_rx_bytes;
+static int64_t tcp_rx_errors;
+
+/* slirp_timer_check.c */
+int slirp_timer_check(Slirp *slirp);
+
+static inline uint16_t get_be16(const uint8_t *d)
+{
+    return (d[0] << 8) | d[1];
+}
+
+static inline void put_be16(uint8_t *d, uint16_t v)
+{
+    d[0] = v >> 8;
+    d[1] = v;
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double get_cpu_time(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+/* number of open file descriptors */
+static int get_fd_count(void)
+{
+    DIR *d;
+    int n;
+
+    d = opendir("/proc/self/fd");
+    if (!d)
+        return -1;
+    n = 0;
+    while (readdir(d) != NULL)
+        n++;
+    closedir(d);
+    return n - 3; /* ".", ".." and the directory */
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, int len)
+{
+    while (len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0)
+        sum += p[0] << 8;
+    return sum;
+}
+
+static uint16_t csum_end(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* build the Ethernet and IPv4 headers of a guest frame. Return the
+   pointer to the IP payload. */
+static uint8_t *build_ip_frame(uint8_t *buf, int protocol, int payload_len)
+{
+    uint8_t *ip = buf + 14;
+    int ip_len = 20 + payload_len;
+
+    memcpy(buf, host_mac, 6);
+    memcpy(buf + 6, guest_mac, 6);
+    put_be16(buf + 12, 0x0800);
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put_be16(ip + 2, ip_len);
+    ip[8] = 64;
+    ip[9] = protocol;
+    put_be32(ip + 12, GUEST_ADDR);
+    put_be32(ip + 16, HOST_ADDR);
+    put_be16(ip + 10, csum_end(csum_add(0, ip, 20)));
+    return ip + 20;
+}
+
+/* sum of the TCP/UDP pseudo header */
+static uint32_t pseudo_header_sum(int protocol, int len)
+{
+    uint8_t buf[12];
+
+    put_be32(buf, GUEST_ADDR);
+    put_be32(buf + 4, HOST_ADDR);
+    buf[8] = 0;
+    buf[9] = protocol;
+    put_be16(buf + 10, len);
+    return csum_add(0, buf, 12);
+}
+
+/* announce the guest MAC address with a gratuitous ARP request */
+static void send_arp(void)
+{
+    uint8_t buf[42];
+
+    memset(buf, 0xff, 6);
+    memcpy(buf + 6, guest_mac, 6);
+    put_be16(buf + 12, 0x0806);
+    put_be16(buf + 14, 1); /* Ethernet */
+    put_be16(buf + 16, 0x0800);
+    buf[18] = 6;
+    buf[19] = 4;
+    put_be16(buf + 20, 1); /* request */
+    memcpy(buf + 22, guest_mac, 6);
+    put_be32(buf + 28, GUEST_ADDR);
+    memset(buf + 32, 0, 6);
+    put_be32(buf + 38, HOST_ADDR);
+    slirp_input(slirp, buf, sizeof(buf));
+}
+
+static void slirp_poll(int timeout_ms)
+{
+    fd_set rfds, wfds, efds;
+    struct timeval tv;
+    int nfds, ret;
+
+    nfds = -1;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    slirp_select_fill(slirp, &nfds, &rfds, &wfds, &efds);
+    tv.tv_sec = 0;
+    tv.tv_usec = timeout_ms * 1000;
+    ret = select(nfds + 1, &rfds, &wfds, &efds, &tv);
+    slirp_select_poll(slirp, &rfds, &wfds, &efds, ret <= 0);
+}
+
+int slirp_can_output(void *opaque)
+{
+    return 1;
+}
+
+static int get_udp_byte(int pos)
+{
+    return (pos * 7) & 0xff;
+}
+
+static void udp_output(const uint8_t *ip, int ip_len)
+{
+    int hlen, frag_offset, pos, i;
+
+    hlen = (ip[0] & 0xf) * 4;
+    frag_offset = (get_be16(ip + 6) & 0x1fff) * 8;
+    /* the datagram is counted with its first fragment */
+    if (frag_offset == 0)
+        udp_rx_count++;
+    /* check the payload */
+    for(i = hlen; i < ip_len; i++) {
+        pos = frag_offset + i - hlen - 8;
+        if (pos >= 0 && ip[i] != get_udp_byte(pos)) {
+            udp_rx_errors++;
+            break;
+        }
+    }
+}
+
+static int get_tcp_byte(int pos)
+{
+    return (pos * 13 + 1) & 0xff;
+}
+
+static void tcp_queue_ack(int i)
+{
+    if (!tcp_conns[i].ack_pending) {
+        tcp_conns[i].ack_pending = TRUE;
+        tcp_ack_list[tcp_ack_count++] = i;
+    }
+}
+
+/* segment sent by slirp to the guest */
+static void tcp_guest_input(const uint8_t *ip, int ip_len)
+{
+    const uint8_t *tcp;
+    TCPConn *c;
+    uint32_t seq;
+    int hlen, i, j, flags, len;
+
+    hlen = (ip[0] & 0xf) * 4;
+    tcp = ip + hlen;
+    if (get_be16(tcp) != tcp_server_port)
+        return;
+    i = get_be16(tcp + 2) - GUEST_PORT;
+    if (i < 0 || i >= tcp_conn_count)
+        return;
+    c = &tcp_conns[i];
+    flags = tcp[13];
+    seq = get_be32(tcp + 4);
+    len = ip_len - hlen - (tcp[12] >> 4) * 4;
+    if (flags & 0x04) { /* RST */
+        if (c->state != TCP_CONN_RESET) {
+            c->state = TCP_CONN_RESET;
+            tcp_closed_count++;
+        }
+        return;
+    }
+    if ((flags & 0x12) == 0x12) { /* SYN ACK */
+        if (c->state == TCP_CONN_SYN_SENT) {
+            c->rcv_nxt = seq + 1;
+            c->state = TCP_CONN_ESTABLISHED;
+            tcp_established_count++;
+        }
+        tcp_queue_ack(i);
+        return;
+    }
+    if (seq != c->rcv_nxt) {
+        /* retransmission or keepalive probe */
+        tcp_queue_ack(i);
+        return;
+    }
+    if (len > 0) {
+        tcp = tcp + (tcp[12] >> 4) * 4;
+        for(j = 0; j < len; j++) {
+            if (tcp[j] != get_tcp_byte((c->rx_bytes + j) % TCP_MSG_SIZE)) {
+                tcp_rx_errors++;
+                break;
+            }
+        }
+        c->rcv_nxt += len;
+        c->rx_bytes += len;
+        tcp_rx_bytes += len;
+        tcp_queue_ack(i);
+    }
+    if ((flags & 0x01) && c->state == TCP_CONN_FIN_SENT) { /* FIN */
+        c->rcv_nxt++;
+        c->state = TCP_CONN_CLOSED;
+        tcp_closed_count++;
+        tcp_queue_ack(i);
+    }
+}
+
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
+{
+    const uint8_t *ip;
+    int ip_len;
+
+    if (pkt_len < 14 + 20 || get_be16(pkt + 12) != 0x0800)
+        return;
+    ip = pkt + 14;
+    ip_len = get_be16(ip + 2);
+    if (ip_len > pkt_len - 14)
+        return;
+    if (ip[9] == IPPROTO_UDP)
+        udp_output(ip, ip_len);
+    else if (ip[9] == IPPROTO_TCP)
+        tcp_guest_input(ip, ip_len);
+}
+
+/* bind a socket on 127.0.0.1 with a free port */
+static int bind_local_socket(int type, int *pport)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int fd;
+
+    fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    *pport = ntohs(addr.sin_port);
+    return fd;
+}
+
+#define ECHO_BATCH 64
+#define UDP_SIZE_MAX 65000
+
+static void udp_echo_server(int fd)
+{
+    static uint8_t bufs[ECHO_BATCH][UDP_SIZE_MAX];
+    struct mmsghdr msgs[ECHO_BATCH];
+    struct iovec iovs[ECHO_BATCH];
+    struct sockaddr_in addrs[ECHO_BATCH];
+    int i, n;
+
+    for(;;) {
+        for(i = 0; i < ECHO_BATCH; i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        n = recvmmsg(fd, msgs, ECHO_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0)
+            continue;
+        for(i = 0; i < n; i++)
+            iovs[i].iov_len = msgs[i].msg_len;
+        sendmmsg(fd, msgs, n, 0);
+    }
+}
+
+static void start_server(int fd, void (*server)(int fd))
+{
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (server_pid == 0) {
+        server(fd);
+        _exit(0);
+    }
+    close(fd);
+}
+
+static void stop_server(void)
+{
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+}
+
+/* send 'count' datagrams of 'size' bytes to the echo server and
+   receive them back */
+static void udp_bench(int size, int count)
+{
+    static uint8_t buf[14 + 20 + 8 + UDP_SIZE_MAX];
+    uint8_t *udp;
+    int64_t tx_count, lost_count, last_rx_count;
+    double t0, last_rx_time, t;
+    int port, i, k;
+
+    start_server(bind_local_socket(SOCK_DGRAM, &port), udp_echo_server);
+
+    udp = build_ip_frame(buf, IPPROTO_UDP, 8 + size);
+    put_be16(udp, GUEST_PORT);
+    put_be16(udp + 2, port);
+    put_be16(udp + 4, 8 + size);
+    put_be16(udp + 6, 0); /* no checksum */
+    for(i = 0; i < size; i++)
+        udp[8 + i] = get_udp_byte(i);
+
+    udp_rx_count = 0;
+    udp_rx_errors = 0;
+    tx_count = 0;
+    lost_count = 0;
+    last_rx_count = 0;
+    t0 = get_time();
+    last_rx_time = t0;
+    while (udp_rx_count + lost_count < count) {
+        for(k = 0; k < TX_BURST && tx_count < count &&
+                tx_count - udp_rx_count - lost_count < UDP_WINDOW; k++) {
+            slirp_input(slirp, buf, 14 + 20 + 8 + size);
+            tx_count++;
+        }
+        slirp_poll(1);
+        t = get_time();
+        if (udp_rx_count != last_rx_count) {
+            last_rx_count = udp_rx_count;
+            last_rx_time = t;
+        } else if (t - last_rx_time > UDP_LOSS_DELAY) {
+            /* the datagrams in flight are lost */
+            lost_count = tx_count - udp_rx_count;
+            last_rx_time = t;
+        }
+    }
+    t = last_rx_time - t0;
+    printf("udp %5d bytes: %" PRId64 "/%d datagrams, %" PRId64
+           " errors, %.3f s, %.0f kpps\n",
+           size, udp_rx_count, count, udp_rx_errors, t,
+           udp_rx_count / t * 1e-3);
+    stop_server();
+}
+
+/* send a segment from the guest on the connection 'i' */
+static void tcp_send(int i, int flags, const uint8_t *data, int len)
+{
+    uint8_t buf[14 + 20 + 20 + TCP_MSG_SIZE];
+    uint8_t *tcp;
+    TCPConn *c = &tcp_conns[i];
+
+    tcp = build_ip_frame(buf, IPPROTO_TCP, 20 + len);
+    put_be16(tcp, GUEST_PORT + i);
+    put_be16(tcp + 2, tcp_server_port);
+    put_be32(tcp + 4, c->snd_nxt);
+    put_be32(tcp + 8, c->rcv_nxt);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    put_be16(tcp + 14, 0xffff); /* window */
+    put_be16(tcp + 16, 0);
+    put_be16(tcp + 18, 0);
+    memcpy(tcp + 20, data, len);
+    put_be16(tcp + 16, csum_end(csum_add(pseudo_header_sum(IPPROTO_TCP,
+                                                           20 + len),
+                                         tcp, 20 + len)));
+    slirp_input(slirp, buf, 14 + 20 + 20 + len);
+    c->snd_nxt += len;
+    if (flags & 0x03) /* SYN or FIN */
+        c->snd_nxt++;
+}
+
+/* poll slirp, then acknowledge the received segments */
+static void tcp_poll(int timeout_ms)
+{
+    int i, n, *list;
+
+    slirp_poll(timeout_ms);
+    /* an ACK can make slirp send more segments, which are queued in
+       the other list */
+    while (tcp_ack_count > 0) {
+        list = tcp_ack_list;
+        n = tcp_ack_count;
+        tcp_ack_list = tcp_ack_list1;
+        tcp_ack_list1 = list;
+        tcp_ack_count = 0;
+        for(i = 0; i < n; i++)
+            tcp_conns[list[i]].ack_pending = FALSE;
+        for(i = 0; i < n; i++)
+            tcp_send(list[i], 0x10, NULL, 0);
+    }
+}
+
+#define TCP_ECHO_EVENTS 256
+
+static void tcp_echo_server(int fd)
+{
+    struct epoll_event ev, events[TCP_ECHO_EVENTS];
+    static uint8_t buf[65536];
+    int epoll_fd, i, n, len, conn_fd;
+
+    /* the pending connections are accepted until EAGAIN */
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    epoll_fd = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    for(;;) {
+        n = epoll_wait(epoll_fd, events, TCP_ECHO_EVENTS, -1);
+        for(i = 0; i < n; i++) {
+            if (events[i].data.fd == fd) {
+                while ((conn_fd = accept4(fd, NULL, NULL,
+                                          SOCK_NONBLOCK)) >= 0) {
+                    ev.events = EPOLLIN;
+                    ev.data.fd = conn_fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev);
+                }
+            } else {
+                conn_fd = events[i].data.fd;
+                len = read(conn_fd, buf, sizeof(buf));
+                if (len <= 0)
+                    close(conn_fd);
+                else
+                    write(conn_fd, buf, len);
+            }
+        }
+    }
+}
+
+/* open 'count' connections, starting with the index 'first' */
+static void tcp_connect(int first, int count)
+{
+    int i;
+
+    for(i = first; i < first + count; i++) {
+        tcp_conns[i].snd_nxt = 1000 * i;
+        tcp_conns[i].state = TCP_CONN_SYN_SENT;
+        tcp_send(i, 0x02, NULL, 0);
+        if ((i % TX_BURST) == TX_BURST - 1)
+            tcp_poll(0);
+    }
+}
+
+static BOOL tcp_wait(const int *pcount, int target, double timeout)
+{
+    double t0 = get_time();
+
+    while (*pcount < target) {
+        if (get_time() - t0 > timeout)
+            return FALSE;
+        tcp_poll(1);
+    }
+    return TRUE;
+}
+
+/* close the established connections and wait for the FIN of slirp */
+static void tcp_close_all(void)
+{
+    int i, n;
+
+    n = 0;
+    for(i = 0; i < tcp_conn_count; i++) {
+        if (tcp_conns[i].state == TCP_CONN_ESTABLISHED) {
+            tcp_conns[i].state = TCP_CONN_FIN_SENT;
+            tcp_send(i, 0x11, NULL, 0);
+            n++;
+        }
+    }
+    tcp_wait(&tcp_closed_count, tcp_closed_count + n, 30);
+}
+
+/* start the TCP echo server, listening before the guest connects */
+static void tcp_start_server(void)
+{
+    int fd, port;
+
+    fd = bind_local_socket(SOCK_STREAM, &port);
+    if (listen(fd, 4096) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    tcp_server_port = port;
+    start_server(fd, tcp_echo_server);
+}
+
+static void tcp_init(int conn_count)
+{
+    tcp_conn_count = conn_count;
+    tcp_conns = mallocz(sizeof(tcp_conns[0]) * conn_count);
+    tcp_ack_list = malloc(sizeof(tcp_ack_list[0]) * conn_count);
+    tcp_ack_list1 = malloc(sizeof(tcp_ack_list[0]) * conn_count);
+    tcp_ack_count = 0;
+    tcp_established_count = 0;
+    tcp_closed_count = 0;
+    tcp_rx_bytes = 0;
+    tcp_rx_errors = 0;
+}
+
+static void tcp_end(void)
+{
+    free(tcp_conns);
+    free(tcp_ack_list);
+    free(tcp_ack_list1);
+    tcp_conns = NULL;
+    tcp_conn_count = 0;
+}
+
+/* open 'conn_count' connections to the echo server, exchange
+   'rounds' messages on each of them, then measure the cost of the
+   idle connections for the main loop and the timers */
+static void tcp_bench(int conn_count, int rounds)
+{
+    uint8_t msg[TCP_MSG_SIZE];
+    int i, k, fd_count0, fd_count1, fd_count2;
+    int64_t target;
+    double t0, t_connect, t_echo, t_idle, t_timers;
+
+    fd_count0 = get_fd_count();
+    tcp_start_server();
+    tcp_init(conn_count);
+
+    t0 = get_time();
+    tcp_connect(0, conn_count);
+    if (!tcp_wait(&tcp_established_count, conn_count, 30)) {
+        fprintf(stderr, "tcp: only %d/%d connections established\n",
+                tcp_established_count, conn_count);
+        stop_server();
+        exit(1);
+    }
+    t_connect = get_time() - t0;
+
+    for(i = 0; i < TCP_MSG_SIZE; i++)
+        msg[i] = get_tcp_byte(i);
+    t0 = get_time();
+    for(k = 0; k < rounds; k++) {
+        for(i = 0; i < conn_count; i++) {
+            tcp_send(i, 0x18, msg, TCP_MSG_SIZE);
+            if ((i % TX_BURST) == TX_BURST - 1)
+                tcp_poll(0);
+        }
+        target = (int64_t)conn_count * TCP_MSG_SIZE * (k + 1);
+        t_echo = get_time();
+        while (tcp_rx_bytes < target) {
+            if (get_time() - t_echo > 30) {
+                fprintf(stderr, "tcp: echo timeout\n");
+                stop_server();
+                exit(1);
+            }
+            tcp_poll(1);
+        }
+    }
+    t_echo = get_time() - t0;
+
+    /* main loop iteration with no traffic */
+    t0 = get_time();
+    for(i = 0; i < 2000; i++)
+        tcp_poll(0);
+    t_idle = (get_time() - t0) / 2000;
+
+    /* CPU time of 5 s of main loop with a 10 ms timeout */
+    t0 = get_time();
+    t_timers = get_cpu_time();
+    while (get_time() - t0 < 5)
+        tcp_poll(10);
+    t_timers = get_cpu_time() - t_timers;
+
+    fd_count1 = get_fd_count();
+    tcp_close_all();
+    /* slirp closes the host sockets after the FIN exchange */
+    t0 = get_time();
+    while (get_time() - t0 < 1)
+        tcp_poll(10);
+    fd_count2 = get_fd_count();
+
+    printf("tcp %5d connections: connect %.3f s, echo %.0f msg/s, "
+           "%" PRId64 " errors, idle poll %.1f us, timers %.3f s CPU "
+           "in 5 s, %d closed, host fds %d -> %d\n",
+           conn_count, t_connect, (double)conn_count * rounds / t_echo,
+           tcp_rx_errors, t_idle * 1e6, t_timers, tcp_closed_count,
+           fd_count1 - fd_count0, fd_count2 - fd_count0);
+    stop_server();
+    tcp_end();
+}
+
+/* run the timer wheel check on an established connection */
+static void timers_check(void)
+{
+    int n_errors;
+
+    tcp_start_server();
+    tcp_init(1);
+    tcp_connect(0, 1);
+    if (!tcp_wait(&tcp_established_count, 1, 10)) {
+        fprintf(stderr, "timers: connection not established\n");
+        stop_server();
+        exit(1);
+    }
+    n_errors = slirp_timer_check(slirp);
+    tcp_close_all();
+    stop_server();
+    tcp_end();
+    if (n_errors != 0) {
+        printf("timers: %d errors\n", n_errors);
+        exit(1);
+    }
+    printf("timers: OK\n");
+}
+
+static void help(void)
+{
+    printf("usage: slirp_bench [options] [workload...]\n"
+           "\n"
+           "Exchange packets between a simulated guest and echo servers\n"
+           "on the host through slirp.\n"
+           "\n"
+           "options are:\n"
+           "-n count    number of UDP datagrams (default: 200000)\n"
+           "-s size     UDP payload size (default: 64, 1400 and 2000)\n"
+           "-c count    number of TCP connections (default: 1000)\n"
+           "\n"
+           "workloads (default: all):\n"
+           "udp         UDP echo throughput\n"
+           "tcp         TCP connection scaling\n"
+           "timers      check the TCP timers of the timer wheel\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct in_addr net, mask, host, dhcp, dns;
+    static const int udp_sizes[] = { 64, 1400, 2000 };
+    struct rlimit rlim;
+    int c, i, udp_count, udp_size, conn_count;
+    BOOL run_all, run_udp, run_tcp, run_timers;
+
+    udp_count = 200000;
+    udp_size = 0;
+    conn_count = 1000;
+    for(;;) {
+        c = getopt(argc, argv, "hn:s:c:");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'n':
+            udp_count = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            udp_size = strtoul(optarg, NULL, 0);
+            if (udp_size < 1 || udp_size > UDP_SIZE_MAX)
+                help();
+            break;
+        case 'c':
+            conn_count = strtoul(optarg, NULL, 0);
+            if (conn_count < 1 || conn_count > 65535 - GUEST_PORT)
+                help();
+            break;
+        default:
+            help();
+        }
+    }
+    if (udp_count <= 0)
+        help();
+    run_all = (optind == argc);
+    run_udp = run_all;
+    run_tcp = run_all;
+    run_timers = run_all;
+    for(i = optind; i < argc; i++) {
+        if (!strcmp(argv[i], "udp"))
+            run_udp = TRUE;
+        else if (!strcmp(argv[i], "tcp"))
+            run_tcp = TRUE;
+        else if (!strcmp(argv[i], "timers"))
+            run_timers = TRUE;
+        else
+            help();
+    }
+
+    /* one host socket per connection */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+
+    /* the child servers are killed with SIGTERM */
+    signal(SIGPIPE, SIG_IGN);
+    inet_aton("10.0.2.0", &net);
+    inet_aton("255.255.255.0", &mask);
+    host.s_addr = htonl(HOST_ADDR);
+    dhcp.s_addr = htonl(GUEST_ADDR);
+    inet_aton("10.0.2.3", &dns);
+    slirp = slirp_init(0, net, mask, host, NULL, NULL, NULL, dhcp, dns, NULL);
+    send_arp();
+
+    if (run_udp) {
+        if (udp_size != 0) {
+            udp_bench(udp_size, udp_count);
+        } else {
+            for(i = 0; i < countof(udp_sizes); i++)
+                udp_bench(udp_sizes[i], udp_count);
+        }
+    }
+    if (run_tcp)
+        tcp_bench(conn_count, 10);
+    if (run_timers)
+        timers_check();
+    return 0;
+}
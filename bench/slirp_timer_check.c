@@ -0,0 +1,174 @@
+/*
+ * Check of the slirp TCP timers
+ *
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "slirp/slirp.h"
+
+/* Unlike slirp_bench.c, this file uses the slirp internals: the
+   timers of an established connection are armed directly and the
+   slow timer is run tick by tick, so that delays of several days are
+   checked in a few seconds. A timer has fired when tcp_timers() has
+   cleared or armed it again. */
+
+#define CHECK_TIMER_COUNT 3
+
+static const int check_timers[CHECK_TIMER_COUNT] = {
+    TCPT_REXMT, TCPT_KEEP, TCPT_2MSL,
+};
+
+static const char *check_timer_names[CHECK_TIMER_COUNT] = {
+    "rexmt", "keep", "2msl",
+};
+
+/* delays in ticks around the limits of the wheel levels (see
+   socket.h) */
+static const int check_delays[] = {
+    1, 2,
+    SO_WHEEL_SLOTS0 - 1, SO_WHEEL_SLOTS0, SO_WHEEL_SLOTS0 + 1, 300,
+    5000, (1 << (SO_WHEEL_BITS0 + SO_WHEEL_BITS)) - 1,
+    1 << (SO_WHEEL_BITS0 + SO_WHEEL_BITS),
+    (1 << (SO_WHEEL_BITS0 + SO_WHEEL_BITS)) + 1, 100000,
+    SO_WHEEL_SPAN - 1, SO_WHEEL_SPAN, SO_WHEEL_SPAN + 1000,
+};
+
+static struct tcpcb *find_established(Slirp *slirp)
+{
+    struct socket *so;
+
+    for (so = slirp->tcb.so_next; so != &slirp->tcb; so = so->so_next) {
+        if (so->so_tcpcb && so->so_tcpcb->t_state == TCPS_ESTABLISHED)
+            return so->so_tcpcb;
+    }
+    return NULL;
+}
+
+/* run the slow timer until tcp_now & mask == mask, i.e. just before
+   the wheel level covering 'mask + 1' ticks wraps around */
+static void advance_to(Slirp *slirp, struct tcpcb *tp, uint32_t mask)
+{
+    while ((slirp->tcp_now & mask) != mask) {
+        tp->t_rcvtime = slirp->tcp_now;
+        tcp_slowtimo(slirp);
+    }
+}
+
+/*
+ * Arm the timers with delays[i] ticks (none if 0) and check that each
+ * of them fires on its tick. Return the number of errors.
+ */
+static int check_delay(Slirp *slirp, struct tcpcb *tp, const int *delays)
+{
+    uint32_t start, expire[CHECK_TIMER_COUNT];
+    BOOL pending[CHECK_TIMER_COUNT];
+    int i, n_pending, n_errors;
+
+    tcp_canceltimers(tp);
+    tp->t_rxtshift = 0;
+    start = slirp->tcp_now;
+    n_pending = 0;
+    for (i = 0; i < CHECK_TIMER_COUNT; i++) {
+        pending[i] = (delays[i] != 0);
+        if (pending[i]) {
+            tcp_timer_activate(tp, check_timers[i], delays[i]);
+            expire[i] = start + delays[i];
+            n_pending++;
+        }
+    }
+
+    n_errors = 0;
+    while (n_pending > 0) {
+        /* the connection stays active, so the keepalive and 2MSL
+           timers do not drop it */
+        tp->t_rcvtime = slirp->tcp_now;
+        tcp_slowtimo(slirp);
+        for (i = 0; i < CHECK_TIMER_COUNT; i++) {
+            if (!pending[i])
+                continue;
+            if (tp->t_timer[check_timers[i]] != expire[i]) {
+                if (slirp->tcp_now != expire[i]) {
+                    fprintf(stderr, "%s timer of %d ticks from %u "
+                            "fired after %d ticks\n",
+                            check_timer_names[i], delays[i], start,
+                            (int)(slirp->tcp_now - start));
+                    n_errors++;
+                }
+                /* stop it, so that the retransmission timer does not
+                   drop the connection */
+                tp->t_timer[check_timers[i]] = 0;
+                pending[i] = FALSE;
+                n_pending--;
+            } else if (slirp->tcp_now == expire[i]) {
+                fprintf(stderr, "%s timer of %d ticks from %u "
+                        "did not fire\n",
+                        check_timer_names[i], delays[i], start);
+                n_errors++;
+                pending[i] = FALSE;
+                n_pending--;
+            }
+        }
+    }
+    return n_errors;
+}
+
+/*
+ * Check the timers of the first established connection: each timer
+ * alone with the delays of check_delays[], starting at any tick, just
+ * before the first level wraps around and just before the second one
+ * wraps around, then the three timers together. Return the number of
+ * errors.
+ */
+int slirp_timer_check(Slirp *slirp)
+{
+    static const uint32_t start_masks[] = {
+        0, SO_WHEEL_SLOTS0 - 1, (1 << (SO_WHEEL_BITS0 + SO_WHEEL_BITS)) - 1,
+    };
+    struct tcpcb *tp;
+    int delays[CHECK_TIMER_COUNT];
+    int i, j, k, n, n_errors;
+
+    tp = find_established(slirp);
+    if (!tp) {
+        fprintf(stderr, "no established connection\n");
+        return 1;
+    }
+    n_errors = 0;
+    for (k = 0; k < countof(start_masks); k++) {
+        for (i = 0; i < CHECK_TIMER_COUNT; i++) {
+            for (j = 0; j < countof(check_delays); j++) {
+                advance_to(slirp, tp, start_masks[k]);
+                memset(delays, 0, sizeof(delays));
+                delays[i] = check_delays[j];
+                n_errors += check_delay(slirp, tp, delays);
+            }
+        }
+        /* the three timers in different levels */
+        n = countof(check_delays);
+        for (j = 0; j < n; j++) {
+            advance_to(slirp, tp, start_masks[k]);
+            for (i = 0; i < CHECK_TIMER_COUNT; i++)
+                delays[i] = check_delays[(j + i * 5) % n];
+            n_errors += check_delay(slirp, tp, delays);
+        }
+    }
+    tcp_canceltimers(tp);
+    return n_errors;
+}
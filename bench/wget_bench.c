@@ -0,0 +1,224 @@
+/*
+ * HTTP download latency benchmark
+ *
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "cutils.h"
+#include "fs.h"
+#include "fs_wget.h"
+
+/* The files f000, f001, ... are opened one after the other through
+   the network filesystem, so each open is one HTTP download. The open
+   latencies are printed as percentiles. The file contents are
+   generated by '-g' and checked after each download. */
+
+#define FILE_COUNT_MAX 10000
+
+static BOOL open_done;
+static int open_err;
+
+static int get_file_size(int i)
+{
+    return 2000 + i;
+}
+
+static int get_file_byte(int i, int j)
+{
+    return (i * 31 + j) & 0xff;
+}
+
+static int64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
+}
+
+static void generate_files(const char *dir, int file_count)
+{
+    char filename[1024];
+    FILE *f;
+    int i, j;
+
+    mkdir(dir, 0755);
+    for(i = 0; i < file_count; i++) {
+        snprintf(filename, sizeof(filename), "%s/f%03d", dir, i);
+        f = fopen(filename, "wb");
+        if (!f) {
+            perror(filename);
+            exit(1);
+        }
+        for(j = 0; j < get_file_size(i); j++)
+            fputc(get_file_byte(i, j), f);
+        fclose(f);
+    }
+}
+
+static void open_cb(FSDevice *fs, FSQID *qid, int err, void *opaque)
+{
+    open_done = TRUE;
+    open_err = err;
+}
+
+static BOOL open_is_done(void *opaque)
+{
+    return open_done;
+}
+
+static BOOL start_done;
+
+static void start_cb(void *opaque)
+{
+    start_done = TRUE;
+}
+
+static BOOL start_is_done(void *opaque)
+{
+    return start_done;
+}
+
+static int cmp_int64(const void *a1, const void *b1)
+{
+    int64_t a = *(const int64_t *)a1;
+    int64_t b = *(const int64_t *)b1;
+    return (a > b) - (a < b);
+}
+
+static void help(void)
+{
+    printf("usage: wget_bench [-c count] url\n"
+           "       wget_bench -g dir [-c count]\n"
+           "\n"
+           "Open the files f000, f001, ... of the network filesystem at\n"
+           "'url' and print the download latency percentiles. 'url' can\n"
+           "be a space separated list of mirrors.\n"
+           "\n"
+           "options are:\n"
+           "-c count    number of files (default: 300)\n"
+           "-g dir      generate the files in 'dir' (the filesystem is then\n"
+           "            built with build_filelist)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *gen_dir;
+    FSDevice *fs;
+    FSFile *root, *f;
+    FSQID qid;
+    char name[32];
+    uint8_t *buf;
+    int64_t *lat, t0, total;
+    int c, i, j, file_count, n_errors, size, ret;
+
+    gen_dir = NULL;
+    file_count = 300;
+    for(;;) {
+        c = getopt(argc, argv, "hc:g:");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'c':
+            file_count = strtoul(optarg, NULL, 0);
+            if (file_count < 1 || file_count > FILE_COUNT_MAX) {
+                fprintf(stderr, "invalid file count\n");
+                exit(1);
+            }
+            break;
+        case 'g':
+            gen_dir = optarg;
+            break;
+        default:
+            help();
+        }
+    }
+    if (gen_dir) {
+        generate_files(gen_dir, file_count);
+        return 0;
+    }
+    if (optind >= argc)
+        help();
+
+    fs_wget_init();
+    fs = fs_net_init(argv[optind], NULL, start_cb, NULL);
+    if (!fs)
+        exit(1);
+    fs_net_event_loop(start_is_done, NULL);
+    if (fs->fs_attach(fs, &root, &qid, 0, "", "") < 0) {
+        fprintf(stderr, "could not attach the filesystem\n");
+        exit(1);
+    }
+
+    lat = malloc(sizeof(lat[0]) * file_count);
+    buf = malloc(get_file_size(file_count));
+    n_errors = 0;
+    total = 0;
+    for(i = 0; i < file_count; i++) {
+        snprintf(name, sizeof(name), "f%03d", i);
+        f = fs_walk_path(fs, root, name);
+        if (!f) {
+            fprintf(stderr, "%s: not found\n", name);
+            exit(1);
+        }
+        open_done = FALSE;
+        open_err = 0;
+        t0 = get_time_us();
+        ret = fs->fs_open(fs, &qid, f, P9_O_RDONLY, open_cb, NULL);
+        if (ret == 1)
+            fs_net_event_loop(open_is_done, NULL);
+        else if (ret < 0)
+            open_err = ret;
+        lat[i] = get_time_us() - t0;
+        total += lat[i];
+        size = get_file_size(i);
+        if (open_err < 0 ||
+            fs->fs_read(fs, f, 0, buf, size + 1) != size) {
+            n_errors++;
+        } else {
+            for(j = 0; j < size; j++) {
+                if (buf[j] != get_file_byte(i, j)) {
+                    n_errors++;
+                    break;
+                }
+            }
+        }
+        fs->fs_delete(fs, f);
+    }
+    qsort(lat, file_count, sizeof(lat[0]), cmp_int64);
+    printf("files %d errors %d  p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  "
+           "max %.1f ms  total %.0f ms\n",
+           file_count, n_errors,
+           lat[file_count / 2] / 1000.0,
+           lat[file_count * 90 / 100] / 1000.0,
+           lat[file_count * 99 / 100] / 1000.0,
+           lat[file_count - 1] / 1000.0,
+           total / 1000.0);
+    fs_wget_end();
+    return n_errors != 0;
+}
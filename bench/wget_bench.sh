@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Download latency with one and two mirrors which delay 5% of the
+# requests by 400 ms (see bench/README). Run from the top directory
+# after 'make build_filelist bench'.
+#
+set -e
+
+dir=$(mktemp -d)
+pids=""
+cleanup() {
+    [ -n "$pids" ] && kill $pids 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+./bench/wget_bench -g "$dir/src"
+./build_filelist "$dir/src" "$dir/www" > /dev/null
+
+python3 bench/http_delay_server.py 8801 "$dir/www" 0.05 0.4 & pids="$pids $!"
+python3 bench/http_delay_server.py 8802 "$dir/www" 0.05 0.4 & pids="$pids $!"
+sleep 1
+
+echo "one mirror:"
+./bench/wget_bench "http://127.0.0.1:8801"
+echo "two mirrors:"
+./bench/wget_bench "http://127.0.0.1:8801 http://127.0.0.1:8802"
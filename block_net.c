@@ -34,6 +34,7 @@
 
 #include "cutils.h"
 #include "virtio.h"
+#include "fs_utils.h"
 #include "fs_wget.h"
 #include "list.h"
 #include "fbuf.h"
@@ -49,11 +50,12 @@ typedef struct CachedBlock {
     struct BlockDeviceHTTP *bf;
     unsigned int block_num;
     CachedBlockStateEnum state;
+    XHRState *xhr; /* request loading the block (CBLOCK_LOADING state) */
     FileBuffer fbuf;
 } CachedBlock;
 
-#define BLK_FMT "%sblk%09u.bin"
-#define GROUP_FMT "%sgrp%09u.bin"
+#define BLK_FMT "blk%09u.bin"
+#define GROUP_FMT "grp%09u.bin"
 #define PREFETCH_GROUP_LEN_MAX 32
 
 typedef struct {
@@ -72,7 +74,7 @@ typedef struct Cluster {
 typedef struct BlockDeviceHTTP {
     BlockDevice *bs;
     int max_cache_size_kb;
-    char url[1024];
+    char *url; /* directories of the mirrors separated by spaces */
     int prefetch_count;
     void (*start_cb)(void *opaque);
     void *start_opaque;
@@ -173,10 +175,11 @@ static int64_t bf_get_sector_count(BlockDevice *bs)
     return bf->nb_sectors;
 }
 
-static void bf_start_load_block(BlockDevice *bs, int block_num)
+static void bf_start_load_block(BlockDevice *bs, int block_num,
+                                WGetPriorityEnum prio)
 {
     BlockDeviceHTTP *bf = bs->opaque;
-    char filename[1024];
+    char filename[64], *url;
     CachedBlock *b;
     b = bf_add_block(bf, block_num);
     bf->n_read_blocks++;
@@ -192,9 +195,12 @@ static void bf_start_load_block(BlockDevice *bs, int block_num)
            (int)(bf->n_write_sectors / 2),
            (int)(bf->n_allocated_clusters * bf->sectors_per_cluster / 2));
 #endif
-    snprintf(filename, sizeof(filename), BLK_FMT, bf->url, block_num);
-    //    printf("wget %s\n", filename);
-    fs_wget(filename, NULL, NULL, b, bf_read_onload, TRUE);
+    snprintf(filename, sizeof(filename), BLK_FMT, block_num);
+    url = compose_url_list(bf->url, filename);
+    //    printf("wget %s\n", url);
+    b->xhr = fs_wget(url, NULL, NULL, b, bf_read_onload, TRUE);
+    fs_wget_set_priority(b->xhr, prio);
+    free(url);
 }
 
 static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
@@ -204,7 +210,8 @@ static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
     BlockDeviceHTTP *bf = bs->opaque;
     CachedBlock *b;
     PrefetchGroupRequest *req;
-    char filename[1024];
+    char filename[64], *url;
+    XHRState *xhr;
     BOOL req_flag;
     int i;
     
@@ -227,9 +234,16 @@ static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
     }
 
     if (req_flag) {
-        snprintf(filename, sizeof(filename), GROUP_FMT, bf->url, group_num);
-        //        printf("wget %s\n", filename);
-        fs_wget(filename, NULL, NULL, req, bf_prefetch_group_onload, TRUE);
+        snprintf(filename, sizeof(filename), GROUP_FMT, group_num);
+        url = compose_url_list(bf->url, filename);
+        //        printf("wget %s\n", url);
+        xhr = fs_wget(url, NULL, NULL, req, bf_prefetch_group_onload, TRUE);
+        fs_wget_set_priority(xhr, WGET_PRIO_BACKGROUND);
+        for(i = 0; i < n_block_num; i++) {
+            if (req->tab_block[i])
+                req->tab_block[i]->xhr = xhr;
+        }
+        free(url);
         /* XXX: should add request in a list to free it for clean exit */
     } else {
         free(req);
@@ -259,13 +273,15 @@ static void bf_prefetch_group_onload(void *opaque, int err, void *data,
     free(req);
 }
 
+/* return 1 if the request is pending, 0 if done or -1 if I/O error */
 static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
 {
     BlockDeviceHTTP *bf = bs->opaque;
-    int offset, block_num, n, cluster_num;
+    int offset, block_num, n, cluster_num, ret;
     CachedBlock *b;
     Cluster *c;
     
+    ret = 0;
     for(;;) {
         n = bf->sector_count - bf->sector_index;
         if (n == 0)
@@ -276,8 +292,12 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
             offset = bf->sector_num % bf->sectors_per_cluster;
             n = min_int(n, bf->sectors_per_cluster - offset);
             if (bf->is_write) {
-                file_buffer_write(&c->fbuf, offset * 512,
-                                  bf->io_buf + bf->sector_index * 512, n * 512);
+                if (file_buffer_write(&c->fbuf, offset * 512,
+                                      bf->io_buf + bf->sector_index * 512,
+                                      n * 512) < 0) {
+                    ret = -1;
+                    break;
+                }
             } else {
                 file_buffer_read(&c->fbuf, offset * 512,
                                  bf->io_buf + bf->sector_index * 512, n * 512);
@@ -294,6 +314,7 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
             if (b) {
                 if (b->state == CBLOCK_LOADING) {
                     /* wait until the block is loaded */
+                    fs_wget_set_priority(b->xhr, WGET_PRIO_DEMAND);
                     return 1;
                 } else {
                     if (bf->is_write) {
@@ -309,10 +330,23 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
                         /* copy the cached block data to the cluster */
                         cluster_offset = (cluster_num * bf->sectors_per_cluster) &
                             (bf->block_size - 1);
-                        file_buffer_read(&b->fbuf, cluster_offset * 512,
-                                         buf, cluster_size);
-                        file_buffer_write(&c->fbuf, 0, buf, cluster_size);
-                        free(buf);
+                        if (!buf) {
+                            ret = -1;
+                        } else {
+                            file_buffer_read(&b->fbuf, cluster_offset * 512,
+                                             buf, cluster_size);
+                            ret = file_buffer_write(&c->fbuf, 0, buf,
+                                                    cluster_size);
+                            free(buf);
+                        }
+                        if (ret < 0) {
+                            /* not enough memory */
+                            file_buffer_reset(&c->fbuf);
+                            free(c);
+                            bf->clusters[cluster_num] = NULL;
+                            bf->cur_block_num = -1;
+                            break;
+                        }
                         bf->n_allocated_clusters++;
                         continue; /* write to the allocated cluster */
                     } else {
@@ -323,7 +357,7 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
                     bf->sector_num += n;
                 }
             } else {
-                bf_start_load_block(bs, block_num);
+                bf_start_load_block(bs, block_num, WGET_PRIO_DEMAND);
                 return 1;
             }
             bf->cur_block_num = -1;
@@ -333,9 +367,9 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
     if (!is_sync) {
         //        printf("end of request\n");
         /* end of request */
-        bf->cb(bf->opaque, 0);
+        bf->cb(bf->opaque, ret);
     } 
-    return 0;
+    return ret;
 }
 
 static void bf_update_block(CachedBlock *b, const uint8_t *data)
@@ -344,7 +378,16 @@ static void bf_update_block(CachedBlock *b, const uint8_t *data)
     BlockDevice *bs = bf->bs;
 
     assert(b->state == CBLOCK_LOADING);
-    file_buffer_write(&b->fbuf, 0, data, bf->block_size * 512);
+    if (file_buffer_write(&b->fbuf, 0, data, bf->block_size * 512) < 0) {
+        /* not enough memory: the block is not cached and the waiting
+           request fails */
+        if (b->block_num == bf->cur_block_num) {
+            bf->cur_block_num = -1;
+            bf->cb(bf->opaque, -1);
+        }
+        bf_free_block(bf, b);
+        return;
+    }
     b->state = CBLOCK_LOADED;
     
     /* continue I/O read/write if necessary */
@@ -408,18 +451,29 @@ BlockDevice *block_device_init_http(const char *url,
 {
     BlockDevice *bs;
     BlockDeviceHTTP *bf;
-    char *p;
+    const char *p, *p1;
+    DynBuf dbuf;
+    int len;
 
     bs = mallocz(sizeof(*bs));
     bf = mallocz(sizeof(*bf));
-    strcpy(bf->url, url);
-    /* get the path with the trailing '/' */
-    p = strrchr(bf->url, '/');
-    if (!p)
-        p = bf->url;
-    else
-        p++;
-    *p = '\0';
+    /* get the path with the trailing '/' of each mirror */
+    dbuf_init(&dbuf);
+    p = url;
+    for(;;) {
+        p += strspn(p, " \t\n");
+        if (*p == '\0')
+            break;
+        len = strcspn(p, " \t\n");
+        for(p1 = p + len; p1 > p && p1[-1] != '/'; p1--)
+            continue;
+        if (dbuf.size != 0)
+            dbuf_putc(&dbuf, ' ');
+        dbuf_write(&dbuf, dbuf.size, (const uint8_t *)p, p1 - p);
+        p += len;
+    }
+    dbuf_putc(&dbuf, '\0');
+    bf->url = (char *)dbuf.buf;
 
     init_list_head(&bf->cached_blocks);
     bf->max_cache_size_kb = max_cache_size_kb;
@@ -514,7 +568,8 @@ static void bf_init_onload(void *opaque, int err, void *data, size_t size)
             if (l == 1) {
                 block_num = tab_block_num[0];
                 if (!bf_find_block(bf, block_num)) {
-                    bf_start_load_block(bs, block_num);
+                    bf_start_load_block(bs, block_num,
+                                        WGET_PRIO_BACKGROUND);
                 }
             } else {
                 bf_start_load_prefetch_group(bs, idx / bf->prefetch_group_len,
@@ -173,6 +173,14 @@ static inline int ctz32(uint32_t a)
     return 32;
 }
 
+static inline int ctz64(uint64_t a)
+{
+    if ((uint32_t)a != 0)
+        return ctz32(a);
+    else
+        return 32 + ctz32(a >> 32);
+}
+
 
 void *mallocz(size_t size);
 void pstrcpy(char *buf, int buf_size, const char *str);
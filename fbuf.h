@@ -5,7 +5,11 @@ typedef struct {
 #if defined(EMSCRIPTEN)
     int handle;
 #else
-    uint8_t *data;
+    uint8_t **chunks; /* NULL entries are holes */
+    size_t chunk_count; /* number of entries in 'chunks' */
+    uint8_t *data; /* mapping of 'fd' */
+    int fd; /* backing file or -1 if the data is in 'chunks' */
+    size_t map_size; /* size of the mapping of 'fd' */
 #endif
     size_t allocated_size;
 } FileBuffer;
@@ -13,10 +17,13 @@ typedef struct {
 void file_buffer_init(FileBuffer *bs);
 void file_buffer_reset(FileBuffer *bs);
 int file_buffer_resize(FileBuffer *bs, size_t new_size);
-void file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
-                       size_t size);
+int file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
+                      size_t size);
 void file_buffer_set(FileBuffer *bs, size_t offset, int val, size_t size);
 void file_buffer_read(FileBuffer *bs, size_t offset, uint8_t *buf,
                       size_t size);
+#if !defined(EMSCRIPTEN)
+int file_buffer_set_file(FileBuffer *bs, int fd, size_t size);
+#endif
 
 #endif /* FBUF_H */
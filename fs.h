@@ -195,7 +195,8 @@ struct FSDevice {
 
 FSDevice *fs_disk_init(const char *root_path);
 FSDevice *fs_mem_init(void);
-FSDevice *fs_net_init(const char *url, void (*start)(void *opaque), void *opaque);
+FSDevice *fs_net_init(const char *url, const char *overlay_dir,
+                      void (*start)(void *opaque), void *opaque);
 void fs_net_set_pwd(FSDevice *fs, const char *pwd);
 #ifdef EMSCRIPTEN
 void fs_import_file(const char *filename, uint8_t *buf, int buf_len);
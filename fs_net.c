@@ -29,6 +29,13 @@
 #include <stdarg.h>
 #include <sys/time.h>
 #include <ctype.h>
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #include "cutils.h"
 #include "list.h"
@@ -54,6 +61,11 @@
 #define DUMP_CACHE_LOAD
 #endif
 
+/* local files can be stored in an overlay directory */
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+#define USE_OVERLAY
+#endif
+
 #if defined(EMSCRIPTEN)
 #define DEFAULT_INODE_CACHE_SIZE (64 * 1024 * 1024)
 #else
@@ -101,6 +113,10 @@ typedef struct FSINode {
     uint32_t ctime_sec;
     uint32_t mtime_nsec;
     uint32_t ctime_nsec;
+#ifdef USE_OVERLAY
+    uint64_t overlay_id; /* 0 if unknown in the overlay journal */
+    BOOL overlay_dirty; /* the attributes must be logged */
+#endif
     union {
         struct {
             FSINodeRegStateEnum state;
@@ -203,6 +219,12 @@ typedef struct FSDeviceMem {
     /* network */
     struct list_head base_url_list; /* list of FSBaseURL.link */
     char *import_dir;
+    FSFileID root_id;
+#ifdef USE_OVERLAY
+    char *overlay_dir;
+    int overlay_fd; /* journal file descriptor, -1 if not logging */
+    uint64_t overlay_id_alloc;
+#endif
 #ifdef DUMP_CACHE_LOAD
     BOOL dump_cache_load;
     BOOL dump_started;
@@ -238,6 +260,7 @@ typedef struct FSOpenInfo {
 
     struct list_head archive_link; /* FS_OPEN_WGET_ARCHIVE_FILE */
     uint64_t archive_offset;  /* FS_OPEN_WGET_ARCHIVE_FILE */
+    struct FSOpenInfo *archive; /* FS_OPEN_WGET_ARCHIVE_FILE */
     struct list_head archive_file_list; /* FS_OPEN_WGET_ARCHIVE */
     
     /* the following is set in case there is a fs_open callback */
@@ -262,50 +285,247 @@ static FSBaseURL *fs_net_set_base_url(FSDevice *fs1,
                                       AES_KEY *aes_state);
 static void fs_cmd_close(FSDevice *fs, FSFile *f);
 static void fs_error_archive(FSOpenInfo *oi);
+static void fs_write_archive(FSOpenInfo *oi, const uint8_t *data,
+                             size_t size);
+static int fs_open_wget(FSDevice *fs1, FSINode *n, FSOpenWgetEnum open_type);
 #ifdef DUMP_CACHE_LOAD
 static void dump_loaded_file(FSDevice *fs1, FSINode *n);
 #endif
 
 #if !defined(EMSCRIPTEN)
 /* file buffer (the content of the buffer can be stored elsewhere) */
+
+/* The data is stored in chunks so that resizing does not copy it and
+   so that sparse files only use memory for the written parts. A NULL
+   chunk reads as zero. The bytes of the last chunk after the end of
+   the buffer are always zero. */
+#define FILE_BUFFER_CHUNK_BITS 12
+#define FILE_BUFFER_CHUNK_SIZE (1 << FILE_BUFFER_CHUNK_BITS)
+
 void file_buffer_init(FileBuffer *bs)
 {
+    bs->chunks = NULL;
+    bs->chunk_count = 0;
     bs->data = NULL;
+    bs->fd = -1;
+    bs->map_size = 0;
     bs->allocated_size = 0;
 }
 
+static void file_buffer_free_chunks(FileBuffer *bs, size_t start)
+{
+    size_t i;
+    for(i = start; i < bs->chunk_count; i++) {
+        free(bs->chunks[i]);
+        bs->chunks[i] = NULL;
+    }
+}
+
 void file_buffer_reset(FileBuffer *bs)
 {
-    free(bs->data);
+#ifdef USE_OVERLAY
+    if (bs->fd >= 0) {
+        if (bs->data)
+            munmap(bs->data, bs->map_size);
+        close(bs->fd);
+    } else
+#endif
+    {
+        file_buffer_free_chunks(bs, 0);
+        free(bs->chunks);
+    }
     file_buffer_init(bs);
 }
 
-int file_buffer_resize(FileBuffer *bs, size_t new_size)
+#ifdef USE_OVERLAY
+#define FILE_BUFFER_MAP_ALIGN (64 * 1024)
+
+/* the mapping is larger than the file so that appending to the file
+   seldom moves it */
+static int file_buffer_map(FileBuffer *bs, size_t size)
+{
+    size_t map_size;
+    uint8_t *data;
+
+    if (size <= bs->map_size)
+        return 0;
+    map_size = bs->map_size + bs->map_size / 2;
+    if (size > map_size)
+        map_size = size;
+    map_size = block_align(map_size, FILE_BUFFER_MAP_ALIGN);
+    if (bs->data) {
+#ifdef __linux__
+        data = mremap(bs->data, bs->map_size, map_size, MREMAP_MAYMOVE);
+#else
+        munmap(bs->data, bs->map_size);
+        bs->data = NULL;
+        bs->map_size = 0;
+        data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    bs->fd, 0);
+#endif
+    } else {
+        data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    bs->fd, 0);
+    }
+    if (data == MAP_FAILED)
+        return -1;
+    bs->data = data;
+    bs->map_size = map_size;
+    return 0;
+}
+
+/* use the file 'fd' of 'size' bytes as storage. The previous content
+   is discarded. */
+int file_buffer_set_file(FileBuffer *bs, int fd, size_t size)
 {
-    uint8_t *new_data;
-    new_data = realloc(bs->data, new_size);
-    if (!new_data && new_size != 0)
+    file_buffer_reset(bs);
+    bs->fd = fd;
+    if (file_buffer_map(bs, size) < 0) {
+        file_buffer_init(bs);
         return -1;
-    bs->data = new_data;
+    }
+    bs->allocated_size = size;
+    return 0;
+}
+#endif
+
+/* the new bytes read as zero. With a backing file, the allocated size
+   is the file length. */
+int file_buffer_resize(FileBuffer *bs, size_t new_size)
+{
+    size_t count, new_count, pos;
+    uint8_t **new_chunks, *ptr;
+
+#ifdef USE_OVERLAY
+    if (bs->fd >= 0) {
+        if (file_buffer_map(bs, new_size) < 0 ||
+            ftruncate(bs->fd, new_size) < 0)
+            return -1;
+        bs->allocated_size = new_size;
+        return 0;
+    }
+#endif
+    count = (new_size + FILE_BUFFER_CHUNK_SIZE - 1) >> FILE_BUFFER_CHUNK_BITS;
+    if (new_size < bs->allocated_size) {
+        file_buffer_free_chunks(bs, count);
+        pos = new_size & (FILE_BUFFER_CHUNK_SIZE - 1);
+        ptr = count > 0 ? bs->chunks[count - 1] : NULL;
+        if (pos != 0 && ptr)
+            memset(ptr + pos, 0, FILE_BUFFER_CHUNK_SIZE - pos);
+    } else if (count > bs->chunk_count) {
+        new_count = bs->chunk_count + bs->chunk_count / 2;
+        if (count > new_count)
+            new_count = count;
+        new_chunks = realloc(bs->chunks, new_count * sizeof(bs->chunks[0]));
+        if (!new_chunks)
+            return -1;
+        memset(new_chunks + bs->chunk_count, 0,
+               (new_count - bs->chunk_count) * sizeof(bs->chunks[0]));
+        bs->chunks = new_chunks;
+        bs->chunk_count = new_count;
+    }
     bs->allocated_size = new_size;
     return 0;
 }
 
-void file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
-                       size_t size)
+/* return < 0 if not enough memory */
+int file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
+                      size_t size)
 {
-    memcpy(bs->data + offset, buf, size);
+    size_t pos, l;
+    uint8_t *ptr;
+
+#ifdef USE_OVERLAY
+    if (bs->fd >= 0) {
+        memcpy(bs->data + offset, buf, size);
+        return 0;
+    }
+#endif
+    while (size > 0) {
+        pos = offset & (FILE_BUFFER_CHUNK_SIZE - 1);
+        l = FILE_BUFFER_CHUNK_SIZE - pos;
+        if (l > size)
+            l = size;
+        ptr = bs->chunks[offset >> FILE_BUFFER_CHUNK_BITS];
+        if (!ptr) {
+            if (l == FILE_BUFFER_CHUNK_SIZE)
+                ptr = malloc(FILE_BUFFER_CHUNK_SIZE);
+            else
+                ptr = mallocz(FILE_BUFFER_CHUNK_SIZE);
+            if (!ptr)
+                return -1;
+            bs->chunks[offset >> FILE_BUFFER_CHUNK_BITS] = ptr;
+        }
+        memcpy(ptr + pos, buf, l);
+        offset += l;
+        buf += l;
+        size -= l;
+    }
+    return 0;
 }
 
 void file_buffer_set(FileBuffer *bs, size_t offset, int val, size_t size)
 {
-    memset(bs->data + offset, val, size);
+    size_t pos, l;
+    uint8_t *ptr, **pptr;
+
+#ifdef USE_OVERLAY
+    if (bs->fd >= 0) {
+        memset(bs->data + offset, val, size);
+        return;
+    }
+#endif
+    while (size > 0) {
+        pos = offset & (FILE_BUFFER_CHUNK_SIZE - 1);
+        l = FILE_BUFFER_CHUNK_SIZE - pos;
+        if (l > size)
+            l = size;
+        pptr = &bs->chunks[offset >> FILE_BUFFER_CHUNK_BITS];
+        ptr = *pptr;
+        if (val == 0 && l == FILE_BUFFER_CHUNK_SIZE) {
+            /* make a hole */
+            free(ptr);
+            *pptr = NULL;
+        } else if (ptr) {
+            memset(ptr + pos, val, l);
+        } else if (val != 0) {
+            ptr = mallocz(FILE_BUFFER_CHUNK_SIZE);
+            if (!ptr)
+                return;
+            memset(ptr + pos, val, l);
+            *pptr = ptr;
+        }
+        offset += l;
+        size -= l;
+    }
 }
 
 void file_buffer_read(FileBuffer *bs, size_t offset, uint8_t *buf,
                        size_t size)
 {
-    memcpy(buf, bs->data + offset, size);
+    size_t pos, l;
+    uint8_t *ptr;
+
+#ifdef USE_OVERLAY
+    if (bs->fd >= 0) {
+        memcpy(buf, bs->data + offset, size);
+        return;
+    }
+#endif
+    while (size > 0) {
+        pos = offset & (FILE_BUFFER_CHUNK_SIZE - 1);
+        l = FILE_BUFFER_CHUNK_SIZE - pos;
+        if (l > size)
+            l = size;
+        ptr = bs->chunks[offset >> FILE_BUFFER_CHUNK_BITS];
+        if (ptr)
+            memcpy(buf, ptr + pos, l);
+        else
+            memset(buf, 0, l);
+        offset += l;
+        buf += l;
+        size -= l;
+    }
 }
 #endif
 
@@ -314,6 +534,15 @@ static int64_t to_blocks(FSDeviceMem *fs, uint64_t size)
     return (size + fs->block_size - 1) >> fs->block_size_log2;
 }
 
+#ifdef USE_OVERLAY
+static char *overlay_data_filename(FSDeviceMem *fs, uint64_t id)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "data/%" PRIu64, id);
+    return compose_path(fs->overlay_dir, buf);
+}
+#endif
+
 static FSINode *inode_incref(FSDevice *fs, FSINode *n)
 {
     n->refcount++;
@@ -337,6 +566,13 @@ static void inode_free(FSDevice *fs1, FSINode *n)
     case FT_REG:
         fs->fs_blocks -= to_blocks(fs, n->u.reg.size);
         assert(fs->fs_blocks >= 0);
+#ifdef USE_OVERLAY
+        if (n->u.reg.fbuf.fd >= 0 && n->overlay_id != 0 && fs->overlay_dir) {
+            char *filename = overlay_data_filename(fs, n->overlay_id);
+            unlink(filename);
+            free(filename);
+        }
+#endif
         file_buffer_reset(&n->u.reg.fbuf);
 #ifdef DUMP_CACHE_LOAD
         free(n->u.reg.filename);
@@ -576,6 +812,254 @@ static void flush_dir(FSDevice *fs, FSINode *n)
     assert(n->u.dir.size == 0);
 }
 
+#ifdef USE_OVERLAY
+/************************************************************/
+/* overlay journal */
+
+/* The local files are stored in an overlay directory so that they
+   survive the session and do not use the heap. The content of a file
+   is in 'data/<id>' and the metadata changes are appended to
+   'journal', one record per line:
+
+   B id path              give an ID to a file of the base filesystem
+   N id dir_id mode uid gid name [target|major minor]  new file
+   L dir_id name id       hard link
+   U dir_id name          unlink
+   R dir_id name new_dir_id new_name   rename
+   A id mode uid gid mtime ctime       attributes
+   D id                   the content is now in 'data/<id>'
+
+   Each record is written with a single write() so that an interrupted
+   session leaves at most an incomplete last line. */
+
+static void __attribute__((format(printf, 2, 3))) overlay_log(FSDeviceMem *fs, const char *fmt, ...)
+{
+    va_list ap;
+    char *buf;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    buf = malloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+    if (write(fs->overlay_fd, buf, len) != len) {
+        fprintf(stderr, "%s: could not write the overlay journal\n",
+                fs->overlay_dir);
+    }
+    free(buf);
+}
+
+/* slow, but only used the first time a file of the base filesystem
+   is modified */
+static char *inode_find_path(FSINode *dir, FSINode *n, const char *path)
+{
+    struct list_head *el;
+    FSDirEntry *de;
+    char *path1, *res;
+
+    list_for_each(el, &dir->u.dir.de_list) {
+        de = list_entry(el, FSDirEntry, link);
+        if (!strcmp(de->name, ".") || !strcmp(de->name, ".."))
+            continue;
+        if (de->inode == n)
+            return compose_path(path, de->name);
+        if (de->inode->type == FT_DIR) {
+            path1 = compose_path(path, de->name);
+            res = inode_find_path(de->inode, n, path1);
+            free(path1);
+            if (res)
+                return res;
+        }
+    }
+    return NULL;
+}
+
+/* return 0 if 'n' cannot be referenced in the journal (e.g. it was
+   unlinked) */
+static uint64_t overlay_get_id(FSDeviceMem *fs, FSINode *n)
+{
+    char *path, *qpath;
+
+    if (n->overlay_id == 0) {
+        path = inode_find_path(fs->root_inode, n, "/");
+        if (!path) {
+            if (n != fs->root_inode)
+                return 0;
+            path = strdup("/");
+        }
+        n->overlay_id = fs->overlay_id_alloc++;
+        qpath = quoted_str(path);
+        overlay_log(fs, "B %" PRIu64 " %s\n", n->overlay_id, qpath);
+        free(qpath);
+        free(path);
+    }
+    return n->overlay_id;
+}
+
+static void overlay_log_attr(FSDeviceMem *fs, FSINode *n)
+{
+    uint64_t id;
+
+    n->overlay_dirty = FALSE;
+    if (fs->overlay_fd < 0)
+        return;
+    id = overlay_get_id(fs, n);
+    if (id == 0)
+        return;
+    overlay_log(fs, "A %" PRIu64 " %o %u %u %u.%09u %u.%09u\n",
+                id, n->mode, n->uid, n->gid, n->mtime_sec, n->mtime_nsec,
+                n->ctime_sec, n->ctime_nsec);
+}
+
+static void overlay_log_new(FSDeviceMem *fs, FSINode *dir, const char *name,
+                            FSINode *n)
+{
+    uint64_t dir_id;
+    char *qname, *qtarget;
+
+    if (fs->overlay_fd < 0)
+        return;
+    dir_id = overlay_get_id(fs, dir);
+    if (dir_id == 0)
+        return;
+    n->overlay_id = fs->overlay_id_alloc++;
+    qname = quoted_str(name);
+    if (n->type == FT_LNK) {
+        qtarget = quoted_str(n->u.symlink.name);
+        overlay_log(fs, "N %" PRIu64 " %" PRIu64 " %o %u %u %s %s\n",
+                    n->overlay_id, dir_id, n->mode | (n->type << 12),
+                    n->uid, n->gid, qname, qtarget);
+        free(qtarget);
+    } else if (n->type == FT_CHR || n->type == FT_BLK) {
+        overlay_log(fs, "N %" PRIu64 " %" PRIu64 " %o %u %u %s %u %u\n",
+                    n->overlay_id, dir_id, n->mode | (n->type << 12),
+                    n->uid, n->gid, qname, n->u.dev.major, n->u.dev.minor);
+    } else {
+        overlay_log(fs, "N %" PRIu64 " %" PRIu64 " %o %u %u %s\n",
+                    n->overlay_id, dir_id, n->mode | (n->type << 12),
+                    n->uid, n->gid, qname);
+    }
+    free(qname);
+    overlay_log_attr(fs, n);
+}
+
+/* must be called before the link is done */
+static void overlay_log_link(FSDeviceMem *fs, FSINode *dir, const char *name,
+                             FSINode *n)
+{
+    uint64_t dir_id, id;
+    char *qname;
+
+    if (fs->overlay_fd < 0)
+        return;
+    dir_id = overlay_get_id(fs, dir);
+    id = overlay_get_id(fs, n);
+    if (dir_id == 0 || id == 0)
+        return;
+    qname = quoted_str(name);
+    overlay_log(fs, "L %" PRIu64 " %s %" PRIu64 "\n", dir_id, qname, id);
+    free(qname);
+}
+
+/* must be called before the unlink is done */
+static void overlay_log_unlink(FSDeviceMem *fs, FSINode *dir, const char *name)
+{
+    uint64_t dir_id;
+    char *qname;
+
+    if (fs->overlay_fd < 0)
+        return;
+    dir_id = overlay_get_id(fs, dir);
+    if (dir_id == 0)
+        return;
+    qname = quoted_str(name);
+    overlay_log(fs, "U %" PRIu64 " %s\n", dir_id, qname);
+    free(qname);
+}
+
+/* must be called before the rename is done */
+static void overlay_log_rename(FSDeviceMem *fs, FSINode *dir, const char *name,
+                               FSINode *new_dir, const char *new_name)
+{
+    uint64_t dir_id, new_dir_id;
+    char *qname, *qnew_name;
+
+    if (fs->overlay_fd < 0)
+        return;
+    dir_id = overlay_get_id(fs, dir);
+    new_dir_id = overlay_get_id(fs, new_dir);
+    if (dir_id == 0 || new_dir_id == 0)
+        return;
+    qname = quoted_str(name);
+    qnew_name = quoted_str(new_name);
+    overlay_log(fs, "R %" PRIu64 " %s %" PRIu64 " %s\n",
+                dir_id, qname, new_dir_id, qnew_name);
+    free(qname);
+    free(qnew_name);
+}
+
+/* move the content of a local file to the overlay directory */
+static int overlay_spill(FSDeviceMem *fs, FSINode *n)
+{
+    FileBuffer fbuf;
+    uint64_t id;
+    char *filename;
+    size_t size, i, pos, l;
+    int fd;
+
+    id = overlay_get_id(fs, n);
+    if (id == 0)
+        return 0; /* unlinked file: keep it in memory */
+    filename = overlay_data_filename(fs, id);
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    free(filename);
+    if (fd < 0)
+        return -1;
+    size = n->u.reg.size;
+    file_buffer_init(&fbuf);
+    if (ftruncate(fd, size) < 0 ||
+        file_buffer_set_file(&fbuf, fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    /* the holes stay holes in the data file */
+    for(i = 0; i < n->u.reg.fbuf.chunk_count; i++) {
+        pos = (size_t)i << FILE_BUFFER_CHUNK_BITS;
+        if (n->u.reg.fbuf.chunks[i] && pos < size) {
+            l = size - pos;
+            if (l > FILE_BUFFER_CHUNK_SIZE)
+                l = FILE_BUFFER_CHUNK_SIZE;
+            memcpy(fbuf.data + pos, n->u.reg.fbuf.chunks[i], l);
+        }
+    }
+    file_buffer_reset(&n->u.reg.fbuf);
+    n->u.reg.fbuf = fbuf;
+    overlay_log(fs, "D %" PRIu64 "\n", id);
+    return 0;
+}
+#endif
+
+/* the content of 'n' is modified, so it is now local */
+static int inode_set_local(FSDevice *fs1, FSINode *n)
+{
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
+
+    if (n->u.reg.state == REG_STATE_LOADED) {
+        list_del(&n->u.reg.link);
+        fs->inode_cache_size -= n->u.reg.size;
+        assert(fs->inode_cache_size >= 0);
+        n->u.reg.state = REG_STATE_LOCAL;
+    }
+#ifdef USE_OVERLAY
+    if (fs->overlay_fd >= 0 && n->u.reg.fbuf.fd < 0)
+        return overlay_spill(fs, n);
+#endif
+    return 0;
+}
+
 static void fs_delete(FSDevice *fs, FSFile *f)
 {
     fs_close(fs, f);
@@ -661,6 +1145,9 @@ static int fs_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
     inode_dir_add(fs, n1, ".", inode_incref(fs, n1));
     inode_dir_add(fs, n1, "..", inode_incref(fs, n));
     inode_dir_add(fs, n, name, n1);
+#ifdef USE_OVERLAY
+    overlay_log_new((FSDeviceMem *)fs, n, name, n1);
+#endif
     inode_to_qid(qid, n1);
     return 0;
 }
@@ -712,6 +1199,10 @@ static int fs_open_write_cb(void *opaque, const uint8_t *data, size_t size)
     size_t len;
     FSINode *n = oi->n;
     
+    if (oi->open_type == FS_OPEN_WGET_ARCHIVE) {
+        fs_write_archive(oi, data, size);
+        return 0;
+    }
     /* we ignore extraneous data */
     len = n->u.reg.size - oi->cur_pos;
     if (size < len)
@@ -757,31 +1248,84 @@ static void fs_wget_set_error(FSINode *n)
     fs_open_end(oi);
 }
 
-static void fs_read_archive(FSOpenInfo *oi)
+/* The archive is demultiplexed as it is received: the data of each
+   file goes directly to its own buffer and the file is marked as
+   loaded as soon as its last byte is there. The archive files are
+   sorted by offset in 'archive_file_list'. */
+static void fs_write_archive(FSOpenInfo *oi, const uint8_t *data,
+                             size_t size)
 {
-    FSINode *n = oi->n;
-    uint64_t pos, pos1, l;
-    uint8_t buf[1024];
-    FSINode *n1;
+    FSINode *n = oi->n, *n1;
     FSOpenInfo *oi1;
-    struct list_head *el, *el1;
-    
-    list_for_each_safe(el, el1, &oi->archive_file_list) {
-        oi1 = list_entry(el, FSOpenInfo, archive_link);
+    uint64_t pos, len;
+
+    /* we ignore extraneous data */
+    len = n->u.reg.size - oi->cur_pos;
+    if (size > len)
+        size = len;
+    for(;;) {
+        if (list_empty(&oi->archive_file_list)) {
+            /* the remaining data is not needed */
+            oi->cur_pos += size;
+            break;
+        }
+        oi1 = list_entry(oi->archive_file_list.next, FSOpenInfo,
+                         archive_link);
         n1 = oi1->n;
-        /* copy the archive data to the file */
-        pos = oi1->archive_offset;
-        pos1 = 0;
-        while (pos1 < n1->u.reg.size) {
-            l = n1->u.reg.size - pos1;
-            if (l > sizeof(buf))
-                l = sizeof(buf);
-            file_buffer_read(&n->u.reg.fbuf, pos, buf, l);
-            file_buffer_write(&n1->u.reg.fbuf, pos1, buf, l);
-            pos += l;
-            pos1 += l;
+        if (oi->cur_pos >= oi1->archive_offset + n1->u.reg.size) {
+#ifdef DUMP_CACHE_LOAD
+            dump_loaded_file(oi->fs, n1);
+#endif
+            /* also completes the pending open of the file */
+            fs_wget_set_loaded(n1);
+            continue;
+        }
+        if (size == 0)
+            break;
+        if (oi->cur_pos < oi1->archive_offset) {
+            /* skip the files which are not loaded from the archive */
+            len = oi1->archive_offset - oi->cur_pos;
+            if (len > size)
+                len = size;
+        } else {
+            pos = oi->cur_pos - oi1->archive_offset;
+            len = n1->u.reg.size - pos;
+            if (len > size)
+                len = size;
+            if (file_buffer_write(&n1->u.reg.fbuf, pos, data, len) < 0) {
+                fs_wget_set_error(n1);
+                continue;
+            }
+        }
+        data += len;
+        size -= len;
+        oi->cur_pos += len;
+    }
+}
+
+/* Only the files of the archive are kept, so the archive itself
+   returns to the unloaded state. If it was opened in the mean time,
+   it is loaded again as a regular file. */
+static void fs_end_archive(FSOpenInfo *oi)
+{
+    FSDevice *fs1 = oi->fs;
+    FSINode *n = oi->n;
+    FSFile *f = oi->f;
+    FSOpenCompletionFunc *cb = oi->cb;
+    void *opaque = oi->opaque;
+
+    n->u.reg.state = REG_STATE_UNLOADED;
+    file_buffer_reset(&n->u.reg.fbuf);
+    fs_open_end(oi);
+    if (cb) {
+        if (fs_open_wget(fs1, n, FS_OPEN_WGET_REG) < 0) {
+            cb(fs1, NULL, -P9_EIO, opaque);
+            return;
         }
-        fs_wget_set_loaded(n1);
+        oi = n->u.reg.open_info;
+        oi->f = f;
+        oi->cb = cb;
+        oi->opaque = opaque;
     }
 }
 
@@ -823,12 +1367,16 @@ static void fs_open_cb(void *opaque, int err, void *data, size_t size)
             /* end of transfer */
             if (oi->cur_pos != n->u.reg.size)
                 goto error;
+            if (oi->open_type == FS_OPEN_WGET_ARCHIVE) {
+                /* all the archive files are loaded at this point */
+                assert(list_empty(&oi->archive_file_list));
+                fs_end_archive(oi);
+            } else {
 #ifdef DUMP_CACHE_LOAD
-            dump_loaded_file(oi->fs, n);
+                dump_loaded_file(oi->fs, n);
 #endif
-            if (oi->open_type == FS_OPEN_WGET_ARCHIVE)
-                fs_read_archive(oi);
-            fs_wget_set_loaded(n);
+                fs_wget_set_loaded(n);
+            }
         }
     }
 }
@@ -845,7 +1393,9 @@ static int fs_open_wget(FSDevice *fs1, FSINode *n, FSOpenWgetEnum open_type)
     
     fs_trim_cache(fs1, n->u.reg.size);
     
-    if (file_buffer_resize(&n->u.reg.fbuf, n->u.reg.size) < 0)
+    /* the archive data is directly stored in the archive files */
+    if (open_type != FS_OPEN_WGET_ARCHIVE &&
+        file_buffer_resize(&n->u.reg.fbuf, n->u.reg.size) < 0)
         return -P9_EIO;
     n->u.reg.state = REG_STATE_LOADING;
     oi = mallocz(sizeof(*oi));
@@ -858,11 +1408,12 @@ static int fs_open_wget(FSDevice *fs1, FSINode *n, FSOpenWgetEnum open_type)
             init_list_head(&oi->archive_file_list);
         file_id_to_filename(fname, n->u.reg.file_id);
         bu = n->u.reg.base_url;
-        url = compose_path(bu->url, fname);
+        url = compose_url_list(bu->url, fname);
         if (bu->encrypted) {
             oi->dec_state = decrypt_file_init(&bu->aes_state, fs_open_write_cb, oi);
         }
         oi->xhr = fs_wget(url, bu->user, bu->password, oi, fs_open_cb, FALSE);
+        free(url);
     }
     n->u.reg.open_info = oi;
     return 0;
@@ -878,7 +1429,10 @@ static void fs_preload_file(FSDevice *fs1, const char *filename)
 #if defined(DEBUG_CACHE)
         printf("preload: %s\n", filename);
 #endif
-        fs_open_wget(fs1, n, FS_OPEN_WGET_REG);
+        if (fs_open_wget(fs1, n, FS_OPEN_WGET_REG) == 0) {
+            fs_wget_set_priority(n->u.reg.open_info->xhr,
+                                 WGET_PRIO_PREFETCH);
+        }
     }
 }
 
@@ -942,6 +1496,7 @@ static void fs_preload_archive(FSDevice *fs1, const char *filename)
 
         /* start loading the archive */
         fs_open_wget(fs1, n, FS_OPEN_WGET_ARCHIVE);
+        fs_wget_set_priority(n->u.reg.open_info->xhr, WGET_PRIO_PREFETCH);
         
         /* indicate that all the archive files are being loaded. Also
            check consistency of size and file id */
@@ -957,6 +1512,7 @@ static void fs_preload_archive(FSDevice *fs1, const char *filename)
                     list_add_tail(&n1->u.reg.open_info->archive_link,
                                   &n->u.reg.open_info->archive_file_list);
                     n1->u.reg.open_info->archive_offset = offset;
+                    n1->u.reg.open_info->archive = n->u.reg.open_info;
                 } else {
 #if defined(DEBUG_CACHE)
                     printf(" inconsistent archive file: %s\n", paf->name);
@@ -1054,7 +1610,11 @@ static int fs_open(FSDevice *fs1, FSQID *qid, FSFile *f, uint32_t flags,
                 oi = n->u.reg.open_info;
                 if (oi->cb)
                     return -P9_EIO;
-                oi = n->u.reg.open_info;
+                /* the guest now waits for the preloaded file */
+                if (oi->open_type == FS_OPEN_WGET_ARCHIVE_FILE)
+                    fs_wget_set_priority(oi->archive->xhr, WGET_PRIO_DEMAND);
+                else
+                    fs_wget_set_priority(oi->xhr, WGET_PRIO_DEMAND);
                 oi->f = f;
                 oi->cb = cb;
                 oi->opaque = opaque;
@@ -1094,6 +1654,9 @@ static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
         
         n1 = inode_new(fs, FT_REG, mode, f->uid, gid);
         inode_dir_add(fs, n, name, n1);
+#ifdef USE_OVERLAY
+        overlay_log_new((FSDeviceMem *)fs, n, name, n1);
+#endif
         
         inode_dec_open(fs, f->inode);
         f->inode = inode_inc_open(fs, n1);
@@ -1186,7 +1749,9 @@ static int fs_truncate(FSDevice *fs1, FSINode *n, uint64_t size)
 {
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
     intptr_t diff, diff_blocks;
+#if defined(EMSCRIPTEN)
     size_t new_allocated_size;
+#endif
     
     if (n->type != FT_REG)
         return -P9_EINVAL;
@@ -1204,13 +1769,24 @@ static int fs_truncate(FSDevice *fs1, FSINode *n, uint64_t size)
         if (size == 0) {
             /* now local content */
             n->u.reg.state = REG_STATE_LOCAL;
+            n->u.reg.size = 0;
+            /* if it fails, the empty file stays in memory */
+            inode_set_local(fs1, n);
         }
         break;
     case REG_STATE_LOADED:
     case REG_STATE_LOCAL:
+        if (diff > 0 && (fs->fs_blocks + diff_blocks) > fs->fs_max_blocks)
+            return -P9_ENOSPC;
+        /* file is modified, so it is now local */
+        if (inode_set_local(fs1, n) < 0)
+            return -P9_EIO;
+#if !defined(EMSCRIPTEN)
+        /* no copy and the new bytes are holes */
+        if (file_buffer_resize(&n->u.reg.fbuf, size) < 0)
+            return -P9_ENOSPC;
+#else
         if (diff > 0) {
-            if ((fs->fs_blocks + diff_blocks) > fs->fs_max_blocks)
-                return -P9_ENOSPC;
             if (size > n->u.reg.fbuf.allocated_size) {
                 new_allocated_size = n->u.reg.fbuf.allocated_size * 5 / 4;
                 if (size > new_allocated_size)
@@ -1226,13 +1802,7 @@ static int fs_truncate(FSDevice *fs1, FSINode *n, uint64_t size)
                     return -P9_ENOSPC;
             }
         }
-        /* file is modified, so it is now local */
-        if (n->u.reg.state == REG_STATE_LOADED) {
-            list_del(&n->u.reg.link);
-            fs->inode_cache_size -= n->u.reg.size;
-            assert(fs->inode_cache_size >= 0);
-            n->u.reg.state = REG_STATE_LOCAL;
-        }
+#endif
         break;
     default:
         abort();
@@ -1246,7 +1816,6 @@ static int fs_truncate(FSDevice *fs1, FSINode *n, uint64_t size)
 static int fs_write(FSDevice *fs1, FSFile *f, uint64_t offset,
                     const uint8_t *buf, int count)
 {
-    FSDeviceMem *fs = (FSDeviceMem *)fs1;
     FSINode *n = f->inode;
     uint64_t end;
     int err;
@@ -1269,14 +1838,13 @@ static int fs_write(FSDevice *fs1, FSFile *f, uint64_t offset,
             return err;
     }
     inode_update_mtime(fs1, n);
-    /* file is modified, so it is now local */
-    if (n->u.reg.state == REG_STATE_LOADED) {
-        list_del(&n->u.reg.link);
-        fs->inode_cache_size -= n->u.reg.size;
-        assert(fs->inode_cache_size >= 0);
-        n->u.reg.state = REG_STATE_LOCAL;
-    }
-    file_buffer_write(&n->u.reg.fbuf, offset, buf, count);
+    if (inode_set_local(fs1, n) < 0)
+        return -P9_EIO;
+#ifdef USE_OVERLAY
+    n->overlay_dirty = TRUE;
+#endif
+    if (file_buffer_write(&n->u.reg.fbuf, offset, buf, count) < 0)
+        return -P9_ENOSPC;
     return count;
 }
 
@@ -1284,6 +1852,10 @@ static void fs_close(FSDevice *fs, FSFile *f)
 {
     if (f->is_opened) {
         f->is_opened = FALSE;
+#ifdef USE_OVERLAY
+        if (f->inode->overlay_dirty)
+            overlay_log_attr((FSDeviceMem *)fs, f->inode);
+#endif
     }
     if (f->req)
         fs_cmd_close(fs, f);
@@ -1364,6 +1936,9 @@ static int fs_setattr(FSDevice *fs1, FSFile *f, uint32_t mask,
         n->ctime_sec = tv.tv_sec;
         n->ctime_nsec = tv.tv_usec * 1000;
     }
+#ifdef USE_OVERLAY
+    overlay_log_attr((FSDeviceMem *)fs1, n);
+#endif
     return 0;
 }
 
@@ -1375,6 +1950,9 @@ static int fs_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
         return -P9_EPERM;
     if (inode_search(n, name))
         return -P9_EEXIST;
+#ifdef USE_OVERLAY
+    overlay_log_link((FSDeviceMem *)fs, n, name, f->inode);
+#endif
     inode_dir_add(fs, n, name, inode_incref(fs, f->inode));
     return 0;
 }
@@ -1390,6 +1968,9 @@ static int fs_symlink(FSDevice *fs, FSQID *qid,
     n1 = inode_new(fs, FT_LNK, 0777, f->uid, gid);
     n1->u.symlink.name = strdup(symgt);
     inode_dir_add(fs, n, name, n1);
+#ifdef USE_OVERLAY
+    overlay_log_new((FSDeviceMem *)fs, n, name, n1);
+#endif
     inode_to_qid(qid, n1);
     return 0;
 }
@@ -1414,6 +1995,9 @@ static int fs_mknod(FSDevice *fs, FSQID *qid,
         n1->u.dev.minor = minor;
     }
     inode_dir_add(fs, n, name, n1);
+#ifdef USE_OVERLAY
+    overlay_log_new((FSDeviceMem *)fs, n, name, n1);
+#endif
     inode_to_qid(qid, n1);
     return 0;
 }
@@ -1430,50 +2014,67 @@ static int fs_readlink(FSDevice *fs, char *buf, int buf_size, FSFile *f)
     return 0;
 }
 
-static int fs_renameat(FSDevice *fs, FSFile *f, const char *name, 
-                       FSFile *new_f, const char *new_name)
+static int inode_rename(FSDevice *fs, FSINode *dir, const char *name, 
+                        FSINode *new_dir, const char *new_name)
 {
     FSDirEntry *de, *de1;
     FSINode *n1;
     
-    de = inode_search(f->inode, name);
+    de = inode_search(dir, name);
     if (!de)
         return -P9_ENOENT;
-    de1 = inode_search(new_f->inode, new_name);
+    de1 = inode_search(new_dir, new_name);
     n1 = NULL;
     if (de1) {
         n1 = de1->inode;
         if (n1->type == FT_DIR)
             return -P9_EEXIST; /* XXX: handle the case */
-        inode_dirent_delete_no_decref(fs, new_f->inode, de1);
     }
-    inode_dir_add(fs, new_f->inode, new_name, inode_incref(fs, de->inode));
-    inode_dirent_delete(fs, f->inode, de);
+#ifdef USE_OVERLAY
+    overlay_log_rename((FSDeviceMem *)fs, dir, name, new_dir, new_name);
+#endif
+    if (de1)
+        inode_dirent_delete_no_decref(fs, new_dir, de1);
+    inode_dir_add(fs, new_dir, new_name, inode_incref(fs, de->inode));
+    inode_dirent_delete(fs, dir, de);
     if (n1)
         inode_decref(fs, n1);
     return 0;
 }
 
-static int fs_unlinkat(FSDevice *fs, FSFile *f, const char *name)
+static int fs_renameat(FSDevice *fs, FSFile *f, const char *name, 
+                       FSFile *new_f, const char *new_name)
+{
+    return inode_rename(fs, f->inode, name, new_f->inode, new_name);
+}
+
+static int inode_unlink(FSDevice *fs, FSINode *dir, const char *name)
 {
     FSDirEntry *de;
     FSINode *n;
 
     if (!strcmp(name, ".") || !strcmp(name, ".."))
         return -P9_ENOENT;
-    de = inode_search(f->inode, name);
+    de = inode_search(dir, name);
     if (!de)
         return -P9_ENOENT;
     n = de->inode;
-    if (n->type == FT_DIR) {
-        if (!is_empty_dir(fs, n))
-            return -P9_ENOTEMPTY;
+    if (n->type == FT_DIR && !is_empty_dir(fs, n))
+        return -P9_ENOTEMPTY;
+#ifdef USE_OVERLAY
+    overlay_log_unlink((FSDeviceMem *)fs, dir, name);
+#endif
+    if (n->type == FT_DIR)
         flush_dir(fs, n);
-    }
-    inode_dirent_delete(fs, f->inode, de);
+    inode_dirent_delete(fs, dir, de);
     return 0;
 }
 
+static int fs_unlinkat(FSDevice *fs, FSFile *f, const char *name)
+{
+    return inode_unlink(fs, f->inode, name);
+}
+
 static int fs_lock(FSDevice *fs, FSFile *f, const FSLock *lock)
 {
     FSINode *n = f->inode;
@@ -1504,6 +2105,14 @@ static void fs_mem_end(FSDevice *fs1)
     FSINode *n;
     FSDirEntry *de;
 
+#ifdef USE_OVERLAY
+    /* the overlay data must be kept */
+    if (fs->overlay_fd >= 0)
+        close(fs->overlay_fd);
+    fs->overlay_fd = -1;
+    free(fs->overlay_dir);
+    fs->overlay_dir = NULL;
+#endif
     list_for_each_safe(el, el1, &fs->inode_list) {
         n = list_entry(el, FSINode, link);
         n->refcount = 0;
@@ -1567,6 +2176,10 @@ FSDevice *fs_mem_init(void)
     init_list_head(&fs->preload_archive_list);
 
     init_list_head(&fs->base_url_list);
+#ifdef USE_OVERLAY
+    fs->overlay_fd = -1;
+    fs->overlay_id_alloc = 1;
+#endif
 
     /* create the root inode */
     n = inode_new(fs1, FT_DIR, 0777, 0, 0);
@@ -1790,7 +2403,12 @@ static void dump_loaded_file(FSDevice *fs1, FSINode *n)
         fprintf(fs->dump_preload_archive_file, "  %s %" PRId64 " %" PRIx64 "\n",
                 n->u.reg.filename, n->u.reg.size, n->u.reg.file_id);
         fflush(fs->dump_preload_archive_file);
-        fwrite(n->u.reg.fbuf.data, 1, n->u.reg.size, fs->dump_archive_file);
+        {
+            uint8_t *buf = malloc(n->u.reg.size);
+            file_buffer_read(&n->u.reg.fbuf, 0, buf, n->u.reg.size);
+            fwrite(buf, 1, n->u.reg.size, fs->dump_archive_file);
+            free(buf);
+        }
         fflush(fs->dump_archive_file);
         fs->dump_archive_size += n->u.reg.size;
         if (fs->dump_archive_size >= ARCHIVE_SIZE_MAX) {
@@ -2040,6 +2658,7 @@ static int filelist_load(FSDevice *fs1, const char *str)
     return ret;
 }
 
+
 /************************************************************/
 /* FS init from network */
 
@@ -2054,6 +2673,321 @@ static void __attribute__((format(printf, 1, 2))) fatal_error(const char *fmt, .
     exit(1);
 }
 
+#ifdef USE_OVERLAY
+/***********************************************/
+/* overlay journal replay */
+
+typedef struct {
+    FSINode **tab; /* indexed by overlay ID, each entry holds a reference */
+    uint64_t tab_size;
+    uint64_t max_id;
+    /* file names of the current record. Each of them is at most as
+       long as the record line */
+    char *name, *name2;
+    size_t name_size;
+} OverlayReplayState;
+
+static FSINode *replay_get_inode(OverlayReplayState *s, const char **pp)
+{
+    uint64_t id;
+    if (parse_uint64(&id, pp) < 0 || id >= s->tab_size)
+        return NULL;
+    return s->tab[id];
+}
+
+static int replay_set_inode(FSDevice *fs, OverlayReplayState *s,
+                            uint64_t id, FSINode *n)
+{
+    uint64_t new_size;
+
+    if (id == 0 || id > UINT32_MAX)
+        return -1;
+    if (id >= s->tab_size) {
+        new_size = s->tab_size * 3 / 2;
+        if (new_size < id + 1)
+            new_size = id + 1;
+        s->tab = realloc(s->tab, new_size * sizeof(s->tab[0]));
+        memset(s->tab + s->tab_size, 0,
+               (new_size - s->tab_size) * sizeof(s->tab[0]));
+        s->tab_size = new_size;
+    }
+    if (s->tab[id])
+        return -1;
+    s->tab[id] = inode_incref(fs, n);
+    n->overlay_id = id;
+    return 0;
+}
+
+static int replay_new(FSDevice *fs1, OverlayReplayState *s, const char **pp)
+{
+    char *name = s->name, *target = s->name2;
+    uint32_t mode, uid, gid;
+    FSINodeTypeEnum type;
+    FSINode *dir, *n;
+    uint64_t id;
+
+    if (parse_uint64(&id, pp) < 0)
+        return -1;
+    if (id > s->max_id)
+        s->max_id = id;
+    dir = replay_get_inode(s, pp);
+    if (parse_uint32_base(&mode, pp, 8) < 0 ||
+        parse_uint32(&uid, pp) < 0 ||
+        parse_uint32(&gid, pp) < 0 ||
+        parse_fname(name, s->name_size, pp) < 0)
+        return -1;
+    type = mode >> 12;
+    if (type == FT_LNK && parse_fname(target, s->name_size, pp) < 0)
+        return -1;
+    if (!dir || dir->type != FT_DIR || inode_search(dir, name))
+        return 0; /* ignored */
+    n = inode_new(fs1, type, mode, uid, gid);
+    switch(type) {
+    case FT_DIR:
+        inode_dir_add(fs1, n, ".", inode_incref(fs1, n));
+        inode_dir_add(fs1, n, "..", inode_incref(fs1, dir));
+        break;
+    case FT_LNK:
+        n->u.symlink.name = strdup(target);
+        break;
+    case FT_CHR:
+    case FT_BLK:
+        if (parse_uint32(&n->u.dev.major, pp) < 0 ||
+            parse_uint32(&n->u.dev.minor, pp) < 0)
+            return -1;
+        break;
+    default:
+        break;
+    }
+    inode_dir_add(fs1, dir, name, n);
+    return replay_set_inode(fs1, s, id, n);
+}
+
+/* the file content is the one of the last session */
+static int replay_data(FSDevice *fs1, FSINode *n)
+{
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    struct stat st;
+    char *filename;
+    int fd;
+
+    if (n->type != FT_REG || n->u.reg.fbuf.fd >= 0 ||
+        n->u.reg.state == REG_STATE_LOADING)
+        return 0;
+    filename = overlay_data_filename(fs, n->overlay_id);
+    fd = open(filename, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        /* the file was deleted later */
+        free(filename);
+        return 0;
+    }
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size > UINTPTR_MAX) {
+        fprintf(stderr, "%s: cannot open\n", filename);
+        free(filename);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    free(filename);
+    if (file_buffer_set_file(&n->u.reg.fbuf, fd, st.st_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    switch(n->u.reg.state) {
+    case REG_STATE_LOADED:
+        list_del(&n->u.reg.link);
+        fs->inode_cache_size -= n->u.reg.size;
+        fs_base_url_decref(fs1, n->u.reg.base_url);
+        break;
+    case REG_STATE_UNLOADED:
+        fs_base_url_decref(fs1, n->u.reg.base_url);
+        break;
+    default:
+        break;
+    }
+    n->u.reg.state = REG_STATE_LOCAL;
+    fs->fs_blocks += to_blocks(fs, st.st_size) - to_blocks(fs, n->u.reg.size);
+    n->u.reg.size = st.st_size;
+    return 0;
+}
+
+/* 'str' contains 'len' bytes of complete records. The records which
+   cannot be parsed are skipped. */
+static void overlay_replay(FSDevice *fs1, const char *str, size_t len)
+{
+    OverlayReplayState s_s, *s = &s_s;
+    const char *p, *p_end, *line_end;
+    char *name, *new_name;
+    FSINode *n, *dir, *new_dir;
+    uint64_t i, id;
+    size_t line_len;
+    int ret;
+
+    memset(s, 0, sizeof(*s));
+    p = skip_header(str);
+    p_end = str + len;
+    while (p < p_end) {
+        line_end = memchr(p, '\n', p_end - p);
+        line_len = line_end - p;
+        ret = -1;
+        if (line_len >= INT_MAX)
+            goto skip;
+        if (line_len + 1 > s->name_size) {
+            s->name_size = line_len + 1;
+            s->name = realloc(s->name, s->name_size);
+            s->name2 = realloc(s->name2, s->name_size);
+        }
+        name = s->name;
+        new_name = s->name2;
+        switch(*p++) {
+        case 'B':
+            if (parse_uint64(&id, &p) < 0 ||
+                parse_fname(name, s->name_size, &p) < 0)
+                break;
+            if (id > s->max_id)
+                s->max_id = id;
+            n = inode_search_path(fs1, name);
+            if (!n) {
+                fprintf(stderr, "overlay: '%s' not found\n", name);
+                ret = 0;
+            } else {
+                ret = replay_set_inode(fs1, s, id, n);
+            }
+            break;
+        case 'N':
+            ret = replay_new(fs1, s, &p);
+            break;
+        case 'L':
+            dir = replay_get_inode(s, &p);
+            if (parse_fname(name, s->name_size, &p) < 0)
+                break;
+            n = replay_get_inode(s, &p);
+            if (dir && n && dir->type == FT_DIR && n->type != FT_DIR &&
+                !inode_search(dir, name))
+                inode_dir_add(fs1, dir, name, inode_incref(fs1, n));
+            ret = 0;
+            break;
+        case 'U':
+            dir = replay_get_inode(s, &p);
+            if (parse_fname(name, s->name_size, &p) < 0)
+                break;
+            if (dir)
+                inode_unlink(fs1, dir, name);
+            ret = 0;
+            break;
+        case 'R':
+            dir = replay_get_inode(s, &p);
+            if (parse_fname(name, s->name_size, &p) < 0)
+                break;
+            new_dir = replay_get_inode(s, &p);
+            if (parse_fname(new_name, s->name_size, &p) < 0)
+                break;
+            if (dir && new_dir && new_dir->type == FT_DIR)
+                inode_rename(fs1, dir, name, new_dir, new_name);
+            ret = 0;
+            break;
+        case 'A':
+            {
+                uint32_t mode, uid, gid, mtime_sec, mtime_nsec;
+                uint32_t ctime_sec, ctime_nsec;
+                n = replay_get_inode(s, &p);
+                if (parse_uint32_base(&mode, &p, 8) < 0 ||
+                    parse_uint32(&uid, &p) < 0 ||
+                    parse_uint32(&gid, &p) < 0 ||
+                    parse_time(&mtime_sec, &mtime_nsec, &p) < 0 ||
+                    parse_time(&ctime_sec, &ctime_nsec, &p) < 0)
+                    break;
+                if (n) {
+                    n->mode = mode;
+                    n->uid = uid;
+                    n->gid = gid;
+                    n->mtime_sec = mtime_sec;
+                    n->mtime_nsec = mtime_nsec;
+                    n->ctime_sec = ctime_sec;
+                    n->ctime_nsec = ctime_nsec;
+                }
+                ret = 0;
+            }
+            break;
+        case 'D':
+            n = replay_get_inode(s, &p);
+            ret = n ? replay_data(fs1, n) : 0;
+            break;
+        default:
+            break;
+        }
+    skip:
+        if (ret < 0 || p != line_end) {
+            fprintf(stderr, "overlay: skipping the invalid journal record "
+                    "at offset %" PRIu64 "\n", (uint64_t)(line_end - line_len - str));
+        }
+        p = line_end + 1;
+    }
+
+    /* release the inodes which are no longer referenced */
+    for(i = 0; i < s->tab_size; i++) {
+        if (s->tab[i])
+            inode_decref(fs1, s->tab[i]);
+    }
+    free(s->tab);
+    free(s->name);
+    free(s->name2);
+    ((FSDeviceMem *)fs1)->overlay_id_alloc = s->max_id + 1;
+}
+
+/* replay the journal of the overlay directory, then log the
+   modifications in it */
+static void overlay_open(FSDevice *fs1)
+{
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    char *filename, *buf, *p;
+    char fname[FILEID_SIZE_MAX];
+    FSFileID root_id;
+    struct stat st;
+    size_t len;
+    int fd;
+
+    filename = compose_path(fs->overlay_dir, "data");
+    if ((mkdir(fs->overlay_dir, 0777) < 0 && errno != EEXIST) ||
+        (mkdir(filename, 0777) < 0 && errno != EEXIST))
+        fatal_error("%s: %s", filename, strerror(errno));
+    free(filename);
+
+    filename = compose_path(fs->overlay_dir, "journal");
+    fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        fatal_error("%s: %s", filename, strerror(errno));
+    buf = malloc(st.st_size + 1);
+    if (read(fd, buf, st.st_size) != st.st_size)
+        fatal_error("%s: read error", filename);
+    buf[st.st_size] = '\0';
+
+    if (st.st_size == 0) {
+        fs->overlay_fd = fd;
+        overlay_log(fs, "Version: 1\nRootID: %s\n\n",
+                    file_id_to_filename(fname, fs->root_id));
+    } else {
+        if (parse_tag_version(buf) != 1 ||
+            parse_tag_file_id(&root_id, buf, "RootID") < 0 ||
+            !skip_header(buf))
+            fatal_error("%s: invalid overlay journal", filename);
+        if (root_id != fs->root_id)
+            fatal_error("%s: the overlay belongs to another filesystem version",
+                        fs->overlay_dir);
+        /* only an interrupted write leaves an incomplete last record:
+           remove it so that the next records start on a new line */
+        p = strrchr(buf, '\n');
+        len = p ? p + 1 - buf : 0;
+        overlay_replay(fs1, buf, len);
+        if (len < st.st_size && ftruncate(fd, len) < 0)
+            fatal_error("%s: %s", filename, strerror(errno));
+        fs->overlay_fd = fd;
+    }
+    free(buf);
+    free(filename);
+}
+#endif
+
 static void fs_create_cmd(FSDevice *fs)
 {
     FSFile *root_fd;
@@ -2095,8 +3029,8 @@ static FSDevice *fs_import_fs;
 
 #define DEFAULT_IMPORT_FILE_PATH "/tmp"
 
-FSDevice *fs_net_init(const char *url, void (*start_cb)(void *opaque),
-                      void *start_opaque)
+FSDevice *fs_net_init(const char *url, const char *overlay_dir,
+                      void (*start_cb)(void *opaque), void *start_opaque)
 {
     FSDevice *fs;
     FSDeviceMem *fs1;
@@ -2110,6 +3044,13 @@ FSDevice *fs_net_init(const char *url, void (*start_cb)(void *opaque),
 #endif
     fs1 = (FSDeviceMem *)fs;
     fs1->import_dir = strdup(DEFAULT_IMPORT_FILE_PATH);
+    if (overlay_dir) {
+#ifdef USE_OVERLAY
+        fs1->overlay_dir = strdup(overlay_dir);
+#else
+        fprintf(stderr, "Overlay directories are not supported\n");
+#endif
+    }
     
     fs_create_cmd(fs);
 
@@ -2141,7 +3082,7 @@ static void fs_initial_sync(FSDevice *fs,
     gettimeofday(&tv, NULL);
     snprintf(buf, sizeof(buf), HEAD_FILENAME "?nocache=%" PRId64,
              (int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
-    head_url = compose_url(s->url, buf);
+    head_url = compose_url_list(s->url, buf);
     head_fd = fs_dup(fs, s->root_fd);
     assert(!fs->fs_create(fs, &qid, head_fd, ".head",
                           P9_O_RDWR | P9_O_TRUNC, 0644, 0));
@@ -2174,6 +3115,7 @@ static void head_loaded(FSDevice *fs, FSFile *f, int64_t size, void *opaque)
 
     if (parse_tag_file_id(&root_id, buf, "RootID") < 0)
         fatal_error("expected RootID tag");
+    ((FSDeviceMem *)fs)->root_id = root_id;
 
     if (parse_tag_uint64(&fs_max_size, buf, "FSMaxSize") == 0 &&
         fs_max_size >= ((uint64_t)1 << 20)) {
@@ -2181,7 +3123,7 @@ static void head_loaded(FSDevice *fs, FSFile *f, int64_t size, void *opaque)
     }
                        
     /* set the Root URL in the filesystem */
-    root_url = compose_url(s->url, ROOT_FILENAME);
+    root_url = compose_url_list(s->url, ROOT_FILENAME);
     fs_net_set_base_url(fs, "/", root_url, NULL, NULL, NULL);
     
     new_filelist_fd = fs_dup(fs, s->root_fd);
@@ -2189,7 +3131,7 @@ static void head_loaded(FSDevice *fs, FSFile *f, int64_t size, void *opaque)
                           P9_O_RDWR | P9_O_TRUNC, 0644, 0));
 
     file_id_to_filename(fname, root_id);
-    url = compose_url(root_url, fname);
+    url = compose_url_list(root_url, fname);
     fs_wget_file2(fs, new_filelist_fd, url, NULL, NULL, NULL, 0,
                   filelist_loaded, s, NULL);
     free(root_url);
@@ -2213,6 +3155,11 @@ static void filelist_loaded(FSDevice *fs, FSFile *f, int64_t size, void *opaque)
     if (filelist_load(fs, (char *)buf) != 0)
         fatal_error("error while parsing file list");
 
+#ifdef USE_OVERLAY
+    if (((FSDeviceMem *)fs)->overlay_dir)
+        overlay_open(fs);
+#endif
+
     /* try to load the kernel and the preload file */
     s->file_index = 0;
     kernel_load_cb(fs, NULL, 0, s);
@@ -71,6 +71,36 @@ char *compose_url(const char *base_url, const char *name)
     }
 }
 
+/* same as compose_url() for each URL of a space separated list */
+char *compose_url_list(const char *base_urls, const char *name)
+{
+    DynBuf dbuf;
+    char *base_url, *url;
+    const char *p;
+    int len;
+
+    dbuf_init(&dbuf);
+    p = base_urls;
+    for(;;) {
+        p += strspn(p, " \t\n");
+        if (*p == '\0')
+            break;
+        len = strcspn(p, " \t\n");
+        base_url = strndup(p, len);
+        url = compose_url(base_url, name);
+        if (dbuf.size != 0)
+            dbuf_putc(&dbuf, ' ');
+        dbuf_putstr(&dbuf, url);
+        free(url);
+        free(base_url);
+        p += len;
+    }
+    if (dbuf.size == 0)
+        dbuf_putstr(&dbuf, name);
+    dbuf_putc(&dbuf, '\0');
+    return (char *)dbuf.buf;
+}
+
 void skip_line(const char **pp)
 {
     const char *p;
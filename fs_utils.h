@@ -74,6 +74,7 @@ void pstrcpy(char *buf, int buf_size, const char *str);
 char *pstrcat(char *buf, int buf_size, const char *s);
 char *compose_path(const char *path, const char *name);
 char *compose_url(const char *base_url, const char *name);
+char *compose_url_list(const char *base_urls, const char *name);
 void skip_line(const char **pp);
 char *quoted_str(const char *str);
 int parse_fname(char *buf, int buf_size, const char **pp);
@@ -28,6 +28,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <sys/time.h>
+#include <time.h>
 #include <ctype.h>
 
 #include "cutils.h"
@@ -35,6 +36,7 @@
 #include "fs.h"
 #include "fs_utils.h"
 #include "fs_wget.h"
+#include "trace.h"
 
 #if defined(EMSCRIPTEN)
 #include <emscripten.h>
@@ -45,11 +47,35 @@
 /***********************************************/
 /* HTTP get */
 
+#define XHR_URL_MAX 16
+
+/* 'url' is a list of URLs separated by spaces */
+static int parse_url_list(char ***purls, const char *url)
+{
+    char **urls;
+    int n, len;
+
+    urls = NULL;
+    n = 0;
+    for(;;) {
+        url += strspn(url, " \t\n");
+        if (*url == '\0' || n >= XHR_URL_MAX)
+            break;
+        len = strcspn(url, " \t\n");
+        urls = realloc(urls, sizeof(urls[0]) * (n + 1));
+        urls[n++] = strndup(url, len);
+        url += len;
+    }
+    *purls = urls;
+    return n;
+}
+
 #ifdef EMSCRIPTEN
 
 struct XHRState {
     void *opaque;
     WGetWriteCallback *cb;
+    BOOL keep_data;
 };
 
 static int downloading_count;
@@ -87,9 +113,17 @@ static void fs_wget_onload(unsigned int handle,
                            void *opaque, void *data, unsigned int size)
 {
     XHRState *s = opaque;
+    void *buf;
     fs_wget_update_downloading_count(-1);
-    if (s->cb)
+    if (s->cb) {
+        if (s->keep_data) {
+            /* 'data' is freed by emscripten */
+            buf = malloc(size);
+            memcpy(buf, data, size);
+            data = buf;
+        }
         s->cb(s->opaque, 0, data, size);
+    }
 }
 
 extern int emscripten_async_wget3_data(const char* url, const char* requesttype, const char *user, const char *password, const uint8_t *post_data, int post_data_len, void *arg, int free, em_async_wget2_data_onload_func onload, em_async_wget2_data_onerror_func onerror, em_async_wget2_data_onprogress_func onprogress);
@@ -101,6 +135,8 @@ XHRState *fs_wget2(const char *url, const char *user, const char *password,
     XHRState *s;
     const char *request;
     uint8_t *post_data;
+    char **urls;
+    int i, url_count;
     
     s = mallocz(sizeof(*s));
     s->opaque = opaque;
@@ -116,9 +152,15 @@ XHRState *fs_wget2(const char *url, const char *user, const char *password,
     }
     fs_wget_update_downloading_count(1);
 
-    emscripten_async_wget3_data(url, request, user, password,
+    /* no mirror selection: only the first URL is used */
+    url_count = parse_url_list(&urls, url);
+    emscripten_async_wget3_data(url_count > 0 ? urls[0] : url,
+                                request, user, password,
                                 post_data, post_data_len, s, 1, fs_wget_onload,
                                 fs_wget_onerror, NULL);
+    for(i = 0; i < url_count; i++)
+        free(urls[i]);
+    free(urls);
     if (post_data_len != 0)
         free(post_data);
     return s;
@@ -130,17 +172,86 @@ void fs_wget_free(XHRState *s)
     s->opaque = NULL;
 }
 
+void fs_wget_set_priority(XHRState *s, WGetPriorityEnum prio)
+{
+}
+
+void fs_wget_set_keep_data(XHRState *s, BOOL enabled)
+{
+    s->keep_data = enabled;
+}
+
+void fs_wget_dump_stats(void)
+{
+}
+
 #else
 
-struct XHRState {
+/* Each URL of a request is a mirror of the same object. Statistics
+   are kept per origin (scheme, host and port) so that new requests
+   go to the fastest mirror. When no data was received after a high
+   percentile of the usual latency of the mirror, the request is
+   hedged to a second mirror and the first one to answer wins. */
+
+#define MIRROR_SAMPLE_COUNT 32 /* latency samples for the percentile */
+#define HEDGE_PERCENTILE 95
+#define HEDGE_DELAY_DEFAULT 500000 /* in us, when no samples are known */
+#define HEDGE_DELAY_MIN 5000 /* in us */
+#define MIRROR_ERROR_PENALTY 1000000 /* in us */
+#define XHR_TRANSFER_MAX 2
+
+/* The requests are queued per priority class and started when their
+   class has less than 'xhr_running_max' running requests. A class
+   does not start requests while a higher class has queued ones. */
+static const int xhr_running_max[WGET_PRIO_COUNT] = { 16, 4, 2 };
+
+//#define DEBUG_MIRROR
+
+typedef struct {
     struct list_head link;
+    char *origin;
+    int64_t latency; /* average time to first byte in us, 0 if unknown */
+    int64_t throughput; /* average in bytes/s, 0 if unknown */
+    uint32_t samples[MIRROR_SAMPLE_COUNT]; /* last latencies in us */
+    int sample_count;
+    int sample_pos;
+    int inflight; /* number of running transfers */
+    BOOL multiplexed; /* the last response used HTTP/2 or later */
+} WGetMirror;
+
+typedef struct {
+    XHRState *s;
     CURL *eh;
+    WGetMirror *m;
+    int64_t start_time;
+    int64_t first_byte_time; /* 0 if no data was received */
+    uint64_t size;
+} XHRTransfer;
+
+struct XHRState {
+    struct list_head link;
+    struct list_head queue_link; /* in xhr_queue[] if not started */
+    WGetPriorityEnum prio;
+    BOOL started;
+    int64_t queue_time; /* in us */
     void *opaque;
     WGetWriteCallback *write_cb;
     WGetReadCallback *read_cb;
+    char *user;
+    char *password;
+    uint64_t post_data_len;
 
     BOOL single_write;
+    BOOL keep_data; /* the callback takes 'dbuf' */
     DynBuf dbuf; /* used if single_write */
+
+    int url_count;
+    char **urls;
+    uint32_t tried_urls; /* bit mask of the URLs already used */
+    XHRTransfer *transfers[XHR_TRANSFER_MAX];
+    XHRTransfer *winner; /* transfer which provides the data */
+    BOOL data_sent; /* data was given to write_cb */
+    int64_t hedge_time; /* 0 if no hedging is planned */
 };
 
 typedef struct {
@@ -150,33 +261,178 @@ typedef struct {
     void *opaque;
 } AsyncCallState;
 
+typedef struct {
+    int64_t count; /* number of started requests */
+    int64_t total_wait; /* in us */
+    int64_t max_wait; /* in us */
+} XHRQueueStats;
+
 static CURLM *curl_multi_ctx;
 static struct list_head xhr_list; /* list of XHRState.link */
+static struct list_head xhr_queue[WGET_PRIO_COUNT]; /* XHRState.queue_link */
+static int xhr_running[WGET_PRIO_COUNT];
+static XHRQueueStats xhr_stats[WGET_PRIO_COUNT];
+static struct list_head mirror_list; /* list of WGetMirror.link */
 
 void fs_wget_init(void)
 {
+    int i;
+
     if (curl_multi_ctx)
         return;
     curl_global_init(CURL_GLOBAL_ALL);
     curl_multi_ctx = curl_multi_init();
+    /* keep enough connections in the cache so that they are reused
+       by the next requests */
+    curl_multi_setopt(curl_multi_ctx, CURLMOPT_MAXCONNECTS,
+                      (long)(xhr_running_max[WGET_PRIO_DEMAND] +
+                             xhr_running_max[WGET_PRIO_PREFETCH] +
+                             xhr_running_max[WGET_PRIO_BACKGROUND]) *
+                      XHR_TRANSFER_MAX);
     init_list_head(&xhr_list);
+    for(i = 0; i < WGET_PRIO_COUNT; i++)
+        init_list_head(&xhr_queue[i]);
+    init_list_head(&mirror_list);
 }
 
 void fs_wget_end(void)
 {
+    struct list_head *el, *el1;
+    WGetMirror *m;
+
+    list_for_each_safe(el, el1, &mirror_list) {
+        m = list_entry(el, WGetMirror, link);
+        free(m->origin);
+        free(m);
+    }
     curl_multi_cleanup(curl_multi_ctx);
     curl_global_cleanup();
 }
 
+static int64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
+}
+
+static WGetMirror *mirror_find(const char *url)
+{
+    const char *p;
+    struct list_head *el;
+    WGetMirror *m;
+    int len;
+
+    p = strstr(url, "://");
+    if (p)
+        p += 3;
+    else
+        p = url;
+    p += strcspn(p, "/");
+    len = p - url;
+    list_for_each(el, &mirror_list) {
+        m = list_entry(el, WGetMirror, link);
+        if (strlen(m->origin) == len && !memcmp(m->origin, url, len))
+            return m;
+    }
+    m = mallocz(sizeof(*m));
+    m->origin = strndup(url, len);
+    list_add_tail(&m->link, &mirror_list);
+    return m;
+}
+
+/* estimated time in us to load a 64 KB object */
+static int64_t mirror_get_cost(WGetMirror *m)
+{
+    int64_t cost;
+    cost = m->latency;
+    if (m->throughput > 0)
+        cost += ((int64_t)65536 * 1000000) / m->throughput;
+    return cost * (1 + m->inflight);
+}
+
+static void mirror_add_latency(WGetMirror *m, int64_t latency)
+{
+    if (latency > INT32_MAX)
+        latency = INT32_MAX;
+    m->samples[m->sample_pos] = latency;
+    m->sample_pos = (m->sample_pos + 1) % MIRROR_SAMPLE_COUNT;
+    if (m->sample_count < MIRROR_SAMPLE_COUNT)
+        m->sample_count++;
+    if (m->latency == 0)
+        m->latency = latency;
+    else
+        m->latency = (m->latency * 7 + latency) / 8;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t v1 = *(const uint32_t *)a, v2 = *(const uint32_t *)b;
+    return (v1 > v2) - (v1 < v2);
+}
+
+static int64_t mirror_get_hedge_delay(WGetMirror *m)
+{
+    uint32_t tab[MIRROR_SAMPLE_COUNT];
+    int n = m->sample_count;
+
+    if (n < 4)
+        return HEDGE_DELAY_DEFAULT;
+    memcpy(tab, m->samples, n * sizeof(tab[0]));
+    qsort(tab, n, sizeof(tab[0]), cmp_u32);
+    return max_int(tab[(n - 1) * HEDGE_PERCENTILE / 100], HEDGE_DELAY_MIN);
+}
+
+static int xhr_find_url(XHRState *s)
+{
+    int i, best;
+    int64_t cost, best_cost;
+
+    best = -1;
+    best_cost = 0;
+    for(i = 0; i < s->url_count; i++) {
+        if (s->tried_urls & (1U << i))
+            continue;
+        cost = mirror_get_cost(mirror_find(s->urls[i]));
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
 static size_t fs_wget_write_cb(char *ptr, size_t size, size_t nmemb,
                                void *userdata)
 {
-    XHRState *s = userdata;
+    XHRTransfer *t = userdata;
+    XHRState *s = t->s;
+    long http_code;
     size *= nmemb;
 
+    /* the data of the error pages is ignored */
+    curl_easy_getinfo(t->eh, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 0 && http_code != 200)
+        return size;
+
+    if (!t->first_byte_time) {
+        t->first_byte_time = get_time_us();
+        mirror_add_latency(t->m, t->first_byte_time - t->start_time);
+    }
+    if (!s->winner) {
+        /* first response: the other transfers are cancelled after
+           curl_multi_perform() */
+        s->winner = t;
+        s->hedge_time = 0;
+    } else if (s->winner != t) {
+        return size;
+    }
+    t->size += size;
+    
     if (s->single_write) {
         dbuf_write(&s->dbuf, s->dbuf.size, (void *)ptr, size);
     } else {
+        s->data_sent = TRUE;
         s->write_cb(s->opaque, 1, ptr, size);
     }
     return size;
@@ -185,59 +441,344 @@ static size_t fs_wget_write_cb(char *ptr, size_t size, size_t nmemb,
 static size_t fs_wget_read_cb(char *ptr, size_t size, size_t nmemb,
                               void *userdata)
 {
-    XHRState *s = userdata;
+    XHRTransfer *t = userdata;
+    XHRState *s = t->s;
     size *= nmemb;
     return s->read_cb(s->opaque, ptr, size);
 }
 
+static void xhr_start_transfer(XHRState *s, int url_index)
+{
+    XHRTransfer *t;
+    CURL *eh;
+    int i;
+
+    for(i = 0; i < XHR_TRANSFER_MAX; i++) {
+        if (!s->transfers[i])
+            break;
+    }
+    assert(i < XHR_TRANSFER_MAX);
+    t = mallocz(sizeof(*t));
+    t->s = s;
+    t->m = mirror_find(s->urls[url_index]);
+    t->m->inflight++;
+    t->start_time = get_time_us();
+    s->transfers[i] = t;
+    s->tried_urls |= 1U << url_index;
+    if (s->post_data_len == 0 && xhr_find_url(s) >= 0) {
+        s->hedge_time = t->start_time + mirror_get_hedge_delay(t->m);
+    } else {
+        s->hedge_time = 0;
+    }
+#ifdef DEBUG_MIRROR
+    printf("wget: %s\n", s->urls[url_index]);
+#endif
+
+    eh = curl_easy_init();
+    t->eh = eh;
+    curl_easy_setopt(eh, CURLOPT_PRIVATE, t);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, t);
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, fs_wget_write_cb);
+    curl_easy_setopt(eh, CURLOPT_HEADER, 0);
+    curl_easy_setopt(eh, CURLOPT_URL, s->urls[url_index]);
+    curl_easy_setopt(eh, CURLOPT_VERBOSE, 0L);
+    curl_easy_setopt(eh, CURLOPT_ACCEPT_ENCODING, "");
+    /* prefer multiplexing on an existing connection. Only done when
+       the origin is known to support it, otherwise the transfer would
+       wait for the previous one to complete. */
+    if (t->m->multiplexed)
+        curl_easy_setopt(eh, CURLOPT_PIPEWAIT, 1L);
+    if (s->user) {
+        curl_easy_setopt(eh, CURLOPT_USERNAME, s->user);
+        curl_easy_setopt(eh, CURLOPT_PASSWORD, s->password);
+    }
+    if (s->post_data_len != 0) {
+        struct curl_slist *headers = NULL;
+        headers = curl_slist_append(headers,
+                                    "Content-Type: application/octet-stream");
+        curl_easy_setopt(eh, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(eh, CURLOPT_POST, 1L);
+        curl_easy_setopt(eh, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t)s->post_data_len);
+        curl_easy_setopt(eh, CURLOPT_READDATA, t);
+        curl_easy_setopt(eh, CURLOPT_READFUNCTION, fs_wget_read_cb);
+    }
+    curl_multi_add_handle(curl_multi_ctx, eh);
+}
+
+static void xhr_end_transfer(XHRTransfer *t)
+{
+    XHRState *s = t->s;
+    int i;
+
+    for(i = 0; i < XHR_TRANSFER_MAX; i++) {
+        if (s->transfers[i] == t)
+            s->transfers[i] = NULL;
+    }
+    if (s->winner == t)
+        s->winner = NULL;
+    t->m->inflight--;
+    curl_multi_remove_handle(curl_multi_ctx, t->eh);
+    curl_easy_cleanup(t->eh);
+    free(t);
+}
+
+/* 'url' can contain several URLs separated by spaces which are
+   mirrors of the same object */
 XHRState *fs_wget2(const char *url, const char *user, const char *password,
                    WGetReadCallback *read_cb, uint64_t post_data_len,
                    void *opaque, WGetWriteCallback *write_cb, BOOL single_write)
 {
     XHRState *s;
     s = mallocz(sizeof(*s));
-    s->eh = curl_easy_init();
     s->opaque = opaque;
     s->write_cb = write_cb;
     s->read_cb = read_cb;
     s->single_write = single_write;
+    s->post_data_len = post_data_len;
+    if (user)
+        s->user = strdup(user);
+    if (password)
+        s->password = strdup(password);
     dbuf_init(&s->dbuf);
-    
-    curl_easy_setopt(s->eh, CURLOPT_PRIVATE, s);
-    curl_easy_setopt(s->eh, CURLOPT_WRITEDATA, s);
-    curl_easy_setopt(s->eh, CURLOPT_WRITEFUNCTION, fs_wget_write_cb);
-    curl_easy_setopt(s->eh, CURLOPT_HEADER, 0);
-    curl_easy_setopt(s->eh, CURLOPT_URL, url);
-    curl_easy_setopt(s->eh, CURLOPT_VERBOSE, 0L);
-    curl_easy_setopt(s->eh, CURLOPT_ACCEPT_ENCODING, "");
-    if (user) {
-        curl_easy_setopt(s->eh, CURLOPT_USERNAME, user);
-        curl_easy_setopt(s->eh, CURLOPT_PASSWORD, password);
+    s->url_count = parse_url_list(&s->urls, url);
+    if (s->url_count == 0) {
+        s->urls = malloc(sizeof(s->urls[0]));
+        s->urls[s->url_count++] = strdup(url);
     }
-    if (post_data_len != 0) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers,
-                                    "Content-Type: application/octet-stream");
-        curl_easy_setopt(s->eh, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(s->eh, CURLOPT_POST, 1L);
-        curl_easy_setopt(s->eh, CURLOPT_POSTFIELDSIZE_LARGE,
-                         (curl_off_t)post_data_len);
-        curl_easy_setopt(s->eh, CURLOPT_READDATA, s);
-        curl_easy_setopt(s->eh, CURLOPT_READFUNCTION, fs_wget_read_cb);
-    }
-    curl_multi_add_handle(curl_multi_ctx, s->eh);
+    
+    /* the transfer is started by xhr_schedule() */
+    s->prio = WGET_PRIO_DEMAND;
+    s->queue_time = get_time_us();
+    list_add_tail(&s->queue_link, &xhr_queue[s->prio]);
     list_add_tail(&s->link, &xhr_list);
     return s;
 }
 
+static void xhr_start(XHRState *s)
+{
+    XHRQueueStats *st = &xhr_stats[s->prio];
+    int64_t wait;
+    int url_index;
+
+    list_del(&s->queue_link);
+    s->started = TRUE;
+    xhr_running[s->prio]++;
+    wait = get_time_us() - s->queue_time;
+    st->count++;
+    st->total_wait += wait;
+    if (wait > st->max_wait)
+        st->max_wait = wait;
+    url_index = xhr_find_url(s);
+    TRACE(wget_start, s, s->urls[url_index], s->prio);
+    xhr_start_transfer(s, url_index);
+}
+
+static void xhr_schedule(void)
+{
+    XHRState *s;
+    int prio;
+
+    for(prio = 0; prio < WGET_PRIO_COUNT; prio++) {
+        while (!list_empty(&xhr_queue[prio]) &&
+               xhr_running[prio] < xhr_running_max[prio]) {
+            s = list_entry(xhr_queue[prio].next, XHRState, queue_link);
+            xhr_start(s);
+        }
+        if (!list_empty(&xhr_queue[prio]))
+            break;
+    }
+}
+
+void fs_wget_set_priority(XHRState *s, WGetPriorityEnum prio)
+{
+    if (s->prio == prio)
+        return;
+    if (s->started) {
+        xhr_running[s->prio]--;
+        xhr_running[prio]++;
+    } else {
+        list_del(&s->queue_link);
+        list_add_tail(&s->queue_link, &xhr_queue[prio]);
+    }
+    s->prio = prio;
+}
+
+void fs_wget_set_keep_data(XHRState *s, BOOL enabled)
+{
+    s->keep_data = enabled;
+}
+
+void fs_wget_dump_stats(void)
+{
+    static const char *prio_names[WGET_PRIO_COUNT] = {
+        "demand", "prefetch", "background" };
+    struct list_head *el;
+    XHRQueueStats *st;
+    int prio, n_queued;
+    
+    for(prio = 0; prio < WGET_PRIO_COUNT; prio++) {
+        st = &xhr_stats[prio];
+        n_queued = 0;
+        list_for_each(el, &xhr_queue[prio])
+            n_queued++;
+        printf("%-10s running=%d queued=%d started=%" PRId64
+               " wait_avg=%0.1fms wait_max=%0.1fms\n",
+               prio_names[prio], xhr_running[prio], n_queued, st->count,
+               st->count ? (double)st->total_wait / st->count / 1000 : 0.0,
+               (double)st->max_wait / 1000);
+    }
+}
+
 void fs_wget_free(XHRState *s)
 {
+    int i;
+
+    for(i = 0; i < XHR_TRANSFER_MAX; i++) {
+        if (s->transfers[i])
+            xhr_end_transfer(s->transfers[i]);
+    }
+    for(i = 0; i < s->url_count; i++)
+        free(s->urls[i]);
+    free(s->urls);
+    free(s->user);
+    free(s->password);
     dbuf_free(&s->dbuf);
-    curl_easy_cleanup(s->eh);
+    if (s->started)
+        xhr_running[s->prio]--;
+    else
+        list_del(&s->queue_link);
     list_del(&s->link);
     free(s);
 }
 
+static BOOL xhr_has_transfers(XHRState *s)
+{
+    int i;
+    for(i = 0; i < XHR_TRANSFER_MAX; i++) {
+        if (s->transfers[i])
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void xhr_transfer_done(XHRTransfer *t, CURLcode res)
+{
+    XHRState *s = t->s;
+    WGetMirror *m = t->m;
+    int64_t d;
+    long http_code;
+    int url_index;
+
+    if (s->winner && s->winner != t) {
+        /* another mirror answered first */
+        xhr_end_transfer(t);
+        return;
+    }
+    curl_easy_getinfo(t->eh, CURLINFO_RESPONSE_CODE, &http_code);
+#if LIBCURL_VERSION_NUM >= 0x073200
+    if (http_code != 0) {
+        long http_version;
+        if (curl_easy_getinfo(t->eh, CURLINFO_HTTP_VERSION,
+                              &http_version) == CURLE_OK)
+            m->multiplexed = (http_version >= CURL_HTTP_VERSION_2_0);
+    }
+#endif
+    /* non HTTP URLs have no response code */
+    if (res == CURLE_OK && (http_code == 200 || http_code == 0)) {
+        if (!t->first_byte_time)
+            mirror_add_latency(m, get_time_us() - t->start_time);
+        d = get_time_us() - t->first_byte_time;
+        if (t->size >= 16384 && t->first_byte_time && d > 0) {
+            d = (t->size * 1000000) / d;
+            if (m->throughput == 0)
+                m->throughput = d;
+            else
+                m->throughput = (m->throughput * 7 + d) / 8;
+        }
+        TRACE(wget_end, s, 0, t->size);
+        xhr_end_transfer(t);
+        /* signal the end of the transfer */
+        if (s->single_write) {
+            s->write_cb(s->opaque, 0, s->dbuf.buf, s->dbuf.size);
+            if (s->keep_data)
+                dbuf_init(&s->dbuf);
+        } else {
+            s->write_cb(s->opaque, 0, NULL, 0);
+        }
+        fs_wget_free(s);
+        return;
+    }
+
+#ifdef DEBUG_MIRROR
+    printf("wget: error %d/%ld from %s\n", res, http_code, m->origin);
+#endif
+    m->latency += MIRROR_ERROR_PENALTY;
+    xhr_end_transfer(t);
+    if (xhr_has_transfers(s))
+        return; /* wait for the other mirror */
+    /* try another mirror if no data was given to the user */
+    url_index = xhr_find_url(s);
+    if (url_index >= 0 && !s->data_sent && s->post_data_len == 0) {
+        dbuf_free(&s->dbuf);
+        dbuf_init(&s->dbuf);
+        xhr_start_transfer(s, url_index);
+        return;
+    }
+    if (http_code < 300)
+        http_code = 404; /* no HTTP error code */
+    TRACE(wget_end, s, -http_code, 0);
+    s->write_cb(s->opaque, -http_code, NULL, 0);
+    fs_wget_free(s);
+}
+
+/* start the hedged requests and return the delay until the next one
+   in ms */
+static int xhr_update_hedging(void)
+{
+    struct list_head *el;
+    XHRState *s;
+    int64_t cur_time, delay;
+    int url_index, timeout;
+
+    cur_time = get_time_us();
+    timeout = INT32_MAX;
+    list_for_each(el, &xhr_list) {
+        s = list_entry(el, XHRState, link);
+        if (s->hedge_time == 0)
+            continue;
+        delay = s->hedge_time - cur_time;
+        if (delay <= 0) {
+            url_index = xhr_find_url(s);
+            if (url_index >= 0)
+                xhr_start_transfer(s, url_index);
+            /* only one hedged request */
+            s->hedge_time = 0;
+        } else {
+            timeout = min_int(timeout, (delay + 999) / 1000);
+        }
+    }
+    return timeout;
+}
+
+/* cancel the transfers which lost against another mirror */
+static void xhr_cancel_losers(void)
+{
+    struct list_head *el;
+    XHRState *s;
+    int i;
+
+    list_for_each(el, &xhr_list) {
+        s = list_entry(el, XHRState, link);
+        if (!s->winner)
+            continue;
+        for(i = 0; i < XHR_TRANSFER_MAX; i++) {
+            if (s->transfers[i] && s->transfers[i] != s->winner)
+                xhr_end_transfer(s->transfers[i]);
+        }
+    }
+}
+
 /* timeout is in ms */
 void fs_net_set_fdset(int *pfd_max, fd_set *rfds, fd_set *wfds, fd_set *efds,
                       int *ptimeout)
@@ -249,36 +790,23 @@ void fs_net_set_fdset(int *pfd_max, fd_set *rfds, fd_set *wfds, fd_set *efds,
     if (!curl_multi_ctx)
         return;
     
+    xhr_schedule();
+    *ptimeout = min_int(*ptimeout, xhr_update_hedging());
     curl_multi_perform(curl_multi_ctx, &n);
+    xhr_cancel_losers();
 
     for(;;) {
         msg = curl_multi_info_read(curl_multi_ctx, &n);
         if (!msg)
             break;
         if (msg->msg == CURLMSG_DONE) {
-            XHRState *s;
-            long http_code;
-
-            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&s);
-            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
-                              &http_code);
-            /* signal the end of the transfer or error */
-            if (http_code == 200) {
-                if (s->single_write) {
-                    s->write_cb(s->opaque, 0, s->dbuf.buf, s->dbuf.size);
-                } else {
-                    s->write_cb(s->opaque, 0, NULL, 0);
-                }
-            } else {
-                s->write_cb(s->opaque, -http_code, NULL, 0);
-            }
-            curl_multi_remove_handle(curl_multi_ctx, s->eh);
-            curl_easy_cleanup(s->eh);
-            dbuf_free(&s->dbuf);
-            list_del(&s->link);
-            free(s);
+            XHRTransfer *t;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+            xhr_transfer_done(t, msg->data.result);
         }
     }
+    /* start the requests which could not start before */
+    xhr_schedule();
 
     curl_multi_fdset(curl_multi_ctx, rfds, wfds, efds, &fd_max);
     *pfd_max = max_int(*pfd_max, fd_max);
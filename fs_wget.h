@@ -49,9 +49,26 @@ typedef void WGetWriteCallback(void *opaque, int err, void *data, size_t size);
 typedef size_t WGetReadCallback(void *opaque, void *data, size_t size);
 typedef struct XHRState XHRState;
 
+/* download priority classes, from the highest */
+typedef enum {
+    WGET_PRIO_DEMAND, /* the guest is waiting for the data */
+    WGET_PRIO_PREFETCH,
+    WGET_PRIO_BACKGROUND,
+    WGET_PRIO_COUNT,
+} WGetPriorityEnum;
+
+/* 'url' can contain several mirrors of the same object separated by
+   spaces */
 XHRState *fs_wget(const char *url, const char *user, const char *password,
                   void *opaque, WGetWriteCallback *cb, BOOL single_write);
 void fs_wget_free(XHRState *s);
+/* the default priority is WGET_PRIO_DEMAND */
+void fs_wget_set_priority(XHRState *s, WGetPriorityEnum prio);
+/* if enabled with single_write, the data given to the end of
+   transfer callback is allocated with malloc() and must be freed by
+   it */
+void fs_wget_set_keep_data(XHRState *s, BOOL enabled);
+void fs_wget_dump_stats(void);
 
 void fs_wget_init(void);
 void fs_wget_end(void);
@@ -27,6 +27,15 @@
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#define USE_MMAP_RAM
+#endif
+#if defined(USE_MMAP_RAM) && defined(__linux__)
+#include <fcntl.h>
+#define USE_MEMFD_RAM
+#endif
 
 #include "cutils.h"
 #include "iomem.h"
@@ -37,6 +46,9 @@ static void default_free_ram(PhysMemoryMap *s, PhysMemoryRange *pr);
 static const uint32_t *default_get_dirty_bits(PhysMemoryMap *map, PhysMemoryRange *pr);
 static void default_set_addr(PhysMemoryMap *map,
                              PhysMemoryRange *pr, uint64_t addr, BOOL enabled);
+static int default_map_ram_file(PhysMemoryMap *s, PhysMemoryRange *pr,
+                                uint64_t offset, int fd, uint64_t size);
+static void default_clear_ram(PhysMemoryMap *s, PhysMemoryRange *pr);
 
 PhysMemoryMap *phys_mem_map_init(void)
 {
@@ -46,6 +58,8 @@ PhysMemoryMap *phys_mem_map_init(void)
     s->free_ram = default_free_ram;
     s->get_dirty_bits = default_get_dirty_bits;
     s->set_ram_addr = default_set_addr;
+    s->map_ram_file = default_map_ram_file;
+    s->clear_ram = default_clear_ram;
     return s;
 }
 
@@ -63,6 +77,20 @@ void phys_mem_map_end(PhysMemoryMap *s)
     free(s);
 }
 
+/* zero all the RAM ranges, e.g. before a reboot */
+void phys_mem_map_clear_ram(PhysMemoryMap *s)
+{
+    int i;
+    PhysMemoryRange *pr;
+
+    for(i = 0; i < s->n_phys_mem_range; i++) {
+        pr = &s->phys_mem_range[i];
+        if (pr->is_ram) {
+            s->clear_ram(s, pr);
+        }
+    }
+}
+
 /* return NULL if not found */
 /* XXX: optimize */
 PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr)
@@ -95,6 +123,7 @@ PhysMemoryRange *register_ram_entry(PhysMemoryMap *s, uint64_t addr,
     else
         pr->size = pr->org_size;
     pr->phys_mem = NULL;
+    pr->fd = -1;
     pr->dirty_bits = NULL;
     return pr;
 }
@@ -106,7 +135,46 @@ static PhysMemoryRange *default_register_ram(PhysMemoryMap *s, uint64_t addr,
 
     pr = register_ram_entry(s, addr, size, devram_flags);
 
+#ifdef USE_MMAP_RAM
+#ifdef USE_MEMFD_RAM
+    if (devram_flags & DEVRAM_FLAG_SHARED) {
+        /* the RAM can be mapped by an external device backend */
+        pr->fd = memfd_create("temu-ram", MFD_CLOEXEC);
+        if (pr->fd >= 0 && ftruncate(pr->fd, size) < 0) {
+            close(pr->fd);
+            pr->fd = -1;
+        }
+        if (pr->fd < 0) {
+            perror("memfd_create");
+            exit(1);
+        }
+        pr->phys_mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, pr->fd, 0);
+        if (pr->phys_mem == MAP_FAILED)
+            pr->phys_mem = NULL;
+    } else
+#endif
+    {
+        /* page aligned and lazily allocated by the host. Files can be
+           mapped inside it. */
+        pr->phys_mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pr->phys_mem == MAP_FAILED) {
+            pr->phys_mem = NULL;
+        } else {
+#ifdef MADV_MERGEABLE
+            /* identical pages (e.g. the code of the same kernel and
+               user programs) can be shared by the host between all
+               the VMs. Not the default because the page merging is
+               visible thru the write timings. */
+            if (devram_flags & DEVRAM_FLAG_MERGEABLE)
+                madvise(pr->phys_mem, size, MADV_MERGEABLE);
+#endif
+        }
+    }
+#else
     pr->phys_mem = mallocz(size);
+#endif
     if (!pr->phys_mem) {
         fprintf(stderr, "Could not allocate VM memory\n");
         exit(1);
@@ -178,7 +246,74 @@ void phys_mem_reset_dirty_bit(PhysMemoryRange *pr, size_t offset)
 
 static void default_free_ram(PhysMemoryMap *s, PhysMemoryRange *pr)
 {
+#ifdef USE_MMAP_RAM
+    munmap(pr->phys_mem, pr->org_size);
+    if (pr->fd >= 0)
+        close(pr->fd);
+#else
     free(pr->phys_mem);
+#endif
+}
+
+static int default_map_ram_file(PhysMemoryMap *s, PhysMemoryRange *pr,
+                                uint64_t offset, int fd, uint64_t size)
+{
+#ifdef USE_MMAP_RAM
+    uintptr_t page_mask;
+    uint8_t *ptr;
+
+    /* dirty bits would not be updated and a private mapping would
+       not be seen by the users of the shared RAM */
+    if (pr->dirty_bits || pr->fd >= 0 || size == 0)
+        return -1;
+    page_mask = getpagesize() - 1;
+    ptr = pr->phys_mem + offset;
+    if (((uintptr_t)ptr & page_mask) != 0 ||
+        offset > pr->org_size ||
+        ((size + page_mask) & ~page_mask) > pr->org_size - offset)
+        return -1;
+    /* the end of the last page is zero filled by the host */
+    if (mmap(ptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             fd, 0) == MAP_FAILED)
+        return -1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void default_clear_ram(PhysMemoryMap *s, PhysMemoryRange *pr)
+{
+#ifdef USE_MMAP_RAM
+    if (pr->fd >= 0) {
+#if defined(USE_MEMFD_RAM) && defined(FALLOC_FL_PUNCH_HOLE)
+        /* give the pages back to the host */
+        if (fallocate(pr->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      0, pr->org_size) < 0)
+#endif
+        {
+            memset(pr->phys_mem, 0, pr->org_size);
+        }
+    } else {
+        /* replacing the mapping gives the pages back to the host and
+           removes the files mapped with map_ram_file() */
+        if (mmap(pr->phys_mem, pr->org_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                 -1, 0) == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+#ifdef MADV_MERGEABLE
+        if (pr->devram_flags & DEVRAM_FLAG_MERGEABLE)
+            madvise(pr->phys_mem, pr->org_size, MADV_MERGEABLE);
+#endif
+    }
+#else
+    memset(pr->phys_mem, 0, pr->org_size);
+#endif
+    /* every page changed */
+    if (pr->dirty_bits)
+        memset(pr->dirty_bits, 0xff, pr->dirty_bits_size);
 }
 
 PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr,
@@ -38,6 +38,11 @@ typedef uint32_t DeviceReadFunc(void *opaque, uint32_t offset, int size_log2);
 #define DEVRAM_FLAG_ROM        (1 << 0) /* not writable */
 #define DEVRAM_FLAG_DIRTY_BITS (1 << 1) /* maintain dirty bits */
 #define DEVRAM_FLAG_DISABLED   (1 << 2) /* allocated but not mapped */
+#define DEVRAM_FLAG_SHARED     (1 << 3) /* backed by a file descriptor which
+                                           can be mapped by other
+                                           processes */
+#define DEVRAM_FLAG_MERGEABLE  (1 << 4) /* identical pages can be merged
+                                           by the host (KSM) */
 #define DEVRAM_PAGE_SIZE_LOG2 12
 #define DEVRAM_PAGE_SIZE (1 << DEVRAM_PAGE_SIZE_LOG2)
 
@@ -52,6 +57,7 @@ typedef struct {
     /* the following is used for RAM access */
     int devram_flags;
     uint8_t *phys_mem;
+    int fd; /* shared RAM file descriptor or -1 */
     int dirty_bits_size; /* in bytes */
     uint32_t *dirty_bits; /* NULL if not used */
     uint32_t *dirty_bits_tab[2];
@@ -74,6 +80,11 @@ struct PhysMemoryMap {
     const uint32_t *(*get_dirty_bits)(PhysMemoryMap *s, PhysMemoryRange *pr);
     void (*set_ram_addr)(PhysMemoryMap *s, PhysMemoryRange *pr, uint64_t addr,
                          BOOL enabled);
+    /* map a file copy-on-write in the RAM. Return -1 if not supported */
+    int (*map_ram_file)(PhysMemoryMap *s, PhysMemoryRange *pr,
+                        uint64_t offset, int fd, uint64_t size);
+    /* zero the RAM contents without changing its host address */
+    void (*clear_ram)(PhysMemoryMap *s, PhysMemoryRange *pr);
     void *opaque;
     void (*flush_tlb_write_range)(void *opaque, uint8_t *ram_addr,
                                   size_t ram_size);
@@ -82,6 +93,7 @@ struct PhysMemoryMap {
 
 PhysMemoryMap *phys_mem_map_init(void);
 void phys_mem_map_end(PhysMemoryMap *s);
+void phys_mem_map_clear_ram(PhysMemoryMap *s);
 PhysMemoryRange *register_ram_entry(PhysMemoryMap *s, uint64_t addr,
                                     uint64_t size, int devram_flags);
 static inline PhysMemoryRange *cpu_register_ram(PhysMemoryMap *s, uint64_t addr,
@@ -126,6 +138,17 @@ static inline BOOL phys_mem_is_dirty_bit(PhysMemoryRange *pr, size_t offset)
 }
 
 void phys_mem_reset_dirty_bit(PhysMemoryRange *pr, size_t offset);
+
+/* map the first 'size' bytes of 'fd' at 'offset' in the RAM range
+   'pr'. Return -1 if the RAM backend cannot do it: the data must then
+   be copied. */
+static inline int phys_mem_map_file(PhysMemoryRange *pr, uint64_t offset,
+                                    int fd, uint64_t size)
+{
+    PhysMemoryMap *map = pr->map;
+    return map->map_ram_file(map, pr, offset, fd, size);
+}
+
 uint8_t *phys_mem_get_ram_ptr(PhysMemoryMap *map, uint64_t paddr, BOOL is_rw);
 
 /* IRQ support */
@@ -145,4 +168,11 @@ static inline void set_irq(IRQSignal *irq, int level)
     irq->set_irq(irq->opaque, irq->irq_num, level);
 }
 
+/* entropy source: fills 'buf' with 'len' random bytes */
+
+typedef struct {
+    void *opaque;
+    void (*read_data)(void *opaque, uint8_t *buf, int len);
+} RNGDevice;
+
 #endif /* IOMEM_H */
@@ -205,7 +205,7 @@ static void init_vm_fs(void *arg)
 
     if (p->fs_count > 0) {
         assert(p->fs_count == 1);
-        p->tab_fs[0].fs_dev = fs_net_init(p->tab_fs[0].filename,
+        p->tab_fs[0].fs_dev = fs_net_init(p->tab_fs[0].filename, NULL,
                                           init_vm_drive, s);
         if (s->pwd) {
             fs_net_set_pwd(p->tab_fs[0].fs_dev, s->pwd);
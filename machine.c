@@ -31,6 +31,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#ifndef EMSCRIPTEN
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "cutils.h"
 #include "iomem.h"
@@ -329,6 +333,9 @@ static int virt_machine_parse_config(VirtMachineParams *p,
             str = buf1;
         }
         p->tab_fs[p->fs_count].tag = strdup(str);
+        if (vm_get_str_opt(obj, "overlay", &str) < 0)
+            goto tag_fail;
+        p->tab_fs[p->fs_count].overlay = strdup_null(str);
         p->fs_count++;
     }
 
@@ -348,6 +355,10 @@ static int virt_machine_parse_config(VirtMachineParams *p,
             if (vm_get_str(obj, "ifname", &str) < 0)
                 goto tag_fail;
             p->tab_eth[p->eth_count].ifname = strdup(str);
+        } else if (!strcmp(str, "vhost-user")) {
+            if (vm_get_str(obj, "socket", &str) < 0)
+                goto tag_fail;
+            p->tab_eth[p->eth_count].socket_path = strdup(str);
         }
         p->eth_count++;
     }
@@ -373,6 +384,10 @@ static int virt_machine_parse_config(VirtMachineParams *p,
         goto tag_fail;
     p->input_device = strdup_null(str);
 
+    if (vm_get_str_opt(cfg, "isa", &str) < 0)
+        goto tag_fail;
+    p->isa = strdup_null(str);
+
     if (vm_get_str_opt(cfg, "accel", &str) < 0)
         goto tag_fail;
     if (str) {
@@ -386,6 +401,39 @@ static int virt_machine_parse_config(VirtMachineParams *p,
         }
     }
 
+    if (vm_get_str_opt(cfg, "interrupt_controller", &str) < 0)
+        goto tag_fail;
+    if (str) {
+        if (!strcmp(str, "plic")) {
+            p->aia_enable = FALSE;
+        } else if (!strcmp(str, "aia")) {
+            p->aia_enable = TRUE;
+        } else {
+            vm_error("unsupported 'interrupt_controller' config: %s\n", str);
+            goto tag_fail;
+        }
+    }
+
+    tag_name = "rng";
+    el = json_object_get(cfg, tag_name);
+    if (!json_is_undefined(el)) {
+        if (el.type != JSON_BOOL) {
+            vm_error("%s: boolean expected\n", tag_name);
+            goto tag_fail;
+        }
+        p->rng_enable = el.u.b;
+    }
+
+    tag_name = "ram_merge";
+    el = json_object_get(cfg, tag_name);
+    if (!json_is_undefined(el)) {
+        if (el.type != JSON_BOOL) {
+            vm_error("%s: boolean expected\n", tag_name);
+            goto tag_fail;
+        }
+        p->ram_merge = el.u.b;
+    }
+
     tag_name = "rtc_local_time";
     el = json_object_get(cfg, tag_name);
     if (!json_is_undefined(el)) {
@@ -403,22 +451,17 @@ static int virt_machine_parse_config(VirtMachineParams *p,
     return -1;
 }
 
-typedef void FSLoadFileCB(void *opaque, uint8_t *buf, int buf_len);
-
 typedef struct {
     VirtMachineParams *vm_params;
     void (*start_cb)(void *opaque);
     void *opaque;
     
-    FSLoadFileCB *file_load_cb;
-    void *file_load_opaque;
-    int file_index;
+    int pending_count; /* number of files being loaded */
 } VMConfigLoadState;
 
-static void config_file_loaded(void *opaque, uint8_t *buf, int buf_len);
-static void config_additional_file_load(VMConfigLoadState *s);
-static void config_additional_file_load_cb(void *opaque,
-                                           uint8_t *buf, int buf_len);
+static void config_file_loaded(VMConfigLoadState *s,
+                               uint8_t *buf, size_t buf_len);
+static void config_additional_file_loaded(VMConfigLoadState *s);
 
 /* XXX: win32, URL */
 char *get_file_path(const char *base_filename, const char *filename)
@@ -447,70 +490,151 @@ char *get_file_path(const char *base_filename, const char *filename)
 
 
 #ifdef EMSCRIPTEN
-static int load_file(uint8_t **pbuf, const char *filename)
+static void load_file(VMFileEntry *fe, const char *filename)
 {
     abort();
 }
+
+void vm_file_free(VMFileEntry *fe)
+{
+    free(fe->buf);
+    fe->buf = NULL;
+}
+
+void vm_file_dup(VMFileEntry *fe, const VMFileEntry *fe1)
+{
+    memset(fe, 0, sizeof(*fe));
+    fe->len = fe1->len;
+    if (fe1->buf) {
+        fe->buf = malloc(fe1->len);
+        memcpy(fe->buf, fe1->buf, fe1->len);
+    }
+}
 #else
-/* return -1 if error. */
-static int load_file(uint8_t **pbuf, const char *filename)
+/* The file is mapped read-only if possible so that it is never copied
+   to the heap. Exit if error. */
+static void load_file(VMFileEntry *fe, const char *filename)
 {
-    FILE *f;
-    int size;
+    struct stat st;
     uint8_t *buf;
+    size_t pos;
+    ssize_t ret;
+    int fd;
     
-    f = fopen(filename, "rb");
-    if (!f) {
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
         perror(filename);
         exit(1);
     }
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    buf = malloc(size);
-    if (fread(buf, 1, size, f) != size) {
-        fprintf(stderr, "%s: read error\n", filename);
-        exit(1);
+    fe->len = st.st_size;
+    if (S_ISREG(st.st_mode) && fe->len != 0) {
+        buf = mmap(NULL, fe->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            fe->buf = buf;
+            fe->is_mmap = TRUE;
+            fe->fd = fd;
+            return;
+        }
+    }
+    /* fallback: read the file in memory */
+    buf = malloc(fe->len);
+    for(pos = 0; pos < fe->len; pos += ret) {
+        ret = read(fd, buf + pos, fe->len - pos);
+        if (ret <= 0) {
+            fprintf(stderr, "%s: read error\n", filename);
+            exit(1);
+        }
+    }
+    close(fd);
+    fe->buf = buf;
+    fe->is_mmap = FALSE;
+}
+
+void vm_file_free(VMFileEntry *fe)
+{
+    if (fe->is_mmap) {
+        munmap(fe->buf, fe->len);
+        close(fe->fd);
+        fe->is_mmap = FALSE;
+    } else {
+        free(fe->buf);
+    }
+    fe->buf = NULL;
+}
+
+/* copy the contents of 'fe1' to 'fe' (without the file name). A
+   mapped file is mapped again instead of being copied. */
+void vm_file_dup(VMFileEntry *fe, const VMFileEntry *fe1)
+{
+    uint8_t *buf;
+    int fd;
+
+    memset(fe, 0, sizeof(*fe));
+    fe->len = fe1->len;
+    if (fe1->is_mmap) {
+        fd = dup(fe1->fd);
+        if (fd >= 0) {
+            buf = mmap(NULL, fe1->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (buf != MAP_FAILED) {
+                fe->buf = buf;
+                fe->is_mmap = TRUE;
+                fe->fd = fd;
+                return;
+            }
+            close(fd);
+        }
+    }
+    if (fe1->buf) {
+        fe->buf = malloc(fe1->len);
+        memcpy(fe->buf, fe1->buf, fe1->len);
     }
-    fclose(f);
-    *pbuf = buf;
-    return size;
 }
 #endif
 
 #ifdef CONFIG_FS_NET
+typedef struct {
+    VMConfigLoadState *s;
+    int file_index; /* -1 for the configuration file */
+} VMFileLoadRequest;
+
 static void config_load_file_cb(void *opaque, int err, void *data, size_t size)
 {
-    VMConfigLoadState *s = opaque;
+    VMFileLoadRequest *r = opaque;
+    VMConfigLoadState *s = r->s;
+    int file_index = r->file_index;
+    VMFileEntry *fe;
     
     //    printf("err=%d data=%p size=%ld\n", err, data, size);
+    free(r);
     if (err < 0) {
         vm_error("Error %d while loading file\n", -err);
         exit(1);
     }
-    s->file_load_cb(s->file_load_opaque, data, size);
+    if (file_index < 0) {
+        config_file_loaded(s, data, size);
+        free(data);
+    } else {
+        /* the downloaded buffer is used without copy */
+        fe = &s->vm_params->files[file_index];
+        fe->buf = data;
+        fe->len = size;
+        config_additional_file_loaded(s);
+    }
 }
-#endif
 
-static void config_load_file(VMConfigLoadState *s, const char *filename,
-                             FSLoadFileCB *cb, void *opaque)
+static void config_wget_file(VMConfigLoadState *s, const char *url,
+                             int file_index)
 {
-    //    printf("loading %s\n", filename);
-#ifdef CONFIG_FS_NET
-    if (is_url(filename)) {
-        s->file_load_cb = cb;
-        s->file_load_opaque = opaque;
-        fs_wget(filename, NULL, NULL, s, config_load_file_cb, TRUE);
-    } else
-#endif
-    {
-        uint8_t *buf;
-        int size;
-        size = load_file(&buf, filename);
-        cb(opaque, buf, size);
-        free(buf);
-    }
+    VMFileLoadRequest *r;
+    XHRState *xhr;
+
+    r = malloc(sizeof(*r));
+    r->s = s;
+    r->file_index = file_index;
+    xhr = fs_wget(url, NULL, NULL, r, config_load_file_cb, TRUE);
+    fs_wget_set_keep_data(xhr, TRUE);
 }
+#endif
 
 void virt_machine_load_config_file(VirtMachineParams *p,
                                    const char *filename,
@@ -518,6 +642,7 @@ void virt_machine_load_config_file(VirtMachineParams *p,
                                    void *opaque)
 {
     VMConfigLoadState *s;
+    VMFileEntry fe;
     
     s = mallocz(sizeof(*s));
     s->vm_params = p;
@@ -525,57 +650,58 @@ void virt_machine_load_config_file(VirtMachineParams *p,
     s->opaque = opaque;
     p->cfg_filename = strdup(filename);
 
-    config_load_file(s, filename, config_file_loaded, s);
+    //    printf("loading %s\n", filename);
+#ifdef CONFIG_FS_NET
+    if (is_url(filename)) {
+        config_wget_file(s, filename, -1);
+        return;
+    }
+#endif
+    load_file(&fe, filename);
+    config_file_loaded(s, fe.buf, fe.len);
+    vm_file_free(&fe);
 }
 
-static void config_file_loaded(void *opaque, uint8_t *buf, int buf_len)
+/* all the additional files are requested at once. The machine is
+   started when the last one is loaded. */
+static void config_file_loaded(VMConfigLoadState *s,
+                               uint8_t *buf, size_t buf_len)
 {
-    VMConfigLoadState *s = opaque;
     VirtMachineParams *p = s->vm_params;
+    char *fname;
+    int i;
 
     if (virt_machine_parse_config(p, (char *)buf, buf_len) < 0)
         exit(1);
     
-    /* load the additional files */
-    s->file_index = 0;
-    config_additional_file_load(s);
-}
-
-static void config_additional_file_load(VMConfigLoadState *s)
-{
-    VirtMachineParams *p = s->vm_params;
-    while (s->file_index < VM_FILE_COUNT &&
-           p->files[s->file_index].filename == NULL) {
-        s->file_index++;
-    }
-    if (s->file_index == VM_FILE_COUNT) {
-        if (s->start_cb)
-            s->start_cb(s->opaque);
-        free(s);
-    } else {
-        char *fname;
-        
-        fname = get_file_path(p->cfg_filename,
-                              p->files[s->file_index].filename);
-        config_load_file(s, fname,
-                         config_additional_file_load_cb, s);
+    /* one more so that the start is done after all the requests */
+    s->pending_count = 1;
+    for(i = 0; i < VM_FILE_COUNT; i++) {
+        if (!p->files[i].filename)
+            continue;
+        fname = get_file_path(p->cfg_filename, p->files[i].filename);
+#ifdef CONFIG_FS_NET
+        if (is_url(fname)) {
+            s->pending_count++;
+            config_wget_file(s, fname, i);
+        } else
+#endif
+        {
+            /* local files are used in place without copy */
+            load_file(&p->files[i], fname);
+        }
         free(fname);
     }
+    config_additional_file_loaded(s);
 }
 
-static void config_additional_file_load_cb(void *opaque,
-                                           uint8_t *buf, int buf_len)
+static void config_additional_file_loaded(VMConfigLoadState *s)
 {
-    VMConfigLoadState *s = opaque;
-    VirtMachineParams *p = s->vm_params;
-
-    p->files[s->file_index].buf = malloc(buf_len);
-    memcpy(p->files[s->file_index].buf, buf, buf_len);
-    p->files[s->file_index].len = buf_len;
-
-    /* load the next files */
-    s->file_index++;
-    config_additional_file_load(s);
+    if (--s->pending_count != 0)
+        return;
+    if (s->start_cb)
+        s->start_cb(s->opaque);
+    free(s);
 }
 
 void vm_add_cmdline(VirtMachineParams *p, const char *cmdline)
@@ -604,7 +730,7 @@ void virt_machine_free_config(VirtMachineParams *p)
     free(p->cmdline);
     for(i = 0; i < VM_FILE_COUNT; i++) {
         free(p->files[i].filename);
-        free(p->files[i].buf);
+        vm_file_free(&p->files[i]);
     }
     for(i = 0; i < p->drive_count; i++) {
         free(p->tab_drive[i].filename);
@@ -613,12 +739,15 @@ void virt_machine_free_config(VirtMachineParams *p)
     for(i = 0; i < p->fs_count; i++) {
         free(p->tab_fs[i].filename);
         free(p->tab_fs[i].tag);
+        free(p->tab_fs[i].overlay);
     }
     for(i = 0; i < p->eth_count; i++) {
         free(p->tab_eth[i].driver);
         free(p->tab_eth[i].ifname);
+        free(p->tab_eth[i].socket_path);
     }
     free(p->input_device);
+    free(p->isa);
     free(p->display_device);
     free(p->cfg_filename);
 }
@@ -46,6 +46,9 @@ struct FBDevice {
 
 #define VM_CONFIG_VERSION 1
 
+/* name of the console port for the guest logs */
+#define VM_LOG_PORT_NAME "org.tinyemu.log"
+
 typedef enum {
     VM_FILE_BIOS,
     VM_FILE_VGA_BIOS,
@@ -58,7 +61,9 @@ typedef enum {
 typedef struct {
     char *filename;
     uint8_t *buf;
-    int len;
+    size_t len;
+    BOOL is_mmap; /* 'buf' is a private read-only mapping of 'fd' */
+    int fd;
 } VMFileEntry;
 
 typedef struct {
@@ -71,12 +76,14 @@ typedef struct {
     char *device;
     char *tag; /* 9p mount tag */
     char *filename;
+    char *overlay; /* local overlay directory */
     FSDevice *fs_dev;
 } VMFSEntry;
 
 typedef struct {
     char *driver;
     char *ifname;
+    char *socket_path; /* vhost-user backend */
     EthernetDevice *net;
 } VMEthEntry;
 
@@ -92,6 +99,7 @@ typedef struct {
     char *display_device; /* NULL means no display */
     int width, height; /* graphic width & height */
     CharacterDevice *console;
+    CharacterDevice *log_console; /* optional write only console port */
     VMDriveEntry tab_drive[MAX_DRIVE_DEVICE];
     int drive_count;
     VMFSEntry tab_fs[MAX_FS_DEVICE];
@@ -101,7 +109,12 @@ typedef struct {
 
     char *cmdline; /* bios or kernel command line */
     BOOL accel_enable; /* enable acceleration (KVM) */
+    BOOL aia_enable; /* use the AIA interrupt controllers (RISCV) */
+    char *isa; /* ISA profile (RISCV), NULL means all the extensions */
     char *input_device; /* NULL means no input */
+    BOOL rng_enable; /* add an entropy device */
+    BOOL ram_merge; /* let the host merge the identical RAM pages (KSM) */
+    RNGDevice *rng; /* entropy source, set by the caller */
     
     /* kernel, bios and other auxiliary files */
     VMFileEntry files[VM_FILE_COUNT];
@@ -129,6 +142,8 @@ struct VirtMachineClass {
     void (*vm_send_mouse_event)(VirtMachine *s1, int dx, int dy, int dz,
                                 unsigned int buttons);
     void (*vm_send_key_event)(VirtMachine *s1, BOOL is_down, uint16_t key_code);
+    /* optional: number of executed guest instructions */
+    uint64_t (*virt_machine_get_insn_counter)(VirtMachine *s);
 };
 
 extern const VirtMachineClass riscv_machine_class;
@@ -146,6 +161,8 @@ void virt_machine_load_config_file(VirtMachineParams *p,
 void vm_add_cmdline(VirtMachineParams *p, const char *cmdline);
 char *get_file_path(const char *base_filename, const char *filename);
 void virt_machine_free_config(VirtMachineParams *p);
+void vm_file_dup(VMFileEntry *fe, const VMFileEntry *fe1);
+void vm_file_free(VMFileEntry *fe);
 VirtMachine *virt_machine_init(const VirtMachineParams *p);
 void virt_machine_end(VirtMachine *s);
 static inline int virt_machine_get_sleep_duration(VirtMachine *s, int delay)
@@ -32,6 +32,7 @@
 #include "cutils.h"
 #include "iomem.h"
 #include "riscv_cpu.h"
+#include "trace.h"
 
 #ifndef MAX_XLEN
 #error MAX_XLEN must be defined
@@ -178,19 +179,28 @@ PHYS_MEM_READ_WRITE(64, uint64_t)
 #define PTE_U_MASK (1 << 4)
 #define PTE_A_MASK (1 << 6)
 #define PTE_D_MASK (1 << 7)
+#if MAX_XLEN >= 64
+#define PTE_N_MASK ((uint64_t)1 << 63) /* Svnapot */
+#define PTE_PPN_BITS 44
+#endif
+
+#define NAPOT_SHIFT 16 /* only 64 KiB NAPOT pages are supported */
 
 #define ACCESS_READ  0
 #define ACCESS_WRITE 1
 #define ACCESS_CODE  2
 
 /* access = 0: read, 1 = write, 2 = code. Set the exception_pending
-   field if necessary. return 0 if OK, -1 if translation error */
+   field if necessary. return 0 if OK, -1 if translation error.
+   '*ppg_shift' is set to the log2 of the size of the naturally
+   aligned region which is translated with the same permissions and
+   physically contiguous (PG_SHIFT or NAPOT_SHIFT). */
 static int get_phys_addr(RISCVCPUState *s,
-                         target_ulong *ppaddr, target_ulong vaddr,
-                         int access)
+                         target_ulong *ppaddr, int *ppg_shift,
+                         target_ulong vaddr, int access)
 {
     int mode, levels, pte_bits, pte_idx, pte_mask, pte_size_log2, xwr, priv;
-    int need_write, vaddr_shift, i, pte_addr_bits;
+    int need_write, vaddr_shift, i, pte_addr_bits, pg_shift;
     target_ulong pte_addr, pte, vaddr_mask, paddr;
 
     if ((s->mstatus & MSTATUS_MPRV) && access != ACCESS_CODE) {
@@ -200,6 +210,7 @@ static int get_phys_addr(RISCVCPUState *s,
         priv = s->priv;
     }
 
+    *ppg_shift = PG_SHIFT;
     if (priv == PRV_M) {
         if (s->cur_xlen < MAX_XLEN) {
             /* truncate virtual address */
@@ -238,6 +249,7 @@ static int get_phys_addr(RISCVCPUState *s,
         pte_addr_bits = 44;
     }
 #endif
+    HPM_COUNT_EVENT(s, HPM_EVENT_PAGE_WALK, 1);
     pte_addr = (s->satp & (((target_ulong)1 << pte_addr_bits) - 1)) << PG_SHIFT;
     pte_bits = 12 - pte_size_log2;
     pte_mask = (1 << pte_bits) - 1;
@@ -252,7 +264,26 @@ static int get_phys_addr(RISCVCPUState *s,
         //printf("pte=0x%08" PRIx64 "\n", pte);
         if (!(pte & PTE_V_MASK))
             return -1; /* invalid PTE */
-        paddr = (pte >> 10) << PG_SHIFT;
+        pg_shift = PG_SHIFT;
+#if MAX_XLEN >= 64
+        if (pte_size_log2 == 3) {
+            /* the upper bits are not part of the PPN */
+            paddr = ((pte >> 10) & (((target_ulong)1 << PTE_PPN_BITS) - 1)) <<
+                PG_SHIFT;
+            if (pte & PTE_N_MASK) {
+                /* NAPOT leaf PTE: only allowed at the last level with
+                   ppn[3:0] = 0b1000 for a 64 KiB page */
+                if (i != levels - 1 || (pte & 7 << 1) == 0 ||
+                    ((paddr >> PG_SHIFT) & 0xf) != 8)
+                    return -1;
+                paddr &= ~(((target_ulong)1 << NAPOT_SHIFT) - 1);
+                pg_shift = NAPOT_SHIFT;
+            }
+        } else
+#endif
+        {
+            paddr = (pte >> 10) << PG_SHIFT;
+        }
         xwr = (pte >> 1) & 7;
         if (xwr != 0) {
             if (xwr == 2 || xwr == 6)
@@ -283,8 +314,11 @@ static int get_phys_addr(RISCVCPUState *s,
                 else
                     phys_write_u64(s, pte_addr, pte);
             }
+            if (pg_shift > vaddr_shift)
+                vaddr_shift = pg_shift;
             vaddr_mask = ((target_ulong)1 << vaddr_shift) - 1;
             *ppaddr = (vaddr & vaddr_mask) | (paddr  & ~vaddr_mask);
+            *ppg_shift = pg_shift;
             return 0;
         } else {
             pte_addr = paddr;
@@ -293,13 +327,143 @@ static int get_phys_addr(RISCVCPUState *s,
     return -1;
 }
 
+/* fill the TLB entries of all the pages of the translated region of
+   size 1 << pg_shift containing 'vaddr' which are inside the RAM range
+   'pr', so that a single page walk is done for a NAPOT page. */
+static void tlb_fill(TLBEntry *tlb, PhysMemoryRange *pr,
+                     target_ulong vaddr, target_ulong paddr, int pg_shift)
+{
+    target_ulong mask, va, pa;
+    int i, n;
+
+    mask = ((target_ulong)1 << pg_shift) - 1;
+    va = vaddr & ~mask;
+    pa = paddr & ~mask;
+    n = 1 << (pg_shift - PG_SHIFT);
+    for(i = 0; i < n; i++) {
+        if (pa >= pr->addr && pa - pr->addr < pr->size) {
+            TLBEntry *e = &tlb[(va >> PG_SHIFT) & (TLB_SIZE - 1)];
+            e->vaddr = va;
+            e->mem_addend = (uintptr_t)(pr->phys_mem +
+                                        (uintptr_t)(pa - pr->addr)) - va;
+        }
+        va += 1 << PG_SHIFT;
+        pa += 1 << PG_SHIFT;
+    }
+}
+
+struct __attribute__((packed)) unaligned_u16 {
+    uint16_t u16;
+};
+
+struct __attribute__((packed)) unaligned_u32 {
+    uint32_t u32;
+};
+
+#if MLEN >= 64
+struct __attribute__((packed)) unaligned_u64 {
+    uint64_t u64;
+};
+#endif
+
+#if MLEN >= 128
+struct __attribute__((packed)) unaligned_u128 {
+    uint128_t u128;
+};
+#endif
+
+static mem_uint_t load_unaligned(const uint8_t *ptr, int size_log2)
+{
+    switch(size_log2) {
+    case 1:
+        return ((const struct unaligned_u16 *)ptr)->u16;
+    case 2:
+        return ((const struct unaligned_u32 *)ptr)->u32;
+#if MLEN >= 64
+    case 3:
+        return ((const struct unaligned_u64 *)ptr)->u64;
+#endif
+#if MLEN >= 128
+    case 4:
+        return ((const struct unaligned_u128 *)ptr)->u128;
+#endif
+    default:
+        abort();
+    }
+}
+
+static void store_unaligned(uint8_t *ptr, mem_uint_t val, int size_log2)
+{
+    switch(size_log2) {
+    case 1:
+        ((struct unaligned_u16 *)ptr)->u16 = val;
+        break;
+    case 2:
+        ((struct unaligned_u32 *)ptr)->u32 = val;
+        break;
+#if MLEN >= 64
+    case 3:
+        ((struct unaligned_u64 *)ptr)->u64 = val;
+        break;
+#endif
+#if MLEN >= 128
+    case 4:
+        ((struct unaligned_u128 *)ptr)->u128 = val;
+        break;
+#endif
+    default:
+        abort();
+    }
+}
+
+/* Return the host address of 'addr' if it is in RAM, using and
+   filling the TLB. Otherwise return NULL with *perr = 0, or with
+   *perr = -1 if there is an exception. */
+static uint8_t *get_ram_ptr(RISCVCPUState *s, target_ulong addr,
+                            int access, int *perr)
+{
+    TLBEntry *tlb;
+    target_ulong paddr;
+    PhysMemoryRange *pr;
+    uint32_t tlb_idx;
+    int pg_shift;
+
+    *perr = 0;
+    tlb = (access == ACCESS_WRITE) ? s->tlb_write : s->tlb_read;
+    tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+    if (tlb[tlb_idx].vaddr == (addr & ~PG_MASK))
+        return (uint8_t *)(tlb[tlb_idx].mem_addend + (uintptr_t)addr);
+    if (access == ACCESS_WRITE)
+        HPM_COUNT_EVENT(s, HPM_EVENT_DTLB_STORE_MISS, 1);
+    else
+        HPM_COUNT_EVENT(s, HPM_EVENT_DTLB_LOAD_MISS, 1);
+    if (get_phys_addr(s, &paddr, &pg_shift, addr, access)) {
+        s->pending_tval = addr;
+        s->pending_exception = (access == ACCESS_WRITE) ?
+            CAUSE_STORE_PAGE_FAULT : CAUSE_LOAD_PAGE_FAULT;
+        *perr = -1;
+        return NULL;
+    }
+    pr = get_phys_mem_range(s->mem_map, paddr);
+    if (!pr || !pr->is_ram)
+        return NULL;
+    if (access == ACCESS_WRITE) {
+        phys_mem_set_dirty_bit(pr, paddr - pr->addr);
+        /* the dirty bits are set page by page */
+        if (pr->dirty_bits)
+            pg_shift = PG_SHIFT;
+    }
+    tlb_fill(tlb, pr, addr, paddr, pg_shift);
+    return pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+}
+
 /* return 0 if OK, != 0 if exception */
 int target_read_slow(RISCVCPUState *s, mem_uint_t *pval,
                      target_ulong addr, int size_log2)
 {
-    int size, tlb_idx, err, al;
+    int size, err, al, pg_shift, l;
     target_ulong paddr, offset;
-    uint8_t *ptr;
+    uint8_t *ptr, *ptr1, buf[MLEN / 8];
     PhysMemoryRange *pr;
     mem_uint_t ret;
 
@@ -307,6 +471,26 @@ int target_read_slow(RISCVCPUState *s, mem_uint_t *pval,
     size = 1 << size_log2;
     al = addr & (size - 1);
     if (al != 0) {
+        /* in RAM, a single translation and a host unaligned load if
+           the access stays in one page, two translations otherwise */
+        ptr = get_ram_ptr(s, addr, ACCESS_READ, &err);
+        if (ptr) {
+            l = PG_MASK + 1 - (addr & PG_MASK);
+            if (l >= size) {
+                *pval = load_unaligned(ptr, size_log2);
+                return 0;
+            }
+            ptr1 = get_ram_ptr(s, addr + l, ACCESS_READ, &err);
+            if (ptr1) {
+                memcpy(buf, ptr, l);
+                memcpy(buf + l, ptr1, size - l);
+                *pval = load_unaligned(buf, size_log2);
+                return 0;
+            }
+        }
+        if (err)
+            return err;
+        /* not in RAM: split the access */
         switch(size_log2) {
         case 1:
             {
@@ -366,8 +550,11 @@ int target_read_slow(RISCVCPUState *s, mem_uint_t *pval,
         default:
             abort();
         }
+        /* the two partial loads count as one */
+        HPM_COUNT_EVENT(s, HPM_EVENT_LOAD, -2);
     } else {
-        if (get_phys_addr(s, &paddr, addr, ACCESS_READ)) {
+        HPM_COUNT_EVENT(s, HPM_EVENT_DTLB_LOAD_MISS, 1);
+        if (get_phys_addr(s, &paddr, &pg_shift, addr, ACCESS_READ)) {
             s->pending_tval = addr;
             s->pending_exception = CAUSE_LOAD_PAGE_FAULT;
             return -1;
@@ -381,10 +568,8 @@ int target_read_slow(RISCVCPUState *s, mem_uint_t *pval,
 #endif
             return 0;
         } else if (pr->is_ram) {
-            tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+            tlb_fill(s->tlb_read, pr, addr, paddr, pg_shift);
             ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-            s->tlb_read[tlb_idx].vaddr = addr & ~PG_MASK;
-            s->tlb_read[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
             switch(size_log2) {
             case 0:
                 ret = *(uint8_t *)ptr;
@@ -439,22 +624,45 @@ int target_read_slow(RISCVCPUState *s, mem_uint_t *pval,
 int target_write_slow(RISCVCPUState *s, target_ulong addr,
                       mem_uint_t val, int size_log2)
 {
-    int size, i, tlb_idx, err;
+    int size, i, err, pg_shift, l;
     target_ulong paddr, offset;
-    uint8_t *ptr;
+    uint8_t *ptr, *ptr1, buf[MLEN / 8];
     PhysMemoryRange *pr;
     
     /* first handle unaligned accesses */
     size = 1 << size_log2;
     if ((addr & (size - 1)) != 0) {
+        /* same as target_read_slow(). Both pages are translated
+           before writing so that no memory is modified in case of
+           exception. */
+        ptr = get_ram_ptr(s, addr, ACCESS_WRITE, &err);
+        if (ptr) {
+            l = PG_MASK + 1 - (addr & PG_MASK);
+            if (l >= size) {
+                store_unaligned(ptr, val, size_log2);
+                return 0;
+            }
+            ptr1 = get_ram_ptr(s, addr + l, ACCESS_WRITE, &err);
+            if (ptr1) {
+                store_unaligned(buf, val, size_log2);
+                memcpy(ptr, buf, l);
+                memcpy(ptr1, buf + l, size - l);
+                return 0;
+            }
+        }
+        if (err)
+            return err;
+        /* not in RAM: byte accesses */
         /* XXX: should avoid modifying the memory in case of exception */
         for(i = 0; i < size; i++) {
             err = target_write_u8(s, addr + i, (val >> (8 * i)) & 0xff);
             if (err)
                 return err;
         }
+        HPM_COUNT_EVENT(s, HPM_EVENT_STORE, -size);
     } else {
-        if (get_phys_addr(s, &paddr, addr, ACCESS_WRITE)) {
+        HPM_COUNT_EVENT(s, HPM_EVENT_DTLB_STORE_MISS, 1);
+        if (get_phys_addr(s, &paddr, &pg_shift, addr, ACCESS_WRITE)) {
             s->pending_tval = addr;
             s->pending_exception = CAUSE_STORE_PAGE_FAULT;
             return -1;
@@ -468,10 +676,11 @@ int target_write_slow(RISCVCPUState *s, target_ulong addr,
 #endif
         } else if (pr->is_ram) {
             phys_mem_set_dirty_bit(pr, paddr - pr->addr);
-            tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+            /* the dirty bits are set page by page */
+            if (pr->dirty_bits)
+                pg_shift = PG_SHIFT;
+            tlb_fill(s->tlb_write, pr, addr, paddr, pg_shift);
             ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-            s->tlb_write[tlb_idx].vaddr = addr & ~PG_MASK;
-            s->tlb_write[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
             switch(size_log2) {
             case 0:
                 *(uint8_t *)ptr = val;
@@ -521,10 +730,6 @@ int target_write_slow(RISCVCPUState *s, target_ulong addr,
     return 0;
 }
 
-struct __attribute__((packed)) unaligned_u32 {
-    uint32_t u32;
-};
-
 /* unaligned access at an address known to be a multiple of 2 */
 static uint32_t get_insn32(uint8_t *ptr)
 {
@@ -540,12 +745,13 @@ static no_inline __exception int target_read_insn_slow(RISCVCPUState *s,
                                                        uint8_t **pptr,
                                                        target_ulong addr)
 {
-    int tlb_idx;
+    int pg_shift;
     target_ulong paddr;
     uint8_t *ptr;
     PhysMemoryRange *pr;
     
-    if (get_phys_addr(s, &paddr, addr, ACCESS_CODE)) {
+    HPM_COUNT_EVENT(s, HPM_EVENT_ITLB_MISS, 1);
+    if (get_phys_addr(s, &paddr, &pg_shift, addr, ACCESS_CODE)) {
         s->pending_tval = addr;
         s->pending_exception = CAUSE_FETCH_PAGE_FAULT;
         return -1;
@@ -557,10 +763,8 @@ static no_inline __exception int target_read_insn_slow(RISCVCPUState *s,
         s->pending_exception = CAUSE_FAULT_FETCH;
         return -1;
     }
-    tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+    tlb_fill(s->tlb_code, pr, addr, paddr, pg_shift);
     ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-    s->tlb_code[tlb_idx].vaddr = addr & ~PG_MASK;
-    s->tlb_code[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
     *pptr = ptr;
     return 0;
 }
@@ -597,6 +801,7 @@ static void tlb_init(RISCVCPUState *s)
 
 static void tlb_flush_all(RISCVCPUState *s)
 {
+    TRACE(tlb_flush, s);
     tlb_init(s);
 }
 
@@ -644,8 +849,181 @@ static void glue(riscv_cpu_flush_tlb_write_range_ram,
                       MSTATUS_FS | \
                       MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR)
 
-/* cycle and insn counters */
-#define COUNTEREN_MASK ((1 << 0) | (1 << 2))
+/* cycle, insn and hpm counters. The time counter is emulated by
+   the software. */
+#define COUNTEREN_MASK (~(uint32_t)(1 << 1))
+/* mcycle and minstret cannot be stopped */
+#define MCOUNTINHIBIT_MASK (~(uint32_t)7)
+
+/* Zkr */
+#define MSECCFG_USEED   (1 << 8)
+#define MSECCFG_SSEED   (1 << 9)
+#define SEED_OPST_ES16  ((uint32_t)2 << 30)
+
+#define MHPMEVENT_OF    ((uint64_t)1 << 63)
+#define MHPMEVENT_MINH  ((uint64_t)1 << 62)
+#define MHPMEVENT_SINH  ((uint64_t)1 << 61)
+#define MHPMEVENT_UINH  ((uint64_t)1 << 60)
+#define MHPMEVENT_EVENT 0xff
+
+/* max number of instructions between two overflow checks of the
+   counters which do not count instructions */
+#define HPM_CHECK_INTERVAL 10000
+
+static uint64_t hpm_get_event_count(RISCVCPUState *s, int event)
+{
+    if (event == HPM_EVENT_CYCLES || event == HPM_EVENT_INSTRET)
+        return s->insn_counter;
+    else
+        return s->hpm_events[event];
+}
+
+static uint64_t hpm_read(RISCVCPUState *s, int idx)
+{
+    HPMCounter *c = &s->hpm_counters[idx];
+    if (!c->running)
+        return c->start_val;
+    return c->start_val + hpm_get_event_count(s, c->mhpmevent & MHPMEVENT_EVENT) -
+        c->start_event;
+}
+
+static void hpm_write(RISCVCPUState *s, int idx, uint64_t val)
+{
+    HPMCounter *c = &s->hpm_counters[idx];
+    c->start_val = val;
+    c->start_event = hpm_get_event_count(s, c->mhpmevent & MHPMEVENT_EVENT);
+}
+
+/* start or stop the counter after a change of mhpmevent,
+   mcountinhibit or of the privilege level */
+static void hpm_update(RISCVCPUState *s, int idx)
+{
+    HPMCounter *c = &s->hpm_counters[idx];
+    uint64_t inh;
+    BOOL running;
+
+    if (s->priv == PRV_M)
+        inh = MHPMEVENT_MINH;
+    else if (s->priv == PRV_S)
+        inh = MHPMEVENT_SINH;
+    else
+        inh = MHPMEVENT_UINH;
+    if ((c->mhpmevent & MHPMEVENT_EVENT) != HPM_EVENT_NONE &&
+        !((s->mcountinhibit >> (idx + HPM_COUNTER_FIRST)) & 1))
+        s->hpm_active_mask |= 1 << idx;
+    else
+        s->hpm_active_mask &= ~(1 << idx);
+    running = ((s->hpm_active_mask >> idx) & 1) && !(c->mhpmevent & inh);
+    if (running != c->running) {
+        c->start_val = hpm_read(s, idx);
+        c->running = running;
+        hpm_write(s, idx, c->start_val);
+    }
+    if (running && !(c->mhpmevent & MHPMEVENT_OF))
+        s->hpm_running_mask |= 1 << idx;
+    else
+        s->hpm_running_mask &= ~(1 << idx);
+}
+
+/* update the counters of 'mask' and the set of counted events */
+static void hpm_update_mask(RISCVCPUState *s, uint32_t mask)
+{
+    HPMCounter *c;
+    uint32_t event_mask;
+    int idx;
+
+    while (mask != 0) {
+        idx = ctz32(mask);
+        mask &= mask - 1;
+        hpm_update(s, idx);
+    }
+    event_mask = 0;
+    mask = s->hpm_active_mask;
+    while (mask != 0) {
+        idx = ctz32(mask);
+        mask &= mask - 1;
+        c = &s->hpm_counters[idx];
+        if (c->running)
+            event_mask |= 1 << (c->mhpmevent & MHPMEVENT_EVENT);
+    }
+    s->hpm_event_mask = event_mask;
+}
+
+static void hpm_update_all(RISCVCPUState *s)
+{
+    hpm_update_mask(s, (1 << HPM_COUNTER_COUNT) - 1);
+}
+
+static void hpm_set_event(RISCVCPUState *s, int idx, uint64_t val)
+{
+    HPMCounter *c = &s->hpm_counters[idx];
+    uint64_t count;
+    int event;
+
+    count = hpm_read(s, idx);
+    event = val & MHPMEVENT_EVENT;
+    if (event >= HPM_EVENT_COUNT)
+        event = HPM_EVENT_NONE;
+    c->mhpmevent = (val & (MHPMEVENT_OF | MHPMEVENT_MINH |
+                           MHPMEVENT_SINH | MHPMEVENT_UINH)) | event;
+    hpm_write(s, idx, count);
+    hpm_update_mask(s, 1 << idx);
+}
+
+/* set the OF bit and raise the overflow interrupt for the counters
+   which wrapped around (Sscofpmf) */
+static void hpm_check_overflow(RISCVCPUState *s)
+{
+    uint32_t mask;
+    uint64_t delta;
+    HPMCounter *c;
+    int idx;
+
+    mask = s->hpm_running_mask;
+    while (mask != 0) {
+        idx = ctz32(mask);
+        mask &= mask - 1;
+        c = &s->hpm_counters[idx];
+        delta = hpm_get_event_count(s, c->mhpmevent & MHPMEVENT_EVENT) -
+            c->start_event;
+        if (c->start_val != 0 && delta >= -c->start_val) {
+            c->start_val += delta;
+            c->start_event += delta;
+            c->mhpmevent |= MHPMEVENT_OF;
+            s->hpm_running_mask &= ~(1 << idx);
+            s->mip |= MIP_LCOFIP;
+        }
+    }
+}
+
+/* limit the number of executed instructions so that the counter
+   overflows are detected in time. Exact for the instruction and cycle
+   events. */
+static int hpm_get_max_cycles(RISCVCPUState *s, int n_cycles)
+{
+    uint32_t mask;
+    uint64_t n;
+    HPMCounter *c;
+    int idx, event;
+
+    mask = s->hpm_running_mask;
+    while (mask != 0) {
+        idx = ctz32(mask);
+        mask &= mask - 1;
+        c = &s->hpm_counters[idx];
+        event = c->mhpmevent & MHPMEVENT_EVENT;
+        if (event == HPM_EVENT_CYCLES || event == HPM_EVENT_INSTRET) {
+            if (c->start_val != 0) {
+                n = -c->start_val - (s->insn_counter - c->start_event);
+                if (n < n_cycles)
+                    n_cycles = max_int(n, 1);
+            }
+        } else {
+            n_cycles = min_int(n_cycles, HPM_CHECK_INTERVAL);
+        }
+    }
+    return n_cycles;
+}
 
 /* return the complete mstatus with the SD bit */
 static target_ulong get_mstatus(RISCVCPUState *s, target_ulong mask)
@@ -681,10 +1059,12 @@ static void set_mstatus(RISCVCPUState *s, target_ulong val)
         ((s->mstatus & MSTATUS_MPRV) && (mod & MSTATUS_MPP) != 0)) {
         tlb_flush_all(s);
     }
+#if FLEN > 0
     s->fs = (val >> MSTATUS_FS_SHIFT) & 3;
+#endif
 
     mask = MSTATUS_MASK & ~MSTATUS_FS;
-#if MAX_XLEN >= 64
+#if MAX_XLEN >= 64 && !defined(CONFIG_FIXED_XLEN)
     {
         int uxl, sxl;
         uxl = (val >> MSTATUS_UXL_SHIFT) & 3;
@@ -698,6 +1078,171 @@ static void set_mstatus(RISCVCPUState *s, target_ulong val)
     s->mstatus = (s->mstatus & ~mask) | (val & mask);
 }
 
+/* AIA interrupt files */
+
+/* return the pending and enabled identity with the highest priority or
+   0 if none */
+static int imsic_get_top(IMSICFile *f)
+{
+    uint64_t mask;
+    int id;
+
+    if (!(f->eidelivery & 1))
+        return 0;
+    mask = f->eip & f->eie & ~(uint64_t)1;
+    if (mask == 0)
+        return 0;
+    id = ctz64(mask);
+    if (f->eithreshold != 0 && id >= f->eithreshold)
+        return 0;
+    return id;
+}
+
+static void imsic_update_mip(RISCVCPUState *s)
+{
+    if (imsic_get_top(&s->imsic[IMSIC_FILE_M]))
+        s->mip |= MIP_MEIP;
+    else
+        s->mip &= ~MIP_MEIP;
+    if (imsic_get_top(&s->imsic[IMSIC_FILE_S]))
+        s->mip |= MIP_SEIP;
+    else
+        s->mip &= ~MIP_SEIP;
+    /* exit from power down if an interrupt is pending */
+    if (s->power_down_flag && (s->mip & s->mie) != 0)
+        s->power_down_flag = FALSE;
+}
+
+/* return the eip/eie register selected by 'isel' and the shift of its
+   first identity. Return NULL if invalid register. */
+static uint64_t *imsic_get_eix(RISCVCPUState *s, IMSICFile *f,
+                               uint32_t isel, int *pshift)
+{
+    uint64_t *preg;
+    int k;
+
+    if (isel >= 0x80 && isel <= 0xbf)
+        preg = &f->eip;
+    else if (isel >= 0xc0 && isel <= 0xff)
+        preg = &f->eie;
+    else
+        return NULL;
+    k = isel & 0x3f;
+    /* only the even registers exist when XLEN >= 64 */
+    if (s->cur_xlen != 32 && (k & 1))
+        return NULL;
+    *pshift = k * 32;
+    return preg;
+}
+
+static int imsic_ireg_read(RISCVCPUState *s, IMSICFile *f, uint32_t isel,
+                           target_ulong *pval)
+{
+    uint64_t *preg;
+    int shift;
+
+    switch(isel) {
+    case 0x70:
+        *pval = f->eidelivery;
+        break;
+    case 0x72:
+        *pval = f->eithreshold;
+        break;
+    default:
+        preg = imsic_get_eix(s, f, isel, &shift);
+        if (!preg)
+            return -1;
+        if (shift >= IMSIC_NUM_IDS)
+            *pval = 0;
+        else if (s->cur_xlen == 32)
+            *pval = (uint32_t)(*preg >> shift);
+        else
+            *pval = *preg;
+        break;
+    }
+    return 0;
+}
+
+static int imsic_ireg_write(RISCVCPUState *s, IMSICFile *f, uint32_t isel,
+                            target_ulong val)
+{
+    uint64_t *preg, mask;
+    int shift;
+
+    switch(isel) {
+    case 0x70:
+        f->eidelivery = val & 1;
+        break;
+    case 0x72:
+        f->eithreshold = val & (IMSIC_NUM_IDS - 1);
+        break;
+    default:
+        preg = imsic_get_eix(s, f, isel, &shift);
+        if (!preg)
+            return -1;
+        if (shift >= IMSIC_NUM_IDS)
+            break;
+        if (s->cur_xlen == 32)
+            mask = (uint64_t)0xffffffff << shift;
+        else
+            mask = -1;
+        mask &= ~(uint64_t)1; /* identity 0 does not exist */
+        *preg = (*preg & ~mask) | (((uint64_t)val << shift) & mask);
+        break;
+    }
+    imsic_update_mip(s);
+    return 0;
+}
+
+/* value of the xtopei CSRs */
+static target_ulong imsic_read_topei(IMSICFile *f)
+{
+    int id;
+    id = imsic_get_top(f);
+    return (id << 16) | id;
+}
+
+/* claim the top identity */
+static void imsic_claim_topei(RISCVCPUState *s, IMSICFile *f)
+{
+    int id;
+    id = imsic_get_top(f);
+    if (id != 0) {
+        f->eip &= ~((uint64_t)1 << id);
+        imsic_update_mip(s);
+    }
+}
+
+/* default interrupt priority order of the AIA specification, highest
+   first (MEI, MSI, MTI, SEI, SSI, STI, ... with the local interrupts
+   16-23 around them). The reserved and custom ones come last. */
+static const uint8_t irq_default_prio[32] = {
+    23, 22, 21, 20, 11, 3, 7, 19, 18, 17, 16, 9, 1, 5, 12, 10,
+    2, 6, 13, 0, 4, 8, 14, 15, 24, 25, 26, 27, 28, 29, 30, 31,
+};
+
+/* return the highest priority interrupt of 'mask' (!= 0) */
+static int get_top_irq(uint32_t mask)
+{
+    int i, irq;
+    for(i = 0; i < 32; i++) {
+        irq = irq_default_prio[i];
+        if ((mask >> irq) & 1)
+            return irq;
+    }
+    abort();
+}
+
+/* value of the xtopi CSRs: the interrupts only have their default
+   priority */
+static target_ulong get_topi(RISCVCPUState *s, uint32_t mask)
+{
+    mask &= s->mip & s->mie;
+    if (mask == 0)
+        return 0;
+    return (get_top_irq(mask) << 16) | 1;
+}
+
 /* return -1 if invalid CSR. 0 if OK. 'will_write' indicate that the
    csr will be written after (used for CSR access check) */
 static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr,
@@ -728,8 +1273,23 @@ static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr,
         val = s->fflags | (s->frm << 5);
         break;
 #endif
+    case 0x015: /* seed */
+        /* the entropy source is only accessible with a read-write
+           instruction */
+        if (!s->rng || !will_write)
+            goto invalid_csr;
+        if ((s->priv == PRV_S && !(s->mseccfg & MSECCFG_SSEED)) ||
+            (s->priv == PRV_U && !(s->mseccfg & MSECCFG_USEED)))
+            goto invalid_csr;
+        {
+            uint8_t buf[2];
+            s->rng->read_data(s->rng->opaque, buf, 2);
+            val = SEED_OPST_ES16 | get_le16(buf);
+        }
+        break;
     case 0xc00: /* ucycle */
     case 0xc02: /* uinstret */
+    case 0xc03 ... 0xc1f: /* hpmcounter */
         {
             uint32_t counteren;
             if (s->priv < PRV_M) {
@@ -741,10 +1301,14 @@ static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr,
                     goto invalid_csr;
             }
         }
-        val = (int64_t)s->insn_counter;
+        if (csr >= 0xc03)
+            val = (int64_t)hpm_read(s, (csr & 0x1f) - HPM_COUNTER_FIRST);
+        else
+            val = (int64_t)s->insn_counter;
         break;
     case 0xc80: /* mcycleh */
     case 0xc82: /* minstreth */
+    case 0xc83 ... 0xc9f: /* hpmcounterh */
         if (s->cur_xlen != 32)
             goto invalid_csr;
         {
@@ -758,7 +1322,10 @@ static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr,
                     goto invalid_csr;
             }
         }
-        val = s->insn_counter >> 32;
+        if (csr >= 0xc83)
+            val = hpm_read(s, (csr & 0x1f) - HPM_COUNTER_FIRST) >> 32;
+        else
+            val = s->insn_counter >> 32;
         break;
         
     case 0x100:
@@ -788,6 +1355,21 @@ static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr,
     case 0x144: /* sip */
         val = s->mip & s->mideleg;
         break;
+    case 0x150: /* siselect */
+        if (!s->aia_enabled)
+            goto invalid_csr;
+        val = s->siselect;
+        break;
+    case 0x151: /* sireg */
+        if (!s->aia_enabled ||
+            imsic_ireg_read(s, &s->imsic[IMSIC_FILE_S], s->siselect, &val))
+            goto invalid_csr;
+        break;
+    case 0x15c: /* stopei */
+        if (!s->aia_enabled)
+            goto invalid_csr;
+        val = imsic_read_topei(&s->imsic[IMSIC_FILE_S]);
+        break;
     case 0x180:
         val = s->satp;
         break;
@@ -828,19 +1410,87 @@ static int csr_read(RISCVCPUState *s, target_ulong *pval, uint32_t csr,
     case 0x344:
         val = s->mip;
         break;
+    case 0x350: /* miselect */
+        if (!s->aia_enabled)
+            goto invalid_csr;
+        val = s->miselect;
+        break;
+    case 0x351: /* mireg */
+        if (!s->aia_enabled ||
+            imsic_ireg_read(s, &s->imsic[IMSIC_FILE_M], s->miselect, &val))
+            goto invalid_csr;
+        break;
+    case 0x35c: /* mtopei */
+        if (!s->aia_enabled)
+            goto invalid_csr;
+        val = imsic_read_topei(&s->imsic[IMSIC_FILE_M]);
+        break;
+    case 0x320:
+        val = s->mcountinhibit;
+        break;
+    case 0x323 ... 0x33f: /* mhpmevent */
+        val = s->hpm_counters[(csr & 0x1f) - HPM_COUNTER_FIRST].mhpmevent;
+        if (s->cur_xlen == 32)
+            val &= 0xffffffff;
+        break;
+    case 0x723 ... 0x73f: /* mhpmeventh */
+        if (s->cur_xlen != 32)
+            goto invalid_csr;
+        val = s->hpm_counters[(csr & 0x1f) - HPM_COUNTER_FIRST].mhpmevent >> 32;
+        break;
+    case 0x747: /* mseccfg */
+        if (!s->rng)
+            goto invalid_csr;
+        val = s->mseccfg;
+        break;
+    case 0x757: /* mseccfgh */
+        if (!s->rng || s->cur_xlen != 32)
+            goto invalid_csr;
+        val = 0;
+        break;
     case 0xb00: /* mcycle */
     case 0xb02: /* minstret */
         val = (int64_t)s->insn_counter;
         break;
+    case 0xb03 ... 0xb1f: /* mhpmcounter */
+        val = (int64_t)hpm_read(s, (csr & 0x1f) - HPM_COUNTER_FIRST);
+        break;
     case 0xb80: /* mcycleh */
     case 0xb82: /* minstreth */
         if (s->cur_xlen != 32)
             goto invalid_csr;
         val = s->insn_counter >> 32;
         break;
+    case 0xb83 ... 0xb9f: /* mhpmcounterh */
+        if (s->cur_xlen != 32)
+            goto invalid_csr;
+        val = hpm_read(s, (csr & 0x1f) - HPM_COUNTER_FIRST) >> 32;
+        break;
+    case 0xda0: /* scountovf */
+        {
+            int i;
+            val = 0;
+            for(i = 0; i < HPM_COUNTER_COUNT; i++) {
+                if (s->hpm_counters[i].mhpmevent & MHPMEVENT_OF)
+                    val |= 1 << (i + HPM_COUNTER_FIRST);
+            }
+            if (s->priv < PRV_M)
+                val &= s->mcounteren;
+        }
+        break;
+    case 0xdb0: /* stopi */
+        if (!s->aia_enabled)
+            goto invalid_csr;
+        val = get_topi(s, s->mideleg);
+        break;
     case 0xf14:
         val = s->mhartid;
         break;
+    case 0xfb0: /* mtopi */
+        if (!s->aia_enabled)
+            goto invalid_csr;
+        val = get_topi(s, ~s->mideleg);
+        break;
     default:
     invalid_csr:
 #ifdef DUMP_INVALID_CSR
@@ -903,6 +1553,8 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val)
         s->fs = 3;
         break;
 #endif
+    case 0x015: /* seed: writes are ignored */
+        break;
     case 0x100: /* sstatus */
         set_mstatus(s, (s->mstatus & ~SSTATUS_MASK) | (val & SSTATUS_MASK));
         break;
@@ -932,6 +1584,20 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val)
         mask = s->mideleg;
         s->mip = (s->mip & ~mask) | (val & mask);
         break;
+    case 0x150: /* siselect */
+        if (!s->aia_enabled)
+            return -1;
+        s->siselect = val & 0xfff;
+        break;
+    case 0x151: /* sireg */
+        if (!s->aia_enabled)
+            return -1;
+        return imsic_ireg_write(s, &s->imsic[IMSIC_FILE_S], s->siselect, val);
+    case 0x15c: /* stopei */
+        if (!s->aia_enabled)
+            return -1;
+        imsic_claim_topei(s, &s->imsic[IMSIC_FILE_S]);
+        break;
     case 0x180:
         /* no ASID implemented */
 #if MAX_XLEN == 32
@@ -959,7 +1625,7 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val)
         set_mstatus(s, val);
         break;
     case 0x301: /* misa */
-#if MAX_XLEN >= 64
+#if MAX_XLEN >= 64 && !defined(CONFIG_FIXED_XLEN)
         {
             int new_mxl;
             new_mxl = (val >> (s->cur_xlen - 2)) & 3;
@@ -980,11 +1646,15 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val)
         s->medeleg = (s->medeleg & ~mask) | (val & mask);
         break;
     case 0x303:
-        mask = MIP_SSIP | MIP_STIP | MIP_SEIP;
+        mask = MIP_SSIP | MIP_STIP | MIP_SEIP | MIP_LCOFIP;
         s->mideleg = (s->mideleg & ~mask) | (val & mask);
         break;
     case 0x304:
-        mask = MIP_MSIP | MIP_MTIP | MIP_SSIP | MIP_STIP | MIP_SEIP;
+        mask = MIP_MSIP | MIP_MTIP | MIP_SSIP | MIP_STIP | MIP_SEIP |
+            MIP_LCOFIP;
+        /* the M interrupt file is separate from the S one */
+        if (s->aia_enabled)
+            mask |= MIP_MEIP;
         s->mie = (s->mie & ~mask) | (val & mask);
         break;
     case 0x305:
@@ -1006,9 +1676,72 @@ static int csr_write(RISCVCPUState *s, uint32_t csr, target_ulong val)
         s->mtval = val;
         break;
     case 0x344:
-        mask = MIP_SSIP | MIP_STIP;
+        mask = MIP_SSIP | MIP_STIP | MIP_LCOFIP;
         s->mip = (s->mip & ~mask) | (val & mask);
         break;
+    case 0x350: /* miselect */
+        if (!s->aia_enabled)
+            return -1;
+        s->miselect = val & 0xfff;
+        break;
+    case 0x351: /* mireg */
+        if (!s->aia_enabled)
+            return -1;
+        return imsic_ireg_write(s, &s->imsic[IMSIC_FILE_M], s->miselect, val);
+    case 0x35c: /* mtopei */
+        if (!s->aia_enabled)
+            return -1;
+        imsic_claim_topei(s, &s->imsic[IMSIC_FILE_M]);
+        break;
+    /* the counter CSRs exit the interpreter loop so that the overflow
+       checks take the new configuration into account */
+    case 0x320:
+        s->mcountinhibit = val & MCOUNTINHIBIT_MASK;
+        hpm_update_all(s);
+        return 1;
+    case 0x323 ... 0x33f: /* mhpmevent */
+        {
+            int idx = (csr & 0x1f) - HPM_COUNTER_FIRST;
+            uint64_t v = val;
+            if (s->cur_xlen == 32)
+                v = (s->hpm_counters[idx].mhpmevent & ~(uint64_t)0xffffffff) |
+                    (uint32_t)val;
+            hpm_set_event(s, idx, v);
+        }
+        return 1;
+    case 0x723 ... 0x73f: /* mhpmeventh */
+        if (s->cur_xlen != 32)
+            return -1;
+        {
+            int idx = (csr & 0x1f) - HPM_COUNTER_FIRST;
+            hpm_set_event(s, idx,
+                          ((uint64_t)val << 32) |
+                          (uint32_t)s->hpm_counters[idx].mhpmevent);
+        }
+        return 1;
+    case 0x747: /* mseccfg */
+        s->mseccfg = val & (MSECCFG_USEED | MSECCFG_SSEED);
+        break;
+    case 0x757: /* mseccfgh */
+        break;
+    case 0xb03 ... 0xb1f: /* mhpmcounter */
+        {
+            int idx = (csr & 0x1f) - HPM_COUNTER_FIRST;
+            uint64_t v = val;
+            if (s->cur_xlen == 32)
+                v = (hpm_read(s, idx) & ~(uint64_t)0xffffffff) | (uint32_t)val;
+            hpm_write(s, idx, v);
+        }
+        return 1;
+    case 0xb83 ... 0xb9f: /* mhpmcounterh */
+        if (s->cur_xlen != 32)
+            return -1;
+        {
+            int idx = (csr & 0x1f) - HPM_COUNTER_FIRST;
+            hpm_write(s, idx, ((uint64_t)val << 32) |
+                      (uint32_t)hpm_read(s, idx));
+        }
+        return 1;
     default:
 #ifdef DUMP_INVALID_CSR
         printf("csr_write: invalid CSR=0x%x\n", csr);
@@ -1022,7 +1755,7 @@ static void set_priv(RISCVCPUState *s, int priv)
 {
     if (s->priv != priv) {
         tlb_flush_all(s);
-#if MAX_XLEN >= 64
+#if MAX_XLEN >= 64 && !defined(CONFIG_FIXED_XLEN)
         /* change the current xlen */
         {
             int mxl;
@@ -1036,6 +1769,10 @@ static void set_priv(RISCVCPUState *s, int priv)
         }
 #endif
         s->priv = priv;
+        /* some counters may be inhibited in the new mode. Only the
+           active counters depend on the privilege level. */
+        if (s->hpm_active_mask)
+            hpm_update_mask(s, s->hpm_active_mask);
     }
 }
 
@@ -1079,6 +1816,11 @@ static void raise_exception2(RISCVCPUState *s, uint32_t cause,
         }
     }
 #endif
+    if (cause & CAUSE_INTERRUPT) {
+        TRACE(cpu_interrupt, s, cause & ~CAUSE_INTERRUPT, (uint64_t)s->pc);
+    } else {
+        TRACE(cpu_exception, s, cause, (uint64_t)tval, (uint64_t)s->pc);
+    }
 
     if (s->priv <= PRV_S) {
         /* delegate the exception to the supervisor priviledge */
@@ -1090,6 +1832,11 @@ static void raise_exception2(RISCVCPUState *s, uint32_t cause,
         deleg = 0;
     }
     
+    if (cause & CAUSE_INTERRUPT)
+        HPM_COUNT_EVENT(s, HPM_EVENT_INTERRUPT, 1);
+    else
+        HPM_COUNT_EVENT(s, HPM_EVENT_EXCEPTION, 1);
+
     causel = cause & 0x7fffffff;
     if (cause & CAUSE_INTERRUPT)
         causel |= (target_ulong)1 << (s->cur_xlen - 1);
@@ -1191,7 +1938,10 @@ static __exception int raise_interrupt(RISCVCPUState *s)
     mask = get_pending_irq_mask(s);
     if (mask == 0)
         return 0;
-    irq_num = ctz32(mask);
+    /* the interrupts going to M mode are taken first */
+    if (mask & ~s->mideleg)
+        mask &= ~s->mideleg;
+    irq_num = get_top_irq(mask);
     raise_exception(s, irq_num | CAUSE_INTERRUPT);
     return -1;
 }
@@ -1213,6 +1963,47 @@ static inline uint32_t get_field1(uint32_t val, int src_pos,
         return (val >> (src_pos - dst_pos)) & mask;
 }
 
+#define SPIN_LOOP_MAX_LEN 64 /* max number of instructions of a spin
+                                loop iteration */
+#define SPIN_LOOP_COUNT 32 /* iterations without progress before
+                              yielding */
+
+/* Return TRUE if the CPU is busy waiting. It is called for each fence
+   or pause instruction: a spin loop executes the same one repeatedly
+   after a few instructions and the registers do not change because
+   the polled memory location does not change. */
+static BOOL check_spin_loop(RISCVCPUState *s, target_ulong pc,
+                            uint64_t insn_counter)
+{
+    uint32_t h;
+    int i;
+
+    if (pc != s->spin_pc ||
+        insn_counter - s->spin_insn_counter > SPIN_LOOP_MAX_LEN) {
+        s->spin_pc = pc;
+        s->spin_insn_counter = insn_counter;
+        s->spin_count = 0;
+        return FALSE;
+    }
+    s->spin_insn_counter = insn_counter;
+    h = 0;
+    for(i = 1; i < 32; i++) {
+        h = h * 31 + (uint32_t)s->reg[i];
+#if MAX_XLEN >= 64
+        h = h * 31 + (uint32_t)(s->reg[i] >> 32);
+#endif
+    }
+    if (h != s->spin_regs_hash) {
+        s->spin_regs_hash = h;
+        s->spin_count = 0;
+        return FALSE;
+    }
+    if (++s->spin_count < SPIN_LOOP_COUNT)
+        return FALSE;
+    s->spin_count = 0;
+    return TRUE;
+}
+
 #define XLEN 32
 #include "riscv_cpu_template.h"
 
@@ -1234,9 +2025,15 @@ static void glue(riscv_cpu_interp, MAX_XLEN)(RISCVCPUState *s, int n_cycles)
     uint64_t timeout;
 
     timeout = s->insn_counter + n_cycles;
-    while (!s->power_down_flag &&
+    s->spin_wait = FALSE;
+    while (!s->power_down_flag && !s->spin_wait &&
            (int)(timeout - s->insn_counter) > 0) {
         n_cycles = timeout - s->insn_counter;
+        if (s->hpm_running_mask)
+            n_cycles = hpm_get_max_cycles(s, n_cycles);
+#ifdef CONFIG_FIXED_XLEN
+        glue(riscv_cpu_interp_x, MAX_XLEN)(s, n_cycles);
+#else
         switch(s->cur_xlen) {
         case 32:
             riscv_cpu_interp_x32(s, n_cycles);
@@ -1254,6 +2051,9 @@ static void glue(riscv_cpu_interp, MAX_XLEN)(RISCVCPUState *s, int n_cycles)
         default:
             abort();
         }
+#endif
+        if (s->hpm_running_mask)
+            hpm_check_overflow(s);
     }
 }
 
@@ -1286,17 +2086,28 @@ static BOOL glue(riscv_cpu_get_power_down, MAX_XLEN)(RISCVCPUState *s)
     return s->power_down_flag;
 }
 
-static RISCVCPUState *glue(riscv_cpu_init, MAX_XLEN)(PhysMemoryMap *mem_map)
+static BOOL glue(riscv_cpu_get_spin_wait, MAX_XLEN)(RISCVCPUState *s)
 {
-    RISCVCPUState *s;
-    
-#ifdef USE_GLOBAL_STATE
-    s = &riscv_cpu_global_state;
-#else
-    s = mallocz(sizeof(*s));
-#endif
-    s->common.class_ptr = &glue(riscv_cpu_class, MAX_XLEN);
+    return s->spin_wait;
+}
+
+/* put the CPU in its power-on state. The memory map, the entropy
+   source and the AIA mode are kept. */
+static void glue(riscv_cpu_reset, MAX_XLEN)(RISCVCPUState *s)
+{
+    PhysMemoryMap *mem_map;
+    RNGDevice *rng;
+    BOOL aia_enabled;
+
+    mem_map = s->mem_map;
+    rng = s->rng;
+    aia_enabled = s->aia_enabled;
+    memset(s, 0, sizeof(*s));
+    s->common.class_ptr = &glue(riscv_cpu_class, CPU_SUFFIX);
     s->mem_map = mem_map;
+    s->rng = rng;
+    s->aia_enabled = aia_enabled;
+
     s->pc = 0x1000;
     s->priv = PRV_M;
     s->cur_xlen = MAX_XLEN;
@@ -1317,6 +2128,19 @@ static RISCVCPUState *glue(riscv_cpu_init, MAX_XLEN)(PhysMemoryMap *mem_map)
     s->misa |= MCPUID_C;
 #endif
     tlb_init(s);
+}
+
+static RISCVCPUState *glue(riscv_cpu_init, MAX_XLEN)(PhysMemoryMap *mem_map)
+{
+    RISCVCPUState *s;
+    
+#ifdef USE_GLOBAL_STATE
+    s = &riscv_cpu_global_state;
+#else
+    s = mallocz(sizeof(*s));
+#endif
+    s->mem_map = mem_map;
+    glue(riscv_cpu_reset, MAX_XLEN)(s);
     return s;
 }
 
@@ -1332,7 +2156,28 @@ static uint32_t glue(riscv_cpu_get_misa, MAX_XLEN)(RISCVCPUState *s)
     return s->misa;
 }
 
-const RISCVCPUClass glue(riscv_cpu_class, MAX_XLEN) = {
+static void glue(riscv_cpu_set_aia, MAX_XLEN)(RISCVCPUState *s,
+                                             BOOL enabled)
+{
+    s->aia_enabled = enabled;
+}
+
+static void glue(riscv_cpu_set_rng, MAX_XLEN)(RISCVCPUState *s,
+                                             RNGDevice *rs)
+{
+    s->rng = rs;
+}
+
+static void glue(riscv_cpu_send_msi, MAX_XLEN)(RISCVCPUState *s, int file,
+                                              uint32_t eiid)
+{
+    if (eiid == 0 || eiid >= IMSIC_NUM_IDS)
+        return;
+    s->imsic[file].eip |= (uint64_t)1 << eiid;
+    imsic_update_mip(s);
+}
+
+const RISCVCPUClass glue(riscv_cpu_class, CPU_SUFFIX) = {
     glue(riscv_cpu_init, MAX_XLEN),
     glue(riscv_cpu_end, MAX_XLEN),
     glue(riscv_cpu_interp, MAX_XLEN),
@@ -1343,12 +2188,49 @@ const RISCVCPUClass glue(riscv_cpu_class, MAX_XLEN) = {
     glue(riscv_cpu_get_power_down, MAX_XLEN),
     glue(riscv_cpu_get_misa, MAX_XLEN),
     glue(riscv_cpu_flush_tlb_write_range_ram, MAX_XLEN),
+    glue(riscv_cpu_set_aia, MAX_XLEN),
+    glue(riscv_cpu_send_msi, MAX_XLEN),
+    glue(riscv_cpu_get_spin_wait, MAX_XLEN),
+    glue(riscv_cpu_set_rng, MAX_XLEN),
+    glue(riscv_cpu_reset, MAX_XLEN),
 };
 
-#if CONFIG_RISCV_MAX_XLEN == MAX_XLEN
-RISCVCPUState *riscv_cpu_init(PhysMemoryMap *mem_map, int max_xlen)
+#if CONFIG_RISCV_MAX_XLEN == MAX_XLEN && !defined(CPU_PROFILE)
+
+#ifdef CONFIG_RISCV_PROFILES
+typedef struct {
+    int max_xlen;
+    uint32_t misa; /* without S and U */
+    const RISCVCPUClass *class_ptr;
+} RISCVCPUProfile;
+
+static const RISCVCPUProfile riscv_cpu_profiles[] = {
+    { 64, MCPUID_I | MCPUID_M | MCPUID_A | MCPUID_C,
+      &riscv_cpu_class64imac },
+    { 64, MCPUID_I | MCPUID_M | MCPUID_A | MCPUID_F | MCPUID_D | MCPUID_C,
+      &riscv_cpu_class64gc },
+};
+#endif
+
+/* 'misa' selects the extensions (without S and U). If it is 0, the
+   generic interpreter with all the extensions is used. Otherwise the
+   interpreter specialised for this ISA profile is returned if any. */
+RISCVCPUState *riscv_cpu_init(PhysMemoryMap *mem_map, int max_xlen,
+                              uint32_t misa)
 {
     const RISCVCPUClass *c;
+    RISCVCPUState *s;
+#ifdef CONFIG_RISCV_PROFILES
+    int i;
+
+    if (misa != 0) {
+        for(i = 0; i < countof(riscv_cpu_profiles); i++) {
+            const RISCVCPUProfile *p = &riscv_cpu_profiles[i];
+            if (p->max_xlen == max_xlen && p->misa == misa)
+                return p->class_ptr->riscv_cpu_init(mem_map);
+        }
+    }
+#endif
     switch(max_xlen) {
         /* with emscripten we compile a single CPU */
 #if defined(EMSCRIPTEN)
@@ -1371,7 +2253,13 @@ RISCVCPUState *riscv_cpu_init(PhysMemoryMap *mem_map, int max_xlen)
     default:
         return NULL;
     }
-    return c->riscv_cpu_init(mem_map);
+    s = c->riscv_cpu_init(mem_map);
+    /* the generic interpreter cannot remove extensions */
+    if (misa != 0 &&
+        (c->riscv_cpu_get_misa(s) & ~(MCPUID_SUPER | MCPUID_USER)) != misa) {
+        c->riscv_cpu_end(s);
+        return NULL;
+    }
+    return s;
 }
-#endif /* CONFIG_RISCV_MAX_XLEN == MAX_XLEN */
-
+#endif /* CONFIG_RISCV_MAX_XLEN == MAX_XLEN && !CPU_PROFILE */
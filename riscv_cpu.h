@@ -40,6 +40,31 @@
 #define MIP_SEIP (1 << 9)
 #define MIP_HEIP (1 << 10)
 #define MIP_MEIP (1 << 11)
+#define MIP_LCOFIP (1 << 13) /* counter overflow (Sscofpmf) */
+
+/* events selectable in mhpmevent */
+enum {
+    HPM_EVENT_NONE,
+    HPM_EVENT_CYCLES,
+    HPM_EVENT_INSTRET,
+    HPM_EVENT_LOAD,
+    HPM_EVENT_STORE,
+    HPM_EVENT_BRANCH, /* taken branches and jumps */
+    HPM_EVENT_FP_OP,
+    HPM_EVENT_ITLB_MISS,
+    HPM_EVENT_DTLB_LOAD_MISS,
+    HPM_EVENT_DTLB_STORE_MISS,
+    HPM_EVENT_PAGE_WALK,
+    HPM_EVENT_EXCEPTION,
+    HPM_EVENT_INTERRUPT,
+
+    HPM_EVENT_COUNT,
+};
+
+/* AIA interrupt files */
+#define IMSIC_FILE_M 0
+#define IMSIC_FILE_S 1
+#define IMSIC_NUM_IDS 64 /* identity 0 is reserved */
 
 typedef struct RISCVCPUState RISCVCPUState;
 
@@ -55,6 +80,11 @@ typedef struct {
     uint32_t (*riscv_cpu_get_misa)(RISCVCPUState *s);
     void (*riscv_cpu_flush_tlb_write_range_ram)(RISCVCPUState *s,
                                                 uint8_t *ram_ptr, size_t ram_size);
+    void (*riscv_cpu_set_aia)(RISCVCPUState *s, BOOL enabled);
+    void (*riscv_cpu_send_msi)(RISCVCPUState *s, int file, uint32_t eiid);
+    BOOL (*riscv_cpu_get_spin_wait)(RISCVCPUState *s);
+    void (*riscv_cpu_set_rng)(RISCVCPUState *s, RNGDevice *rs);
+    void (*riscv_cpu_reset)(RISCVCPUState *s);
 } RISCVCPUClass;
 
 typedef struct {
@@ -66,8 +96,12 @@ int riscv_cpu_get_max_xlen(void);
 extern const RISCVCPUClass riscv_cpu_class32;
 extern const RISCVCPUClass riscv_cpu_class64;
 extern const RISCVCPUClass riscv_cpu_class128;
+/* interpreters specialised for a fixed ISA profile */
+extern const RISCVCPUClass riscv_cpu_class64imac;
+extern const RISCVCPUClass riscv_cpu_class64gc;
 
-RISCVCPUState *riscv_cpu_init(PhysMemoryMap *mem_map, int max_xlen);
+RISCVCPUState *riscv_cpu_init(PhysMemoryMap *mem_map, int max_xlen,
+                              uint32_t misa);
 static inline void riscv_cpu_end(RISCVCPUState *s)
 {
     const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
@@ -114,5 +148,38 @@ static inline void riscv_cpu_flush_tlb_write_range_ram(RISCVCPUState *s,
     const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
     c->riscv_cpu_flush_tlb_write_range_ram(s, ram_ptr, ram_size);
 }
+/* enable the AIA CSRs. The external interrupts are then driven by
+   the interrupt files. */
+static inline void riscv_cpu_set_aia(RISCVCPUState *s, BOOL enabled)
+{
+    const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
+    c->riscv_cpu_set_aia(s, enabled);
+}
+/* write 'eiid' to the seteipnum register of an interrupt file */
+static inline void riscv_cpu_send_msi(RISCVCPUState *s, int file,
+                                      uint32_t eiid)
+{
+    const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
+    c->riscv_cpu_send_msi(s, file, eiid);
+}
+/* TRUE if the last riscv_cpu_interp() stopped in a spin loop */
+static inline BOOL riscv_cpu_get_spin_wait(RISCVCPUState *s)
+{
+    const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
+    return c->riscv_cpu_get_spin_wait(s);
+}
+/* entropy source of the Zkr 'seed' CSR. The CSR is only present if
+   'rs' is not NULL. */
+static inline void riscv_cpu_set_rng(RISCVCPUState *s, RNGDevice *rs)
+{
+    const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
+    c->riscv_cpu_set_rng(s, rs);
+}
+/* reset the CPU in place (warm reboot) */
+static inline void riscv_cpu_reset(RISCVCPUState *s)
+{
+    const RISCVCPUClass *c = ((RISCVCPUCommonState *)s)->class_ptr;
+    c->riscv_cpu_reset(s);
+}
 
 #endif /* RISCV_CPU_H */
@@ -21,7 +21,10 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-#if F_SIZE == 32
+#if F_SIZE == 16
+#define OPID 2
+#define F_HIGH F16_HIGH
+#elif F_SIZE == 32
 #define OPID 0
 #define F_HIGH F32_HIGH
 #elif F_SIZE == 64
@@ -223,6 +226,25 @@
                 if (rm < 0)
                     goto illegal_insn;
                 switch(rs2) {
+#if F_SIZE == 16
+                case 0: /* cvt.h.s */
+                    s->fp_reg[rd] = cvt_sf32_sf16(s->fp_reg[rs1], rm, &s->fflags) | F16_HIGH;
+                    break;
+#if FLEN >= 64
+                case 1: /* cvt.h.d */
+                    s->fp_reg[rd] = cvt_sf64_sf16(s->fp_reg[rs1], rm, &s->fflags) | F16_HIGH;
+                    break;
+#endif
+#if FLEN >= 128
+                case 3: /* cvt.h.q */
+                    s->fp_reg[rd] = cvt_sf128_sf16(s->fp_reg[rs1], rm, &s->fflags) | F16_HIGH;
+                    break;
+#endif
+#else
+                case 2: /* cvt.[sdq].h */
+                    s->fp_reg[rd] = glue(cvt_sf16_sf, F_SIZE)(s->fp_reg[rs1], &s->fflags) | F_HIGH;
+                    break;
+#endif /* F_SIZE == 16 */
 #if F_SIZE == 32 && FLEN >= 64
                 case 1: /* cvt.s.d */
                     s->fp_reg[rd] = cvt_sf64_sf32(s->fp_reg[rs1], rm, &s->fflags) | F32_HIGH;
@@ -264,7 +286,9 @@
                 switch(rm) {
 #if F_SIZE <= XLEN
                 case 0: /* fmv.x.s */
-#if F_SIZE == 32
+#if F_SIZE == 16
+                    val = (int16_t)s->fp_reg[rs1];
+#elif F_SIZE == 32
                     val = (int32_t)s->fp_reg[rs1];
 #elif F_SIZE == 64
                     val = (int64_t)s->fp_reg[rs1];
@@ -287,7 +311,9 @@
             case (0x1e << 2) | OPID: /* fmv.s.x */
                 if (rs2 != 0 || rm != 0)
                     goto illegal_insn;
-#if F_SIZE == 32
+#if F_SIZE == 16
+                s->fp_reg[rd] = (uint16_t)s->reg[rs1] | F16_HIGH;
+#elif F_SIZE == 32
                 s->fp_reg[rd] = (int32_t)s->reg[rs1];
 #elif F_SIZE == 64
                 s->fp_reg[rd] = (int64_t)s->reg[rs1];
@@ -37,6 +37,16 @@
 #endif
 #endif /* !FLEN */
 
+/* CPU_PROFILE is defined when building an interpreter specialised for
+   a fixed ISA profile: the extensions are selected at compile time
+   (FLEN) and XLEN cannot be changed by the guest. */
+#ifdef CPU_PROFILE
+#define CPU_SUFFIX glue(MAX_XLEN, CPU_PROFILE)
+#define CONFIG_FIXED_XLEN
+#else
+#define CPU_SUFFIX MAX_XLEN
+#endif
+
 #define CONFIG_EXT_C /* compressed instructions */
 
 #if defined(EMSCRIPTEN)
@@ -77,6 +87,7 @@ typedef uint128_t fp_uint;
 #else
 #error unsupported FLEN
 #endif
+#define F16_HIGH ((fp_uint)-1 << 16) /* Zfh */
 #endif
 
 /* MLEN is the maximum memory access width */
@@ -175,6 +186,32 @@ typedef struct {
     uintptr_t mem_addend;
 } TLBEntry;
 
+#define HPM_COUNTER_FIRST 3
+#define HPM_COUNTER_COUNT 29 /* mhpmcounter3 to mhpmcounter31 */
+
+/* the events are only counted when a running counter selects them */
+#define HPM_COUNT_EVENT(s, event, n) do {                       \
+        if (unlikely((s)->hpm_event_mask & (1 << (event))))     \
+            (s)->hpm_events[event] += (n);                      \
+    } while (0)
+
+typedef struct {
+    uint64_t mhpmevent;
+    BOOL running;
+    /* value = start_val + (event count - start_event) if running,
+       start_val otherwise */
+    uint64_t start_val;
+    uint64_t start_event;
+} HPMCounter;
+
+/* AIA interrupt file (IMSIC) */
+typedef struct {
+    uint64_t eip; /* pending identities */
+    uint64_t eie; /* enabled identities */
+    uint32_t eidelivery;
+    uint32_t eithreshold;
+} IMSICFile;
+
 struct RISCVCPUState {
     RISCVCPUCommonState common; /* must be first */
     
@@ -201,6 +238,12 @@ struct RISCVCPUState {
     int32_t n_cycles; /* only used inside the CPU loop */
     uint64_t insn_counter;
     BOOL power_down_flag;
+    /* spin loop detection */
+    BOOL spin_wait; /* the CPU yields until the next event */
+    target_ulong spin_pc;
+    uint64_t spin_insn_counter;
+    uint32_t spin_regs_hash;
+    int spin_count;
     int pending_exception; /* used during MMU exception handling */
     target_ulong pending_tval;
     
@@ -231,6 +274,25 @@ struct RISCVCPUState {
 #endif
     uint32_t scounteren;
 
+    /* performance monitoring */
+    uint32_t mcountinhibit;
+    uint32_t hpm_running_mask; /* running counters with OF = 0 */
+    uint32_t hpm_active_mask; /* counters with an event and not inhibited
+                                 by mcountinhibit */
+    uint32_t hpm_event_mask; /* events counted by a running counter */
+    uint64_t hpm_events[HPM_EVENT_COUNT]; /* cycles and instret excepted */
+    HPMCounter hpm_counters[HPM_COUNTER_COUNT];
+
+    /* Zkr entropy source (NULL if none) */
+    RNGDevice *rng;
+    target_ulong mseccfg;
+
+    /* AIA */
+    BOOL aia_enabled;
+    uint32_t miselect;
+    uint32_t siselect;
+    IMSICFile imsic[2]; /* IMSIC_FILE_M, IMSIC_FILE_S */
+
     target_ulong load_res; /* for atomic LR/SC */
 
     PhysMemoryMap *mem_map;
@@ -240,8 +302,8 @@ struct RISCVCPUState {
     TLBEntry tlb_code[TLB_SIZE];
 };
 
-#define target_read_slow glue(glue(riscv, MAX_XLEN), _read_slow)
-#define target_write_slow glue(glue(riscv, MAX_XLEN), _write_slow)
+#define target_read_slow glue(glue(riscv, CPU_SUFFIX), _read_slow)
+#define target_write_slow glue(glue(riscv, CPU_SUFFIX), _write_slow)
 
 DLL_PUBLIC int target_read_slow(RISCVCPUState *s, mem_uint_t *pval,
                                 target_ulong addr, int size_log2);
@@ -254,6 +316,7 @@ static inline __exception int target_read_u ## size(RISCVCPUState *s, uint_type
 {\
     uint32_t tlb_idx;\
     tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);\
+    HPM_COUNT_EVENT(s, HPM_EVENT_LOAD, 1);\
     if (likely(s->tlb_read[tlb_idx].vaddr == (addr & ~(PG_MASK & ~((size / 8) - 1))))) { \
         *pval = *(uint_type *)(s->tlb_read[tlb_idx].mem_addend + (uintptr_t)addr);\
     } else {\
@@ -272,6 +335,7 @@ static inline __exception int target_write_u ## size(RISCVCPUState *s, target_ul
 {\
     uint32_t tlb_idx;\
     tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);\
+    HPM_COUNT_EVENT(s, HPM_EVENT_STORE, 1);\
     if (likely(s->tlb_write[tlb_idx].vaddr == (addr & ~(PG_MASK & ~((size / 8) - 1))))) { \
         *(uint_type *)(s->tlb_write[tlb_idx].mem_addend + (uintptr_t)addr) = val;\
         return 0;\
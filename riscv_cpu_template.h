@@ -197,6 +197,26 @@ static inline uintx_t glue(mulhsu, XLEN)(intx_t a, uintx_t b)
         goto jump_insn;            \
     } while (0)
 
+/* taken jump: if the target is in the current code page, the
+   execution continues in place. The cycle counter and the interrupts
+   are tested as when changing page. */
+#define BRANCH_INSN do {                                                \
+        target_ulong cur_pc = GET_PC();                                 \
+        HPM_COUNT_EVENT(s, HPM_EVENT_BRANCH, 1);                        \
+        if (likely(((s->pc ^ cur_pc) & ~(target_ulong)PG_MASK) == 0 &&  \
+                   (s->pc & PG_MASK) < PG_MASK - 1 &&                   \
+                   s->n_cycles > 0 && (s->mip & s->mie) == 0)) {        \
+            code_ptr += (intptr_t)(s->pc & PG_MASK) -                   \
+                (intptr_t)(cur_pc & PG_MASK);                           \
+            goto jump_insn;                                             \
+        }                                                               \
+        JUMP_INSN;                                                      \
+    } while (0)
+
+/* with a fixed XLEN, only the MAX_XLEN interpreter loop is built. The
+   other XLEN values only provide their helpers (e.g. div32 for the W
+   instructions). */
+#if !defined(CONFIG_FIXED_XLEN) || XLEN == MAX_XLEN
 static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                                                    int n_cycles1)
 {
@@ -250,6 +270,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
 
             /* check pending interrupts */
             if (unlikely((s->mip & s->mie) != 0)) {
+                s->insn_counter = GET_INSN_COUNTER();
                 if (raise_interrupt(s)) {
                     s->n_cycles--; 
                     goto the_end;
@@ -471,7 +492,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                            get_field1(insn, 2, 5, 5), 12);
                 s->reg[1] = GET_PC() + 2;
                 s->pc = (intx_t)(GET_PC() + imm);
-                JUMP_INSN;
+                BRANCH_INSN;
 #else
             case 1: /* c.addiw */
                 if (rd != 0) {
@@ -574,7 +595,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                            get_field1(insn, 3, 1, 3) |
                            get_field1(insn, 2, 5, 5), 12);
                 s->pc = (intx_t)(GET_PC() + imm);
-                JUMP_INSN;
+                BRANCH_INSN;
             case 6: /* c.beqz */
                 rs1 = ((insn >> 7) & 7) | 8;
                 imm = sext(get_field1(insn, 12, 8, 8) | 
@@ -584,7 +605,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                            get_field1(insn, 2, 5, 5), 9);
                 if (s->reg[rs1] == 0) {
                     s->pc = (intx_t)(GET_PC() + imm);
-                    JUMP_INSN;
+                    BRANCH_INSN;
                 }
                 break;
             case 7: /* c.bnez */
@@ -596,7 +617,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                            get_field1(insn, 2, 5, 5), 9);
                 if (s->reg[rs1] != 0) {
                     s->pc = (intx_t)(GET_PC() + imm);
-                    JUMP_INSN;
+                    BRANCH_INSN;
                 }
                 break;
             default:
@@ -698,7 +719,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                         if (rd == 0)
                             goto illegal_insn;
                         s->pc = s->reg[rd] & ~1;
-                        JUMP_INSN;
+                        BRANCH_INSN;
                     } else {
                         /* c.mv */
                         if (rd != 0)
@@ -715,7 +736,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                             val = GET_PC() + 2;
                             s->pc = s->reg[rd] & ~1;
                             s->reg[1] = val;
-                            JUMP_INSN;
+                            BRANCH_INSN;
                         }
                     } else {
                         if (rd != 0) {
@@ -792,14 +813,14 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
             if (rd != 0)
                 s->reg[rd] = GET_PC() + 4;
             s->pc = (intx_t)(GET_PC() + imm);
-            JUMP_INSN;
+            BRANCH_INSN;
         case 0x67: /* jalr */
             imm = (int32_t)insn >> 20;
             val = GET_PC() + 4;
             s->pc = (intx_t)(s->reg[rs1] + imm) & ~1;
             if (rd != 0)
                 s->reg[rd] = val;
-            JUMP_INSN;
+            BRANCH_INSN;
         case 0x63:
             funct3 = (insn >> 12) & 7;
             switch(funct3 >> 1) {
@@ -823,7 +844,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                     ((insn << (11 - 7)) & (1 << 11));
                 imm = (imm << 19) >> 19;
                 s->pc = (intx_t)(GET_PC() + imm);
-                JUMP_INSN;
+                BRANCH_INSN;
             }
             NEXT_INSN;
         case 0x03: /* load */
@@ -1295,6 +1316,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                         if (s->priv < PRV_S)
                             goto illegal_insn;
                         s->pc = GET_PC();
+                        s->insn_counter = GET_INSN_COUNTER();
                         handle_sret(s);
                         goto done_interp;
                     }
@@ -1306,6 +1328,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                         if (s->priv < PRV_M)
                             goto illegal_insn;
                         s->pc = GET_PC();
+                        s->insn_counter = GET_INSN_COUNTER();
                         handle_mret(s);
                         goto done_interp;
                     }
@@ -1351,9 +1374,17 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
         case 0x0f: /* misc-mem */
             funct3 = (insn >> 12) & 7;
             switch(funct3) {
-            case 0: /* fence */
+            case 0: /* fence, pause */
                 if (insn & 0xf00fff80)
                     goto illegal_insn;
+                if (unlikely(check_spin_loop(s, GET_PC(),
+                                             GET_INSN_COUNTER()))) {
+                    /* busy waiting: give the host CPU back until the
+                       next event */
+                    s->spin_wait = TRUE;
+                    s->pc = GET_PC() + 4;
+                    goto done_interp;
+                }
                 break;
             case 1: /* fence.i */
                 if (insn != 0x0000100f)
@@ -1375,6 +1406,14 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
             NEXT_INSN;
         case 0x2f:
             funct3 = (insn >> 12) & 7;
+/* unlike the other loads and stores, the atomic accesses must be
+   naturally aligned */
+#define OP_A_CHECK_ALIGN(size, cause)                                   \
+            if (addr & (size / 8 - 1)) {                                \
+                s->pending_exception = cause;                           \
+                s->pending_tval = addr;                                 \
+                goto exception;                                         \
+            }
 #define OP_A(size)                                                      \
             {                                                           \
                 uint ## size ##_t rval;                                 \
@@ -1385,12 +1424,14 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                 case 2: /* lr.w */                                      \
                     if (rs2 != 0)                                       \
                         goto illegal_insn;                              \
+                    OP_A_CHECK_ALIGN(size, CAUSE_MISALIGNED_LOAD);      \
                     if (target_read_u ## size(s, &rval, addr))          \
                         goto mmu_exception;                             \
                     val = (int## size ## _t)rval;                       \
                     s->load_res = addr;                                 \
                     break;                                              \
                 case 3: /* sc.w */                                      \
+                    OP_A_CHECK_ALIGN(size, CAUSE_MISALIGNED_STORE);     \
                     if (s->load_res == addr) {                          \
                         if (target_write_u ## size(s, addr, s->reg[rs2])) \
                             goto mmu_exception;                         \
@@ -1408,6 +1449,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                 case 0x14: /* amomax.w */                               \
                 case 0x18: /* amominu.w */                              \
                 case 0x1c: /* amomaxu.w */                              \
+                    OP_A_CHECK_ALIGN(size, CAUSE_MISALIGNED_STORE);     \
                     if (target_read_u ## size(s, &rval, addr))          \
                         goto mmu_exception;                             \
                     val = (int## size ## _t)rval;                       \
@@ -1483,6 +1525,14 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
             imm = (int32_t)insn >> 20;
             addr = s->reg[rs1] + imm;
             switch(funct3) {
+            case 1: /* flh */
+                {
+                    uint16_t rval;
+                    if (target_read_u16(s, &rval, addr))
+                        goto mmu_exception;
+                    s->fp_reg[rd] = rval | F16_HIGH;
+                }
+                break;
             case 2: /* flw */
                 {
                     uint32_t rval;
@@ -1524,6 +1574,10 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
             imm = (imm << 20) >> 20;
             addr = s->reg[rs1] + imm;
             switch(funct3) {
+            case 1: /* fsh */
+                if (target_write_u16(s, addr, s->fp_reg[rs2]))
+                    goto mmu_exception;
+                break;
             case 2: /* fsw */
                 if (target_write_u32(s, addr, s->fp_reg[rs2]))
                     goto mmu_exception;
@@ -1547,6 +1601,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
         case 0x43: /* fmadd */
             if (s->fs == 0)
                 goto illegal_insn;
+            HPM_COUNT_EVENT(s, HPM_EVENT_FP_OP, 1);
             funct3 = (insn >> 25) & 3;
             rs3 = insn >> 27;
             rm = get_insn_rm(s, (insn >> 12) & 7);
@@ -1557,6 +1612,10 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                 s->fp_reg[rd] = fma_sf32(s->fp_reg[rs1], s->fp_reg[rs2],
                                          s->fp_reg[rs3], rm, &s->fflags) | F32_HIGH;
                 break;
+            case 2:
+                s->fp_reg[rd] = fma_sf16(s->fp_reg[rs1], s->fp_reg[rs2],
+                                         s->fp_reg[rs3], rm, &s->fflags) | F16_HIGH;
+                break;
 #if FLEN >= 64
             case 1:
                 s->fp_reg[rd] = fma_sf64(s->fp_reg[rs1], s->fp_reg[rs2],
@@ -1577,6 +1636,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
         case 0x47: /* fmsub */
             if (s->fs == 0)
                 goto illegal_insn;
+            HPM_COUNT_EVENT(s, HPM_EVENT_FP_OP, 1);
             funct3 = (insn >> 25) & 3;
             rs3 = insn >> 27;
             rm = get_insn_rm(s, (insn >> 12) & 7);
@@ -1589,6 +1649,12 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                                          s->fp_reg[rs3] ^ FSIGN_MASK32,
                                          rm, &s->fflags) | F32_HIGH;
                 break;
+            case 2:
+                s->fp_reg[rd] = fma_sf16(s->fp_reg[rs1],
+                                         s->fp_reg[rs2],
+                                         s->fp_reg[rs3] ^ FSIGN_MASK16,
+                                         rm, &s->fflags) | F16_HIGH;
+                break;
 #if FLEN >= 64
             case 1:
                 s->fp_reg[rd] = fma_sf64(s->fp_reg[rs1],
@@ -1613,6 +1679,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
         case 0x4b: /* fnmsub */
             if (s->fs == 0)
                 goto illegal_insn;
+            HPM_COUNT_EVENT(s, HPM_EVENT_FP_OP, 1);
             funct3 = (insn >> 25) & 3;
             rs3 = insn >> 27;
             rm = get_insn_rm(s, (insn >> 12) & 7);
@@ -1625,6 +1692,12 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                                          s->fp_reg[rs3],
                                          rm, &s->fflags) | F32_HIGH;
                 break;
+            case 2:
+                s->fp_reg[rd] = fma_sf16(s->fp_reg[rs1] ^ FSIGN_MASK16,
+                                         s->fp_reg[rs2],
+                                         s->fp_reg[rs3],
+                                         rm, &s->fflags) | F16_HIGH;
+                break;
 #if FLEN >= 64
             case 1:
                 s->fp_reg[rd] = fma_sf64(s->fp_reg[rs1] ^ FSIGN_MASK64,
@@ -1649,6 +1722,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
         case 0x4f: /* fnmadd */
             if (s->fs == 0)
                 goto illegal_insn;
+            HPM_COUNT_EVENT(s, HPM_EVENT_FP_OP, 1);
             funct3 = (insn >> 25) & 3;
             rs3 = insn >> 27;
             rm = get_insn_rm(s, (insn >> 12) & 7);
@@ -1661,6 +1735,12 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
                                          s->fp_reg[rs3] ^ FSIGN_MASK32,
                                          rm, &s->fflags) | F32_HIGH;
                 break;
+            case 2:
+                s->fp_reg[rd] = fma_sf16(s->fp_reg[rs1] ^ FSIGN_MASK16,
+                                         s->fp_reg[rs2],
+                                         s->fp_reg[rs3] ^ FSIGN_MASK16,
+                                         rm, &s->fflags) | F16_HIGH;
+                break;
 #if FLEN >= 64
             case 1:
                 s->fp_reg[rd] = fma_sf64(s->fp_reg[rs1] ^ FSIGN_MASK64,
@@ -1685,10 +1765,13 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
         case 0x53:
             if (s->fs == 0)
                 goto illegal_insn;
+            HPM_COUNT_EVENT(s, HPM_EVENT_FP_OP, 1);
             imm = insn >> 25;
             rm = (insn >> 12) & 7;
             switch(imm) {
 
+#define F_SIZE 16
+#include "riscv_cpu_fp_template.h"
 #define F_SIZE 32
 #include "riscv_cpu_fp_template.h"
 #if FLEN >= 64
@@ -1720,6 +1803,7 @@ static void no_inline glue(riscv_cpu_interp_x, XLEN)(RISCVCPUState *s,
     if (s->pending_exception >= 0) {
         /* Note: the idea is that one exception counts for one cycle. */
         s->n_cycles--; 
+        s->insn_counter = GET_INSN_COUNTER();
         raise_exception2(s, s->pending_exception, s->pending_tval);
     }
     /* we exit because XLEN may have changed */
@@ -1732,8 +1816,10 @@ the_end:
            s->priv);
 #endif
 }
+#endif /* !CONFIG_FIXED_XLEN || XLEN == MAX_XLEN */
 
 #undef uintx_t
 #undef intx_t
 #undef XLEN
 #undef OP_A
+#undef OP_A_CHECK_ALIGN
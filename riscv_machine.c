@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <ctype.h>
 
 #include "cutils.h"
 #include "iomem.h"
@@ -52,18 +53,37 @@ typedef struct RISCVMachine {
     uint64_t timecmp;
     /* PLIC */
     uint32_t plic_pending_irq, plic_served_irq;
-    IRQSignal plic_irq[32]; /* IRQ 0 is not used */
+    IRQSignal plic_irq[32]; /* IRQ 0 is not used. Connected to the
+                               APLIC if AIA is enabled */
+    /* AIA */
+    BOOL aia_enable;
+    uint32_t aplic_domaincfg;
+    uint32_t aplic_sourcecfg[32];
+    uint32_t aplic_target[32];
+    uint32_t aplic_msiaddrcfg[4];
+    uint32_t aplic_input; /* raw input levels */
+    uint32_t aplic_pending;
+    uint32_t aplic_enabled;
     /* HTIF */
     uint64_t htif_tohost, htif_fromhost;
 
     VIRTIODevice *keyboard_dev;
     VIRTIODevice *mouse_dev;
+    VIRTIODevice *rng_dev;
 
     int virtio_count;
+    VIRTIODevice *virtio_dev[32];
+
+    /* reboot */
+    BOOL reset_request;
+    VMFileEntry files[VM_FILE_COUNT]; /* boot files kept for the reboot */
+    char *cmdline;
 } RISCVMachine;
 
 #define LOW_RAM_SIZE   0x00010000 /* 64KB */
 #define RAM_BASE_ADDR  0x80000000
+#define SYSCON_BASE_ADDR 0x00100000
+#define SYSCON_SIZE      0x00001000
 #define CLINT_BASE_ADDR 0x02000000
 #define CLINT_SIZE      0x000c0000
 #define HTIF_BASE_ADDR 0x40008000
@@ -73,6 +93,11 @@ typedef struct RISCVMachine {
 #define VIRTIO_IRQ       1
 #define PLIC_BASE_ADDR 0x40100000
 #define PLIC_SIZE      0x00400000
+#define APLIC_BASE_ADDR 0x0d000000
+#define APLIC_SIZE      0x00004000
+#define IMSIC_M_BASE_ADDR 0x24000000
+#define IMSIC_S_BASE_ADDR 0x28000000
+#define IMSIC_SIZE        0x00001000
 #define FRAMEBUFFER_BASE_ADDR 0x41000000
 
 #define RTC_FREQ 10000000
@@ -192,6 +217,39 @@ static void htif_poll(RISCVMachine *s)
 }
 #endif
 
+/* SiFive test device: used by the guest to power off or reboot */
+#define SYSCON_FAIL  0x3333 /* exit code in the high 16 bits */
+#define SYSCON_PASS  0x5555
+#define SYSCON_RESET 0x7777
+
+static uint32_t syscon_read(void *opaque, uint32_t offset, int size_log2)
+{
+    return 0;
+}
+
+static void syscon_write(void *opaque, uint32_t offset, uint32_t val,
+                         int size_log2)
+{
+    RISCVMachine *s = opaque;
+
+    if (offset != 0)
+        return;
+    switch(val & 0xffff) {
+    case SYSCON_FAIL:
+        printf("\nPower off (exit code %d).\n", val >> 16);
+        exit(val >> 16);
+    case SYSCON_PASS:
+        printf("\nPower off.\n");
+        exit(0);
+    case SYSCON_RESET:
+        /* done after the current instruction */
+        s->reset_request = TRUE;
+        break;
+    default:
+        break;
+    }
+}
+
 static uint32_t clint_read(void *opaque, uint32_t offset, int size_log2)
 {
     RISCVMachine *m = opaque;
@@ -313,6 +371,281 @@ static void plic_set_irq(void *opaque, int irq_num, int state)
     plic_update_mip(s);
 }
 
+/* AIA: the wired interrupts are converted to MSIs by the APLIC and
+   sent to the S interrupt file of the CPU. The claim is then done with
+   the stopei CSR instead of a PLIC MMIO access. */
+
+static void imsic_write(void *opaque, uint32_t offset, uint32_t val,
+                        int size_log2, int file)
+{
+    RISCVMachine *s = opaque;
+
+    assert(size_log2 == 2);
+    switch(offset) {
+    case 0: /* seteipnum_le */
+        riscv_cpu_send_msi(s->cpu_state, file, val);
+        break;
+    case 4: /* seteipnum_be */
+        riscv_cpu_send_msi(s->cpu_state, file, bswap_32(val));
+        break;
+    default:
+        break;
+    }
+}
+
+static uint32_t imsic_read(void *opaque, uint32_t offset, int size_log2)
+{
+    return 0;
+}
+
+static void imsic_m_write(void *opaque, uint32_t offset, uint32_t val,
+                          int size_log2)
+{
+    imsic_write(opaque, offset, val, size_log2, IMSIC_FILE_M);
+}
+
+static void imsic_s_write(void *opaque, uint32_t offset, uint32_t val,
+                          int size_log2)
+{
+    imsic_write(opaque, offset, val, size_log2, IMSIC_FILE_S);
+}
+
+#define APLIC_DOMAINCFG_IE (1 << 8)
+#define APLIC_DOMAINCFG_DM (1 << 2) /* MSI delivery mode */
+
+#define APLIC_SM_INACTIVE 0
+#define APLIC_SM_DETACHED 1
+#define APLIC_SM_EDGE1    4
+#define APLIC_SM_EDGE0    5
+#define APLIC_SM_LEVEL1   6
+#define APLIC_SM_LEVEL0   7
+
+#define APLIC_SOURCECFG  0x0004
+#define APLIC_MSIADDRCFG 0x1bc0
+#define APLIC_SETIP      0x1c00
+#define APLIC_SETIPNUM   0x1cdc
+#define APLIC_IN_CLRIP   0x1d00
+#define APLIC_CLRIPNUM   0x1ddc
+#define APLIC_SETIE      0x1e00
+#define APLIC_SETIENUM   0x1edc
+#define APLIC_CLRIE      0x1f00
+#define APLIC_CLRIENUM   0x1fdc
+#define APLIC_SETIPNUM_LE 0x2000
+#define APLIC_SETIPNUM_BE 0x2004
+#define APLIC_GENMSI     0x3000
+#define APLIC_TARGET     0x3004
+
+/* active sources */
+static uint32_t aplic_get_active(RISCVMachine *s)
+{
+    uint32_t mask;
+    int i;
+    mask = 0;
+    for(i = 1; i < 32; i++) {
+        if (s->aplic_sourcecfg[i] != APLIC_SM_INACTIVE)
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+/* rectified input values of the sources */
+static uint32_t aplic_get_rectified(RISCVMachine *s)
+{
+    uint32_t mask;
+    int i;
+    mask = 0;
+    for(i = 1; i < 32; i++) {
+        switch(s->aplic_sourcecfg[i]) {
+        case APLIC_SM_EDGE1:
+        case APLIC_SM_LEVEL1:
+            mask |= s->aplic_input & (1 << i);
+            break;
+        case APLIC_SM_EDGE0:
+        case APLIC_SM_LEVEL0:
+            mask |= ~s->aplic_input & (1 << i);
+            break;
+        default:
+            break;
+        }
+    }
+    return mask;
+}
+
+/* sources whose pending bit can be set by software */
+static uint32_t aplic_get_settable(RISCVMachine *s)
+{
+    uint32_t mask, rectified;
+    int i;
+    rectified = aplic_get_rectified(s);
+    mask = 0;
+    for(i = 1; i < 32; i++) {
+        switch(s->aplic_sourcecfg[i]) {
+        case APLIC_SM_DETACHED:
+        case APLIC_SM_EDGE1:
+        case APLIC_SM_EDGE0:
+            mask |= 1 << i;
+            break;
+        case APLIC_SM_LEVEL1:
+        case APLIC_SM_LEVEL0:
+            /* only if the input is asserted */
+            mask |= rectified & (1 << i);
+            break;
+        default:
+            break;
+        }
+    }
+    return mask;
+}
+
+/* forward the pending and enabled interrupts as MSIs */
+static void aplic_update(RISCVMachine *s)
+{
+    uint32_t mask;
+    int i;
+
+    if (!(s->aplic_domaincfg & APLIC_DOMAINCFG_IE))
+        return;
+    mask = s->aplic_pending & s->aplic_enabled;
+    while (mask != 0) {
+        i = ctz32(mask);
+        mask &= ~(1 << i);
+        s->aplic_pending &= ~(1 << i);
+        riscv_cpu_send_msi(s->cpu_state, IMSIC_FILE_S,
+                           s->aplic_target[i] & 0x7ff);
+    }
+}
+
+static void aplic_set_pending(RISCVMachine *s, uint32_t mask)
+{
+    s->aplic_pending |= mask & aplic_get_settable(s);
+    aplic_update(s);
+}
+
+static uint32_t aplic_read(void *opaque, uint32_t offset, int size_log2)
+{
+    RISCVMachine *s = opaque;
+    uint32_t val;
+    int i;
+
+    assert(size_log2 == 2);
+    val = 0;
+    if (offset == 0) {
+        val = 0x80000000 | s->aplic_domaincfg | APLIC_DOMAINCFG_DM;
+    } else if (offset >= APLIC_SOURCECFG && offset < APLIC_SOURCECFG + 31 * 4) {
+        i = (offset - APLIC_SOURCECFG) / 4 + 1;
+        val = s->aplic_sourcecfg[i];
+    } else if (offset >= APLIC_MSIADDRCFG && offset < APLIC_MSIADDRCFG + 16) {
+        val = s->aplic_msiaddrcfg[(offset - APLIC_MSIADDRCFG) / 4];
+    } else if (offset == APLIC_SETIP) {
+        val = s->aplic_pending;
+    } else if (offset == APLIC_IN_CLRIP) {
+        val = aplic_get_rectified(s);
+    } else if (offset == APLIC_SETIE) {
+        val = s->aplic_enabled;
+    } else if (offset >= APLIC_TARGET && offset < APLIC_TARGET + 31 * 4) {
+        i = (offset - APLIC_TARGET) / 4 + 1;
+        val = s->aplic_target[i];
+    }
+    return val;
+}
+
+static void aplic_write(void *opaque, uint32_t offset, uint32_t val,
+                        int size_log2)
+{
+    RISCVMachine *s = opaque;
+    uint32_t active;
+    int i;
+
+    assert(size_log2 == 2);
+    active = aplic_get_active(s);
+    if (offset == 0) {
+        /* only MSI delivery mode and little endian are supported */
+        s->aplic_domaincfg = val & APLIC_DOMAINCFG_IE;
+    } else if (offset >= APLIC_SOURCECFG && offset < APLIC_SOURCECFG + 31 * 4) {
+        i = (offset - APLIC_SOURCECFG) / 4 + 1;
+        /* no child domain, so no delegation */
+        val &= 7;
+        if (val == 2 || val == 3)
+            val = APLIC_SM_INACTIVE;
+        s->aplic_sourcecfg[i] = val;
+        if (val == APLIC_SM_INACTIVE) {
+            s->aplic_pending &= ~(1 << i);
+            s->aplic_enabled &= ~(1 << i);
+            s->aplic_target[i] = 0;
+        } else if (val == APLIC_SM_LEVEL1 || val == APLIC_SM_LEVEL0) {
+            /* the pending bit follows the input level */
+            s->aplic_pending &= ~(1 << i);
+            s->aplic_pending |= aplic_get_rectified(s) & (1 << i);
+        }
+    } else if (offset >= APLIC_MSIADDRCFG && offset < APLIC_MSIADDRCFG + 16) {
+        /* the MSIs are always sent to the local interrupt file */
+        s->aplic_msiaddrcfg[(offset - APLIC_MSIADDRCFG) / 4] = val;
+    } else if (offset == APLIC_SETIP) {
+        aplic_set_pending(s, val & active);
+    } else if (offset == APLIC_SETIPNUM || offset == APLIC_SETIPNUM_LE) {
+        if (val < 32)
+            aplic_set_pending(s, (1 << val) & active);
+    } else if (offset == APLIC_SETIPNUM_BE) {
+        val = bswap_32(val);
+        if (val < 32)
+            aplic_set_pending(s, (1 << val) & active);
+    } else if (offset == APLIC_IN_CLRIP) {
+        s->aplic_pending &= ~val;
+    } else if (offset == APLIC_CLRIPNUM) {
+        if (val < 32)
+            s->aplic_pending &= ~(1 << val);
+    } else if (offset == APLIC_SETIE) {
+        s->aplic_enabled |= val & active;
+    } else if (offset == APLIC_SETIENUM) {
+        if (val < 32)
+            s->aplic_enabled |= (1 << val) & active;
+    } else if (offset == APLIC_CLRIE) {
+        s->aplic_enabled &= ~val;
+    } else if (offset == APLIC_CLRIENUM) {
+        if (val < 32)
+            s->aplic_enabled &= ~(1 << val);
+    } else if (offset == APLIC_GENMSI) {
+        /* sent immediately, so never busy */
+        riscv_cpu_send_msi(s->cpu_state, IMSIC_FILE_S, val & 0x7ff);
+    } else if (offset >= APLIC_TARGET && offset < APLIC_TARGET + 31 * 4) {
+        i = (offset - APLIC_TARGET) / 4 + 1;
+        /* hart index and EIID. No guest interrupt file. */
+        if (active & (1 << i))
+            s->aplic_target[i] = val & 0xfffc07ff;
+    }
+    aplic_update(s);
+}
+
+static void aplic_set_irq(void *opaque, int irq_num, int state)
+{
+    RISCVMachine *s = opaque;
+    uint32_t mask, rectified;
+
+    mask = 1 << irq_num;
+    rectified = aplic_get_rectified(s);
+    if (state)
+        s->aplic_input |= mask;
+    else
+        s->aplic_input &= ~mask;
+    switch(s->aplic_sourcecfg[irq_num]) {
+    case APLIC_SM_EDGE1:
+    case APLIC_SM_EDGE0:
+    case APLIC_SM_LEVEL1:
+    case APLIC_SM_LEVEL0:
+        if (aplic_get_rectified(s) & ~rectified & mask) {
+            s->aplic_pending |= mask;
+        } else if ((s->aplic_sourcecfg[irq_num] == APLIC_SM_LEVEL1 ||
+                    s->aplic_sourcecfg[irq_num] == APLIC_SM_LEVEL0) &&
+                   !(aplic_get_rectified(s) & mask)) {
+            s->aplic_pending &= ~mask;
+        }
+        aplic_update(s);
+        break;
+    default:
+        break;
+    }
+}
+
 static uint8_t *get_ram_ptr(RISCVMachine *s, uint64_t paddr, BOOL is_rw)
 {
     return phys_mem_get_ram_ptr(s->mem_map, paddr, is_rw);
@@ -447,7 +780,7 @@ static void fdt_prop(FDTState *s, const char *prop_name,
 }
 
 static void fdt_prop_tab_u32(FDTState *s, const char *prop_name,
-                             uint32_t *tab, int tab_len)
+                             const uint32_t *tab, int tab_len)
 {
     int i;
     fdt_put32(s, FDT_PROP);
@@ -591,6 +924,7 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
 {
     FDTState *s;
     int size, max_xlen, i, cur_phandle, intc_phandle, plic_phandle;
+    int imsic_phandle, syscon_phandle;
     char isa_string[128], *q;
     uint32_t misa;
     uint32_t tab[4];
@@ -628,6 +962,16 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
             *q++ = 'a' + i;
     }
     *q = '\0';
+    pstrcat(isa_string, sizeof(isa_string), "_zicclsm_zihintpause");
+    if (misa & (1 << ('F' - 'A')))
+        pstrcat(isa_string, sizeof(isa_string), "_zfh_zfhmin");
+    if (m->rng_dev)
+        pstrcat(isa_string, sizeof(isa_string), "_zkr");
+    if (m->aia_enable)
+        pstrcat(isa_string, sizeof(isa_string), "_smaia_ssaia");
+    pstrcat(isa_string, sizeof(isa_string), "_sscofpmf");
+    if (max_xlen >= 64)
+        pstrcat(isa_string, sizeof(isa_string), "_svnapot");
     fdt_prop_str(s, "riscv,isa", isa_string);
     
     fdt_prop_str(s, "mmu-type", max_xlen <= 32 ? "riscv,sv32" : "riscv,sv48");
@@ -645,6 +989,46 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
     
     fdt_end_node(s); /* cpus */
 
+    /* SBI PMU events: generic events, then cache events (type 1) */
+    {
+        static const uint32_t event_to_mhpmevent[] = {
+            0x00001, 0, HPM_EVENT_CYCLES,
+            0x00002, 0, HPM_EVENT_INSTRET,
+            0x00005, 0, HPM_EVENT_BRANCH,
+            0x10000, 0, HPM_EVENT_LOAD, /* L1D read access */
+            0x10002, 0, HPM_EVENT_STORE, /* L1D write access */
+            0x10019, 0, HPM_EVENT_DTLB_LOAD_MISS,
+            0x1001b, 0, HPM_EVENT_DTLB_STORE_MISS,
+            0x10021, 0, HPM_EVENT_ITLB_MISS,
+        };
+        static const uint32_t event_to_mhpmcounters[] = {
+            0x00001, 0x00001, 0xfffffff9,
+            0x00002, 0x00002, 0xfffffffc,
+            0x00005, 0x00005, 0xfffffff8,
+            0x10000, 0x10000, 0xfffffff8,
+            0x10002, 0x10002, 0xfffffff8,
+            0x10019, 0x10019, 0xfffffff8,
+            0x1001b, 0x1001b, 0xfffffff8,
+            0x10021, 0x10021, 0xfffffff8,
+        };
+        /* the raw events are the mhpmevent values */
+        static const uint32_t raw_event_to_mhpmcounters[] = {
+            0, 0, 0xffffffff, 0xffffff00, 0xfffffff8,
+        };
+        fdt_begin_node(s, "pmu");
+        fdt_prop_str(s, "compatible", "riscv,pmu");
+        fdt_prop_tab_u32(s, "riscv,event-to-mhpmevent",
+                         event_to_mhpmevent,
+                         countof(event_to_mhpmevent));
+        fdt_prop_tab_u32(s, "riscv,event-to-mhpmcounters",
+                         event_to_mhpmcounters,
+                         countof(event_to_mhpmcounters));
+        fdt_prop_tab_u32(s, "riscv,raw-event-to-mhpmcounters",
+                         raw_event_to_mhpmcounters,
+                         countof(raw_event_to_mhpmcounters));
+        fdt_end_node(s); /* pmu */
+    }
+
     fdt_begin_node_num(s, "memory", RAM_BASE_ADDR);
     fdt_prop_str(s, "device_type", "memory");
     tab[0] = (uint64_t)RAM_BASE_ADDR >> 32;
@@ -679,23 +1063,61 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
     
     fdt_end_node(s); /* clint */
 
-    fdt_begin_node_num(s, "plic", PLIC_BASE_ADDR);
-    fdt_prop_u32(s, "#interrupt-cells", 1);
-    fdt_prop(s, "interrupt-controller", NULL, 0);
-    fdt_prop_str(s, "compatible", "riscv,plic0");
-    fdt_prop_u32(s, "riscv,ndev", 31);
-    fdt_prop_tab_u64_2(s, "reg", PLIC_BASE_ADDR, PLIC_SIZE);
-
-    tab[0] = intc_phandle;
-    tab[1] = 9; /* S ext irq */
-    tab[2] = intc_phandle;
-    tab[3] = 11; /* M ext irq */
-    fdt_prop_tab_u32(s, "interrupts-extended", tab, 4);
-
-    plic_phandle = cur_phandle++;
-    fdt_prop_u32(s, "phandle", plic_phandle);
-
-    fdt_end_node(s); /* plic */
+    fdt_begin_node_num(s, "test", SYSCON_BASE_ADDR);
+    fdt_prop_tab_str(s, "compatible",
+                     "sifive,test1", "sifive,test0", "syscon", NULL);
+    fdt_prop_tab_u64_2(s, "reg", SYSCON_BASE_ADDR, SYSCON_SIZE);
+    syscon_phandle = cur_phandle++;
+    fdt_prop_u32(s, "phandle", syscon_phandle);
+    fdt_end_node(s); /* test */
+
+    if (m->aia_enable) {
+        /* only the S interrupt file is described: the M one is
+           reserved to the firmware */
+        fdt_begin_node_num(s, "imsics", IMSIC_S_BASE_ADDR);
+        fdt_prop_str(s, "compatible", "riscv,imsics");
+        fdt_prop_u32(s, "#interrupt-cells", 0);
+        fdt_prop(s, "interrupt-controller", NULL, 0);
+        fdt_prop(s, "msi-controller", NULL, 0);
+        fdt_prop_u32(s, "#msi-cells", 0);
+        fdt_prop_u32(s, "riscv,num-ids", IMSIC_NUM_IDS - 1);
+        fdt_prop_tab_u64_2(s, "reg", IMSIC_S_BASE_ADDR, IMSIC_SIZE);
+        tab[0] = intc_phandle;
+        tab[1] = 9; /* S ext irq */
+        fdt_prop_tab_u32(s, "interrupts-extended", tab, 2);
+        imsic_phandle = cur_phandle++;
+        fdt_prop_u32(s, "phandle", imsic_phandle);
+        fdt_end_node(s); /* imsics */
+
+        fdt_begin_node_num(s, "aplic", APLIC_BASE_ADDR);
+        fdt_prop_str(s, "compatible", "riscv,aplic");
+        fdt_prop_u32(s, "#interrupt-cells", 2);
+        fdt_prop(s, "interrupt-controller", NULL, 0);
+        fdt_prop_u32(s, "msi-parent", imsic_phandle);
+        fdt_prop_u32(s, "riscv,num-sources", 31);
+        fdt_prop_tab_u64_2(s, "reg", APLIC_BASE_ADDR, APLIC_SIZE);
+        plic_phandle = cur_phandle++;
+        fdt_prop_u32(s, "phandle", plic_phandle);
+        fdt_end_node(s); /* aplic */
+    } else {
+        fdt_begin_node_num(s, "plic", PLIC_BASE_ADDR);
+        fdt_prop_u32(s, "#interrupt-cells", 1);
+        fdt_prop(s, "interrupt-controller", NULL, 0);
+        fdt_prop_str(s, "compatible", "riscv,plic0");
+        fdt_prop_u32(s, "riscv,ndev", 31);
+        fdt_prop_tab_u64_2(s, "reg", PLIC_BASE_ADDR, PLIC_SIZE);
+        
+        tab[0] = intc_phandle;
+        tab[1] = 9; /* S ext irq */
+        tab[2] = intc_phandle;
+        tab[3] = 11; /* M ext irq */
+        fdt_prop_tab_u32(s, "interrupts-extended", tab, 4);
+        
+        plic_phandle = cur_phandle++;
+        fdt_prop_u32(s, "phandle", plic_phandle);
+        
+        fdt_end_node(s); /* plic */
+    }
     
     for(i = 0; i < m->virtio_count; i++) {
         fdt_begin_node_num(s, "virtio", VIRTIO_BASE_ADDR + i * VIRTIO_SIZE);
@@ -704,7 +1126,12 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
                            VIRTIO_SIZE);
         tab[0] = plic_phandle;
         tab[1] = VIRTIO_IRQ + i;
-        fdt_prop_tab_u32(s, "interrupts-extended", tab, 2);
+        if (m->aia_enable) {
+            tab[2] = 4; /* level high */
+            fdt_prop_tab_u32(s, "interrupts-extended", tab, 3);
+        } else {
+            fdt_prop_tab_u32(s, "interrupts-extended", tab, 2);
+        }
         fdt_end_node(s); /* virtio */
     }
 
@@ -722,6 +1149,20 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
     
     fdt_end_node(s); /* soc */
 
+    fdt_begin_node(s, "reboot");
+    fdt_prop_str(s, "compatible", "syscon-reboot");
+    fdt_prop_u32(s, "regmap", syscon_phandle);
+    fdt_prop_u32(s, "offset", 0);
+    fdt_prop_u32(s, "value", SYSCON_RESET);
+    fdt_end_node(s); /* reboot */
+
+    fdt_begin_node(s, "poweroff");
+    fdt_prop_str(s, "compatible", "syscon-poweroff");
+    fdt_prop_u32(s, "regmap", syscon_phandle);
+    fdt_prop_u32(s, "offset", 0);
+    fdt_prop_u32(s, "value", SYSCON_PASS);
+    fdt_end_node(s); /* poweroff */
+
     fdt_begin_node(s, "chosen");
     fdt_prop_str(s, "bootargs", cmd_line ? cmd_line : "");
     if (kernel_size > 0) {
@@ -751,49 +1192,59 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst,
     return size;
 }
 
-static void copy_bios(RISCVMachine *s, const uint8_t *buf, int buf_len,
-                      const uint8_t *kernel_buf, int kernel_buf_len,
-                      const uint8_t *initrd_buf, int initrd_buf_len,
+/* copy a file at 'offset' in the RAM or map it in place if possible */
+static void copy_file_to_ram(RISCVMachine *s, uint64_t offset,
+                             const VMFileEntry *fe)
+{
+    PhysMemoryRange *pr;
+
+    pr = get_phys_mem_range(s->mem_map, RAM_BASE_ADDR);
+    if (fe->is_mmap && phys_mem_map_file(pr, offset, fe->fd, fe->len) == 0)
+        return;
+    memcpy(pr->phys_mem + offset, fe->buf, fe->len);
+}
+
+static void copy_bios(RISCVMachine *s, const VMFileEntry *bios,
+                      const VMFileEntry *kernel, const VMFileEntry *initrd,
                       const char *cmd_line)
 {
-    uint32_t fdt_addr, align, kernel_base, initrd_base;
+    uint64_t kernel_base, initrd_base, align;
+    uint32_t fdt_addr;
     uint8_t *ram_ptr;
     uint32_t *q;
 
-    if (buf_len > s->ram_size) {
+    if (bios->len > s->ram_size) {
         vm_error("BIOS too big\n");
         exit(1);
     }
-
-    ram_ptr = get_ram_ptr(s, RAM_BASE_ADDR, TRUE);
-    memcpy(ram_ptr, buf, buf_len);
+    copy_file_to_ram(s, 0, bios);
 
     kernel_base = 0;
-    if (kernel_buf_len > 0) {
+    if (kernel->len > 0) {
         /* copy the kernel if present */
         if (s->max_xlen == 32)
             align = 4 << 20; /* 4 MB page align */
         else
             align = 2 << 20; /* 2 MB page align */
-        kernel_base = (buf_len + align - 1) & ~(align - 1);
-        memcpy(ram_ptr + kernel_base, kernel_buf, kernel_buf_len);
-        if (kernel_buf_len + kernel_base > s->ram_size) {
+        kernel_base = (bios->len + align - 1) & ~(align - 1);
+        if (kernel->len + kernel_base > s->ram_size) {
             vm_error("kernel too big");
             exit(1);
         }
+        copy_file_to_ram(s, kernel_base, kernel);
     }
 
     initrd_base = 0;
-    if (initrd_buf_len > 0) {
+    if (initrd->len > 0) {
         /* same allocation as QEMU */
         initrd_base = s->ram_size / 2;
         if (initrd_base > (128 << 20))
             initrd_base = 128 << 20;
-        memcpy(ram_ptr + initrd_base, initrd_buf, initrd_buf_len);
-        if (initrd_buf_len + initrd_base > s->ram_size) {
+        if (initrd->len + initrd_base > s->ram_size) {
             vm_error("initrd too big");
             exit(1);
         }
+        copy_file_to_ram(s, initrd_base, initrd);
     }
     
     ram_ptr = get_ram_ptr(s, 0, TRUE);
@@ -801,8 +1252,8 @@ static void copy_bios(RISCVMachine *s, const uint8_t *buf, int buf_len,
     fdt_addr = 0x1000 + 8 * 8;
 
     riscv_build_fdt(s, ram_ptr + fdt_addr,
-                    RAM_BASE_ADDR + kernel_base, kernel_buf_len,
-                    RAM_BASE_ADDR + initrd_base, initrd_buf_len,
+                    RAM_BASE_ADDR + kernel_base, kernel->len,
+                    RAM_BASE_ADDR + initrd_base, initrd->len,
                     cmd_line);
 
     /* jump_addr = 0x80000000 */
@@ -824,6 +1275,36 @@ static void riscv_flush_tlb_write_range(void *opaque, uint8_t *ram_addr,
 
 static void riscv_machine_set_defaults(VirtMachineParams *p)
 {
+    p->rng_enable = TRUE;
+}
+
+/* parse an ISA string such as "rv64gc" or "rv64imac". Return the
+   misa extension bits or 0 if error. The multi-letter extensions
+   are ignored. */
+static uint32_t parse_isa_string(const char *str, int max_xlen)
+{
+    char *p;
+    uint32_t misa;
+    int c;
+
+    if (tolower((unsigned char)str[0]) != 'r' ||
+        tolower((unsigned char)str[1]) != 'v')
+        return 0;
+    if (strtoul(str + 2, &p, 10) != max_xlen)
+        return 0;
+    misa = 0;
+    while (*p != '\0' && *p != '_') {
+        c = tolower((unsigned char)*p++);
+        if (c == 'g') {
+            misa |= (1 << ('i' - 'a')) | (1 << ('m' - 'a')) |
+                (1 << ('a' - 'a')) | (1 << ('f' - 'a')) | (1 << ('d' - 'a'));
+        } else if (c >= 'a' && c <= 'z') {
+            misa |= 1 << (c - 'a');
+        } else {
+            return 0;
+        }
+    }
+    return misa;
 }
 
 static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
@@ -831,6 +1312,7 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
     RISCVMachine *s;
     VIRTIODevice *blk_dev;
     int irq_num, i, max_xlen, ram_flags;
+    uint32_t misa;
     VIRTIOBusDef vbus_s, *vbus = &vbus_s;
 
 
@@ -854,14 +1336,39 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
     s->mem_map->opaque = s;
     s->mem_map->flush_tlb_write_range = riscv_flush_tlb_write_range;
 
-    s->cpu_state = riscv_cpu_init(s->mem_map, max_xlen);
+    misa = 0;
+    if (p->isa) {
+        misa = parse_isa_string(p->isa, max_xlen);
+        if (misa == 0) {
+            vm_error("invalid ISA string for %s: %s\n", p->machine_name, p->isa);
+            return NULL;
+        }
+    }
+    s->cpu_state = riscv_cpu_init(s->mem_map, max_xlen, misa);
     if (!s->cpu_state) {
-        vm_error("unsupported max_xlen=%d\n", max_xlen);
+        if (p->isa)
+            vm_error("unsupported ISA: %s\n", p->isa);
+        else
+            vm_error("unsupported max_xlen=%d\n", max_xlen);
         /* XXX: should free resources */
         return NULL;
     }
     /* RAM */
     ram_flags = 0;
+    if (p->ram_merge)
+        ram_flags |= DEVRAM_FLAG_MERGEABLE;
+#ifdef CONFIG_VHOST_USER
+    /* the external backends need to access the guest RAM */
+    for(i = 0; i < p->eth_count; i++) {
+        if (!strcmp(p->tab_eth[i].driver, "vhost-user"))
+            ram_flags |= DEVRAM_FLAG_SHARED;
+    }
+    for(i = 0; i < p->drive_count; i++) {
+        if (p->tab_drive[i].device &&
+            !strcmp(p->tab_drive[i].device, "vhost-user"))
+            ram_flags |= DEVRAM_FLAG_SHARED;
+    }
+#endif
     cpu_register_ram(s->mem_map, RAM_BASE_ADDR, p->ram_size, ram_flags);
     cpu_register_ram(s->mem_map, 0x00000000, LOW_RAM_SIZE, 0);
     s->rtc_real_time = p->rtc_real_time;
@@ -869,12 +1376,28 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
         s->rtc_start_time = rtc_get_real_time(s);
     }
     
+    cpu_register_device(s->mem_map, SYSCON_BASE_ADDR, SYSCON_SIZE, s,
+                        syscon_read, syscon_write, DEVIO_SIZE32);
     cpu_register_device(s->mem_map, CLINT_BASE_ADDR, CLINT_SIZE, s,
                         clint_read, clint_write, DEVIO_SIZE32);
-    cpu_register_device(s->mem_map, PLIC_BASE_ADDR, PLIC_SIZE, s,
-                        plic_read, plic_write, DEVIO_SIZE32);
-    for(i = 1; i < 32; i++) {
-        irq_init(&s->plic_irq[i], plic_set_irq, s, i);
+    s->aia_enable = p->aia_enable;
+    if (s->aia_enable) {
+        riscv_cpu_set_aia(s->cpu_state, TRUE);
+        cpu_register_device(s->mem_map, IMSIC_M_BASE_ADDR, IMSIC_SIZE, s,
+                            imsic_read, imsic_m_write, DEVIO_SIZE32);
+        cpu_register_device(s->mem_map, IMSIC_S_BASE_ADDR, IMSIC_SIZE, s,
+                            imsic_read, imsic_s_write, DEVIO_SIZE32);
+        cpu_register_device(s->mem_map, APLIC_BASE_ADDR, APLIC_SIZE, s,
+                            aplic_read, aplic_write, DEVIO_SIZE32);
+        for(i = 1; i < 32; i++) {
+            irq_init(&s->plic_irq[i], aplic_set_irq, s, i);
+        }
+    } else {
+        cpu_register_device(s->mem_map, PLIC_BASE_ADDR, PLIC_SIZE, s,
+                            plic_read, plic_write, DEVIO_SIZE32);
+        for(i = 1; i < 32; i++) {
+            irq_init(&s->plic_irq[i], plic_set_irq, s, i);
+        }
     }
 
     cpu_register_device(s->mem_map, HTIF_BASE_ADDR, 16,
@@ -890,29 +1413,54 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
     if (p->console) {
         vbus->irq = &s->plic_irq[irq_num];
         s->common.console_dev = virtio_console_init(vbus, p->console);
+        if (p->log_console) {
+            virtio_console_add_port(s->common.console_dev, VM_LOG_PORT_NAME,
+                                    p->log_console);
+        }
         vbus->addr += VIRTIO_SIZE;
         irq_num++;
-        s->virtio_count++;
+        s->virtio_dev[s->virtio_count++] = s->common.console_dev;
     }
     
     /* virtio net device */
     for(i = 0; i < p->eth_count; i++) {
+        VIRTIODevice *net_dev;
         vbus->irq = &s->plic_irq[irq_num];
-        virtio_net_init(vbus, p->tab_eth[i].net);
-        s->common.net = p->tab_eth[i].net;
+#ifdef CONFIG_VHOST_USER
+        if (!strcmp(p->tab_eth[i].driver, "vhost-user")) {
+            net_dev = virtio_vhost_user_init(vbus, 1,
+                                             p->tab_eth[i].socket_path);
+            if (!net_dev)
+                exit(1);
+        } else
+#endif
+        {
+            net_dev = virtio_net_init(vbus, p->tab_eth[i].net);
+            s->common.net = p->tab_eth[i].net;
+        }
         vbus->addr += VIRTIO_SIZE;
         irq_num++;
-        s->virtio_count++;
+        s->virtio_dev[s->virtio_count++] = net_dev;
     }
 
     /* virtio block device */
     for(i = 0; i < p->drive_count; i++) {
         vbus->irq = &s->plic_irq[irq_num];
-        blk_dev = virtio_block_init(vbus, p->tab_drive[i].block_dev);
-        (void)blk_dev;
+#ifdef CONFIG_VHOST_USER
+        if (p->tab_drive[i].device &&
+            !strcmp(p->tab_drive[i].device, "vhost-user")) {
+            blk_dev = virtio_vhost_user_init(vbus, 2,
+                                             p->tab_drive[i].filename);
+            if (!blk_dev)
+                exit(1);
+        } else
+#endif
+        {
+            blk_dev = virtio_block_init(vbus, p->tab_drive[i].block_dev);
+        }
         vbus->addr += VIRTIO_SIZE;
         irq_num++;
-        s->virtio_count++;
+        s->virtio_dev[s->virtio_count++] = blk_dev;
     }
 
     /* virtio filesystem */
@@ -921,11 +1469,10 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
         vbus->irq = &s->plic_irq[irq_num];
         fs_dev = virtio_9p_init(vbus, p->tab_fs[i].fs_dev,
                                 p->tab_fs[i].tag);
-        (void)fs_dev;
         //        virtio_set_debug(fs_dev, VIRTIO_DEBUG_9P);
         vbus->addr += VIRTIO_SIZE;
         irq_num++;
-        s->virtio_count++;
+        s->virtio_dev[s->virtio_count++] = fs_dev;
     }
 
     if (p->display_device) {
@@ -951,36 +1498,95 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
                                                 VIRTIO_INPUT_TYPE_KEYBOARD);
             vbus->addr += VIRTIO_SIZE;
             irq_num++;
-            s->virtio_count++;
+            s->virtio_dev[s->virtio_count++] = s->keyboard_dev;
 
             vbus->irq = &s->plic_irq[irq_num];
             s->mouse_dev = virtio_input_init(vbus,
                                              VIRTIO_INPUT_TYPE_TABLET);
             vbus->addr += VIRTIO_SIZE;
             irq_num++;
-            s->virtio_count++;
+            s->virtio_dev[s->virtio_count++] = s->mouse_dev;
         } else {
             vm_error("unsupported input device: %s\n", p->input_device);
             exit(1);
         }
     }
+
+    /* entropy device and Zkr seed CSR */
+    if (p->rng_enable && p->rng) {
+        vbus->irq = &s->plic_irq[irq_num];
+        s->rng_dev = virtio_rng_init(vbus, p->rng);
+        vbus->addr += VIRTIO_SIZE;
+        irq_num++;
+        s->virtio_dev[s->virtio_count++] = s->rng_dev;
+        riscv_cpu_set_rng(s->cpu_state, p->rng);
+    }
     
     if (!p->files[VM_FILE_BIOS].buf) {
         vm_error("No bios found");
     }
 
-    copy_bios(s, p->files[VM_FILE_BIOS].buf, p->files[VM_FILE_BIOS].len,
-              p->files[VM_FILE_KERNEL].buf, p->files[VM_FILE_KERNEL].len,
-              p->files[VM_FILE_INITRD].buf, p->files[VM_FILE_INITRD].len,
-              p->cmdline);
+    /* the configuration is freed after the init */
+    for(i = 0; i < VM_FILE_COUNT; i++) {
+        vm_file_dup(&s->files[i], &p->files[i]);
+    }
+    if (p->cmdline)
+        s->cmdline = strdup(p->cmdline);
+
+    copy_bios(s, &s->files[VM_FILE_BIOS], &s->files[VM_FILE_KERNEL],
+              &s->files[VM_FILE_INITRD], s->cmdline);
     
     return (VirtMachine *)s;
 }
 
+/* warm reboot: the machine is put back in its power-on state in
+   place, without reallocating the RAM or reloading the files */
+static void riscv_machine_reset(RISCVMachine *s)
+{
+    int i;
+
+    /* the pending asynchronous requests would write to the new
+       guest memory */
+    for(i = 0; i < s->virtio_count; i++) {
+        if (virtio_is_busy(s->virtio_dev[i]))
+            return;
+    }
+    s->reset_request = FALSE;
+
+    for(i = 0; i < s->virtio_count; i++) {
+        virtio_reset_device(s->virtio_dev[i]);
+    }
+
+    s->timecmp = 0;
+    if (s->rtc_real_time)
+        s->rtc_start_time = rtc_get_real_time(s);
+    s->plic_pending_irq = 0;
+    s->plic_served_irq = 0;
+    s->aplic_domaincfg = 0;
+    memset(s->aplic_sourcecfg, 0, sizeof(s->aplic_sourcecfg));
+    memset(s->aplic_target, 0, sizeof(s->aplic_target));
+    memset(s->aplic_msiaddrcfg, 0, sizeof(s->aplic_msiaddrcfg));
+    s->aplic_pending = 0;
+    s->aplic_enabled = 0;
+    s->htif_tohost = 0;
+    s->htif_fromhost = 0;
+
+    phys_mem_map_clear_ram(s->mem_map);
+    riscv_cpu_reset(s->cpu_state);
+
+    copy_bios(s, &s->files[VM_FILE_BIOS], &s->files[VM_FILE_KERNEL],
+              &s->files[VM_FILE_INITRD], s->cmdline);
+}
+
 static void riscv_machine_end(VirtMachine *s1)
 {
     RISCVMachine *s = (RISCVMachine *)s1;
+    int i;
     /* XXX: stop all */
+    for(i = 0; i < VM_FILE_COUNT; i++) {
+        vm_file_free(&s->files[i]);
+    }
+    free(s->cmdline);
     riscv_cpu_end(s->cpu_state);
     phys_mem_map_end(s->mem_map);
     free(s);
@@ -1006,7 +1612,10 @@ static int riscv_machine_get_sleep_duration(VirtMachine *s1, int delay)
                 delay = delay1;
         }
     }
-    if (!riscv_cpu_get_power_down(s))
+    /* a spinning CPU waits for the next event. Only done if the RTC
+       follows the host time, otherwise the guest time would stop. */
+    if (!riscv_cpu_get_power_down(s) &&
+        !(m->rtc_real_time && riscv_cpu_get_spin_wait(s)))
         delay = 0;
     return delay;
 }
@@ -1015,6 +1624,14 @@ static void riscv_machine_interp(VirtMachine *s1, int max_exec_cycle)
 {
     RISCVMachine *s = (RISCVMachine *)s1;
     riscv_cpu_interp(s->cpu_state, max_exec_cycle);
+    if (s->reset_request)
+        riscv_machine_reset(s);
+}
+
+static uint64_t riscv_machine_get_insn_counter(VirtMachine *s1)
+{
+    RISCVMachine *s = (RISCVMachine *)s1;
+    return riscv_cpu_get_cycles(s->cpu_state);
 }
 
 static void riscv_vm_send_key_event(VirtMachine *s1, BOOL is_down,
@@ -1050,4 +1667,5 @@ const VirtMachineClass riscv_machine_class = {
     riscv_vm_mouse_is_absolute,
     riscv_vm_send_mouse_event,
     riscv_vm_send_key_event,
+    riscv_machine_get_insn_counter,
 };
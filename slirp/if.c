@@ -112,6 +112,7 @@ diddit:
 		/* Update *_queued */
 		so->so_queued++;
 		so->so_nqueued++;
+		sochanged(so);
 		/*
 		 * Check if the interactive session should be downgraded to
 		 * the batchq.  A session is downgraded if it has queued 6
@@ -194,6 +195,7 @@ if_start(Slirp *slirp)
 
 	/* Update so_queued */
 	if (ifm->ifq_so) {
+		sochanged(ifm->ifq_so);
 		if (--ifm->ifq_so->so_queued == 0)
 		   /* If there's no more queued, reset nqueued */
 		   ifm->ifq_so->so_nqueued = 0;
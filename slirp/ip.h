@@ -175,6 +175,7 @@ struct	ip_timestamp {
 #define	MAXTTL		255		/* maximum time to live (seconds) */
 #define	IPDEFTTL	64		/* default ttl, from RFC 1340 */
 #define	IPFRAGTTL	60		/* time to live for frags, slowhz */
+#define	IPQ_HASH_SIZE	256		/* size of the reass. queue hash table */
 #define	IPTTLDEC	1		/* subtracted when forwarding */
 
 #define	IP_MSS		576		/* default maximum segment size */
@@ -208,14 +209,15 @@ struct ipovly {
 /*
  * Ip reassembly queue structure.  Each fragment
  * being reassembled is attached to one of these structures.
- * They are timed out after ipq_ttl drops to 0, and may also
+ * They are timed out when tcp_now reaches ipq_expire, and may also
  * be reclaimed if memory becomes tight.
- * size 28 bytes
+ * size 44 bytes
  */
 struct ipq {
         struct qlink frag_link;			/* to ip headers of fragments */
 	struct qlink ip_link;				/* to other reass headers */
-	uint8_t	ipq_ttl;		/* time for reass q to live */
+	struct qlink hash_link;			/* to reass headers with same hash */
+	uint32_t ipq_expire;		/* tcp_now when the reass q dies */
 	uint8_t	ipq_p;			/* protocol of this fragment */
 	uint16_t	ipq_id;			/* sequence id for reassembly */
 	struct	in_addr ipq_src,ipq_dst;
@@ -45,6 +45,14 @@
         const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
         (type *)( (char *)__mptr - offsetof(type,member) );})
 
+/* hash of the reassembly queue of a fragment */
+static inline int ipq_hash(struct ip *ip)
+{
+    uint32_t h = ip->ip_src.s_addr ^ ip->ip_dst.s_addr ^
+        ((uint32_t)ip->ip_id << 8) ^ ip->ip_p;
+    return ((h * 0x9e3779b1) >> 16) & (IPQ_HASH_SIZE - 1);
+}
+
 static struct ip *ip_reass(Slirp *slirp, struct ip *ip, struct ipq *fp);
 static void ip_freef(Slirp *slirp, struct ipq *fp);
 static void ip_enq(register struct ipasfrag *p,
@@ -58,7 +66,12 @@ static void ip_deq(register struct ipasfrag *p);
 void
 ip_init(Slirp *slirp)
 {
+    int i;
+
     slirp->ipq.ip_link.next = slirp->ipq.ip_link.prev = &slirp->ipq.ip_link;
+    for (i = 0; i < IPQ_HASH_SIZE; i++) {
+        slirp->ipq_hash[i].next = slirp->ipq_hash[i].prev = &slirp->ipq_hash[i];
+    }
     udp_init(slirp);
     tcp_init(slirp);
 }
@@ -168,9 +181,10 @@ ip_input(struct mbuf *m)
 		 * Look for queue of fragments
 		 * of this datagram.
 		 */
-		for (l = slirp->ipq.ip_link.next; l != &slirp->ipq.ip_link;
-		     l = l->next) {
-            fp = container_of(l, struct ipq, ip_link);
+		struct qlink *head = &slirp->ipq_hash[ipq_hash(ip)];
+
+		for (l = head->next; l != head; l = l->next) {
+            fp = container_of(l, struct ipq, hash_link);
             if (ip->ip_id == fp->ipq_id &&
                     ip->ip_src.s_addr == fp->ipq_src.s_addr &&
                     ip->ip_dst.s_addr == fp->ipq_dst.s_addr &&
@@ -272,7 +286,8 @@ ip_reass(Slirp *slirp, struct ip *ip, struct ipq *fp)
 	  }
 	  fp = mtod(t, struct ipq *);
 	  insque(&fp->ip_link, &slirp->ipq.ip_link);
-	  fp->ipq_ttl = IPFRAGTTL;
+	  insque(&fp->hash_link, &slirp->ipq_hash[ipq_hash(ip)]);
+	  fp->ipq_expire = slirp->tcp_now + IPFRAGTTL;
 	  fp->ipq_p = ip->ip_p;
 	  fp->ipq_id = ip->ip_id;
 	  fp->frag_link.next = fp->frag_link.prev = &fp->frag_link;
@@ -380,6 +395,7 @@ insert:
 	ip->ip_src = fp->ipq_src;
 	ip->ip_dst = fp->ipq_dst;
 	remque(&fp->ip_link);
+	remque(&fp->hash_link);
 	(void) m_free(dtom(slirp, fp));
 	m->m_len += (ip->ip_hl << 2);
 	m->m_data -= (ip->ip_hl << 2);
@@ -406,6 +422,7 @@ ip_freef(Slirp *slirp, struct ipq *fp)
 		m_freem(dtom(slirp, q));
 	}
 	remque(&fp->ip_link);
+	remque(&fp->hash_link);
 	(void) m_free(dtom(slirp, fp));
 }
 
@@ -437,7 +454,8 @@ ip_deq(register struct ipasfrag *p)
 /*
  * IP timer processing;
  * if a timer expires on a reassembly
- * queue, discard it.
+ * queue, discard it.  The queues all live IPFRAGTTL ticks and are
+ * kept newest first, so only the expired ones at the tail are visited.
  */
 void
 ip_slowtimo(Slirp *slirp)
@@ -446,17 +464,17 @@ ip_slowtimo(Slirp *slirp)
 
 	DEBUG_CALL("ip_slowtimo");
 
-    l = slirp->ipq.ip_link.next;
+    l = slirp->ipq.ip_link.prev;
 
         if (l == NULL)
 	   return;
 
     while (l != &slirp->ipq.ip_link) {
         struct ipq *fp = container_of(l, struct ipq, ip_link);
-        l = l->next;
-		if (--fp->ipq_ttl == 0) {
-			ip_freef(slirp, fp);
-		}
+        l = l->prev;
+		if ((int32_t)(fp->ipq_expire - slirp->tcp_now) > 0)
+			break;
+		ip_freef(slirp, fp);
     }
 }
 
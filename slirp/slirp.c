@@ -33,9 +33,6 @@ static const uint8_t special_ethaddr[6] = {
 
 static const uint8_t zero_ethaddr[6] = { 0, 0, 0, 0, 0, 0 };
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
-
 u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
 static int do_slowtimo;
@@ -222,11 +219,25 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+#ifdef HAVE_EPOLL
+    slirp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (slirp->epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+#endif
+
     return slirp;
 }
 
 void slirp_cleanup(Slirp *slirp)
 {
+#ifdef HAVE_RECVMMSG
+    free(slirp->udp_rx_overflow);
+#endif
+#ifdef HAVE_EPOLL
+    close(slirp->epoll_fd);
+#endif
     free(slirp->tftp_prefix);
     free(slirp->bootp_filename);
     free(slirp);
@@ -236,134 +247,286 @@ void slirp_cleanup(Slirp *slirp)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
-void slirp_select_fill(Slirp *slirp, int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds)
+/*
+ * Events to poll for a socket
+ */
+static int so_poll_events(struct socket *so)
 {
-    struct socket *so, *so_next;
-    int nfds;
+    int events;
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
+    /*
+     * NOFDREF can include still connecting to local-host,
+     * newly socreated() sockets etc. Don't want to select these.
+     */
+    if (so->so_state & SS_NOFDREF || so->s == -1)
+        return 0;
 
-    nfds = *pnfds;
-	/*
-	 * First, TCP sockets
-	 */
-	do_slowtimo = 0;
+    if (so->so_tcpcb) {
+        /*
+         * Set for reading sockets which are accepting
+         */
+        if (so->so_state & SS_FACCEPTCONN)
+            return SO_EV_READ;
+
+        /*
+         * Set for writing sockets which are connecting
+         */
+        if (so->so_state & SS_ISFCONNECTING)
+            return SO_EV_WRITE;
+
+        events = 0;
+        /*
+         * Set for writing if we are connected, can send more, and
+         * we have something to send
+         */
+        if (CONN_CANFSEND(so) && so->so_rcv.sb_cc)
+            events |= SO_EV_WRITE;
+
+        /*
+         * Set for reading (and urgent data) if we are connected, can
+         * receive more, and we have room for it XXX /2 ?
+         */
+        if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2)))
+            events |= SO_EV_READ | SO_EV_EXCEPT;
+        return events;
+    } else {
+        /*
+         * When UDP packets are received from over the
+         * link, they're sendto()'d straight away, so
+         * no need for setting for writing
+         * Limit the number of packets queued by this session
+         * to 4.  Note that even though we try and limit this
+         * to 4 packets, the session could have more queued
+         * if the packets needed to be fragmented
+         * (XXX <= 4 ?)
+         */
+        if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4)
+            return SO_EV_READ;
+        return 0;
+    }
+}
 
-	{
-		/*
-		 * *_slowtimo needs calling if there are IP fragments
-		 * in the fragment queue, or there are TCP connections active
-		 */
-		do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
-		    (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
+#ifdef HAVE_EPOLL
 
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
+/* maximum number of socket events handled by slirp_select_poll() */
+#define SLIRP_POLL_EVENTS 256
 
-			/*
-			 * See if we need a tcp_fasttimo
-			 */
-			if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
-			   time_fasttimo = curtime; /* Flag when we want a fasttimo */
+static void so_update_events(Slirp *slirp, struct socket *so)
+{
+    struct epoll_event ev;
+    int events, op;
 
-			/*
-			 * NOFDREF can include still connecting to local-host,
-			 * newly socreated() sockets etc. Don't want to select these.
-	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
+    events = so_poll_events(so);
+    if (events == so->so_events)
+        return;
+    if (events == 0) {
+        if (so->s >= 0)
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->s, NULL);
+    } else {
+        ev.events = ((events & SO_EV_READ) ? EPOLLIN : 0) |
+            ((events & SO_EV_WRITE) ? EPOLLOUT : 0) |
+            ((events & SO_EV_EXCEPT) ? EPOLLPRI : 0);
+        ev.data.ptr = so;
+        op = so->so_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+            /* the fd was replaced (SS_FACCEPTONCE) or closed */
+            if (errno == ENOENT)
+                op = EPOLL_CTL_ADD;
+            else if (errno == EEXIST)
+                op = EPOLL_CTL_MOD;
+            else
+                return;
+            if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0)
+                return;
+        }
+    }
+    so->so_events = events;
+}
 
-			/*
-			 * Set for reading sockets which are accepting
-			 */
-			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-				continue;
-			}
+#endif
 
-			/*
-			 * Set for writing sockets which are connecting
-			 */
-			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-				continue;
-			}
+void slirp_select_fill(Slirp *slirp, int *pnfds,
+                       fd_set *readfds, fd_set *writefds, fd_set *xfds)
+{
+    struct socket *so;
+    int nfds;
 
-			/*
-			 * Set for writing if we are connected, can send more, and
-			 * we have something to send
-			 */
-			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-			}
+#ifdef HAVE_SENDMMSG
+    /* send the UDP datagrams queued since the last call */
+    if (slirp->udp_tx_count > 0)
+        sosendto_flush(slirp);
+#endif
 
-			/*
-			 * Set for reading (and urgent data) if we are connected, can
-			 * receive more, and we have room for it XXX /2 ?
-			 */
-			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
-			}
-		}
+    nfds = *pnfds;
+
+    /*
+     * *_slowtimo needs calling if there are IP fragments
+     * in the fragment queue, TCP connections active or
+     * sockets waiting to expire
+     */
+    do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
+                   (&slirp->ipq.ip_link != slirp->ipq.ip_link.next) ||
+                   slirp->so_wheel_count != 0);
+
+    /*
+     * See if we need a tcp_fasttimo
+     */
+    if (time_fasttimo == 0 && slirp->tcp_delack)
+        time_fasttimo = curtime; /* Flag when we want a fasttimo */
+
+#ifdef HAVE_EPOLL
+    /*
+     * The sockets are in an epoll set: only the ones whose state
+     * changed are visited.
+     */
+    while ((so = slirp->so_dirty) != NULL) {
+        if ((slirp->so_dirty = so->so_dnext) != NULL)
+            so->so_dnext->so_dprev = &slirp->so_dirty;
+        so->so_dprev = NULL;
+        so_update_events(slirp, so);
+    }
+    FD_SET(slirp->epoll_fd, readfds);
+    UPD_NFDS(slirp->epoll_fd);
+#else
+    {
+        struct socket *head;
+        int events, i;
+
+        for (i = 0; i < 2; i++) {
+            head = (i == 0) ? &slirp->tcb : &slirp->udb;
+            for (so = head->so_next; so != head; so = so->so_next) {
+                events = so_poll_events(so);
+                if (events == 0)
+                    continue;
+                if (events & SO_EV_READ)
+                    FD_SET(so->s, readfds);
+                if (events & SO_EV_WRITE)
+                    FD_SET(so->s, writefds);
+                if (events & SO_EV_EXCEPT)
+                    FD_SET(so->s, xfds);
+                UPD_NFDS(so->s);
+            }
+        }
+    }
+#endif
+
+    *pnfds = nfds;
+}
 
+/*
+ * Handle the so_revents of a TCP socket
+ */
+static void tcp_poll_socket(struct socket *so)
+{
+    int ret;
+
+	/*
+	 * Check for URG data
+	 * This will soread as well, so no need to
+	 * test for readfds below if this succeeds
+	 */
+	if (so->so_revents & SO_EV_EXCEPT)
+	   sorecvoob(so);
+	/*
+	 * Check sockets for reading
+	 */
+	else if (so->so_revents & SO_EV_READ) {
 		/*
-		 * UDP sockets
+		 * Check for incoming connections
 		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * See if it's timed out
-			 */
-			if (so->so_expire) {
-				if (so->so_expire <= curtime) {
-					udp_detach(so);
-					continue;
-				} else
-					do_slowtimo = 1; /* Let socket expire */
-			}
+		if (so->so_state & SS_FACCEPTCONN) {
+			tcp_connect(so);
+			return;
+		} /* else */
+		ret = soread(so);
+
+		/* Output it if we read something */
+		if (ret > 0)
+		   tcp_output(sototcpcb(so));
+	}
 
-			/*
-			 * When UDP packets are received from over the
-			 * link, they're sendto()'d straight away, so
-			 * no need for setting for writing
-			 * Limit the number of packets queued by this session
-			 * to 4.  Note that even though we try and limit this
-			 * to 4 packets, the session could have more queued
-			 * if the packets needed to be fragmented
-			 * (XXX <= 4 ?)
-			 */
-			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-			}
-		}
+	/*
+	 * Check sockets for writing
+	 */
+	if (so->so_revents & SO_EV_WRITE) {
+	  /*
+	   * Check for non-blocking, still-connecting sockets
+	   */
+	  if (so->so_state & SS_ISFCONNECTING) {
+	    /* Connected */
+	    so->so_state &= ~SS_ISFCONNECTING;
+
+	    ret = send(so->s, (const void *) &ret, 0, 0);
+	    if (ret < 0) {
+	      /* XXXXX Must fix, zero bytes is a NOP */
+	      if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		  errno == EINPROGRESS || errno == ENOTCONN)
+		return;
+
+	      /* else failed */
+	      so->so_state &= SS_PERSISTENT_MASK;
+	      so->so_state |= SS_NOFDREF;
+	    }
+	    /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+	    /*
+	     * Continue tcp_input
+	     */
+	    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+	    /* continue; */
+	  } else
+	    ret = sowrite(so);
+	  /*
+	   * XXXXX If we wrote something (a lot), there
+	   * could be a need for a window update.
+	   * In the worst case, the remote will send
+	   * a window probe to get things going again
+	   */
 	}
 
-        *pnfds = nfds;
+	/*
+	 * Probe a still-connecting, non-blocking socket
+	 * to check if it's still alive
+ 	 */
+#ifdef PROBE_CONN
+	if (so->so_state & SS_ISFCONNECTING) {
+	  ret = recv(so->s, (char *)&ret, 0,0);
+
+	  if (ret < 0) {
+	    /* XXX */
+	    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		errno == EINPROGRESS || errno == ENOTCONN)
+	      return; /* Still connecting, continue */
+
+	    /* else failed */
+	    so->so_state &= SS_PERSISTENT_MASK;
+	    so->so_state |= SS_NOFDREF;
+
+	    /* tcp_input will take care of it */
+	  } else {
+	    ret = send(so->s, &ret, 0,0);
+	    if (ret < 0) {
+	      /* XXX */
+	      if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		  errno == EINPROGRESS || errno == ENOTCONN)
+		return;
+	      /* else failed */
+	      so->so_state &= SS_PERSISTENT_MASK;
+	      so->so_state |= SS_NOFDREF;
+	    } else
+	      so->so_state &= ~SS_ISFCONNECTING;
+
+	  }
+	  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
+	} /* SS_ISFCONNECTING */
+#endif
 }
 
 void slirp_select_poll(Slirp *slirp,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error)
 {
-    struct socket *so, *so_next;
-    int ret;
-
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
+    struct socket *so;
 
     curtime = os_get_time_ms();
 
@@ -376,15 +539,55 @@ void slirp_select_poll(Slirp *slirp,
 			time_fasttimo = 0;
 		}
 		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
-			ip_slowtimo(slirp);
 			tcp_slowtimo(slirp);
+			ip_slowtimo(slirp);
 			last_slowtimo = curtime;
 		}
 
 	/*
 	 * Check sockets
 	 */
+#ifdef HAVE_EPOLL
+	if (!select_error && FD_ISSET(slirp->epoll_fd, readfds)) {
+		struct epoll_event events[SLIRP_POLL_EVENTS];
+		int i, n, ev;
+
+		n = epoll_wait(slirp->epoll_fd, events, SLIRP_POLL_EVENTS, 0);
+		if (n < 0)
+			n = 0;
+		/* the events of the sockets freed meanwhile are cleared */
+		slirp->poll_events = events;
+		slirp->poll_nevents = n;
+		for (i = 0; i < n; i++) {
+			so = events[i].data.ptr;
+			if (so == NULL || so->s == -1)
+				continue;
+			ev = events[i].events;
+			/* like select(), errors wake up the polled events */
+			if (ev & (EPOLLERR | EPOLLHUP))
+				so->so_revents = so->so_events;
+			else
+				so->so_revents = 0;
+			if (ev & EPOLLIN)
+				so->so_revents |= SO_EV_READ;
+			if (ev & EPOLLOUT)
+				so->so_revents |= SO_EV_WRITE;
+			if (ev & EPOLLPRI)
+				so->so_revents |= SO_EV_EXCEPT;
+			so->so_revents &= so->so_events;
+			sochanged(so);
+			if (so->so_tcpcb) {
+				if ((so->so_state & SS_NOFDREF) == 0)
+					tcp_poll_socket(so);
+			} else if (so->so_revents & SO_EV_READ)
+				sorecvfrom(so);
+		}
+		slirp->poll_nevents = 0;
+	}
+#else
 	if (!select_error) {
+		struct socket *so_next;
+
 		/*
 		 * Check TCP sockets
 		 */
@@ -399,106 +602,14 @@ void slirp_select_poll(Slirp *slirp,
 			if (so->so_state & SS_NOFDREF || so->s == -1)
 			   continue;
 
-			/*
-			 * Check for URG data
-			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
-			 */
+			so->so_revents = 0;
+			if (FD_ISSET(so->s, readfds))
+				so->so_revents |= SO_EV_READ;
+			if (FD_ISSET(so->s, writefds))
+				so->so_revents |= SO_EV_WRITE;
 			if (FD_ISSET(so->s, xfds))
-			   sorecvoob(so);
-			/*
-			 * Check sockets for reading
-			 */
-			else if (FD_ISSET(so->s, readfds)) {
-				/*
-				 * Check for incoming connections
-				 */
-				if (so->so_state & SS_FACCEPTCONN) {
-					tcp_connect(so);
-					continue;
-				} /* else */
-				ret = soread(so);
-
-				/* Output it if we read something */
-				if (ret > 0)
-				   tcp_output(sototcpcb(so));
-			}
-
-			/*
-			 * Check sockets for writing
-			 */
-			if (FD_ISSET(so->s, writefds)) {
-			  /*
-			   * Check for non-blocking, still-connecting sockets
-			   */
-			  if (so->so_state & SS_ISFCONNECTING) {
-			    /* Connected */
-			    so->so_state &= ~SS_ISFCONNECTING;
-
-			    ret = send(so->s, (const void *) &ret, 0, 0);
-			    if (ret < 0) {
-			      /* XXXXX Must fix, zero bytes is a NOP */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    }
-			    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-			    /*
-			     * Continue tcp_input
-			     */
-			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
-			}
-
-			/*
-			 * Probe a still-connecting, non-blocking socket
-			 * to check if it's still alive
-	 	 	 */
-#ifdef PROBE_CONN
-			if (so->so_state & SS_ISFCONNECTING) {
-			  ret = recv(so->s, (char *)&ret, 0,0);
-
-			  if (ret < 0) {
-			    /* XXX */
-			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
-
-			    /* else failed */
-			    so->so_state &= SS_PERSISTENT_MASK;
-			    so->so_state |= SS_NOFDREF;
-
-			    /* tcp_input will take care of it */
-			  } else {
-			    ret = send(so->s, &ret, 0,0);
-			    if (ret < 0) {
-			      /* XXX */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    } else
-			      so->so_state &= ~SS_ISFCONNECTING;
-
-			  }
-			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
-			} /* SS_ISFCONNECTING */
-#endif
+				so->so_revents |= SO_EV_EXCEPT;
+			tcp_poll_socket(so);
 		}
 
 		/*
@@ -515,6 +626,7 @@ void slirp_select_poll(Slirp *slirp,
                         }
 		}
 	}
+#endif
 
 	/*
 	 * See if we can start outputting
@@ -523,15 +635,6 @@ void slirp_select_poll(Slirp *slirp,
 	    if_start(slirp);
 	}
     }
-
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
 }
 
 #define ETH_ALEN 6
@@ -610,6 +713,7 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
             rah->ar_sip = ah->ar_tip;
             memcpy(rah->ar_tha, ah->ar_sha, ETH_ALEN);
             rah->ar_tip = ah->ar_sip;
+            TRACE(net_tx, slirp, arp_reply, sizeof(arp_reply));
             slirp_output(slirp->opaque, arp_reply, sizeof(arp_reply));
         }
         break;
@@ -630,6 +734,7 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     struct mbuf *m;
     int proto;
 
+    TRACE(net_rx, slirp, pkt, pkt_len);
     if (pkt_len < ETH_HLEN)
         return;
 
@@ -698,6 +803,7 @@ void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
         /* target IP */
         rah->ar_tip = iph->ip_dst.s_addr;
         slirp->client_ipaddr = iph->ip_dst;
+        TRACE(net_tx, slirp, arp_req, sizeof(arp_req));
         slirp_output(slirp->opaque, arp_req, sizeof(arp_req));
     } else {
         memcpy(eh->h_dest, slirp->client_ethaddr, ETH_ALEN);
@@ -706,6 +812,7 @@ void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
         memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
+        TRACE(net_tx, slirp, buf, ip_data_len + ETH_HLEN);
         slirp_output(slirp->opaque, buf, ip_data_len + ETH_HLEN);
     }
 }
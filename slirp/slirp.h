@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include "../cutils.h"
+#include "../trace.h"
 #include "slirp_config.h"
 
 #ifdef _WIN32
@@ -113,6 +114,10 @@ int inet_aton(const char *cp, struct in_addr *ia);
 # include <sys/select.h>
 #endif
 
+#ifdef HAVE_EPOLL
+# include <sys/epoll.h>
+#endif
+
 #ifdef HAVE_SYS_WAIT_H
 # include <sys/wait.h>
 #endif
@@ -194,7 +199,8 @@ struct Slirp {
     struct mbuf *next_m;    /* pointer to next mbuf to output */
 
     /* ip states */
-    struct ipq ipq;         /* ip reass. queue */
+    struct ipq ipq;         /* ip reass. queue, newest first */
+    struct qlink ipq_hash[IPQ_HASH_SIZE]; /* reass. queues by id */
     uint16_t ip_id;         /* ip packet ctr, for ids */
 
     /* bootp/dhcp states */
@@ -205,11 +211,35 @@ struct Slirp {
     struct socket tcb;
     struct socket *tcp_last_so;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
-    uint32_t tcp_now;       /* for RFC 1323 timestamps */
+    uint32_t tcp_now;       /* slow timer ticks, for the timers and
+                               RFC 1323 timestamps */
+    struct socket *tcp_hash[SO_HASH_SIZE];
+    struct tcpcb *tcp_delack; /* connections with TF_DELACK */
 
     /* udp states */
     struct socket udb;
     struct socket *udp_last_so;
+    struct socket *udp_hash[SO_HASH_SIZE];
+#ifdef HAVE_RECVMMSG
+    struct mbuf *udp_rx_m[UDP_BATCH]; /* preallocated receive mbufs */
+    uint8_t *udp_rx_overflow;
+#endif
+#ifdef HAVE_SENDMMSG
+    struct udp_tx udp_tx[UDP_BATCH];
+    int udp_tx_count;
+#endif
+
+    /* socket timers */
+    struct socket *so_wheel[SO_WHEEL_SIZE];
+    uint32_t so_wheel_time; /* next tick to run */
+    int so_wheel_count;     /* number of queued sockets */
+
+#ifdef HAVE_EPOLL
+    int epoll_fd;
+    struct socket *so_dirty; /* sockets whose events must be updated */
+    struct epoll_event *poll_events; /* events being dispatched */
+    int poll_nevents;
+#endif
 
     /* tftp states */
     char *tftp_prefix;
@@ -88,6 +88,20 @@
 /* Define if you have readv */
 #undef HAVE_READV
 
+/* Define if you have recvmmsg() and sendmmsg() */
+#undef HAVE_RECVMMSG
+#undef HAVE_SENDMMSG
+#ifdef __linux__
+#define HAVE_RECVMMSG
+#define HAVE_SENDMMSG
+#endif
+
+/* Define if you have epoll */
+#undef HAVE_EPOLL
+#ifdef __linux__
+#define HAVE_EPOLL
+#endif
+
 /* Define if iovec needs to be declared */
 #undef DECLARE_IOVEC
 #ifdef _WIN32
@@ -10,27 +10,286 @@
 
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
+#ifdef HAVE_SENDMMSG
+static void sosendto_drop(struct socket *so);
+#endif
+
+static inline u_int
+sohashkey(uint32_t laddr, u_int lport, uint32_t faddr, u_int fport)
+{
+	uint32_t h = laddr ^ faddr ^ ((lport << 16) | fport);
+
+	return (h * 0x9e3779b1) >> (32 - SO_HASH_BITS);
+}
 
+/*
+ * Find the TCP socket of a 4-tuple
+ */
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(Slirp *slirp, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	so = slirp->tcp_hash[sohashkey(laddr.s_addr, lport,
+				       faddr.s_addr, fport)];
+	for (; so != NULL; so = so->so_hnext) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
 		    so->so_faddr.s_addr == faddr.s_addr &&
 		    so->so_fport == fport)
 		   break;
 	}
+	return so;
+}
+
+/*
+ * Find the UDP socket of a local address and port. UDP sockets are
+ * not bound to a foreign host, so it is not part of the key.
+ */
+struct socket *
+solookup_udp(Slirp *slirp, struct in_addr laddr, u_int lport)
+{
+	struct socket *so;
 
-	if (so == head)
-	   return (struct socket *)NULL;
+	so = slirp->udp_hash[sohashkey(laddr.s_addr, lport, 0, 0)];
+	for (; so != NULL; so = so->so_hnext) {
+		if (so->so_lport == lport &&
+		    so->so_laddr.s_addr == laddr.s_addr)
+		   break;
+	}
 	return so;
+}
 
+static void
+sounhash(struct socket *so)
+{
+	if (so->so_hprev) {
+		if ((*so->so_hprev = so->so_hnext) != NULL)
+			so->so_hnext->so_hprev = so->so_hprev;
+		so->so_hprev = NULL;
+	}
 }
 
+/*
+ * (Re)insert a socket in the lookup table of its protocol. Must be
+ * called when its addresses are set.
+ */
+void
+sohash(struct socket *so)
+{
+	Slirp *slirp = so->slirp;
+	struct socket **head;
+
+	sounhash(so);
+	if (so->so_tcpcb)
+		head = &slirp->tcp_hash[sohashkey(so->so_laddr.s_addr, so->so_lport,
+						  so->so_faddr.s_addr, so->so_fport)];
+	else
+		head = &slirp->udp_hash[sohashkey(so->so_laddr.s_addr, so->so_lport,
+						  0, 0)];
+	if ((so->so_hnext = *head) != NULL)
+		so->so_hnext->so_hprev = &so->so_hnext;
+	*head = so;
+	so->so_hprev = head;
+}
+
+/*
+ * Timer wheel: each socket is queued once, at the first tick
+ * (tcp_now) where one of its timers may expire, so that a tick only
+ * visits the sockets whose timers are due. The first level has one
+ * slot per tick, the slots of the next levels are moved down to the
+ * previous level when it wraps around.
+ */
+static struct socket **
+sotimer_slot(Slirp *slirp, uint32_t expire)
+{
+	uint32_t delta = expire - slirp->so_wheel_time;
+	int base, shift;
+
+	if ((int32_t)delta < 0)
+		return &slirp->so_wheel[slirp->so_wheel_time & (SO_WHEEL_SLOTS0 - 1)];
+	if (delta < SO_WHEEL_SLOTS0)
+		return &slirp->so_wheel[expire & (SO_WHEEL_SLOTS0 - 1)];
+	base = SO_WHEEL_SLOTS0;
+	shift = SO_WHEEL_BITS0;
+	while (delta >= (1U << (shift + SO_WHEEL_BITS))) {
+		base += SO_WHEEL_SLOTS;
+		shift += SO_WHEEL_BITS;
+	}
+	return &slirp->so_wheel[base + ((expire >> shift) & (SO_WHEEL_SLOTS - 1))];
+}
+
+static void
+sotimer_insert(struct socket *so)
+{
+	struct socket **head = sotimer_slot(so->slirp, so->so_texpire);
+
+	if ((so->so_tnext = *head) != NULL)
+		so->so_tnext->so_tprev = &so->so_tnext;
+	*head = so;
+	so->so_tprev = head;
+}
+
+static void
+sotimer_unlink(struct socket *so)
+{
+	if ((*so->so_tprev = so->so_tnext) != NULL)
+		so->so_tnext->so_tprev = so->so_tprev;
+	so->so_tprev = NULL;
+}
+
+static void
+sotimer_del(struct socket *so)
+{
+	if (so->so_tprev) {
+		sotimer_unlink(so);
+		so->slirp->so_wheel_count--;
+	}
+}
+
+/*
+ * Queue the socket so that it is expired at tick 'expire' at the
+ * latest. Nothing is done if it is already queued for an earlier
+ * tick: the expiration function checks what is due.
+ */
+void
+sotimer(struct socket *so, uint32_t expire)
+{
+	Slirp *slirp = so->slirp;
+
+	if (so->so_tprev) {
+		if ((int32_t)(expire - so->so_texpire) >= 0)
+			return;
+		sotimer_unlink(so);
+	} else {
+		slirp->so_wheel_count++;
+	}
+	/* too far: expire early and queue again */
+	if ((int32_t)(expire - slirp->so_wheel_time) >= SO_WHEEL_SPAN)
+		expire = slirp->so_wheel_time + SO_WHEEL_SPAN - 1;
+	so->so_texpire = expire;
+	sotimer_insert(so);
+}
+
+/* take the sockets of a slot, which can be modified by the callers */
+static struct socket *
+sotimer_take(struct socket **slot, struct socket **plist)
+{
+	if ((*plist = *slot) != NULL)
+		(*plist)->so_tprev = plist;
+	*slot = NULL;
+	return *plist;
+}
+
+/* move the sockets of the current slot of 'level' to the lower levels */
+static int
+sotimer_cascade(Slirp *slirp, int level)
+{
+	int shift = SO_WHEEL_BITS0 + (level - 1) * SO_WHEEL_BITS;
+	int idx = (slirp->so_wheel_time >> shift) & (SO_WHEEL_SLOTS - 1);
+	struct socket *so, *list;
+
+	sotimer_take(&slirp->so_wheel[SO_WHEEL_SLOTS0 +
+				      (level - 1) * SO_WHEEL_SLOTS + idx], &list);
+	while ((so = list) != NULL) {
+		sotimer_unlink(so);
+		sotimer_insert(so);
+	}
+	return idx;
+}
+
+static void
+soexpire(struct socket *so)
+{
+	if (so->so_tcpcb) {
+		tcp_timer_expire(so->so_tcpcb);
+	} else if (so->so_expire) {
+		if (so->so_expire <= curtime)
+			udp_detach(so);
+		else
+			sosetexpire(so, so->so_expire - curtime);
+	}
+}
+
+/*
+ * Run the timers up to tcp_now
+ */
+void
+sotimer_run(Slirp *slirp)
+{
+	struct socket *so, *list;
+	int idx, level;
+
+	while ((int32_t)(slirp->tcp_now - slirp->so_wheel_time) >= 0) {
+		idx = slirp->so_wheel_time & (SO_WHEEL_SLOTS0 - 1);
+		if (idx == 0) {
+			for (level = 1; level < SO_WHEEL_LEVELS; level++) {
+				if (sotimer_cascade(slirp, level) != 0)
+					break;
+			}
+		}
+		slirp->so_wheel_time++;
+		sotimer_take(&slirp->so_wheel[idx], &list);
+		while ((so = list) != NULL) {
+			sotimer_del(so);
+			soexpire(so);
+		}
+	}
+}
+
+/*
+ * Expire a UDP socket in 'delay' ms, or never if 0
+ */
+void
+sosetexpire(struct socket *so, u_int delay)
+{
+	if (delay == 0) {
+		so->so_expire = 0;
+	} else {
+		so->so_expire = curtime + delay;
+		sotimer(so, so->slirp->tcp_now +
+			(delay * PR_SLOWHZ + 999) / 1000);
+	}
+}
+
+#ifdef HAVE_EPOLL
+/*
+ * The events polled for a socket depend on its state and buffers:
+ * queue it so that they are updated at the next slirp_select_fill().
+ */
+void
+sochanged(struct socket *so)
+{
+	Slirp *slirp = so->slirp;
+
+	if (so->so_dprev == NULL) {
+		if ((so->so_dnext = slirp->so_dirty) != NULL)
+			so->so_dnext->so_dprev = &so->so_dnext;
+		slirp->so_dirty = so;
+		so->so_dprev = &slirp->so_dirty;
+	}
+}
+
+static void
+sodirty_remove(struct socket *so)
+{
+	Slirp *slirp = so->slirp;
+	int i;
+
+	if (so->so_dprev) {
+		if ((*so->so_dprev = so->so_dnext) != NULL)
+			so->so_dnext->so_dprev = so->so_dprev;
+		so->so_dprev = NULL;
+	}
+	/* do not dispatch the pending events of a freed socket */
+	for (i = 0; i < slirp->poll_nevents; i++) {
+		if (slirp->poll_events[i].data.ptr == so)
+			slirp->poll_events[i].data.ptr = NULL;
+	}
+}
+#endif
+
 /*
  * Create a new socket, initialise the fields
  * It is the responsibility of the caller to
@@ -68,6 +327,14 @@ sofree(struct socket *so)
   } else if (so == slirp->udp_last_so) {
       slirp->udp_last_so = &slirp->udb;
   }
+  sounhash(so);
+  sotimer_del(so);
+#ifdef HAVE_EPOLL
+  sodirty_remove(so);
+#endif
+#ifdef HAVE_SENDMMSG
+  sosendto_drop(so);
+#endif
   m_free(so->so_m);
 
   if(so->so_next && so->so_prev)
@@ -210,6 +477,8 @@ int soreadbuf(struct socket *so, const char *buf, int size)
 	DEBUG_CALL("soreadbuf");
 	DEBUG_ARG("so = %lx", (long )so);
 
+	sochanged(so);
+
 	/*
 	 * No need to check if there's enough room to read.
 	 * soread wouldn't have been called if there weren't
@@ -424,6 +693,117 @@ sowrite(struct socket *so)
 	return nn;
 }
 
+static void
+sorecv_error(struct socket *so)
+{
+	u_char code=ICMP_UNREACH_PORT;
+
+	if(errno == EHOSTUNREACH) code=ICMP_UNREACH_HOST;
+	else if(errno == ENETUNREACH) code=ICMP_UNREACH_NET;
+
+	DEBUG_MISC((dfd," rx error, tx icmp ICMP_UNREACH:%i\n", code));
+	icmp_error(so->so_m, ICMP_UNREACH,code, 0,strerror(errno));
+}
+
+static void
+sorecv_update_expire(struct socket *so)
+{
+	/*
+	 * Hack: domain name lookup will be used the most for UDP,
+	 * and since they'll only be used once there's no need
+	 * for the 4 minute (or whatever) timeout... So we time them
+	 * out much quicker (10 seconds  for now...)
+	 */
+	if (so->so_expire) {
+	  if (so->so_fport == htons(53))
+	    sosetexpire(so, SO_EXPIREFAST);
+	  else
+	    sosetexpire(so, SO_EXPIRE);
+	}
+}
+
+#ifdef HAVE_RECVMMSG
+/*
+ * Drain a UDP socket with recvmmsg(). The datagrams are received
+ * directly in preallocated mbufs. The part of a datagram which does
+ * not fit goes to an overflow buffer and is copied back after
+ * extending the mbuf.
+ */
+static void
+sorecvfrom_batch(struct socket *so)
+{
+	Slirp *slirp = so->slirp;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][2];
+	struct sockaddr_in addr[UDP_BATCH];
+	struct mbuf *m;
+	uint8_t *overflow;
+	int i, n, nb_slots, len, room, iter;
+
+	if (!slirp->udp_rx_overflow) {
+	  slirp->udp_rx_overflow = malloc(UDP_BATCH * UDP_RX_OVERFLOW);
+	  if (!slirp->udp_rx_overflow)
+	    return;
+	}
+
+	for (iter = 0; iter < UDP_RX_MAX_BATCHES; iter++) {
+	  for (nb_slots = 0; nb_slots < UDP_BATCH; nb_slots++) {
+	    m = slirp->udp_rx_m[nb_slots];
+	    if (!m) {
+	      m = m_get(slirp);
+	      if (!m)
+		break;
+	      m->m_data += IF_MAXLINKHDR;
+	      slirp->udp_rx_m[nb_slots] = m;
+	    }
+	    iov[nb_slots][0].iov_base = m->m_data;
+	    iov[nb_slots][0].iov_len = M_FREEROOM(m);
+	    iov[nb_slots][1].iov_base = slirp->udp_rx_overflow +
+	      nb_slots * UDP_RX_OVERFLOW;
+	    iov[nb_slots][1].iov_len = UDP_RX_OVERFLOW;
+	    memset(&msgs[nb_slots], 0, sizeof(msgs[nb_slots]));
+	    msgs[nb_slots].msg_hdr.msg_name = &addr[nb_slots];
+	    msgs[nb_slots].msg_hdr.msg_namelen = sizeof(addr[nb_slots]);
+	    msgs[nb_slots].msg_hdr.msg_iov = iov[nb_slots];
+	    msgs[nb_slots].msg_hdr.msg_iovlen = 2;
+	  }
+	  if (nb_slots == 0)
+	    return;
+
+	  n = recvmmsg(so->s, msgs, nb_slots, MSG_DONTWAIT, NULL);
+	  DEBUG_MISC((dfd, " did recvmmsg %d, errno = %d-%s\n",
+		      n, errno, strerror(errno)));
+	  if (n < 0) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	      sorecv_error(so);
+	    return;
+	  }
+
+	  for (i = 0; i < n; i++) {
+	    m = slirp->udp_rx_m[i];
+	    slirp->udp_rx_m[i] = NULL;
+	    len = msgs[i].msg_len;
+	    room = iov[i][0].iov_len;
+	    if (len > room) {
+	      overflow = iov[i][1].iov_base;
+	      m_inc(m, (m->m_data - m->m_dat) + len + 1);
+	      memcpy(m->m_data + room, overflow, len - room);
+	    }
+	    m->m_len = len;
+	    sorecv_update_expire(so);
+	    udp_output(so, m, &addr[i]);
+	  }
+	  /* the preallocated mbufs are packed for the next call */
+	  for (i = n; i < nb_slots; i++) {
+	    slirp->udp_rx_m[i - n] = slirp->udp_rx_m[i];
+	    slirp->udp_rx_m[i] = NULL;
+	  }
+	  if (n < nb_slots)
+	    break;
+	}
+}
+#endif
+
 /*
  * recvfrom() a UDP socket
  */
@@ -436,6 +816,12 @@ sorecvfrom(struct socket *so)
 	DEBUG_CALL("sorecvfrom");
 	DEBUG_ARG("so = %lx", (long)so);
 
+#ifdef HAVE_RECVMMSG
+	if (so->so_type != IPPROTO_ICMP) {
+	  sorecvfrom_batch(so);
+	  return;
+	}
+#endif
 	if (so->so_type == IPPROTO_ICMP) {   /* This is a "ping" reply */
 	  char buff[256];
 	  int len;
@@ -494,27 +880,10 @@ sorecvfrom(struct socket *so)
 	  DEBUG_MISC((dfd, " did recvfrom %d, errno = %d-%s\n",
 		      m->m_len, errno,strerror(errno)));
 	  if(m->m_len<0) {
-	    u_char code=ICMP_UNREACH_PORT;
-
-	    if(errno == EHOSTUNREACH) code=ICMP_UNREACH_HOST;
-	    else if(errno == ENETUNREACH) code=ICMP_UNREACH_NET;
-
-	    DEBUG_MISC((dfd," rx error, tx icmp ICMP_UNREACH:%i\n", code));
-	    icmp_error(so->so_m, ICMP_UNREACH,code, 0,strerror(errno));
+	    sorecv_error(so);
 	    m_free(m);
 	  } else {
-	  /*
-	   * Hack: domain name lookup will be used the most for UDP,
-	   * and since they'll only be used once there's no need
-	   * for the 4 minute (or whatever) timeout... So we time them
-	   * out much quicker (10 seconds  for now...)
-	   */
-	    if (so->so_expire) {
-	      if (so->so_fport == htons(53))
-		so->so_expire = curtime + SO_EXPIREFAST;
-	      else
-		so->so_expire = curtime + SO_EXPIRE;
-	    }
+	    sorecv_update_expire(so);
 
 	    /*
 	     * If this packet was destined for CTL_ADDR,
@@ -525,13 +894,48 @@ sorecvfrom(struct socket *so)
 	} /* if ping packet */
 }
 
+/* host address of the peer of a UDP socket */
+static void
+sosendto_addr(struct socket *so, struct sockaddr_in *addr)
+{
+	Slirp *slirp = so->slirp;
+
+	memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+	if ((so->so_faddr.s_addr & slirp->vnetwork_mask.s_addr) ==
+	    slirp->vnetwork_addr.s_addr) {
+	  /* It's an alias */
+	  if (so->so_faddr.s_addr == slirp->vnameserver_addr.s_addr) {
+	    if (get_dns_addr(&addr->sin_addr) < 0)
+	      addr->sin_addr = loopback_addr;
+	  } else {
+	    addr->sin_addr = loopback_addr;
+	  }
+	} else
+	  addr->sin_addr = so->so_faddr;
+	addr->sin_port = so->so_fport;
+}
+
+static void
+sosendto_done(struct socket *so)
+{
+	/*
+	 * Kill the socket if there's no reply in 4 minutes,
+	 * but only if it's an expirable socket
+	 */
+	if (so->so_expire)
+		sosetexpire(so, SO_EXPIRE);
+	so->so_state &= SS_PERSISTENT_MASK;
+	so->so_state |= SS_ISFCONNECTED; /* So that it gets select()ed */
+	sochanged(so);
+}
+
 /*
  * sendto() a socket
  */
 int
 sosendto(struct socket *so, struct mbuf *m)
 {
-	Slirp *slirp = so->slirp;
 	int ret;
 	struct sockaddr_in addr;
 
@@ -539,19 +943,7 @@ sosendto(struct socket *so, struct mbuf *m)
 	DEBUG_ARG("so = %lx", (long)so);
 	DEBUG_ARG("m = %lx", (long)m);
 
-        addr.sin_family = AF_INET;
-	if ((so->so_faddr.s_addr & slirp->vnetwork_mask.s_addr) ==
-	    slirp->vnetwork_addr.s_addr) {
-	  /* It's an alias */
-	  if (so->so_faddr.s_addr == slirp->vnameserver_addr.s_addr) {
-	    if (get_dns_addr(&addr.sin_addr) < 0)
-	      addr.sin_addr = loopback_addr;
-	  } else {
-	    addr.sin_addr = loopback_addr;
-	  }
-	} else
-	  addr.sin_addr = so->so_faddr;
-	addr.sin_port = so->so_fport;
+	sosendto_addr(so, &addr);
 
 	DEBUG_MISC((dfd, " sendto()ing, addr.sin_port=%d, addr.sin_addr.s_addr=%.16s\n", ntohs(addr.sin_port), inet_ntoa(addr.sin_addr)));
 
@@ -561,17 +953,114 @@ sosendto(struct socket *so, struct mbuf *m)
 	if (ret < 0)
 		return -1;
 
-	/*
-	 * Kill the socket if there's no reply in 4 minutes,
-	 * but only if it's an expirable socket
-	 */
-	if (so->so_expire)
-		so->so_expire = curtime + SO_EXPIRE;
-	so->so_state &= SS_PERSISTENT_MASK;
-	so->so_state |= SS_ISFCONNECTED; /* So that it gets select()ed */
+	sosendto_done(so);
 	return 0;
 }
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Queue a datagram for sosendto_flush(). 'm' is the complete packet
+ * received from the guest and 'hlen' the length of its IP and UDP
+ * headers. The mbuf becomes the ICMP backup of the socket once sent.
+ */
+void
+sosendto_queue(struct socket *so, struct mbuf *m, int hlen)
+{
+	Slirp *slirp = so->slirp;
+	struct udp_tx *tx;
+
+	DEBUG_CALL("sosendto_queue");
+	DEBUG_ARG("so = %lx", (long)so);
+	DEBUG_ARG("m = %lx", (long)m);
+
+	if (slirp->udp_tx_count == UDP_BATCH)
+	  sosendto_flush(slirp);
+	tx = &slirp->udp_tx[slirp->udp_tx_count++];
+	tx->so = so;
+	tx->m = m;
+	tx->hlen = hlen;
+	sosendto_addr(so, &tx->addr);
+}
+
+/*
+ * Send the queued datagrams with one sendmmsg() per socket
+ */
+void
+sosendto_flush(Slirp *slirp)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct udp_tx *tab[UDP_BATCH], *tx;
+	struct socket *so;
+	int i, j, n, k, ret, count;
+
+	count = slirp->udp_tx_count;
+	for (i = 0; i < count; i++) {
+	  so = slirp->udp_tx[i].so;
+	  if (!so)
+	    continue;
+	  /* all the datagrams of this socket, in order */
+	  n = 0;
+	  for (j = i; j < count; j++) {
+	    tx = &slirp->udp_tx[j];
+	    if (tx->so != so)
+	      continue;
+	    iov[n].iov_base = tx->m->m_data + tx->hlen;
+	    iov[n].iov_len = tx->m->m_len - tx->hlen;
+	    memset(&msgs[n], 0, sizeof(msgs[n]));
+	    msgs[n].msg_hdr.msg_name = &tx->addr;
+	    msgs[n].msg_hdr.msg_namelen = sizeof(tx->addr);
+	    msgs[n].msg_hdr.msg_iov = &iov[n];
+	    msgs[n].msg_hdr.msg_iovlen = 1;
+	    tab[n++] = tx;
+	  }
+
+	  for (k = 0; k < n; ) {
+	    ret = sendmmsg(so->s, msgs + k, n - k, 0);
+	    DEBUG_MISC((dfd, " did sendmmsg %d/%d, errno = %d-%s\n",
+			ret, n - k, errno, strerror(errno)));
+	    if (ret < 0) {
+	      if (errno == EINTR)
+		continue;
+	      /* the first datagram failed */
+	      DEBUG_MISC((dfd,"udp tx errno = %d-%s\n",errno,strerror(errno)));
+	      icmp_error(tab[k]->m, ICMP_UNREACH,ICMP_UNREACH_NET, 0,
+			 strerror(errno));
+	      ret = 1;
+	    } else if (ret > 0) {
+	      sosendto_done(so);
+	    }
+	    k += ret;
+	  }
+
+	  for (k = 0; k < n; k++) {
+	    /* used for ICMP if error on sorecvfrom */
+	    m_free(so->so_m);
+	    so->so_m = tab[k]->m;
+	    tab[k]->so = NULL;
+	  }
+	}
+	slirp->udp_tx_count = 0;
+}
+
+/* forget the queued datagrams of a socket which is freed */
+static void
+sosendto_drop(struct socket *so)
+{
+	Slirp *slirp = so->slirp;
+	struct udp_tx *tx;
+	int i;
+
+	for (i = 0; i < slirp->udp_tx_count; i++) {
+	  tx = &slirp->udp_tx[i];
+	  if (tx->so == so) {
+	    m_free(tx->m);
+	    tx->so = NULL;
+	  }
+	}
+}
+#endif
+
 /*
  * Listen for incoming TCP connections
  */
@@ -608,7 +1097,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	 * SS_FACCEPTONCE sockets must time out.
 	 */
 	if (flags & SS_FACCEPTONCE)
-	   so->so_tcpcb->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT*2;
+	   tcp_timer_activate(so->so_tcpcb, TCPT_KEEP, TCPTV_KEEP_INIT*2);
 
 	so->so_state &= SS_PERSISTENT_MASK;
 	so->so_state |= (SS_FACCEPTCONN | flags);
@@ -645,6 +1134,8 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = addr.sin_addr;
 
 	so->s = s;
+	sohash(so);
+	sochanged(so);
 	return so;
 }
 
@@ -674,9 +1165,7 @@ sofcantrcvmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
-		}
+		so->so_revents &= ~SO_EV_WRITE;
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE) {
@@ -692,12 +1181,7 @@ sofcantsendmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
-            }
+            so->so_revents &= ~(SO_EV_READ | SO_EV_EXCEPT);
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE) {
@@ -11,12 +11,36 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/* size of the TCP and UDP lookup hash tables */
+#define SO_HASH_BITS 14
+#define SO_HASH_SIZE (1 << SO_HASH_BITS)
+
+/*
+ * Timer wheel of the sockets, in slow timer ticks: one level of 256
+ * ticks, then levels of 64 slots each covering 64 times more.
+ */
+#define SO_WHEEL_BITS0 8
+#define SO_WHEEL_BITS 6
+#define SO_WHEEL_LEVELS 3
+#define SO_WHEEL_SLOTS0 (1 << SO_WHEEL_BITS0)
+#define SO_WHEEL_SLOTS (1 << SO_WHEEL_BITS)
+#define SO_WHEEL_SIZE (SO_WHEEL_SLOTS0 + (SO_WHEEL_LEVELS - 1) * SO_WHEEL_SLOTS)
+#define SO_WHEEL_SPAN (1 << (SO_WHEEL_BITS0 + (SO_WHEEL_LEVELS - 1) * SO_WHEEL_BITS))
+
+/* poll events */
+#define SO_EV_READ	0x1
+#define SO_EV_WRITE	0x2
+#define SO_EV_EXCEPT	0x4
+
 /*
  * Our socket structure
  */
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hnext,**so_hprev;	/* tcp_hash or udp_hash chain */
+  struct socket *so_tnext,**so_tprev;	/* timer wheel slot */
+  uint32_t so_texpire;			/* tick of the timer wheel slot */
 
   int s;                           /* The actual socket */
 
@@ -51,6 +75,12 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  int so_revents;		/* SO_EV_x events returned by the last poll */
+#ifdef HAVE_EPOLL
+  int so_events;		/* SO_EV_x events in the epoll set */
+  struct socket *so_dnext,**so_dprev;	/* so_dirty list */
+#endif
 };
 
 
@@ -74,7 +104,17 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+struct socket * solookup(Slirp *, struct in_addr, u_int, struct in_addr, u_int);
+struct socket * solookup_udp(Slirp *, struct in_addr, u_int);
+void sohash(struct socket *);
+void sotimer(struct socket *, uint32_t);
+void sotimer_run(Slirp *);
+void sosetexpire(struct socket *, u_int);
+#ifdef HAVE_EPOLL
+void sochanged(struct socket *);
+#else
+#define sochanged(so) do { } while (0)
+#endif
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
@@ -83,6 +123,10 @@ int sosendoob(struct socket *);
 int sowrite(struct socket *);
 void sorecvfrom(struct socket *);
 int sosendto(struct socket *, struct mbuf *);
+#ifdef HAVE_SENDMMSG
+void sosendto_queue(struct socket *, struct mbuf *, int);
+void sosendto_flush(Slirp *);
+#endif
 struct socket * tcp_listen(Slirp *, uint32_t, u_int, uint32_t, u_int,
                                int);
 void soisfconnecting(register struct socket *);
@@ -67,7 +67,7 @@
                if (ti->ti_flags & TH_PUSH) \
                        tp->t_flags |= TF_ACKNOW; \
                else \
-                       tp->t_flags |= TF_DELACK; \
+                       tcp_delack(tp); \
                (tp)->rcv_nxt += (ti)->ti_len; \
                flags = (ti)->ti_flags & TH_FIN; \
                if (so->so_emu) { \
@@ -84,7 +84,7 @@
 	if ((ti)->ti_seq == (tp)->rcv_nxt && \
         tcpfrag_list_empty(tp) && \
 	    (tp)->t_state == TCPS_ESTABLISHED) { \
-		tp->t_flags |= TF_DELACK; \
+		tcp_delack(tp); \
 		(tp)->rcv_nxt += (ti)->ti_len; \
 		flags = (ti)->ti_flags & TH_FIN; \
 		if (so->so_emu) { \
@@ -335,7 +335,7 @@ findso:
 	    so->so_lport != ti->ti_sport ||
 	    so->so_laddr.s_addr != ti->ti_src.s_addr ||
 	    so->so_faddr.s_addr != ti->ti_dst.s_addr) {
-		so = solookup(&slirp->tcb, ti->ti_src, ti->ti_sport,
+		so = solookup(slirp, ti->ti_src, ti->ti_sport,
 			       ti->ti_dst, ti->ti_dport);
 		if (so)
 			slirp->tcp_last_so = so;
@@ -372,6 +372,7 @@ findso:
 	  so->so_lport = ti->ti_sport;
 	  so->so_faddr = ti->ti_dst;
 	  so->so_fport = ti->ti_dport;
+	  sohash(so);
 
 	  if ((so->so_iptos = tcp_tos(so)) == 0)
 	    so->so_iptos = ((struct ip *)ti)->ip_tos;
@@ -379,6 +380,7 @@ findso:
 	  tp = sototcpcb(so);
 	  tp->t_state = TCPS_LISTEN;
 	}
+	sochanged(so);
 
         /*
          * If this is a still-connecting socket, this probably
@@ -402,11 +404,11 @@ findso:
 	 * Segment received on connection.
 	 * Reset idle time and keep-alive timer.
 	 */
-	tp->t_idle = 0;
+	tp->t_rcvtime = slirp->tcp_now;
 	if (SO_OPTIONS)
-	   tp->t_timer[TCPT_KEEP] = TCPTV_KEEPINTVL;
+	   tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEPINTVL);
 	else
-	   tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_IDLE;
+	   tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEP_IDLE);
 
 	/*
 	 * Process options if not in LISTEN state,
@@ -447,7 +449,7 @@ findso:
 				 */
 				if (tp->t_rtt &&
 				    SEQ_GT(ti->ti_ack, tp->t_rtseq))
-					tcp_xmit_timer(tp, tp->t_rtt);
+					tcp_xmit_timer(tp, tcp_rtt(tp));
 				acked = ti->ti_ack - tp->snd_una;
 				sbdrop(&so->so_snd, acked);
 				tp->snd_una = ti->ti_ack;
@@ -463,9 +465,9 @@ findso:
 				 * decide between more output or persist.
 				 */
 				if (tp->snd_una == tp->snd_max)
-					tp->t_timer[TCPT_REXMT] = 0;
+					tcp_timer_activate(tp, TCPT_REXMT, 0);
 				else if (tp->t_timer[TCPT_PERSIST] == 0)
-					tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+					tcp_timer_activate(tp, TCPT_REXMT, tp->t_rxtcur);
 
 				/*
 				 * This is called because sowwakeup might have
@@ -608,7 +610,7 @@ findso:
 	     */
 	    so->so_m = m;
 	    so->so_ti = ti;
-	    tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT;
+	    tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEP_INIT);
 	    tp->t_state = TCPS_SYN_RECEIVED;
 	  }
 	  return;
@@ -637,7 +639,7 @@ findso:
 	  tcp_rcvseqinit(tp);
 	  tp->t_flags |= TF_ACKNOW;
 	  tp->t_state = TCPS_SYN_RECEIVED;
-	  tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT;
+	  tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEP_INIT);
 	  goto trimthenstep6;
 	} /* case TCPS_LISTEN */
 
@@ -674,7 +676,7 @@ findso:
 				tp->snd_nxt = tp->snd_una;
 		}
 
-		tp->t_timer[TCPT_REXMT] = 0;
+		tcp_timer_activate(tp, TCPT_REXMT, 0);
 		tp->irs = ti->ti_seq;
 		tcp_rcvseqinit(tp);
 		tp->t_flags |= TF_ACKNOW;
@@ -689,7 +691,7 @@ findso:
 			 * use its rtt as our initial srtt & rtt var.
 			 */
 			if (tp->t_rtt)
-				tcp_xmit_timer(tp, tp->t_rtt);
+				tcp_xmit_timer(tp, tcp_rtt(tp));
 		} else
 			tp->t_state = TCPS_SYN_RECEIVED;
 
@@ -948,7 +950,7 @@ trimthenstep6:
 					if (win < 2)
 						win = 2;
 					tp->snd_ssthresh = win * tp->t_maxseg;
-					tp->t_timer[TCPT_REXMT] = 0;
+					tcp_timer_activate(tp, TCPT_REXMT, 0);
 					tp->t_rtt = 0;
 					tp->snd_nxt = ti->ti_ack;
 					tp->snd_cwnd = tp->t_maxseg;
@@ -989,7 +991,7 @@ trimthenstep6:
 		 * Recompute the initial retransmit timer.
 		 */
 		if (tp->t_rtt && SEQ_GT(ti->ti_ack, tp->t_rtseq))
-			tcp_xmit_timer(tp,tp->t_rtt);
+			tcp_xmit_timer(tp, tcp_rtt(tp));
 
 		/*
 		 * If all outstanding data is acked, stop retransmit
@@ -998,10 +1000,10 @@ trimthenstep6:
 		 * timer, using current (possibly backed-off) value.
 		 */
 		if (ti->ti_ack == tp->snd_max) {
-			tp->t_timer[TCPT_REXMT] = 0;
+			tcp_timer_activate(tp, TCPT_REXMT, 0);
 			needoutput = 1;
 		} else if (tp->t_timer[TCPT_PERSIST] == 0)
-			tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+			tcp_timer_activate(tp, TCPT_REXMT, tp->t_rxtcur);
 		/*
 		 * When new data is acked, open the congestion window.
 		 * If the window gives us less than ssthresh packets
@@ -1047,7 +1049,7 @@ trimthenstep6:
 				 * we'll hang forever.
 				 */
 				if (so->so_state & SS_FCANTRCVMORE) {
-					tp->t_timer[TCPT_2MSL] = TCP_MAXIDLE;
+					tcp_timer_activate(tp, TCPT_2MSL, TCP_MAXIDLE);
 				}
 				tp->t_state = TCPS_FIN_WAIT_2;
 			}
@@ -1063,7 +1065,7 @@ trimthenstep6:
 			if (ourfinisacked) {
 				tp->t_state = TCPS_TIME_WAIT;
 				tcp_canceltimers(tp);
-				tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+				tcp_timer_activate(tp, TCPT_2MSL, 2 * TCPTV_MSL);
 			}
 			break;
 
@@ -1086,7 +1088,7 @@ trimthenstep6:
 		 * it and restart the finack timer.
 		 */
 		case TCPS_TIME_WAIT:
-			tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+			tcp_timer_activate(tp, TCPT_2MSL, 2 * TCPTV_MSL);
 			goto dropafterack;
 		}
 	} /* switch(tp->t_state) */
@@ -1163,6 +1165,20 @@ dodata:
 	 * case PRU_RCVD).  If a FIN has already been received on this
 	 * connection then we just ignore the text.
 	 */
+
+	/*
+	 * If this is a small packet, then ACK now - with Nagel
+	 *      congestion avoidance sender won't send more until
+	 *      he gets an ACK.
+	 * (tested here because m is freed below)
+	 *
+	 * See above.
+	 */
+	if (ti->ti_len && (unsigned)ti->ti_len <= 5 &&
+	    ((struct tcpiphdr_2 *)ti)->first_char == (char)27) {
+		tp->t_flags |= TF_ACKNOW;
+	}
+
 	if ((ti->ti_len || (tiflags&TH_FIN)) &&
 	    TCPS_HAVERCVDFIN(tp->t_state) == 0) {
 		TCP_REASS(tp, ti, m, so, tiflags);
@@ -1221,30 +1237,18 @@ dodata:
 		case TCPS_FIN_WAIT_2:
 			tp->t_state = TCPS_TIME_WAIT;
 			tcp_canceltimers(tp);
-			tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+			tcp_timer_activate(tp, TCPT_2MSL, 2 * TCPTV_MSL);
 			break;
 
 		/*
 		 * In TIME_WAIT state restart the 2 MSL time_wait timer.
 		 */
 		case TCPS_TIME_WAIT:
-			tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+			tcp_timer_activate(tp, TCPT_2MSL, 2 * TCPTV_MSL);
 			break;
 		}
 	}
 
-	/*
-	 * If this is a small packet, then ACK now - with Nagel
-	 *      congestion avoidance sender won't send more until
-	 *      he gets an ACK.
-	 *
-	 * See above.
-	 */
-	if (ti->ti_len && (unsigned)ti->ti_len <= 5 &&
-	    ((struct tcpiphdr_2 *)ti)->first_char == (char)27) {
-		tp->t_flags |= TF_ACKNOW;
-	}
-
 	/*
 	 * Return any desired output.
 	 */
@@ -74,7 +74,7 @@ tcp_output(struct tcpcb *tp)
 	 * to send, then transmit; otherwise, investigate further.
 	 */
 	idle = (tp->snd_max == tp->snd_una);
-	if (idle && tp->t_idle >= tp->t_rxtcur)
+	if (idle && tcp_idle(tp) >= tp->t_rxtcur)
 		/*
 		 * We have been idle for "a while" and no acks are
 		 * expected to clock out any data we send --
@@ -118,7 +118,7 @@ again:
 				flags &= ~TH_FIN;
 			win = 1;
 		} else {
-			tp->t_timer[TCPT_PERSIST] = 0;
+			tcp_timer_activate(tp, TCPT_PERSIST, 0);
 			tp->t_rxtshift = 0;
 		}
 	}
@@ -138,7 +138,7 @@ again:
 		 */
 		len = 0;
 		if (win == 0) {
-			tp->t_timer[TCPT_REXMT] = 0;
+			tcp_timer_activate(tp, TCPT_REXMT, 0);
 			tp->snd_nxt = tp->snd_una;
 		}
 	}
@@ -414,6 +414,7 @@ send:
 			 */
 			if (tp->t_rtt == 0) {
 				tp->t_rtt = 1;
+				tp->t_rtttime = tp->t_socket->slirp->tcp_now;
 				tp->t_rtseq = startseq;
 			}
 		}
@@ -428,9 +429,9 @@ send:
 		 */
 		if (tp->t_timer[TCPT_REXMT] == 0 &&
 		    tp->snd_nxt != tp->snd_una) {
-			tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+			tcp_timer_activate(tp, TCPT_REXMT, tp->t_rxtcur);
 			if (tp->t_timer[TCPT_PERSIST]) {
-				tp->t_timer[TCPT_PERSIST] = 0;
+				tcp_timer_activate(tp, TCPT_PERSIST, 0);
 				tp->t_rxtshift = 0;
 			}
 		}
@@ -480,13 +481,15 @@ void
 tcp_setpersist(struct tcpcb *tp)
 {
     int t = ((tp->t_srtt >> 2) + tp->t_rttvar) >> 1;
+    int tv;
 
 	/*
 	 * Start/restart persistence timer.
 	 */
-	TCPT_RANGESET(tp->t_timer[TCPT_PERSIST],
+	TCPT_RANGESET(tv,
 	    t * tcp_backoff[tp->t_rxtshift],
 	    TCPTV_PERSMIN, TCPTV_PERSMAX);
+	tcp_timer_activate(tp, TCPT_PERSIST, tv);
 	if (tp->t_rxtshift < TCP_MAXRXTSHIFT)
 		tp->t_rxtshift++;
 }
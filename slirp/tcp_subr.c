@@ -53,6 +53,7 @@ tcp_init(Slirp *slirp)
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
     slirp->tcp_last_so = &slirp->tcb;
+    slirp->so_wheel_time = slirp->tcp_now + 1;
 }
 
 /*
@@ -186,6 +187,7 @@ tcp_newtcpcb(struct socket *so)
 
 	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
 	tp->t_socket = so;
+	tp->t_rcvtime = so->slirp->tcp_now;
 
 	/*
 	 * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
@@ -252,6 +254,7 @@ tcp_close(struct tcpcb *tp)
 		remque(tcpiphdr2qlink(tcpiphdr_prev(t)));
 		m_freem(m);
 	}
+	tcp_delack_remove(tp);
 	free(tp);
         so->so_tcpcb = NULL;
 	/* clobber input socket cache if we're closing the cached connection */
@@ -430,6 +433,8 @@ tcp_connect(struct socket *inso)
 	/* Translate connections from localhost to the real hostname */
 	if (so->so_faddr.s_addr == 0 || so->so_faddr.s_addr == loopback_addr.s_addr)
 	   so->so_faddr = slirp->vhost_addr;
+	sohash(so);
+	sochanged(so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
@@ -446,7 +451,7 @@ tcp_connect(struct socket *inso)
 	tcp_template(tp);
 
 	tp->t_state = TCPS_SYN_SENT;
-	tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT;
+	tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEP_INIT);
 	tp->iss = slirp->tcp_iss;
 	slirp->tcp_iss += TCP_ISSINCR/2;
 	tcp_sendseqinit(tp);
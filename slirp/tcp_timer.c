@@ -40,64 +40,103 @@ static struct tcpcb *tcp_timers(register struct tcpcb *tp, int timer);
 void
 tcp_fasttimo(Slirp *slirp)
 {
-	register struct socket *so;
 	register struct tcpcb *tp;
 
 	DEBUG_CALL("tcp_fasttimo");
 
-	so = slirp->tcb.so_next;
-	if (so)
-	for (; so != &slirp->tcb; so = so->so_next)
-		if ((tp = (struct tcpcb *)so->so_tcpcb) &&
-		    (tp->t_flags & TF_DELACK)) {
+	/*
+	 * Only the connections which delayed an ack are visited.
+	 */
+	while ((tp = slirp->tcp_delack) != NULL) {
+		tcp_delack_remove(tp);
+		if (tp->t_flags & TF_DELACK) {
 			tp->t_flags &= ~TF_DELACK;
 			tp->t_flags |= TF_ACKNOW;
 			(void) tcp_output(tp);
 		}
+	}
+}
+
+/*
+ * Delay the ack of a connection until the next fast timeout.
+ */
+void
+tcp_delack(struct tcpcb *tp)
+{
+	Slirp *slirp = tp->t_socket->slirp;
+
+	tp->t_flags |= TF_DELACK;
+	if (tp->t_delack_prev == NULL) {
+		if ((tp->t_delack_next = slirp->tcp_delack) != NULL)
+			tp->t_delack_next->t_delack_prev = &tp->t_delack_next;
+		slirp->tcp_delack = tp;
+		tp->t_delack_prev = &slirp->tcp_delack;
+	}
+}
+
+void
+tcp_delack_remove(struct tcpcb *tp)
+{
+	if (tp->t_delack_prev) {
+		if ((*tp->t_delack_prev = tp->t_delack_next) != NULL)
+			tp->t_delack_next->t_delack_prev = tp->t_delack_prev;
+		tp->t_delack_prev = NULL;
+	}
 }
 
 /*
  * Tcp protocol timeout routine called every 500 ms.
- * Updates the timers in all active tcb's and
- * causes finite state machine actions if timers expire.
+ * Advances tcp_now and runs the expired timers. The sockets are
+ * queued in a timer wheel at their next expiration, so the
+ * connections whose timers are not due are not visited.
  */
 void
 tcp_slowtimo(Slirp *slirp)
 {
-	register struct socket *ip, *ipnxt;
-	register struct tcpcb *tp;
-	register int i;
-
 	DEBUG_CALL("tcp_slowtimo");
 
-	/*
-	 * Search through tcb's and update active timers.
-	 */
-	ip = slirp->tcb.so_next;
-        if (ip == NULL) {
-            return;
-        }
-	for (; ip != &slirp->tcb; ip = ipnxt) {
-		ipnxt = ip->so_next;
-		tp = sototcpcb(ip);
-                if (tp == NULL) {
-                        continue;
-                }
-		for (i = 0; i < TCPT_NTIMERS; i++) {
-			if (tp->t_timer[i] && --tp->t_timer[i] == 0) {
-				tcp_timers(tp,i);
-				if (ipnxt->so_prev != ip)
-					goto tpgone;
-			}
+	slirp->tcp_now++;				/* for timestamps */
+	sotimer_run(slirp);
+	slirp->tcp_iss += TCP_ISSINCR/PR_SLOWHZ;	/* increment iss */
+}
+
+/*
+ * Start a timer of tp, expiring in 'delta' ticks, or stop it if
+ * delta is 0.
+ */
+void
+tcp_timer_activate(struct tcpcb *tp, int timer, int delta)
+{
+	if (delta == 0) {
+		tp->t_timer[timer] = 0;
+	} else {
+		tp->t_timer[timer] = tp->t_socket->slirp->tcp_now + delta;
+		sotimer(tp->t_socket, tp->t_timer[timer]);
+	}
+}
+
+/*
+ * Called from the timer wheel: run the expired timers of tp and
+ * queue it again for the remaining ones.
+ */
+void
+tcp_timer_expire(struct tcpcb *tp)
+{
+	uint32_t now = tp->t_socket->slirp->tcp_now;
+	register int i;
+
+	for (i = 0; i < TCPT_NTIMERS; i++) {
+		if (tp->t_timer[i] && (int32_t)(tp->t_timer[i] - now) <= 0) {
+			tp->t_timer[i] = 0;
+			tp = tcp_timers(tp, i);
+			if (tp == NULL)
+				return;
 		}
-		tp->t_idle++;
-		if (tp->t_rtt)
-		   tp->t_rtt++;
-tpgone:
-		;
 	}
-	slirp->tcp_iss += TCP_ISSINCR/PR_SLOWHZ;	/* increment iss */
-	slirp->tcp_now++;				/* for timestamps */
+	for (i = 0; i < TCPT_NTIMERS; i++) {
+		if (tp->t_timer[i])
+			sotimer(tp->t_socket, tp->t_timer[i]);
+	}
 }
 
 /*
@@ -135,8 +174,8 @@ tcp_timers(register struct tcpcb *tp, int timer)
 	 */
 	case TCPT_2MSL:
 		if (tp->t_state != TCPS_TIME_WAIT &&
-		    tp->t_idle <= TCP_MAXIDLE)
-			tp->t_timer[TCPT_2MSL] = TCPTV_KEEPINTVL;
+		    tcp_idle(tp) <= TCP_MAXIDLE)
+			tcp_timer_activate(tp, TCPT_2MSL, TCPTV_KEEPINTVL);
 		else
 			tp = tcp_close(tp);
 		break;
@@ -189,7 +228,7 @@ tcp_timers(register struct tcpcb *tp, int timer)
 		rexmt = TCP_REXMTVAL(tp) * tcp_backoff[tp->t_rxtshift];
 		TCPT_RANGESET(tp->t_rxtcur, rexmt,
 		    (short)tp->t_rttmin, TCPTV_REXMTMAX); /* XXX */
-		tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+		tcp_timer_activate(tp, TCPT_REXMT, tp->t_rxtcur);
 		/*
 		 * If losing, let the lower level know and try for
 		 * a better route.  Also, if we backed off this far,
@@ -262,7 +301,7 @@ tcp_timers(register struct tcpcb *tp, int timer)
 			goto dropit;
 
 		if ((SO_OPTIONS) && tp->t_state <= TCPS_CLOSE_WAIT) {
-		    	if (tp->t_idle >= TCPTV_KEEP_IDLE + TCP_MAXIDLE)
+		    	if (tcp_idle(tp) >= TCPTV_KEEP_IDLE + TCP_MAXIDLE)
 				goto dropit;
 			/*
 			 * Send a packet designed to force a response
@@ -278,9 +317,9 @@ tcp_timers(register struct tcpcb *tp, int timer)
 			 */
 			tcp_respond(tp, &tp->t_template, (struct mbuf *)NULL,
 			    tp->rcv_nxt, tp->snd_una - 1, 0);
-			tp->t_timer[TCPT_KEEP] = TCPTV_KEEPINTVL;
+			tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEPINTVL);
 		} else
-			tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_IDLE;
+			tcp_timer_activate(tp, TCPT_KEEP, TCPTV_KEEP_IDLE);
 		break;
 
 	dropit:
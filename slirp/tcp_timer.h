@@ -122,6 +122,10 @@ struct tcpcb;
 
 void tcp_fasttimo(Slirp *);
 void tcp_slowtimo(Slirp *);
+void tcp_timer_activate(struct tcpcb *, int, int);
+void tcp_timer_expire(struct tcpcb *);
+void tcp_delack(struct tcpcb *);
+void tcp_delack_remove(struct tcpcb *);
 void tcp_canceltimers(struct tcpcb *);
 
 #endif
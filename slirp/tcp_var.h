@@ -43,7 +43,8 @@ struct tcpcb {
 	struct tcpiphdr *seg_next;	/* sequencing queue */
 	struct tcpiphdr *seg_prev;
 	short	t_state;		/* state of this connection */
-	short	t_timer[TCPT_NTIMERS];	/* tcp timers */
+	uint32_t t_timer[TCPT_NTIMERS];	/* tcp timers: expiration tcp_now,
+					 * 0 if not running */
 	short	t_rxtshift;		/* log(2) of rexmt exp. backoff */
 	short	t_rxtcur;		/* current retransmit value */
 	short	t_dupacks;		/* consecutive dup acks recd */
@@ -100,8 +101,9 @@ struct tcpcb {
  * transmit timing stuff.  See below for scale of srtt and rttvar.
  * "Variance" is actually smoothed difference.
  */
-	short	t_idle;			/* inactivity time */
-	short	t_rtt;			/* round trip time */
+	uint32_t t_rcvtime;		/* tcp_now of the last segment received */
+	short	t_rtt;			/* timing a segment (see tcp_rtt()) */
+	uint32_t t_rtttime;		/* tcp_now when the timing started */
 	tcp_seq	t_rtseq;		/* sequence number being timed */
 	short	t_srtt;			/* smoothed round-trip time */
 	short	t_rttvar;		/* variance in round-trip time */
@@ -124,10 +126,16 @@ struct tcpcb {
 	uint32_t	ts_recent_age;		/* when last updated */
 	tcp_seq	last_ack_sent;
 
+	struct tcpcb *t_delack_next, **t_delack_prev; /* tcp_delack list */
 };
 
 #define	sototcpcb(so)	((so)->so_tcpcb)
 
+/* ticks since the last segment was received */
+#define	tcp_idle(tp)	((int)((tp)->t_socket->slirp->tcp_now - (tp)->t_rcvtime))
+/* round trip time of the timed segment, starting at 1 */
+#define	tcp_rtt(tp)	((short)((tp)->t_socket->slirp->tcp_now - (tp)->t_rtttime + 1))
+
 /*
  * The smoothed round-trip time and estimated variance
  * are stored as fixed point numbers scaled by the values below.
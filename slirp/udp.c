@@ -145,21 +145,9 @@ udp_input(register struct mbuf *m, int iphlen)
 	so = slirp->udp_last_so;
 	if (so->so_lport != uh->uh_sport ||
 	    so->so_laddr.s_addr != ip->ip_src.s_addr) {
-		struct socket *tmp;
-
-		for (tmp = slirp->udb.so_next; tmp != &slirp->udb;
-		     tmp = tmp->so_next) {
-			if (tmp->so_lport == uh->uh_sport &&
-			    tmp->so_laddr.s_addr == ip->ip_src.s_addr) {
-				so = tmp;
-				break;
-			}
-		}
-		if (tmp == &slirp->udb) {
-		  so = NULL;
-		} else {
+		so = solookup_udp(slirp, ip->ip_src, uh->uh_sport);
+		if (so)
 		  slirp->udp_last_so = so;
-		}
 	}
 
 	if (so == NULL) {
@@ -183,6 +171,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	   */
 	  so->so_laddr = ip->ip_src;
 	  so->so_lport = uh->uh_sport;
+	  sohash(so);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -197,6 +186,12 @@ udp_input(register struct mbuf *m, int iphlen)
         so->so_fport = uh->uh_dport; /* XXX */
 
 	iphlen += sizeof(struct udphdr);
+#ifdef HAVE_SENDMMSG
+	/* restore the orig mbuf packet and send it later with the
+	   other datagrams of the guest */
+	*ip=save_ip;
+	sosendto_queue(so, m, iphlen);
+#else
 	m->m_len -= iphlen;
 	m->m_data += iphlen;
 
@@ -218,6 +213,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	m->m_data -= iphlen;
 	*ip=save_ip;
 	so->so_m=m;         /* ICMP backup */
+#endif
 
 	return;
 bad:
@@ -305,8 +301,9 @@ int
 udp_attach(struct socket *so)
 {
   if((so->s = os_socket(AF_INET,SOCK_DGRAM,0)) != -1) {
-    so->so_expire = curtime + SO_EXPIRE;
+    sosetexpire(so, SO_EXPIRE);
     insque(so, &so->slirp->udb);
+    sochanged(so);
   }
   return(so->s);
 }
@@ -353,8 +350,9 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	    return NULL;
 	}
 	so->s = os_socket(AF_INET,SOCK_DGRAM,0);
-	so->so_expire = curtime + SO_EXPIRE;
+	sosetexpire(so, SO_EXPIRE);
 	insque(so, &slirp->udb);
+	sochanged(so);
 
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = haddr;
@@ -376,6 +374,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	}
 	so->so_lport = lport;
 	so->so_laddr.s_addr = laddr;
+	sohash(so);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
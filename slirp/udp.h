@@ -36,6 +36,13 @@
 #define UDP_TTL 0x60
 #define UDP_UDPDATALEN 16192
 
+/* max number of datagrams per recvmmsg() or sendmmsg() */
+#define UDP_BATCH 32
+/* max number of recvmmsg() calls per readable socket */
+#define UDP_RX_MAX_BATCHES 8
+/* part of a received datagram which does not fit in an mbuf */
+#define UDP_RX_OVERFLOW 65536
+
 /*
  * Udp protocol header.
  * Per RFC 768, September, 1981.
@@ -73,6 +80,14 @@ struct udpiphdr {
 
 struct mbuf;
 
+/* datagram waiting to be sent by sosendto_flush() */
+struct udp_tx {
+    struct socket *so;
+    struct mbuf *m;             /* complete packet, for ICMP errors */
+    int hlen;                   /* IP and UDP header length */
+    struct sockaddr_in addr;
+};
+
 void udp_init(Slirp *);
 void udp_input(register struct mbuf *, int);
 int udp_output(struct socket *, struct mbuf *, struct sockaddr_in *);
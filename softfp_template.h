@@ -21,7 +21,12 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-#if F_SIZE == 32
+#if F_SIZE == 16
+#define F_UINT uint16_t
+#define F_ULONG uint32_t
+#define MANT_SIZE 10
+#define EXP_SIZE 5
+#elif F_SIZE == 32
 #define F_UINT uint32_t
 #define F_ULONG uint64_t
 #define MANT_SIZE 23
@@ -72,6 +77,7 @@
 #define mul_u glue(mul_u, F_SIZE)
 #define cvt_sf32_sf glue(cvt_sf32_sf, F_SIZE)
 #define cvt_sf64_sf glue(cvt_sf64_sf, F_SIZE)
+#define cvt_sf16_sf glue(cvt_sf16_sf, F_SIZE)
 
 static const F_UINT F_QNAN = (((F_UINT)EXP_MASK << MANT_SIZE) | ((F_UINT)1 << (MANT_SIZE - 1)));
 
@@ -940,6 +946,75 @@ uint32_t glue(fclass_sf, F_SIZE)(F_UINT a)
 
 /* conversions between floats */
 
+#if F_SIZE >= 32
+
+F_UINT cvt_sf16_sf(uint16_t a, uint32_t *pfflags)
+{
+    uint32_t a_sign;
+    int32_t a_exp;
+    F_UINT a_mant;
+
+    a_mant = unpack_sf16(&a_sign, &a_exp, a);
+    if (a_exp == 0x1f) {
+        if (a_mant != 0) {
+            /* NaN */
+            if (issignan_sf16(a)) {
+                *pfflags |= FFLAG_INVALID_OP;
+            }
+            return F_QNAN;
+        } else {
+            /* infinity */
+            return pack_sf(a_sign, EXP_MASK, 0);
+        }
+    }
+    if (a_exp == 0) {
+        if (a_mant == 0)
+            return pack_sf(a_sign, 0, 0); /* zero */
+        a_mant = normalize_subnormal_sf16(&a_exp, a_mant);
+    }
+    /* convert the exponent value */
+    a_exp = a_exp - 0xf + (EXP_MASK / 2);
+    /* shift the mantissa */
+    a_mant <<= (MANT_SIZE - 10);
+    return pack_sf(a_sign, a_exp, a_mant);
+}
+
+uint16_t glue(glue(cvt_sf, F_SIZE), _sf16)(F_UINT a, RoundingModeEnum rm,
+                                           uint32_t *pfflags)
+{
+    uint32_t a_sign;
+    int32_t a_exp;
+    F_UINT a_mant;
+
+    a_mant = unpack_sf(&a_sign, &a_exp, a);
+    if (a_exp == EXP_MASK) {
+        if (a_mant != 0) {
+            /* NaN */
+            if (issignan_sf(a)) {
+                *pfflags |= FFLAG_INVALID_OP;
+            }
+            return F_QNAN16;
+        } else {
+            /* infinity */
+            return pack_sf16(a_sign, 0x1f, 0);
+        }
+    }
+    if (a_exp == 0) {
+        if (a_mant == 0)
+            return pack_sf16(a_sign, 0, 0); /* zero */
+        a_mant = normalize_subnormal_sf(&a_exp, a_mant);
+    } else {
+        a_mant |= (F_UINT)1 << MANT_SIZE;
+    }
+    /* convert the exponent value */
+    a_exp = a_exp - (EXP_MASK / 2) + 0xf;
+    /* shift the mantissa */
+    a_mant = rshift_rnd(a_mant, MANT_SIZE - (16 - 2));
+    return normalize_sf16(a_sign, a_exp, a_mant, rm, pfflags);
+}
+
+#endif
+
 #if F_SIZE >= 64
 
 F_UINT cvt_sf32_sf(uint32_t a, uint32_t *pfflags)
@@ -1127,3 +1202,4 @@ uint64_t glue(glue(cvt_sf, F_SIZE), _sf64)(F_UINT a, RoundingModeEnum rm,
 #undef mul_u
 #undef cvt_sf32_sf
 #undef cvt_sf64_sf
+#undef cvt_sf16_sf
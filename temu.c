@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -37,14 +38,22 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <sys/uio.h>
 #endif
 #include <sys/stat.h>
 #include <signal.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/random.h>
+#endif
 
 #include "cutils.h"
 #include "iomem.h"
 #include "virtio.h"
 #include "machine.h"
+#include "trace.h"
 #ifdef CONFIG_FS_NET
 #include "fs_utils.h"
 #include "fs_wget.h"
@@ -55,20 +64,195 @@
 
 #ifndef _WIN32
 
+/* The console output is buffered and written by the main loop so that
+   the guest is not blocked by a slow terminal or log file. The VirtIO
+   console waits when the buffer is full. The other writers (HTIF
+   console, emulator messages) cannot wait, so their output is dropped
+   and the number of lost bytes is printed. */
+
+#define OUTPUT_BUF_SIZE (256 * 1024) /* must be a power of two */
+#define OUTPUT_BUF_MAX 2
+#define OUTPUT_BUF_RESERVE 4096 /* left for the writers which cannot wait */
+
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    int rpos; /* read position in 'buf' */
+    int len; /* number of bytes in 'buf' */
+    int64_t lost; /* number of dropped bytes not reported yet */
+    /* log file only */
+    char *filename;
+    int64_t file_size;
+    int64_t max_file_size; /* rotation size, 0 = no rotation */
+} OutputBuffer;
+
+static OutputBuffer *output_bufs[OUTPUT_BUF_MAX];
+static int output_buf_count;
+
+static OutputBuffer *output_buf_new(int fd)
+{
+    OutputBuffer *b;
+    assert(output_buf_count < OUTPUT_BUF_MAX);
+    b = mallocz(sizeof(*b));
+    b->fd = fd;
+    b->buf = malloc(OUTPUT_BUF_SIZE);
+    output_bufs[output_buf_count++] = b;
+    return b;
+}
+
+static int log_file_open(const char *filename)
+{
+    return open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+/* the current log file is renamed to 'filename.1' */
+static void log_file_rotate(OutputBuffer *b)
+{
+    char *old_filename;
+    int len;
+
+    close(b->fd);
+    len = strlen(b->filename) + 3;
+    old_filename = malloc(len);
+    snprintf(old_filename, len, "%s.1", b->filename);
+    rename(b->filename, old_filename);
+    free(old_filename);
+    b->fd = log_file_open(b->filename);
+    b->file_size = 0;
+}
+
+static void output_buf_put(OutputBuffer *b, const uint8_t *buf, int len)
+{
+    int wpos, len1;
+
+    while (len > 0) {
+        wpos = (b->rpos + b->len) & (OUTPUT_BUF_SIZE - 1);
+        len1 = min_int(len, OUTPUT_BUF_SIZE - max_int(wpos, b->len));
+        memcpy(b->buf + wpos, buf, len1);
+        b->len += len1;
+        buf += len1;
+        len -= len1;
+    }
+}
+
+/* write as much as possible without blocking */
+static void output_buf_flush(OutputBuffer *b)
+{
+    struct iovec iov[2];
+    int n, ret, len1;
+
+    while (b->len > 0) {
+        len1 = min_int(b->len, OUTPUT_BUF_SIZE - b->rpos);
+        iov[0].iov_base = b->buf + b->rpos;
+        iov[0].iov_len = len1;
+        n = 1;
+        if (len1 < b->len) {
+            iov[1].iov_base = b->buf;
+            iov[1].iov_len = b->len - len1;
+            n = 2;
+        }
+        ret = writev(b->fd, iov, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                b->len = 0; /* the output is lost */
+            break;
+        }
+        b->rpos = (b->rpos + ret) & (OUTPUT_BUF_SIZE - 1);
+        b->len -= ret;
+        if (b->filename) {
+            b->file_size += ret;
+            if (b->max_file_size != 0 && b->file_size >= b->max_file_size)
+                log_file_rotate(b);
+        }
+        if (b->len == 0 && b->lost != 0) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "\n[%" PRId64 " bytes lost]\n",
+                     b->lost);
+            b->lost = 0;
+            output_buf_put(b, (uint8_t *)msg, strlen(msg));
+        }
+    }
+}
+
+/* wait until the buffer is empty */
+static void output_buf_flush_sync(OutputBuffer *b)
+{
+    fd_set wfds;
+
+    for(;;) {
+        output_buf_flush(b);
+        if (b->len == 0)
+            break;
+        FD_ZERO(&wfds);
+        FD_SET(b->fd, &wfds);
+        select(b->fd + 1, NULL, &wfds, NULL, NULL);
+    }
+}
+
+/* never blocks: what does not fit is dropped */
+static void output_buf_write(OutputBuffer *b, const uint8_t *buf, int len)
+{
+    int len1;
+
+    if (len > OUTPUT_BUF_SIZE - b->len)
+        output_buf_flush(b);
+    len1 = min_int(len, OUTPUT_BUF_SIZE - b->len);
+    output_buf_put(b, buf, len1);
+    b->lost += len - len1;
+}
+
+/* number of bytes which can be written by a writer which can wait. An
+   empty buffer gives all its space so that the writers which split
+   their writes always make progress. */
+static int output_buf_get_space(OutputBuffer *b)
+{
+    if (b->len == 0)
+        return OUTPUT_BUF_SIZE;
+    return max_int(OUTPUT_BUF_SIZE - OUTPUT_BUF_RESERVE - b->len, 0);
+}
+
+static void output_bufs_flush_all(void)
+{
+    int i;
+    fflush(stdout);
+    for(i = 0; i < output_buf_count; i++)
+        output_buf_flush_sync(output_bufs[i]);
+}
+
+/* stdout is redirected to the console output buffer so that the
+   emulator messages keep their order with the guest output */
+static ssize_t output_buf_cookie_write(void *opaque, const char *buf,
+                                       size_t size)
+{
+    output_buf_write(opaque, (const uint8_t *)buf, size);
+    return size;
+}
+
+static const cookie_io_functions_t output_buf_cookie_funcs = {
+    .write = output_buf_cookie_write,
+};
+
 typedef struct {
     int stdin_fd;
     int console_esc_state;
     BOOL resize_pending;
+    OutputBuffer *out;
+    OutputBuffer *log; /* copy of the output, may be NULL */
 } STDIODevice;
 
+static void cpu_quota_dump(void);
+
 static struct termios oldtty;
-static int old_fd0_flags;
+static int old_fd0_flags, old_fd1_flags;
 static STDIODevice *global_stdio_device;
 
 static void term_exit(void)
 {
     tcsetattr (0, TCSANOW, &oldtty);
     fcntl(0, F_SETFL, old_fd0_flags);
+    fcntl(1, F_SETFL, old_fd1_flags);
 }
 
 static void term_init(BOOL allow_ctrlc)
@@ -79,6 +263,7 @@ static void term_init(BOOL allow_ctrlc)
     tcgetattr (0, &tty);
     oldtty = tty;
     old_fd0_flags = fcntl(0, F_GETFL);
+    old_fd1_flags = fcntl(1, F_GETFL);
 
     tty.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP
                           |INLCR|IGNCR|ICRNL|IXON);
@@ -98,8 +283,20 @@ static void term_init(BOOL allow_ctrlc)
 
 static void console_write(void *opaque, const uint8_t *buf, int len)
 {
-    fwrite(buf, 1, len, stdout);
-    fflush(stdout);
+    STDIODevice *s = opaque;
+    output_buf_write(s->out, buf, len);
+    if (s->log)
+        output_buf_write(s->log, buf, len);
+}
+
+static int console_get_write_space(void *opaque)
+{
+    STDIODevice *s = opaque;
+    int space;
+    space = output_buf_get_space(s->out);
+    if (s->log)
+        space = min_int(space, output_buf_get_space(s->log));
+    return space;
 }
 
 static int console_read(void *opaque, uint8_t *buf, int len)
@@ -132,9 +329,22 @@ static int console_read(void *opaque, uint8_t *buf, int len)
                 printf("\n"
                        "C-a h   print this help\n"
                        "C-a x   exit emulator\n"
+                       "C-a t   print the CPU time statistics\n"
+#ifdef CONFIG_FS_NET
+                       "C-a n   print the download statistics\n"
+#endif
                        "C-a C-a send C-a\n"
                        );
                 break;
+            case 't':
+                cpu_quota_dump();
+                break;
+#ifdef CONFIG_FS_NET
+            case 'n':
+                printf("\n");
+                fs_wget_dump_stats();
+                break;
+#endif
             case 1:
                 goto output_char;
             default:
@@ -174,20 +384,72 @@ static void console_get_size(STDIODevice *s, int *pw, int *ph)
     *ph = height;
 }
 
-CharacterDevice *console_init(BOOL allow_ctrlc)
+/* write only console port: the output goes to 'log' */
+static void log_console_write(void *opaque, const uint8_t *buf, int len)
+{
+    OutputBuffer *log = opaque;
+    output_buf_write(log, buf, len);
+}
+
+static int log_console_read(void *opaque, uint8_t *buf, int len)
+{
+    return 0;
+}
+
+static int log_console_get_write_space(void *opaque)
+{
+    OutputBuffer *log = opaque;
+    return output_buf_get_space(log);
+}
+
+/* 'log_filename' may be NULL. 'plog_dev' is set to a console port
+   whose output only goes to the log file (or to stdout if no log
+   file). */
+CharacterDevice *console_init(BOOL allow_ctrlc, const char *log_filename,
+                              int64_t log_max_size,
+                              CharacterDevice **plog_dev)
 {
-    CharacterDevice *dev;
+    CharacterDevice *dev, *log_dev;
     STDIODevice *s;
     struct sigaction sig;
+    int fd;
 
     term_init(allow_ctrlc);
 
     dev = mallocz(sizeof(*dev));
     s = mallocz(sizeof(*s));
     s->stdin_fd = 0;
-    /* Note: the glibc does not properly tests the return value of
-       write() in printf, so some messages on stdout may be lost */
     fcntl(s->stdin_fd, F_SETFL, O_NONBLOCK);
+    fcntl(1, F_SETFL, fcntl(1, F_GETFL) | O_NONBLOCK);
+    s->out = output_buf_new(1);
+    /* from now on, only the output buffer writes to fd 1 */
+    fflush(stdout);
+    stdout = fopencookie(s->out, "w", output_buf_cookie_funcs);
+    if (!stdout) {
+        perror("fopencookie");
+        exit(1);
+    }
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    if (log_filename) {
+        fd = log_file_open(log_filename);
+        if (fd < 0) {
+            perror(log_filename);
+            exit(1);
+        }
+        s->log = output_buf_new(fd);
+        s->log->filename = strdup(log_filename);
+        s->log->file_size = lseek(fd, 0, SEEK_END);
+        s->log->max_file_size = log_max_size;
+    }
+    /* the pending output is written before the terminal is restored */
+    atexit(output_bufs_flush_all);
+
+    log_dev = mallocz(sizeof(*log_dev));
+    log_dev->opaque = s->log ? s->log : s->out;
+    log_dev->write_data = log_console_write;
+    log_dev->read_data = log_console_read;
+    log_dev->get_write_space = log_console_get_write_space;
+    *plog_dev = log_dev;
 
     s->resize_pending = TRUE;
     global_stdio_device = s;
@@ -201,6 +463,7 @@ CharacterDevice *console_init(BOOL allow_ctrlc)
     dev->opaque = s;
     dev->write_data = console_write;
     dev->read_data = console_read;
+    dev->get_write_space = console_get_write_space;
     return dev;
 }
 
@@ -531,19 +794,229 @@ static EthernetDevice *slirp_open(void)
 
 #endif /* CONFIG_SLIRP */
 
+/*******************************************************/
+/* entropy source */
+
+typedef struct {
+    BOOL seeded; /* deterministic output, for reproducible runs */
+    uint64_t state;
+    int fd;
+} RNGState;
+
+static void rng_read_data(void *opaque, uint8_t *buf, int len)
+{
+    RNGState *s = opaque;
+    uint64_t v;
+    ssize_t ret;
+    int i, l;
+
+    if (s->seeded) {
+        /* splitmix64 */
+        while (len > 0) {
+            s->state += 0x9e3779b97f4a7c15;
+            v = s->state;
+            v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9;
+            v = (v ^ (v >> 27)) * 0x94d049bb133111eb;
+            v ^= v >> 31;
+            l = min_int(len, 8);
+            for(i = 0; i < l; i++) {
+                buf[i] = v;
+                v >>= 8;
+            }
+            buf += l;
+            len -= l;
+        }
+    } else {
+        while (len > 0) {
+#ifdef __linux__
+            ret = getrandom(buf, len, 0);
+#else
+            ret = read(s->fd, buf, len);
+#endif
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                perror("getrandom");
+                exit(1);
+            }
+            buf += ret;
+            len -= ret;
+        }
+    }
+}
+
+/* if 'seeded' is TRUE, the random bytes are generated from 'seed' */
+static RNGDevice *rng_init(BOOL seeded, uint64_t seed)
+{
+    RNGDevice *dev;
+    RNGState *s;
+
+    s = mallocz(sizeof(*s));
+    s->seeded = seeded;
+    s->state = seed;
+    s->fd = -1;
+#ifndef __linux__
+    if (!seeded) {
+        s->fd = open("/dev/urandom", O_RDONLY);
+        if (s->fd < 0) {
+            perror("/dev/urandom");
+            exit(1);
+        }
+    }
+#endif
+    dev = mallocz(sizeof(*dev));
+    dev->opaque = s;
+    dev->read_data = rng_read_data;
+    return dev;
+}
+
 #define MAX_EXEC_CYCLE 500000
 #define MAX_SLEEP_TIME 10 /* in ms */
 
+/*******************************************************/
+/* CPU quota */
+
+typedef struct {
+    const char *name;
+    int nice; /* host scheduling priority */
+    int period_ms; /* quota accounting period */
+    int max_exec_cycle; /* length of an interpreter slice */
+} CPUPriorityClass;
+
+/* shorter slices and periods give a lower latency to the events */
+static const CPUPriorityClass cpu_prio_tab[] = {
+    { "interactive", -5, 10, MAX_EXEC_CYCLE / 5 },
+    { "normal", 0, 50, MAX_EXEC_CYCLE },
+    { "batch", 10, 100, MAX_EXEC_CYCLE },
+};
+
+typedef struct {
+    const CPUPriorityClass *prio;
+    int cpu_quota; /* percent of a host core, 0 = no limit */
+    int mips; /* million instructions per second, 0 = no limit */
+    int64_t period_start; /* in us */
+    int64_t period_run_time; /* in us */
+    uint64_t period_insn_start;
+    BOOL throttled; /* the CPU is parked until the end of the period */
+    int64_t last_time; /* in us */
+    /* statistics */
+    int64_t total_run_time; /* in us */
+    int64_t total_throttled_time; /* in us */
+} CPUQuotaState;
+
+static CPUQuotaState cpu_quota_state = { &cpu_prio_tab[1] };
+
+static int64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
+}
+
+static BOOL cpu_quota_enabled(void)
+{
+    CPUQuotaState *q = &cpu_quota_state;
+    return (q->cpu_quota != 0 || q->mips != 0);
+}
+
+/* Return the number of cycles the CPU can execute now or 0 if it
+   must stay parked. In that case, '*pdelay' is extended to the end of
+   the current period. The guest time is not affected as the RTC
+   follows the host time. */
+static int cpu_quota_get_slice(VirtMachine *m, int *pdelay)
+{
+    CPUQuotaState *q = &cpu_quota_state;
+    int64_t now, period, budget;
+    uint64_t insn_count, max_insn;
+    int n_cycles;
+
+    n_cycles = q->prio->max_exec_cycle;
+    if (!cpu_quota_enabled())
+        return n_cycles;
+    now = get_time_us();
+    if (q->throttled)
+        q->total_throttled_time += now - q->last_time;
+    q->last_time = now;
+
+    period = (int64_t)q->prio->period_ms * 1000;
+    budget = period * q->cpu_quota / 100;
+    if (now - q->period_start >= period) {
+        q->period_start = now;
+        /* the overrun of the last slice is charged to the new period */
+        if (q->cpu_quota != 0 && q->period_run_time > budget)
+            q->period_run_time -= budget;
+        else
+            q->period_run_time = 0;
+        if (q->mips != 0)
+            q->period_insn_start = m->vmc->virt_machine_get_insn_counter(m);
+    }
+
+    q->throttled = FALSE;
+    if (q->cpu_quota != 0 && q->period_run_time >= budget) {
+        q->throttled = TRUE;
+    }
+    if (q->mips != 0) {
+        insn_count = m->vmc->virt_machine_get_insn_counter(m) -
+            q->period_insn_start;
+        max_insn = (uint64_t)q->mips * q->prio->period_ms * 1000;
+        if (insn_count >= max_insn)
+            q->throttled = TRUE;
+        else if (max_insn - insn_count < n_cycles)
+            n_cycles = max_insn - insn_count;
+    }
+    if (q->throttled) {
+        *pdelay = (q->period_start + period - now + 999) / 1000;
+        return 0;
+    }
+    return n_cycles;
+}
+
+static void cpu_quota_interp(VirtMachine *m, int n_cycles)
+{
+    CPUQuotaState *q = &cpu_quota_state;
+    int64_t t0, t1;
+
+    if (!cpu_quota_enabled()) {
+        virt_machine_interp(m, n_cycles);
+    } else {
+        t0 = get_time_us();
+        virt_machine_interp(m, n_cycles);
+        t1 = get_time_us();
+        q->period_run_time += t1 - t0;
+        q->total_run_time += t1 - t0;
+        q->last_time = t1;
+    }
+}
+
+static void cpu_quota_dump(void)
+{
+    CPUQuotaState *q = &cpu_quota_state;
+
+    printf("\npriority=%s", q->prio->name);
+    if (!cpu_quota_enabled()) {
+        printf(" (no CPU quota)\n");
+        return;
+    }
+    if (q->cpu_quota != 0)
+        printf(" quota=%d%%", q->cpu_quota);
+    if (q->mips != 0)
+        printf(" mips=%d", q->mips);
+    printf(" run=%0.3fs throttled=%0.3fs\n",
+           (double)q->total_run_time / 1e6,
+           (double)q->total_throttled_time / 1e6);
+}
+
 void virt_machine_run(VirtMachine *m)
 {
     fd_set rfds, wfds, efds;
-    int fd_max, ret, delay;
+    int fd_max, ret, delay, n_cycles;
     struct timeval tv;
 #ifndef _WIN32
-    int stdin_fd;
+    int stdin_fd, i;
 #endif
     
     delay = virt_machine_get_sleep_duration(m, MAX_SLEEP_TIME);
+    n_cycles = cpu_quota_get_slice(m, &delay);
     
     /* wait for an event */
     FD_ZERO(&rfds);
@@ -564,23 +1037,48 @@ void virt_machine_run(VirtMachine *m)
             s->resize_pending = FALSE;
         }
     }
+#endif
+#ifndef _WIN32
+    for(i = 0; i < output_buf_count; i++) {
+        OutputBuffer *b = output_bufs[i];
+        output_buf_flush(b);
+        if (b->len > 0) {
+            FD_SET(b->fd, &wfds);
+            fd_max = max_int(fd_max, b->fd);
+        }
+    }
+    /* resume the console output waiting for buffer space */
+    if (m->console_dev)
+        virtio_console_write_space_event(m->console_dev);
 #endif
     if (m->net) {
         m->net->select_fill(m->net, &fd_max, &rfds, &wfds, &efds, &delay);
     }
 #ifdef CONFIG_FS_NET
     fs_net_set_fdset(&fd_max, &rfds, &wfds, &efds, &delay);
+#endif
+#ifdef CONFIG_VHOST_USER
+    virtio_vhost_user_set_fdset(&fd_max, &rfds);
 #endif
     tv.tv_sec = delay / 1000;
     tv.tv_usec = (delay % 1000) * 1000;
     ret = select(fd_max + 1, &rfds, &wfds, &efds, &tv);
+    TRACE(main_loop_wakeup, ret, delay);
     if (m->net) {
         m->net->select_poll(m->net, &rfds, &wfds, &efds, ret);
     }
     if (ret > 0) {
+#ifdef CONFIG_VHOST_USER
+        virtio_vhost_user_poll(&rfds);
+#endif
 #ifndef _WIN32
+        for(i = 0; i < output_buf_count; i++) {
+            OutputBuffer *b = output_bufs[i];
+            if (b->len > 0 && FD_ISSET(b->fd, &wfds))
+                output_buf_flush(b);
+        }
         if (m->console_dev && FD_ISSET(stdin_fd, &rfds)) {
-            uint8_t buf[128];
+            uint8_t buf[4096];
             int ret, len;
             len = virtio_console_get_write_len(m->console_dev);
             len = min_int(len, sizeof(buf));
@@ -596,7 +1094,8 @@ void virt_machine_run(VirtMachine *m)
     sdl_refresh(m);
 #endif
     
-    virt_machine_interp(m, MAX_EXEC_CYCLE);
+    if (n_cycles > 0)
+        cpu_quota_interp(m, n_cycles);
 }
 
 /*******************************************************/
@@ -609,6 +1108,12 @@ static struct option options[] = {
     { "append", required_argument },
     { "no-accel", no_argument },
     { "build-preload", required_argument },
+    { "cpu-quota", required_argument },
+    { "mips", required_argument },
+    { "priority", required_argument },
+    { "console-log", required_argument },
+    { "console-log-size", required_argument },
+    { "rng-seed", required_argument },
     { NULL },
 };
 
@@ -623,6 +1128,14 @@ void help(void)
            "                  emulated software\n"
            "-append cmdline   append cmdline to the kernel command line\n"
            "-no-accel         disable VM acceleration (KVM, x86 machine only)\n"
+           "-cpu-quota pct    limit the CPU usage to pct percent of a host core\n"
+           "-mips n           limit the CPU speed to n million instructions per second\n"
+           "-priority class   set the scheduling class (interactive, normal, batch)\n"
+           "-console-log file copy the console output to file\n"
+           "-console-log-size n\n"
+           "                  rotate the console log file every n MB\n"
+           "-rng-seed n       generate the guest random numbers from the seed n\n"
+           "                  instead of the host entropy source\n"
            "\n"
            "Console keys:\n"
            "Press C-a x to exit the emulator, C-a h to get some help.\n");
@@ -647,9 +1160,10 @@ static BOOL net_poll_cb(void *arg)
 int main(int argc, char **argv)
 {
     VirtMachine *s;
-    const char *path, *cmdline, *build_preload_file;
-    int c, option_index, i, ram_size, accel_enable;
-    BOOL allow_ctrlc;
+    const char *path, *cmdline, *build_preload_file, *console_log;
+    int c, option_index, i, ram_size, accel_enable, console_log_size;
+    BOOL allow_ctrlc, rng_seeded;
+    uint64_t rng_seed;
     BlockDeviceModeEnum drive_mode;
     VirtMachineParams p_s, *p = &p_s;
 
@@ -660,6 +1174,10 @@ int main(int argc, char **argv)
     accel_enable = -1;
     cmdline = NULL;
     build_preload_file = NULL;
+    console_log = NULL;
+    console_log_size = 0;
+    rng_seeded = FALSE;
+    rng_seed = 0;
     for(;;) {
         c = getopt_long_only(argc, argv, "hm:", options, &option_index);
         if (c == -1)
@@ -685,6 +1203,60 @@ int main(int argc, char **argv)
             case 6: /* build-preload */
                 build_preload_file = optarg;
                 break;
+            case 7: /* cpu-quota */
+                {
+                    char *p1;
+                    long v;
+                    v = strtol(optarg, &p1, 0);
+                    if (p1 == optarg || *p1 != '\0' || v < 1 || v > 100) {
+                        fprintf(stderr, "invalid CPU quota (1 to 100): %s\n", optarg);
+                        exit(1);
+                    }
+                    cpu_quota_state.cpu_quota = v;
+                }
+                break;
+            case 8: /* mips */
+                {
+                    char *p1;
+                    long v;
+                    v = strtol(optarg, &p1, 0);
+                    if (p1 == optarg || *p1 != '\0' || v < 1 || v > 1000000) {
+                        fprintf(stderr, "invalid MIPS value: %s\n", optarg);
+                        exit(1);
+                    }
+                    cpu_quota_state.mips = v;
+                }
+                break;
+            case 9: /* priority */
+                for(i = 0; i < countof(cpu_prio_tab); i++) {
+                    if (!strcmp(optarg, cpu_prio_tab[i].name))
+                        break;
+                }
+                if (i == countof(cpu_prio_tab)) {
+                    fprintf(stderr, "unknown priority class: %s\n", optarg);
+                    exit(1);
+                }
+                cpu_quota_state.prio = &cpu_prio_tab[i];
+                break;
+            case 10: /* console-log */
+                console_log = optarg;
+                break;
+            case 11: /* console-log-size */
+                {
+                    char *p1;
+                    long v;
+                    v = strtol(optarg, &p1, 0);
+                    if (p1 == optarg || *p1 != '\0' || v < 1 || v > INT_MAX) {
+                        fprintf(stderr, "invalid console log size: %s\n", optarg);
+                        exit(1);
+                    }
+                    console_log_size = v;
+                }
+                break;
+            case 12: /* rng-seed */
+                rng_seeded = TRUE;
+                rng_seed = strtoull(optarg, NULL, 0);
+                break;
             default:
                 fprintf(stderr, "unknown option index: %d\n", option_index);
                 exit(1);
@@ -726,11 +1298,31 @@ int main(int argc, char **argv)
     if (cmdline) {
         vm_add_cmdline(p, cmdline);
     }
+    if (cpu_quota_state.mips != 0 &&
+        !p->vmc->virt_machine_get_insn_counter) {
+        fprintf(stderr, "-mips is not supported by this machine\n");
+        exit(1);
+    }
+#ifndef _WIN32
+    /* a negative value needs CAP_SYS_NICE: not fatal */
+    if (cpu_quota_state.prio->nice != 0 &&
+        setpriority(PRIO_PROCESS, 0, cpu_quota_state.prio->nice) < 0) {
+        fprintf(stderr, "warning: could not set the '%s' priority (nice %d): %s\n",
+                cpu_quota_state.prio->name, cpu_quota_state.prio->nice,
+                strerror(errno));
+    }
+#endif
     
     /* open the files & devices */
     for(i = 0; i < p->drive_count; i++) {
         BlockDevice *drive;
         char *fname;
+#ifdef CONFIG_VHOST_USER
+        /* handled by an external backend */
+        if (p->tab_drive[i].device &&
+            !strcmp(p->tab_drive[i].device, "vhost-user"))
+            continue;
+#endif
         fname = get_file_path(p->cfg_filename, p->tab_drive[i].filename);
 #ifdef CONFIG_FS_NET
         if (is_url(fname)) {
@@ -754,7 +1346,11 @@ int main(int argc, char **argv)
         path = p->tab_fs[i].filename;
 #ifdef CONFIG_FS_NET
         if (is_url(path)) {
-            fs = fs_net_init(path, NULL, NULL);
+            char *overlay = NULL;
+            if (p->tab_fs[i].overlay)
+                overlay = get_file_path(p->cfg_filename, p->tab_fs[i].overlay);
+            fs = fs_net_init(path, overlay, NULL, NULL);
+            free(overlay);
             if (!fs)
                 exit(1);
             if (build_preload_file)
@@ -794,6 +1390,11 @@ int main(int argc, char **argv)
             if (!p->tab_eth[i].net)
                 exit(1);
         } else
+#endif
+#ifdef CONFIG_VHOST_USER
+        if (!strcmp(p->tab_eth[i].driver, "vhost-user")) {
+            /* handled by an external backend */
+        } else
 #endif
         {
             fprintf(stderr, "Unsupported network driver '%s'\n",
@@ -812,10 +1413,14 @@ int main(int argc, char **argv)
         fprintf(stderr, "Console not supported yet\n");
         exit(1);
 #else
-        p->console = console_init(allow_ctrlc);
+        p->console = console_init(allow_ctrlc, console_log,
+                                  (int64_t)console_log_size << 20,
+                                  &p->log_console);
 #endif
     }
     p->rtc_real_time = TRUE;
+    if (p->rng_enable)
+        p->rng = rng_init(rng_seeded, rng_seed);
 
     s = virt_machine_init(p);
     if (!s)
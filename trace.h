@@ -0,0 +1,52 @@
+/*
+ * Static tracepoints
+ * 
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+/* TRACE(name, args...) is the USDT probe 'temu:name'. An inactive
+   probe is a single nop. The probes and their arguments are:
+
+   virtio_notify(dev, device_id, queue_idx, desc_idx)
+   virtio_complete(dev, device_id, queue_idx, desc_idx, len)
+   block_submit(dev, type, sector_num, n_sectors)   type: 0=read 1=write
+   block_complete(dev, type, ret)
+   p9_request(dev, id, tag)
+   p9_reply(dev, id, tag, len)                       id: 6 if error
+   wget_start(xhr, url, prio)
+   wget_end(xhr, err, size)                          err: 0 or -http_code
+   net_rx(slirp, pkt, len)                           guest -> host
+   net_tx(slirp, pkt, len)                           host -> guest
+   cpu_exception(cpu, cause, tval, pc)
+   cpu_interrupt(cpu, irq, pc)
+   tlb_flush(cpu)
+   main_loop_wakeup(ret, delay)                      select() result, ms
+*/
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(temu, name, ## __VA_ARGS__)
+#else
+#define TRACE(name, ...) do { } while (0)
+#endif
+
+#endif /* TRACE_H */
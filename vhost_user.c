@@ -0,0 +1,144 @@
+/*
+ * vhost-user protocol
+ * 
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "cutils.h"
+#include "vhost_user.h"
+
+/* return 0 if OK, -1 if error */
+int vhost_user_send_msg(int fd, const VhostUserMsg *msg,
+                        const int *fds, int fd_count)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+    } u;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (void *)msg;
+    iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd_count > 0) {
+        memset(&u, 0, sizeof(u));
+        mh.msg_control = u.buf;
+        mh.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+    do {
+        ret = sendmsg(fd, &mh, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != iov.iov_len)
+        return -1;
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ret = read(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* The received file descriptors are stored in 'fds' which must have
+   VHOST_USER_MAX_FDS entries. Return 0 if OK, -1 if error or end of
+   connection. */
+int vhost_user_recv_msg(int fd, VhostUserMsg *msg,
+                        int *fds, int *pfd_count)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+    } u;
+    ssize_t ret;
+    int n;
+
+    *pfd_count = 0;
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg;
+    iov.iov_len = VHOST_USER_HDR_SIZE;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = u.buf;
+    mh.msg_controllen = sizeof(u.buf);
+    do {
+        ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return -1;
+    for(cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            n = min_int(n, VHOST_USER_MAX_FDS - *pfd_count);
+            memcpy(fds + *pfd_count, CMSG_DATA(cmsg), n * sizeof(int));
+            *pfd_count += n;
+        }
+    }
+    if (ret < VHOST_USER_HDR_SIZE &&
+        read_full(fd, (uint8_t *)msg + ret, VHOST_USER_HDR_SIZE - ret) < 0)
+        goto fail;
+    if (msg->size > sizeof(msg->u))
+        goto fail;
+    if (read_full(fd, &msg->u, msg->size) < 0)
+        goto fail;
+    return 0;
+ fail:
+    for(n = 0; n < *pfd_count; n++)
+        close(fds[n]);
+    *pfd_count = 0;
+    return -1;
+}
@@ -0,0 +1,109 @@
+/*
+ * vhost-user protocol
+ * 
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+/* the messages are sent in host byte order on a Unix socket. The
+   file descriptors are passed as SCM_RIGHTS ancillary data. */
+
+enum {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+};
+
+#define VHOST_USER_VERSION         0x1
+#define VHOST_USER_VERSION_MASK    0x3
+#define VHOST_USER_REPLY_MASK      (1 << 2)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_CONFIG   9
+
+/* set in the vring index when no file descriptor is sent */
+#define VHOST_USER_VRING_NOFD_MASK (1 << 8)
+
+#define VHOST_USER_MAX_RAM_SLOTS 8
+#define VHOST_USER_MAX_FDS       8
+#define VHOST_USER_CONFIG_SIZE   256
+
+typedef struct __attribute__((packed)) {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr; /* in the address space of the frontend */
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct __attribute__((packed)) {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size; /* size of the payload */
+    union __attribute__((packed)) {
+        uint64_t u64;
+        struct {
+            uint32_t index;
+            uint32_t num;
+        } state;
+        struct {
+            uint32_t index;
+            uint32_t flags;
+            uint64_t desc_user_addr;
+            uint64_t used_user_addr;
+            uint64_t avail_user_addr;
+            uint64_t log_guest_addr;
+        } addr;
+        struct {
+            uint32_t nregions;
+            uint32_t padding;
+            VhostUserMemoryRegion regions[VHOST_USER_MAX_RAM_SLOTS];
+        } memory;
+        struct {
+            uint32_t offset;
+            uint32_t size;
+            uint32_t flags;
+            uint8_t region[VHOST_USER_CONFIG_SIZE];
+        } config;
+    } u;
+} VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE 12
+
+int vhost_user_send_msg(int fd, const VhostUserMsg *msg,
+                        const int *fds, int fd_count);
+int vhost_user_recv_msg(int fd, VhostUserMsg *msg,
+                        int *fds, int *pfd_count);
+
+#endif /* VHOST_USER_H */
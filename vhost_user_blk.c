@@ -0,0 +1,612 @@
+/*
+ * vhost-user block device backend
+ * 
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cutils.h"
+#include "vhost_user.h"
+
+/* Reference vhost-user backend: a virtio block device stored in a
+   file. Only one frontend is served at a time. */
+
+#define MAX_QUEUE 8
+#define MAX_QUEUE_NUM 32768 /* maximum virtio queue size */
+#define MAX_SEGS 64
+
+#define VIRTIO_F_VERSION_1   32
+#define VIRTIO_BLK_F_RO      5
+#define VIRTIO_BLK_F_FLUSH   9
+
+#define VIRTIO_BLK_T_IN      0
+#define VIRTIO_BLK_T_OUT     1
+#define VIRTIO_BLK_T_FLUSH   4
+#define VIRTIO_BLK_T_GET_ID  8
+
+#define VIRTIO_BLK_S_OK      0
+#define VIRTIO_BLK_S_IOERR   1
+#define VIRTIO_BLK_S_UNSUPP  2
+
+#define SECTOR_SIZE 512
+
+#define VRING_DESC_F_NEXT        1
+#define VRING_DESC_F_WRITE       2
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct {
+    uint64_t guest_phys_addr;
+    uint64_t size;
+    uint64_t userspace_addr;
+    uint8_t *ptr; /* mapping of the region start */
+    uint8_t *mmap_addr;
+    uint64_t mmap_size;
+} MemRegion;
+
+typedef struct {
+    int num;
+    VRingDesc *desc;
+    uint16_t *avail;
+    uint8_t *used;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    int kick_fd;
+    int call_fd;
+    BOOL enabled;
+} VRing;
+
+typedef struct {
+    uint8_t *ptr;
+    uint32_t len;
+    BOOL is_write;
+} Segment;
+
+static int img_fd;
+static uint64_t nb_sectors;
+static BOOL read_only;
+static int debug;
+
+static MemRegion mem_regions[VHOST_USER_MAX_RAM_SLOTS];
+static int mem_region_count;
+static VRing vrings[MAX_QUEUE];
+static BOOL has_protocol_features;
+
+static void *gpa_to_ptr(uint64_t gpa, uint64_t len)
+{
+    MemRegion *r;
+    int i;
+    for(i = 0; i < mem_region_count; i++) {
+        r = &mem_regions[i];
+        if (gpa >= r->guest_phys_addr &&
+            gpa - r->guest_phys_addr + len <= r->size)
+            return r->ptr + (gpa - r->guest_phys_addr);
+    }
+    return NULL;
+}
+
+static void *uaddr_to_ptr(uint64_t uaddr, uint64_t len)
+{
+    MemRegion *r;
+    int i;
+    for(i = 0; i < mem_region_count; i++) {
+        r = &mem_regions[i];
+        if (uaddr >= r->userspace_addr &&
+            uaddr - r->userspace_addr + len <= r->size)
+            return r->ptr + (uaddr - r->userspace_addr);
+    }
+    return NULL;
+}
+
+static void unmap_regions(void)
+{
+    int i;
+    for(i = 0; i < mem_region_count; i++)
+        munmap(mem_regions[i].mmap_addr, mem_regions[i].mmap_size);
+    mem_region_count = 0;
+}
+
+static void vring_reset(VRing *vr)
+{
+    if (vr->kick_fd >= 0)
+        close(vr->kick_fd);
+    if (vr->call_fd >= 0)
+        close(vr->call_fd);
+    memset(vr, 0, sizeof(*vr));
+    vr->kick_fd = -1;
+    vr->call_fd = -1;
+}
+
+/* copy 'len' bytes at 'offset' of the device readable segments */
+static int segs_read(Segment *segs, int n, int offset, void *buf, int len)
+{
+    int i, l;
+    uint8_t *p = buf;
+    for(i = 0; i < n && len > 0; i++) {
+        if (segs[i].is_write)
+            continue;
+        if (offset >= segs[i].len) {
+            offset -= segs[i].len;
+            continue;
+        }
+        l = min_int(len, segs[i].len - offset);
+        memcpy(p, segs[i].ptr + offset, l);
+        p += l;
+        len -= l;
+        offset = 0;
+    }
+    return len == 0 ? 0 : -1;
+}
+
+/* return the number of bytes written in the guest buffers */
+static uint32_t blk_request(Segment *segs, int n)
+{
+    uint8_t hdr[16], *status_ptr;
+    uint32_t type, written_len;
+    uint64_t pos;
+    int i, l, offset, status, last;
+    ssize_t ret;
+
+    /* the status byte is the last byte of the last writable segment */
+    last = n - 1;
+    if (last < 0 || !segs[last].is_write || segs[last].len == 0)
+        return 0;
+    status_ptr = segs[last].ptr + segs[last].len - 1;
+    segs[last].len--;
+    written_len = 1;
+    if (segs_read(segs, n, 0, hdr, sizeof(hdr)) < 0) {
+        *status_ptr = VIRTIO_BLK_S_IOERR;
+        return written_len;
+    }
+    type = get_le32(hdr);
+    pos = get_le64(hdr + 8) * SECTOR_SIZE;
+    status = VIRTIO_BLK_S_OK;
+    if (debug)
+        printf("vhost_user_blk: type=%d sector=%" PRIu64 "\n",
+               type, pos / SECTOR_SIZE);
+    switch(type) {
+    case VIRTIO_BLK_T_IN:
+        for(i = 0; i < n; i++) {
+            if (!segs[i].is_write)
+                continue;
+            ret = pread(img_fd, segs[i].ptr, segs[i].len, pos);
+            if (ret != segs[i].len) {
+                status = VIRTIO_BLK_S_IOERR;
+                break;
+            }
+            pos += ret;
+            written_len += ret;
+        }
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (read_only) {
+            status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        offset = sizeof(hdr);
+        for(i = 0; i < n; i++) {
+            if (segs[i].is_write)
+                continue;
+            if (offset >= segs[i].len) {
+                offset -= segs[i].len;
+                continue;
+            }
+            l = segs[i].len - offset;
+            ret = pwrite(img_fd, segs[i].ptr + offset, l, pos);
+            if (ret != l) {
+                status = VIRTIO_BLK_S_IOERR;
+                break;
+            }
+            pos += l;
+            offset = 0;
+        }
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        if (fdatasync(img_fd) < 0)
+            status = VIRTIO_BLK_S_IOERR;
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        for(i = 0; i < n; i++) {
+            if (segs[i].is_write) {
+                l = min_int(segs[i].len, 20);
+                memset(segs[i].ptr, 0, l);
+                memcpy(segs[i].ptr, "vhost_user_blk", min_int(l, 14));
+                written_len += l;
+                break;
+            }
+        }
+        break;
+    default:
+        status = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+    *status_ptr = status;
+    return written_len;
+}
+
+static void vring_process(VRing *vr)
+{
+    uint16_t avail_idx, head, desc_idx;
+    Segment segs[MAX_SEGS];
+    VRingDesc *d;
+    uint8_t *used_elem;
+    uint32_t written_len;
+    int n, count;
+    BOOL notify;
+
+    notify = FALSE;
+    for(;;) {
+        avail_idx = __atomic_load_n(&vr->avail[1], __ATOMIC_ACQUIRE);
+        if (vr->last_avail_idx == avail_idx)
+            break;
+        head = vr->avail[2 + (vr->last_avail_idx & (vr->num - 1))];
+        n = 0;
+        desc_idx = head;
+        for(count = 0; count < vr->num; count++) {
+            if (desc_idx >= vr->num || n >= MAX_SEGS)
+                goto bad_chain;
+            d = &vr->desc[desc_idx];
+            segs[n].ptr = gpa_to_ptr(d->addr, d->len);
+            if (!segs[n].ptr)
+                goto bad_chain;
+            segs[n].len = d->len;
+            segs[n].is_write = (d->flags & VRING_DESC_F_WRITE) != 0;
+            n++;
+            if (!(d->flags & VRING_DESC_F_NEXT))
+                break;
+            desc_idx = d->next;
+        }
+        written_len = blk_request(segs, n);
+        goto done;
+    bad_chain:
+        fprintf(stderr, "vhost_user_blk: invalid descriptor chain\n");
+        written_len = 0;
+    done:
+        used_elem = vr->used + 4 + (vr->used_idx & (vr->num - 1)) * 8;
+        put_le32(used_elem, head);
+        put_le32(used_elem + 4, written_len);
+        vr->used_idx++;
+        __atomic_store_n((uint16_t *)(vr->used + 2), vr->used_idx,
+                         __ATOMIC_RELEASE);
+        vr->last_avail_idx++;
+        notify = TRUE;
+    }
+    if (notify && !(vr->avail[0] & VRING_AVAIL_F_NO_INTERRUPT) &&
+        vr->call_fd >= 0) {
+        uint64_t val = 1;
+        if (write(vr->call_fd, &val, sizeof(val)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+static void send_reply(int fd, VhostUserMsg *msg, int size)
+{
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    msg->size = size;
+    if (vhost_user_send_msg(fd, msg, NULL, 0) < 0)
+        perror("sendmsg");
+}
+
+static void close_fds(int *fds, int fd_count)
+{
+    int i;
+    for(i = 0; i < fd_count; i++)
+        close(fds[i]);
+}
+
+/* return -1 if the connection must be closed */
+static int handle_msg(int fd, VhostUserMsg *msg, int *fds, int fd_count)
+{
+    VhostUserMemoryRegion *r;
+    MemRegion *mr;
+    VRing *vr;
+    uint32_t idx;
+    int i;
+
+    if (debug)
+        printf("vhost_user_blk: request %d\n", msg->request);
+    switch(msg->request) {
+    case VHOST_USER_GET_FEATURES:
+        msg->u.u64 = ((uint64_t)1 << VIRTIO_F_VERSION_1) |
+            ((uint64_t)1 << VHOST_USER_F_PROTOCOL_FEATURES) |
+            (1 << VIRTIO_BLK_F_FLUSH);
+        if (read_only)
+            msg->u.u64 |= 1 << VIRTIO_BLK_F_RO;
+        send_reply(fd, msg, sizeof(msg->u.u64));
+        break;
+    case VHOST_USER_SET_FEATURES:
+        has_protocol_features = (msg->u.u64 >>
+                                 VHOST_USER_F_PROTOCOL_FEATURES) & 1;
+        break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg->u.u64 = (uint64_t)1 << VHOST_USER_PROTOCOL_F_CONFIG;
+        send_reply(fd, msg, sizeof(msg->u.u64));
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        unmap_regions();
+        if (msg->u.memory.nregions > VHOST_USER_MAX_RAM_SLOTS ||
+            msg->u.memory.nregions != fd_count) {
+            close_fds(fds, fd_count);
+            return -1;
+        }
+        for(i = 0; i < fd_count; i++) {
+            r = &msg->u.memory.regions[i];
+            mr = &mem_regions[i];
+            mr->guest_phys_addr = r->guest_phys_addr;
+            mr->size = r->memory_size;
+            mr->userspace_addr = r->userspace_addr;
+            mr->mmap_size = r->memory_size + r->mmap_offset;
+            mr->mmap_addr = mmap(NULL, mr->mmap_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fds[i], 0);
+            close(fds[i]);
+            if (mr->mmap_addr == MAP_FAILED) {
+                perror("mmap");
+                close_fds(fds + i + 1, fd_count - i - 1);
+                return -1;
+            }
+            mr->ptr = mr->mmap_addr + r->mmap_offset;
+            mem_region_count++;
+        }
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+        if (msg->u.state.index >= MAX_QUEUE ||
+            msg->u.state.num == 0 || msg->u.state.num > MAX_QUEUE_NUM ||
+            (msg->u.state.num & (msg->u.state.num - 1)) != 0)
+            return -1;
+        vr = &vrings[msg->u.state.index];
+        vr->num = msg->u.state.num;
+        /* the ring addresses are checked against the new size */
+        vr->desc = NULL;
+        vr->avail = NULL;
+        vr->used = NULL;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        if (msg->u.addr.index >= MAX_QUEUE)
+            return -1;
+        vr = &vrings[msg->u.addr.index];
+        /* the ring size must be set first */
+        if (vr->num == 0)
+            return -1;
+        vr->desc = uaddr_to_ptr(msg->u.addr.desc_user_addr,
+                                (uint64_t)vr->num * 16);
+        vr->avail = uaddr_to_ptr(msg->u.addr.avail_user_addr,
+                                 6 + (uint64_t)vr->num * 2);
+        vr->used = uaddr_to_ptr(msg->u.addr.used_user_addr,
+                                6 + (uint64_t)vr->num * 8);
+        if (!vr->desc || !vr->avail || !vr->used)
+            return -1;
+        vr->used_idx = get_le16(vr->used + 2);
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        if (msg->u.state.index >= MAX_QUEUE)
+            return -1;
+        vrings[msg->u.state.index].last_avail_idx = msg->u.state.num;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        if (msg->u.state.index >= MAX_QUEUE)
+            return -1;
+        vr = &vrings[msg->u.state.index];
+        msg->u.state.num = vr->last_avail_idx;
+        vring_reset(vr);
+        send_reply(fd, msg, sizeof(msg->u.state));
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        idx = msg->u.u64 & 0xff;
+        if (idx >= MAX_QUEUE) {
+            close_fds(fds, fd_count);
+            return -1;
+        }
+        vr = &vrings[idx];
+        if (msg->request == VHOST_USER_SET_VRING_KICK) {
+            if (vr->kick_fd >= 0)
+                close(vr->kick_fd);
+            vr->kick_fd = fd_count > 0 ? fds[0] : -1;
+            /* without protocol features, the ring starts when the kick
+               file descriptor is received */
+            if (!has_protocol_features)
+                vr->enabled = TRUE;
+        } else if (msg->request == VHOST_USER_SET_VRING_CALL) {
+            if (vr->call_fd >= 0)
+                close(vr->call_fd);
+            vr->call_fd = fd_count > 0 ? fds[0] : -1;
+        } else {
+            close_fds(fds, fd_count);
+        }
+        break;
+    case VHOST_USER_SET_VRING_ENABLE:
+        if (msg->u.state.index >= MAX_QUEUE)
+            return -1;
+        vr = &vrings[msg->u.state.index];
+        vr->enabled = msg->u.state.num;
+        if (vr->enabled && vr->kick_fd >= 0 && vr->desc)
+            vring_process(vr);
+        break;
+    case VHOST_USER_GET_CONFIG:
+        {
+            uint32_t size = min_int(msg->u.config.size,
+                                    VHOST_USER_CONFIG_SIZE);
+            memset(msg->u.config.region, 0, size);
+            if (size >= 8)
+                put_le64(msg->u.config.region, nb_sectors);
+            msg->u.config.size = size;
+            send_reply(fd, msg, 12 + size);
+        }
+        break;
+    default:
+        fprintf(stderr, "vhost_user_blk: unsupported request %d\n",
+                msg->request);
+        close_fds(fds, fd_count);
+        break;
+    }
+    return 0;
+}
+
+static void serve(int conn_fd)
+{
+    struct pollfd pfd[1 + MAX_QUEUE];
+    int vring_tab[MAX_QUEUE];
+    int fds[VHOST_USER_MAX_FDS], fd_count, i, n;
+    VhostUserMsg msg;
+    uint64_t val;
+
+    for(i = 0; i < MAX_QUEUE; i++)
+        vring_reset(&vrings[i]);
+    has_protocol_features = FALSE;
+    for(;;) {
+        pfd[0].fd = conn_fd;
+        pfd[0].events = POLLIN;
+        n = 1;
+        for(i = 0; i < MAX_QUEUE; i++) {
+            if (vrings[i].kick_fd >= 0) {
+                pfd[n].fd = vrings[i].kick_fd;
+                pfd[n].events = POLLIN;
+                vring_tab[n - 1] = i;
+                n++;
+            }
+        }
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        for(i = 1; i < n; i++) {
+            if (pfd[i].revents & POLLIN) {
+                VRing *vr = &vrings[vring_tab[i - 1]];
+                if (read(vr->kick_fd, &val, sizeof(val)) < 0)
+                    continue;
+                if (vr->enabled && vr->desc)
+                    vring_process(vr);
+            }
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (vhost_user_recv_msg(conn_fd, &msg, fds, &fd_count) < 0)
+                break;
+            if (handle_msg(conn_fd, &msg, fds, fd_count) < 0) {
+                fprintf(stderr, "vhost_user_blk: invalid request %d\n",
+                        msg.request);
+                break;
+            }
+        }
+    }
+    for(i = 0; i < MAX_QUEUE; i++)
+        vring_reset(&vrings[i]);
+    unmap_regions();
+}
+
+static void help(void)
+{
+    printf("vhost_user_blk version " CONFIG_VERSION ", Copyright (c) 2026 agent\n"
+           "usage: vhost_user_blk [options] image socket_path\n"
+           "Serve a virtio block device stored in 'image' to a vhost-user frontend\n"
+           "\n"
+           "options are:\n"
+           "-r   read-only device\n"
+           "-d   print the requests\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *image, *path;
+    struct sockaddr_un addr;
+    struct stat st;
+    int c, listen_fd, conn_fd;
+
+    for(;;) {
+        c = getopt(argc, argv, "hrd");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'r':
+            read_only = TRUE;
+            break;
+        case 'd':
+            debug = 1;
+            break;
+        default:
+            help();
+        }
+    }
+    if (optind + 1 >= argc)
+        help();
+    image = argv[optind++];
+    path = argv[optind++];
+
+    img_fd = open(image, read_only ? O_RDONLY : O_RDWR);
+    if (img_fd < 0 || fstat(img_fd, &st) < 0) {
+        perror(image);
+        exit(1);
+    }
+    nb_sectors = st.st_size / SECTOR_SIZE;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0) {
+        perror(path);
+        exit(1);
+    }
+    for(;;) {
+        conn_fd = accept(listen_fd, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            exit(1);
+        }
+        serve(conn_fd);
+        close(conn_fd);
+    }
+    return 0;
+}
@@ -27,10 +27,21 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
+#ifdef CONFIG_VHOST_USER
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "cutils.h"
 #include "list.h"
 #include "virtio.h"
+#include "trace.h"
+#ifdef CONFIG_VHOST_USER
+#include "vhost_user.h"
+#endif
 
 //#define DEBUG_VIRTIO
 
@@ -91,6 +102,9 @@
 
 #define VIRTIO_PCI_CAP_LEN 16
 
+#define VIRTIO_STATUS_DRIVER_OK        0x04
+#define VIRTIO_STATUS_DEVICE_NEEDS_RESET 0x40
+
 #define MAX_QUEUE 8
 #define MAX_CONFIG_SPACE_SIZE 256
 #define MAX_QUEUE_NUM 16
@@ -145,6 +159,8 @@ struct VIRTIODevice {
     uint32_t int_status;
     uint32_t status;
     uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features; /* accepted by the driver */
     uint32_t queue_sel; /* currently selected queue */
     QueueState queue[MAX_QUEUE];
 
@@ -152,13 +168,27 @@ struct VIRTIODevice {
     uint32_t device_id;
     uint32_t vendor_id;
     uint32_t device_features;
+    uint32_t queue_num_max; /* power of two <= 65536 */
     VIRTIODeviceRecvFunc *device_recv;
     void (*config_write)(VIRTIODevice *s); /* called after the config
                                               is written */
+    /* optional: TRUE if an asynchronous request is in progress */
+    BOOL (*device_is_busy)(VIRTIODevice *s);
+    /* optional: called when the driver resets the device */
+    void (*device_reset)(VIRTIODevice *s);
     uint32_t config_space_size; /* in bytes, must be multiple of 4 */
     uint8_t config_space[MAX_CONFIG_SPACE_SIZE];
+#ifdef CONFIG_VHOST_USER
+    struct VhostUserDevice *vhost; /* not NULL for a vhost-user device */
+#endif
 };
 
+#ifdef CONFIG_VHOST_USER
+static void vhost_user_start(VIRTIODevice *s);
+static void vhost_user_stop(VIRTIODevice *s);
+static void vhost_user_kick(VIRTIODevice *s, int queue_idx);
+#endif
+
 static uint32_t virtio_mmio_read(void *opaque, uint32_t offset1, int size_log2);
 static void virtio_mmio_write(void *opaque, uint32_t offset,
                               uint32_t val, int size_log2);
@@ -173,11 +203,13 @@ static void virtio_reset(VIRTIODevice *s)
     s->status = 0;
     s->queue_sel = 0;
     s->device_features_sel = 0;
+    s->driver_features_sel = 0;
+    s->driver_features = 0;
     s->int_status = 0;
     for(i = 0; i < MAX_QUEUE; i++) {
         QueueState *qs = &s->queue[i];
         qs->ready = 0;
-        qs->num = MAX_QUEUE_NUM;
+        qs->num = s->queue_num_max;
         qs->desc_addr = 0;
         qs->avail_addr = 0;
         qs->used_addr = 0;
@@ -248,6 +280,10 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
             pci_device_id = 0x1003; /* console */
             class_id = 0x0780;
             break;
+        case 4:
+            pci_device_id = 0x1005; /* entropy */
+            class_id = 0x00ff;
+            break;
         case 9:
             pci_device_id = 0x1040 + device_id; /* use new device ID */
             class_id = 0x2;
@@ -298,6 +334,7 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
     s->device_id = device_id;
     s->vendor_id = 0xffff;
     s->config_space_size = config_space_size;
+    s->queue_num_max = MAX_QUEUE_NUM;
     s->device_recv = device_recv;
     virtio_reset(s);
 }
@@ -464,6 +501,72 @@ static int memcpy_to_queue(VIRTIODevice *s,
                                 count, TRUE);
 }
 
+/* Return a host pointer to the guest buffer at 'offset' in the read
+   (to_queue = FALSE) or write part of a descriptor chain so that the
+   device can access it without copying. '*plen' is set to the length
+   of the host contiguous part, at most 'count'. Return NULL if the
+   chain is too short. */
+static uint8_t *get_queue_ptr(VIRTIODevice *s, int *plen,
+                              int queue_idx, int desc_idx,
+                              int offset, int count, BOOL to_queue)
+{
+    VIRTIODesc desc;
+    virtio_phys_addr_t addr;
+    uint8_t *ptr, *ptr0;
+    int l, len, pos, f_write_flag;
+
+    *plen = 0;
+    get_desc(s, &desc, queue_idx, desc_idx);
+    if (to_queue) {
+        f_write_flag = VRING_DESC_F_WRITE;
+        for(;;) {
+            if ((desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
+                break;
+            if (!(desc.flags & VRING_DESC_F_NEXT))
+                return NULL;
+            get_desc(s, &desc, queue_idx, desc.next);
+        }
+    } else {
+        f_write_flag = 0;
+    }
+
+    ptr0 = NULL;
+    pos = 0;
+    for(;;) {
+        if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+            break;
+        if (offset < desc.len) {
+            len = min_int(count - pos, desc.len - offset);
+            addr = desc.addr + offset;
+            while (len > 0) {
+                l = min_int(len, VIRTIO_PAGE_SIZE -
+                            (addr & (VIRTIO_PAGE_SIZE - 1)));
+                ptr = s->get_ram_ptr(s, addr, to_queue);
+                if (!ptr)
+                    goto done;
+                if (!ptr0)
+                    ptr0 = ptr;
+                else if (ptr != ptr0 + pos)
+                    goto done;
+                addr += l;
+                len -= l;
+                pos += l;
+            }
+            if (pos == count)
+                break;
+            offset = 0;
+        } else {
+            offset -= desc.len;
+        }
+        if (!(desc.flags & VRING_DESC_F_NEXT))
+            break;
+        get_desc(s, &desc, queue_idx, desc.next);
+    }
+ done:
+    *plen = pos;
+    return ptr0;
+}
+
 /* signal that the descriptor has been consumed */
 static void virtio_consume_desc(VIRTIODevice *s,
                                 int queue_idx, int desc_idx, int desc_len)
@@ -479,6 +582,7 @@ static void virtio_consume_desc(VIRTIODevice *s,
     addr = qs->used_addr + 4 + (index & (qs->num - 1)) * 8;
     virtio_write32(s, addr, desc_idx);
     virtio_write32(s, addr + 4, desc_len);
+    TRACE(virtio_complete, s, s->device_id, queue_idx, desc_idx, desc_len);
 
     s->int_status |= 1;
     set_irq(s->irq, 1);
@@ -528,6 +632,12 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
     uint16_t avail_idx;
     int desc_idx, read_size, write_size;
 
+#ifdef CONFIG_VHOST_USER
+    if (s->vhost) {
+        vhost_user_kick(s, queue_idx);
+        return;
+    }
+#endif
     if (qs->manual_recv)
         return;
 
@@ -542,6 +652,7 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
                        queue_idx, read_size, write_size);
             }
 #endif
+            TRACE(virtio_notify, s, s->device_id, queue_idx, desc_idx);
             if (s->device_recv(s, queue_idx, desc_idx,
                                read_size, write_size) < 0)
                 break;
@@ -550,6 +661,33 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
     }
 }
 
+static void virtio_set_status(VIRTIODevice *s, uint32_t val)
+{
+#ifdef CONFIG_VHOST_USER
+    if (s->vhost && (s->status & VIRTIO_STATUS_DRIVER_OK) &&
+        !(val & VIRTIO_STATUS_DRIVER_OK)) {
+        vhost_user_stop(s);
+    }
+#endif
+    if (val == 0) {
+        /* reset */
+        set_irq(s->irq, 0);
+        virtio_reset(s);
+        if (s->device_reset)
+            s->device_reset(s);
+        return;
+    }
+#ifdef CONFIG_VHOST_USER
+    if (s->vhost && !(s->status & VIRTIO_STATUS_DRIVER_OK) &&
+        (val & VIRTIO_STATUS_DRIVER_OK)) {
+        s->status = val;
+        vhost_user_start(s);
+        return;
+    }
+#endif
+    s->status = val;
+}
+
 static uint32_t virtio_config_read(VIRTIODevice *s, uint32_t offset,
                                    int size_log2)
 {
@@ -653,7 +791,7 @@ static uint32_t virtio_mmio_read(void *opaque, uint32_t offset, int size_log2)
             val = s->queue_sel;
             break;
         case VIRTIO_MMIO_QUEUE_NUM_MAX:
-            val = MAX_QUEUE_NUM;
+            val = s->queue_num_max;
             break;
         case VIRTIO_MMIO_QUEUE_NUM:
             val = s->queue[s->queue_sel].num;
@@ -723,6 +861,17 @@ static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
 }
 #endif
 
+static void set_driver_features(VIRTIODevice *s, uint32_t val)
+{
+    if (s->driver_features_sel == 0) {
+        s->driver_features = (s->driver_features & ~(uint64_t)0xffffffff) |
+            val;
+    } else if (s->driver_features_sel == 1) {
+        s->driver_features = (s->driver_features & 0xffffffff) |
+            ((uint64_t)val << 32);
+    }
+}
+
 static void virtio_mmio_write(void *opaque, uint32_t offset,
                               uint32_t val, int size_log2)
 {
@@ -774,13 +923,14 @@ static void virtio_mmio_write(void *opaque, uint32_t offset,
             set_high32(&s->queue[s->queue_sel].used_addr, val);
             break;
 #endif
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            set_driver_features(s, val);
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            s->driver_features_sel = val;
+            break;
         case VIRTIO_MMIO_STATUS:
-            s->status = val;
-            if (val == 0) {
-                /* reset */
-                set_irq(s->irq, 0);
-                virtio_reset(s);
-            }
+            virtio_set_status(s, val);
             break;
         case VIRTIO_MMIO_QUEUE_READY:
             s->queue[s->queue_sel].ready = val & 1;
@@ -913,6 +1063,12 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
             case VIRTIO_PCI_DEVICE_FEATURE_SEL:
                 s->device_features_sel = val;
                 break;
+            case VIRTIO_PCI_GUEST_FEATURE_SEL:
+                s->driver_features_sel = val;
+                break;
+            case VIRTIO_PCI_GUEST_FEATURE:
+                set_driver_features(s, val);
+                break;
             case VIRTIO_PCI_QUEUE_DESC_LOW:
                 set_low32(&s->queue[s->queue_sel].desc_addr, val);
                 break;
@@ -952,12 +1108,7 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
         } else if (size_log2 == 0) {
             switch(offset) {
             case VIRTIO_PCI_DEVICE_STATUS:
-                s->status = val;
-                if (val == 0) {
-                    /* reset */
-                    set_irq(s->irq, 0);
-                    virtio_reset(s);
-                }
+                virtio_set_status(s, val);
                 break;
             }
         }
@@ -977,6 +1128,19 @@ void virtio_set_debug(VIRTIODevice *s, int debug)
     s->debug = debug;
 }
 
+/* TRUE if the device cannot be reset because a request is still
+   being handled asynchronously */
+BOOL virtio_is_busy(VIRTIODevice *s)
+{
+    return s->device_is_busy && s->device_is_busy(s);
+}
+
+/* same as a reset by the driver */
+void virtio_reset_device(VIRTIODevice *s)
+{
+    virtio_set_status(s, 0);
+}
+
 static void virtio_config_change_notify(VIRTIODevice *s)
 {
     /* INT_CONFIG interrupt */
@@ -1028,6 +1192,7 @@ static void virtio_block_req_end(VIRTIODevice *s, int ret)
     int desc_idx = s1->req.desc_idx;
     uint8_t *buf, buf1[1];
 
+    TRACE(block_complete, s, s1->req.type, ret);
     switch(s1->req.type) {
     case VIRTIO_BLK_T_IN:
         write_size = s1->req.write_size;
@@ -1090,6 +1255,8 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
     case VIRTIO_BLK_T_IN:
         s1->req.buf = malloc(write_size);
         s1->req.write_size = write_size;
+        TRACE(block_submit, s, h.type, h.sector_num,
+              (write_size - 1) / SECTOR_SIZE);
         ret = bs->read_async(bs, h.sector_num, s1->req.buf, 
                              (write_size - 1) / SECTOR_SIZE,
                              virtio_block_req_cb, s);
@@ -1105,6 +1272,7 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
         len = read_size - sizeof(h);
         buf = malloc(len);
         memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
+        TRACE(block_submit, s, h.type, h.sector_num, len / SECTOR_SIZE);
         ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
                               virtio_block_req_cb, s);
         free(buf);
@@ -1121,6 +1289,12 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
     return 0;
 }
 
+static BOOL virtio_block_is_busy(VIRTIODevice *s)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    return s1->req_in_progress;
+}
+
 VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs)
 {
     VIRTIOBlockDevice *s;
@@ -1129,6 +1303,7 @@ VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs)
     s = mallocz(sizeof(*s));
     virtio_init(&s->common, bus,
                 2, 8, virtio_block_recv_request);
+    s->common.device_is_busy = virtio_block_is_busy;
     s->bs = bs;
     
     nb_sectors = bs->get_sector_count(bs);
@@ -1267,25 +1442,207 @@ VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es)
 /*********************************************************************/
 /* console device */
 
+#define VIRTIO_CONSOLE_F_SIZE      (1 << 0)
+#define VIRTIO_CONSOLE_F_MULTIPORT (1 << 1)
+
+/* limited by MAX_QUEUE: each port has 2 queues + 2 control queues */
+#define VIRTIO_CONSOLE_MAX_PORTS 2
+
+#define VIRTIO_CONSOLE_CTRL_QUEUE_RX 2 /* device to driver */
+#define VIRTIO_CONSOLE_CTRL_QUEUE_TX 3
+
+enum {
+    VIRTIO_CONSOLE_DEVICE_READY = 0,
+    VIRTIO_CONSOLE_DEVICE_ADD = 1,
+    VIRTIO_CONSOLE_DEVICE_REMOVE = 2,
+    VIRTIO_CONSOLE_PORT_READY = 3,
+    VIRTIO_CONSOLE_CONSOLE_PORT = 4,
+    VIRTIO_CONSOLE_RESIZE = 5,
+    VIRTIO_CONSOLE_PORT_OPEN = 6,
+    VIRTIO_CONSOLE_PORT_NAME = 7,
+};
+
+#define VIRTIO_CONSOLE_CTRL_FIFO_SIZE 16
+#define VIRTIO_CONSOLE_CTRL_MSG_SIZE 64
+
+typedef struct {
+    int len;
+    uint8_t buf[VIRTIO_CONSOLE_CTRL_MSG_SIZE];
+} VIRTIOConsoleCtrlMsg;
+
 typedef struct VIRTIOConsoleDevice {
     VIRTIODevice common;
-    CharacterDevice *cs;
+    int port_count;
+    CharacterDevice *port_cs[VIRTIO_CONSOLE_MAX_PORTS]; /* port 0 is
+                                                            the console */
+    char *port_name[VIRTIO_CONSOLE_MAX_PORTS];
+    BOOL multiport_ready; /* the driver uses the control queues */
+    /* control messages waiting for a driver buffer */
+    VIRTIOConsoleCtrlMsg ctrl_fifo[VIRTIO_CONSOLE_CTRL_FIFO_SIZE];
+    int ctrl_start, ctrl_count;
+    uint32_t tx_blocked; /* bit n: port n waits for write space */
+    /* bytes of the current output buffer of each port already written */
+    int tx_pos[VIRTIO_CONSOLE_MAX_PORTS];
 } VIRTIOConsoleDevice;
 
+/* write 'buf' to the next available buffer of a device writable
+   queue. Return -1 if no buffer is available. */
+static int virtio_queue_write_buf(VIRTIODevice *s, int queue_idx,
+                                  const uint8_t *buf, int buf_len)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    int desc_idx;
+    uint16_t avail_idx;
+
+    if (!qs->ready)
+        return -1;
+    avail_idx = virtio_read16(s, qs->avail_addr + 2);
+    if (qs->last_avail_idx == avail_idx)
+        return -1;
+    desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
+                             (qs->last_avail_idx & (qs->num - 1)) * 2);
+    memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, buf_len);
+    virtio_consume_desc(s, queue_idx, desc_idx, buf_len);
+    qs->last_avail_idx++;
+    return 0;
+}
+
+static void virtio_console_flush_ctrl(VIRTIOConsoleDevice *s)
+{
+    VIRTIOConsoleCtrlMsg *m;
+    
+    while (s->ctrl_count > 0) {
+        m = &s->ctrl_fifo[s->ctrl_start];
+        if (virtio_queue_write_buf(&s->common, VIRTIO_CONSOLE_CTRL_QUEUE_RX,
+                                   m->buf, m->len) < 0)
+            break;
+        s->ctrl_start = (s->ctrl_start + 1) % VIRTIO_CONSOLE_CTRL_FIFO_SIZE;
+        s->ctrl_count--;
+    }
+}
+
+static void virtio_console_send_ctrl(VIRTIOConsoleDevice *s, uint32_t id,
+                                     uint16_t event, uint16_t value,
+                                     const void *data, int data_len)
+{
+    VIRTIOConsoleCtrlMsg *m;
+
+    if (s->ctrl_count >= VIRTIO_CONSOLE_CTRL_FIFO_SIZE)
+        return; /* the driver does not read its control queue */
+    m = &s->ctrl_fifo[(s->ctrl_start + s->ctrl_count) %
+                      VIRTIO_CONSOLE_CTRL_FIFO_SIZE];
+    data_len = min_int(data_len, VIRTIO_CONSOLE_CTRL_MSG_SIZE - 8);
+    put_le32(m->buf, id);
+    put_le16(m->buf + 4, event);
+    put_le16(m->buf + 6, value);
+    memcpy(m->buf + 8, data, data_len);
+    m->len = 8 + data_len;
+    s->ctrl_count++;
+    virtio_console_flush_ctrl(s);
+}
+
+static void virtio_console_send_resize(VIRTIOConsoleDevice *s)
+{
+    uint8_t buf[4];
+    /* same layout as the config space */
+    memcpy(buf, s->common.config_space, 4);
+    virtio_console_send_ctrl(s, 0, VIRTIO_CONSOLE_RESIZE, 0, buf, 4);
+}
+
+static void virtio_console_handle_ctrl(VIRTIOConsoleDevice *s,
+                                       uint32_t id, uint16_t event,
+                                       uint16_t value)
+{
+    int i;
+    
+    switch(event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+        if (value) {
+            s->multiport_ready = TRUE;
+            for(i = 0; i < s->port_count; i++) {
+                virtio_console_send_ctrl(s, i, VIRTIO_CONSOLE_DEVICE_ADD, 0,
+                                         NULL, 0);
+            }
+        }
+        break;
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (!value || id >= s->port_count)
+            break;
+        if (id == 0) {
+            virtio_console_send_ctrl(s, id, VIRTIO_CONSOLE_CONSOLE_PORT, 1,
+                                     NULL, 0);
+            virtio_console_send_resize(s);
+        } else {
+            virtio_console_send_ctrl(s, id, VIRTIO_CONSOLE_PORT_NAME, 1,
+                                     s->port_name[id],
+                                     strlen(s->port_name[id]));
+        }
+        virtio_console_send_ctrl(s, id, VIRTIO_CONSOLE_PORT_OPEN, 1,
+                                 NULL, 0);
+        break;
+    default:
+        /* the guest side opening or closing of a port is ignored */
+        break;
+    }
+}
+
 static int virtio_console_recv_request(VIRTIODevice *s, int queue_idx,
                                        int desc_idx, int read_size,
                                        int write_size)
 {
     VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
-    CharacterDevice *cs = s1->cs;
-    uint8_t *buf;
+    CharacterDevice *cs;
+    uint8_t buf1[256], *buf;
+    VIRTIOConsoleCtrlMsg *m;
+    int port, len;
 
-    if (queue_idx == 1) {
-        /* send to console */
-        buf = malloc(read_size);
-        memcpy_from_queue(s, buf, queue_idx, desc_idx, 0, read_size);
-        cs->write_data(cs->opaque, buf, read_size);
-        free(buf);
+    if (queue_idx == VIRTIO_CONSOLE_CTRL_QUEUE_RX) {
+        /* new buffer for the pending control messages */
+        if (s1->ctrl_count == 0)
+            return -1;
+        m = &s1->ctrl_fifo[s1->ctrl_start];
+        memcpy_to_queue(s, queue_idx, desc_idx, 0, m->buf, m->len);
+        virtio_consume_desc(s, queue_idx, desc_idx, m->len);
+        s1->ctrl_start = (s1->ctrl_start + 1) % VIRTIO_CONSOLE_CTRL_FIFO_SIZE;
+        s1->ctrl_count--;
+    } else if (queue_idx == VIRTIO_CONSOLE_CTRL_QUEUE_TX) {
+        if (read_size >= 8) {
+            memcpy_from_queue(s, buf1, queue_idx, desc_idx, 0, 8);
+            virtio_console_handle_ctrl(s1, get_le32(buf1),
+                                       get_le16(buf1 + 4), get_le16(buf1 + 6));
+        }
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+    } else if (queue_idx & 1) {
+        /* send to the port: queue 1 for port 0, 2 * n + 3 for port n */
+        port = queue_idx == 1 ? 0 : (queue_idx - 3) / 2;
+        if (port >= s1->port_count) {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+            return 0;
+        }
+        cs = s1->port_cs[port];
+        /* a buffer larger than the write space is written in several
+           parts */
+        len = read_size - s1->tx_pos[port];
+        if (cs->get_write_space)
+            len = min_int(len, cs->get_write_space(cs->opaque));
+        if (len > 0) {
+            if (len <= sizeof(buf1))
+                buf = buf1;
+            else
+                buf = malloc(len);
+            memcpy_from_queue(s, buf, queue_idx, desc_idx,
+                              s1->tx_pos[port], len);
+            cs->write_data(cs->opaque, buf, len);
+            if (buf != buf1)
+                free(buf);
+            s1->tx_pos[port] += len;
+        }
+        if (s1->tx_pos[port] < read_size) {
+            /* retried by virtio_console_write_space_event() */
+            s1->tx_blocked |= 1 << port;
+            return -1;
+        }
+        s1->tx_pos[port] = 0;
         virtio_consume_desc(s, queue_idx, desc_idx, 0);
     }
     return 0;
@@ -1324,32 +1681,51 @@ int virtio_console_get_write_len(VIRTIODevice *s)
 
 int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len)
 {
-    int queue_idx = 0;
-    QueueState *qs = &s->queue[queue_idx];
-    int desc_idx;
-    uint16_t avail_idx;
-
-    if (!qs->ready)
+    if (virtio_queue_write_buf(s, 0, buf, buf_len) < 0)
         return 0;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
-        return 0;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
-    memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, buf_len);
-    virtio_consume_desc(s, queue_idx, desc_idx, buf_len);
-    qs->last_avail_idx++;
     return buf_len;
 }
 
 /* send a resize event */
 void virtio_console_resize_event(VIRTIODevice *s, int width, int height)
 {
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+
     /* indicate the console size */
     put_le16(s->config_space + 0, width);
     put_le16(s->config_space + 2, height);
 
-    virtio_config_change_notify(s);
+    /* with multiport, the size is sent on the control queue */
+    if (s1->multiport_ready)
+        virtio_console_send_resize(s1);
+    else
+        virtio_config_change_notify(s);
+}
+
+/* process the port output which was waiting for write space */
+void virtio_console_write_space_event(VIRTIODevice *s)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    uint32_t mask;
+    int port, queue_idx;
+
+    mask = s1->tx_blocked;
+    s1->tx_blocked = 0;
+    while (mask != 0) {
+        port = ctz32(mask);
+        mask &= mask - 1;
+        queue_idx = port == 0 ? 1 : 2 * port + 3;
+        if (s->queue[queue_idx].ready)
+            queue_notify(s, queue_idx);
+    }
+}
+
+static void virtio_console_reset(VIRTIODevice *s)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+
+    s1->tx_blocked = 0;
+    memset(s1->tx_pos, 0, sizeof(s1->tx_pos));
 }
 
 VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice *cs)
@@ -1358,14 +1734,36 @@ VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice *cs)
 
     s = mallocz(sizeof(*s));
     virtio_init(&s->common, bus,
-                3, 4, virtio_console_recv_request);
-    s->common.device_features = (1 << 0); /* VIRTIO_CONSOLE_F_SIZE */
+                3, 12, virtio_console_recv_request);
+    s->common.device_features = VIRTIO_CONSOLE_F_SIZE;
+    s->common.device_reset = virtio_console_reset;
     s->common.queue[0].manual_recv = TRUE;
     
-    s->cs = cs;
+    s->port_cs[0] = cs;
+    s->port_count = 1;
     return (VIRTIODevice *)s;
 }
 
+/* add a named port (e.g. /dev/virtio-ports/'name' in Linux). The
+   guest can only write to it. Return -1 if too many ports. */
+int virtio_console_add_port(VIRTIODevice *s, const char *name,
+                            CharacterDevice *cs)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    int port;
+
+    if (s1->port_count >= VIRTIO_CONSOLE_MAX_PORTS)
+        return -1;
+    port = s1->port_count++;
+    s1->port_cs[port] = cs;
+    s1->port_name[port] = strdup(name);
+    /* input queue of the port: never filled */
+    s->queue[2 * port + 2].manual_recv = TRUE;
+    s->device_features |= VIRTIO_CONSOLE_F_MULTIPORT;
+    put_le32(s->config_space + 4, VIRTIO_CONSOLE_MAX_PORTS);
+    return 0;
+}
+
 /*********************************************************************/
 /* input device */
 
@@ -1671,11 +2069,473 @@ VIRTIODevice *virtio_input_init(VIRTIOBusDef *bus, VirtioInputTypeEnum type)
     return (VIRTIODevice *)s;
 }
 
+/*********************************************************************/
+/* entropy device */
+
+typedef struct VIRTIORNGDevice {
+    VIRTIODevice common;
+    RNGDevice *rs;
+} VIRTIORNGDevice;
+
+static int virtio_rng_recv_request(VIRTIODevice *s1, int queue_idx,
+                                   int desc_idx, int read_size,
+                                   int write_size)
+{
+    VIRTIORNGDevice *s = (VIRTIORNGDevice *)s1;
+    RNGDevice *rs = s->rs;
+    VIRTIODesc desc;
+    virtio_phys_addr_t addr;
+    uint8_t *ptr;
+    int len, l, total_len;
+
+    /* the random bytes are directly written to the guest buffers */
+    total_len = 0;
+    get_desc(s1, &desc, queue_idx, desc_idx);
+    for(;;) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            addr = desc.addr;
+            len = min_int(desc.len, write_size - total_len);
+            while (len > 0) {
+                l = min_int(len, VIRTIO_PAGE_SIZE -
+                            (addr & (VIRTIO_PAGE_SIZE - 1)));
+                ptr = s1->get_ram_ptr(s1, addr, TRUE);
+                if (!ptr)
+                    goto done;
+                rs->read_data(rs->opaque, ptr, l);
+                addr += l;
+                len -= l;
+                total_len += l;
+            }
+        }
+        if (total_len >= write_size || !(desc.flags & VRING_DESC_F_NEXT))
+            break;
+        get_desc(s1, &desc, queue_idx, desc.next);
+    }
+ done:
+    virtio_consume_desc(s1, queue_idx, desc_idx, total_len);
+    return 0;
+}
+
+VIRTIODevice *virtio_rng_init(VIRTIOBusDef *bus, RNGDevice *rs)
+{
+    VIRTIORNGDevice *s;
+
+    s = mallocz(sizeof(*s));
+    virtio_init(&s->common, bus,
+                4, 0, virtio_rng_recv_request);
+    s->common.device_features = 0;
+    s->rs = rs;
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* vhost-user devices: the queues are processed by an external
+   backend process which directly accesses the guest RAM */
+
+#ifdef CONFIG_VHOST_USER
+
+#define VIRTIO_F_VERSION_1 32
+
+typedef struct VhostUserDevice {
+    struct list_head link;
+    VIRTIODevice *dev;
+    int fd; /* Unix socket connected to the backend */
+    uint64_t features; /* backend features */
+    BOOL has_protocol_features;
+    uint64_t protocol_features; /* accepted protocol features */
+    int kick_fd[MAX_QUEUE]; /* -1 if the queue is not started */
+    int call_fd[MAX_QUEUE];
+} VhostUserDevice;
+
+static struct list_head vhost_user_list = { &vhost_user_list,
+                                            &vhost_user_list };
+
+/* send a request and wait for its reply if 'has_reply' is TRUE. Return
+   0 if OK, -1 if error. */
+static int vhost_user_request(VhostUserDevice *vu, VhostUserMsg *msg,
+                              const int *fds, int fd_count, BOOL has_reply)
+{
+    int req, rfds[VHOST_USER_MAX_FDS], rfd_count, i;
+
+    req = msg->request;
+    msg->flags = VHOST_USER_VERSION;
+    if (vhost_user_send_msg(vu->fd, msg, fds, fd_count) < 0)
+        goto fail;
+    if (has_reply) {
+        if (vhost_user_recv_msg(vu->fd, msg, rfds, &rfd_count) < 0)
+            goto fail;
+        for(i = 0; i < rfd_count; i++)
+            close(rfds[i]);
+        if (msg->request != req || !(msg->flags & VHOST_USER_REPLY_MASK))
+            goto fail;
+    }
+    return 0;
+ fail:
+    fprintf(stderr, "vhost-user: request %d failed\n", req);
+    return -1;
+}
+
+/* 'fd' is sent with the request if >= 0 */
+static int vhost_user_set_u64(VhostUserDevice *vu, int req, uint64_t val,
+                              int fd)
+{
+    VhostUserMsg msg;
+    msg.request = req;
+    msg.size = sizeof(msg.u.u64);
+    msg.u.u64 = val;
+    return vhost_user_request(vu, &msg, &fd, fd >= 0, FALSE);
+}
+
+static int vhost_user_get_u64(VhostUserDevice *vu, int req, uint64_t *pval)
+{
+    VhostUserMsg msg;
+    msg.request = req;
+    msg.size = 0;
+    if (vhost_user_request(vu, &msg, NULL, 0, TRUE) < 0 ||
+        msg.size != sizeof(msg.u.u64))
+        return -1;
+    *pval = msg.u.u64;
+    return 0;
+}
+
+static int vhost_user_set_state(VhostUserDevice *vu, int req,
+                                uint32_t index, uint32_t num)
+{
+    VhostUserMsg msg;
+    msg.request = req;
+    msg.size = sizeof(msg.u.state);
+    msg.u.state.index = index;
+    msg.u.state.num = num;
+    return vhost_user_request(vu, &msg, NULL, 0, FALSE);
+}
+
+/* return the address in the emulator of a guest buffer in shared RAM
+   or 0 if not in shared RAM */
+static uint64_t vhost_user_get_addr(VIRTIODevice *s,
+                                    virtio_phys_addr_t paddr, int len)
+{
+    PhysMemoryRange *pr;
+
+    pr = get_phys_mem_range(s->mem_map, paddr);
+    if (!pr || !pr->is_ram || pr->fd < 0 ||
+        paddr + len > pr->addr + pr->size)
+        return 0;
+    return (uintptr_t)(pr->phys_mem + (paddr - pr->addr));
+}
+
+static int vhost_user_set_mem_table(VhostUserDevice *vu,
+                                    PhysMemoryMap *map)
+{
+    VhostUserMsg msg;
+    VhostUserMemoryRegion *r;
+    PhysMemoryRange *pr;
+    int fds[VHOST_USER_MAX_RAM_SLOTS], i, n;
+
+    memset(&msg, 0, sizeof(msg));
+    n = 0;
+    for(i = 0; i < map->n_phys_mem_range; i++) {
+        pr = &map->phys_mem_range[i];
+        if (pr->is_ram && pr->fd >= 0 && n < VHOST_USER_MAX_RAM_SLOTS) {
+            r = &msg.u.memory.regions[n];
+            r->guest_phys_addr = pr->addr;
+            r->memory_size = pr->org_size;
+            r->userspace_addr = (uintptr_t)pr->phys_mem;
+            r->mmap_offset = 0;
+            fds[n++] = pr->fd;
+        }
+    }
+    if (n == 0) {
+        fprintf(stderr, "vhost-user: the guest RAM is not shared\n");
+        return -1;
+    }
+    msg.request = VHOST_USER_SET_MEM_TABLE;
+    msg.size = 8 + n * sizeof(VhostUserMemoryRegion);
+    msg.u.memory.nregions = n;
+    return vhost_user_request(vu, &msg, fds, n, FALSE);
+}
+
+static int vhost_user_start_queue(VhostUserDevice *vu, int queue_idx)
+{
+    VIRTIODevice *s = vu->dev;
+    QueueState *qs = &s->queue[queue_idx];
+    VhostUserMsg msg;
+    uint64_t desc_addr, avail_addr, used_addr;
+
+    desc_addr = vhost_user_get_addr(s, qs->desc_addr, qs->num * 16);
+    avail_addr = vhost_user_get_addr(s, qs->avail_addr, 6 + qs->num * 2);
+    used_addr = vhost_user_get_addr(s, qs->used_addr, 6 + qs->num * 8);
+    if (!desc_addr || !avail_addr || !used_addr) {
+        fprintf(stderr, "vhost-user: queue %d is not in shared RAM\n",
+                queue_idx);
+        return -1;
+    }
+    if (vhost_user_set_state(vu, VHOST_USER_SET_VRING_NUM,
+                             queue_idx, qs->num) < 0)
+        return -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_ADDR;
+    msg.size = sizeof(msg.u.addr);
+    msg.u.addr.index = queue_idx;
+    msg.u.addr.desc_user_addr = desc_addr;
+    msg.u.addr.used_user_addr = used_addr;
+    msg.u.addr.avail_user_addr = avail_addr;
+    if (vhost_user_request(vu, &msg, NULL, 0, FALSE) < 0)
+        return -1;
+    if (vhost_user_set_state(vu, VHOST_USER_SET_VRING_BASE,
+                             queue_idx, qs->last_avail_idx) < 0)
+        return -1;
+
+    vu->kick_fd[queue_idx] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    vu->call_fd[queue_idx] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (vu->kick_fd[queue_idx] < 0 || vu->call_fd[queue_idx] < 0)
+        return -1;
+    if (vhost_user_set_u64(vu, VHOST_USER_SET_VRING_KICK, queue_idx,
+                           vu->kick_fd[queue_idx]) < 0 ||
+        vhost_user_set_u64(vu, VHOST_USER_SET_VRING_CALL, queue_idx,
+                           vu->call_fd[queue_idx]) < 0)
+        return -1;
+    /* with the protocol features, the queues start disabled */
+    if (vu->has_protocol_features &&
+        vhost_user_set_state(vu, VHOST_USER_SET_VRING_ENABLE,
+                             queue_idx, 1) < 0)
+        return -1;
+    return 0;
+}
+
+/* called when the driver is ready */
+static void vhost_user_start(VIRTIODevice *s)
+{
+    VhostUserDevice *vu = s->vhost;
+    uint64_t features;
+    int i;
+
+    features = s->driver_features & vu->features;
+    if (vu->has_protocol_features)
+        features |= (uint64_t)1 << VHOST_USER_F_PROTOCOL_FEATURES;
+    if (vhost_user_set_u64(vu, VHOST_USER_SET_FEATURES, features, -1) < 0)
+        goto fail;
+    if (vhost_user_set_mem_table(vu, s->mem_map) < 0)
+        goto fail;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        if (s->queue[i].ready) {
+            if (vhost_user_start_queue(vu, i) < 0)
+                goto fail;
+        }
+    }
+    return;
+ fail:
+    vhost_user_stop(s);
+    s->status |= VIRTIO_STATUS_DEVICE_NEEDS_RESET;
+    virtio_config_change_notify(s);
+}
+
+static void vhost_user_stop(VIRTIODevice *s)
+{
+    VhostUserDevice *vu = s->vhost;
+    VhostUserMsg msg;
+    int i;
+
+    for(i = 0; i < MAX_QUEUE; i++) {
+        if (vu->kick_fd[i] >= 0) {
+            /* stop the queue */
+            msg.request = VHOST_USER_GET_VRING_BASE;
+            msg.size = sizeof(msg.u.state);
+            msg.u.state.index = i;
+            msg.u.state.num = 0;
+            if (vhost_user_request(vu, &msg, NULL, 0, TRUE) < 0 ||
+                msg.size != sizeof(msg.u.state) || msg.u.state.index != i) {
+                fprintf(stderr, "vhost-user: could not stop queue %d\n", i);
+            } else {
+                /* the queue restarts from the backend position */
+                s->queue[i].last_avail_idx = msg.u.state.num;
+            }
+            close(vu->kick_fd[i]);
+            vu->kick_fd[i] = -1;
+        }
+        if (vu->call_fd[i] >= 0) {
+            close(vu->call_fd[i]);
+            vu->call_fd[i] = -1;
+        }
+    }
+}
+
+static void vhost_user_kick(VIRTIODevice *s, int queue_idx)
+{
+    VhostUserDevice *vu = s->vhost;
+    uint64_t val = 1;
+
+    if (vu->kick_fd[queue_idx] >= 0) {
+        if (write(vu->kick_fd[queue_idx], &val, sizeof(val)) < 0) {
+            /* the counter cannot overflow in practice */
+        }
+    }
+}
+
+/* the backend signals the used buffers with the call eventfds */
+void virtio_vhost_user_set_fdset(int *pfd_max, fd_set *rfds)
+{
+    struct list_head *el;
+    VhostUserDevice *vu;
+    int i;
+
+    list_for_each(el, &vhost_user_list) {
+        vu = list_entry(el, VhostUserDevice, link);
+        for(i = 0; i < MAX_QUEUE; i++) {
+            if (vu->call_fd[i] >= 0) {
+                FD_SET(vu->call_fd[i], rfds);
+                *pfd_max = max_int(*pfd_max, vu->call_fd[i]);
+            }
+        }
+    }
+}
+
+void virtio_vhost_user_poll(fd_set *rfds)
+{
+    struct list_head *el;
+    VhostUserDevice *vu;
+    VIRTIODevice *s;
+    uint64_t val;
+    int i;
+
+    list_for_each(el, &vhost_user_list) {
+        vu = list_entry(el, VhostUserDevice, link);
+        s = vu->dev;
+        for(i = 0; i < MAX_QUEUE; i++) {
+            if (vu->call_fd[i] >= 0 && FD_ISSET(vu->call_fd[i], rfds)) {
+                if (read(vu->call_fd[i], &val, sizeof(val)) == sizeof(val)) {
+                    s->int_status |= 1;
+                    set_irq(s->irq, 1);
+                }
+            }
+        }
+    }
+}
+
+static VhostUserDevice *vhost_user_connect(const char *path)
+{
+    VhostUserDevice *vu;
+    struct sockaddr_un addr;
+    uint64_t protocol_features;
+    VhostUserMsg msg;
+    int fd, i;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    vu = mallocz(sizeof(*vu));
+    vu->fd = fd;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        vu->kick_fd[i] = -1;
+        vu->call_fd[i] = -1;
+    }
+
+    msg.request = VHOST_USER_SET_OWNER;
+    msg.size = 0;
+    if (vhost_user_request(vu, &msg, NULL, 0, FALSE) < 0)
+        goto fail;
+    if (vhost_user_get_u64(vu, VHOST_USER_GET_FEATURES, &vu->features) < 0)
+        goto fail;
+    if (vu->features & ((uint64_t)1 << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        if (vhost_user_get_u64(vu, VHOST_USER_GET_PROTOCOL_FEATURES,
+                               &protocol_features) < 0)
+            goto fail;
+        protocol_features &= (uint64_t)1 << VHOST_USER_PROTOCOL_F_CONFIG;
+        if (vhost_user_set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES,
+                               protocol_features, -1) < 0)
+            goto fail;
+        vu->has_protocol_features = TRUE;
+        vu->protocol_features = protocol_features;
+    }
+    return vu;
+ fail:
+    close(fd);
+    free(vu);
+    return NULL;
+}
+
+/* 'device_id' is 1 (network) or 2 (block). Return NULL if the
+   connection to the backend at 'path' failed. */
+VIRTIODevice *virtio_vhost_user_init(VIRTIOBusDef *bus, int device_id,
+                                     const char *path)
+{
+    static int net_count;
+    VhostUserDevice *vu;
+    VIRTIODevice *s;
+    VhostUserMsg msg;
+    uint32_t features;
+
+    vu = vhost_user_connect(path);
+    if (!vu)
+        return NULL;
+    s = mallocz(sizeof(*s));
+    features = vu->features & ~((uint32_t)1 << VHOST_USER_F_PROTOCOL_FEATURES);
+    switch(device_id) {
+    case 1:
+        virtio_init(s, bus, 1, 6 + 2, NULL);
+        /* the MAC address is chosen by the emulator. The features
+           which need more configuration fields are not supported. */
+        features &= ~((1 << 3) | (1 << 16) | (1 << 22)); /* MTU, STATUS, MQ */
+        features |= 1 << 5; /* VIRTIO_NET_F_MAC */
+        s->config_space[0] = 0x02;
+        s->config_space[5] = 0x10 + net_count++;
+        break;
+    case 2:
+        /* the capacity is given by the backend */
+        memset(&msg, 0, sizeof(msg));
+        msg.request = VHOST_USER_GET_CONFIG;
+        msg.size = 12 + 60;
+        msg.u.config.size = 60; /* sizeof(struct virtio_blk_config) */
+        if (!(vu->protocol_features &
+              ((uint64_t)1 << VHOST_USER_PROTOCOL_F_CONFIG)) ||
+            vhost_user_request(vu, &msg, NULL, 0, TRUE) < 0 ||
+            msg.u.config.size < 8 || msg.u.config.size > 60) {
+            fprintf(stderr, "%s: could not get the block device "
+                    "configuration\n", path);
+            close(vu->fd);
+            free(vu);
+            free(s);
+            return NULL;
+        }
+        virtio_init(s, bus, 2, (msg.u.config.size + 3) & ~3, NULL);
+        memcpy(s->config_space, msg.u.config.region, msg.u.config.size);
+        features &= ~((1 << 11) | (1 << 12)); /* CONFIG_WCE, MQ */
+        break;
+    default:
+        abort();
+    }
+    s->device_features = features;
+    vu->dev = s;
+    s->vhost = vu;
+    list_add_tail(&vu->link, &vhost_user_list);
+    return s;
+}
+
+#endif /* CONFIG_VHOST_USER */
+
 /*********************************************************************/
 /* 9p filesystem device */
 
-typedef struct {
+/* message size range accepted in Tversion */
+#define P9_MSIZE_MIN 4096
+#define P9_MSIZE_MAX (1024 * 1024)
+/* maximum number of names in Twalk */
+#define P9_MAXWELEM 16
+/* Linux uses one descriptor per page of the message */
+#define P9_QUEUE_NUM 1024
+
+typedef struct FIDDesc {
     struct list_head link;
+    struct FIDDesc *hash_next;
     uint32_t fid;
     FSFile *fd;
 } FIDDesc;
@@ -1685,16 +2545,49 @@ typedef struct VIRTIO9PDevice {
     FSDevice *fs;
     int msize; /* maximum message size */
     struct list_head fid_list; /* list of FIDDesc */
+    FIDDesc **fid_hash; /* fid -> FIDDesc, size is a power of two */
+    int fid_hash_size;
+    int fid_count;
+    uint8_t *iobuf; /* msize bytes, used when the guest buffers are
+                       too fragmented */
+    /* valid during virtio_9p_recv_request() */
+    const uint8_t *req_buf; /* host contiguous start of the request */
+    int req_len;
+    uint8_t *reply_buf; /* reply built in the guest buffer or NULL */
     BOOL req_in_progress;
 } VIRTIO9PDevice;
 
+static inline uint32_t fid_hash(VIRTIO9PDevice *s, uint32_t fid)
+{
+    /* Linux allocates the fids sequentially */
+    return fid & (s->fid_hash_size - 1);
+}
+
+static void fid_hash_resize(VIRTIO9PDevice *s, int new_size)
+{
+    FIDDesc **new_hash, *f, *f_next;
+    int i;
+    uint32_t h;
+
+    new_hash = mallocz(sizeof(new_hash[0]) * new_size);
+    for(i = 0; i < s->fid_hash_size; i++) {
+        for(f = s->fid_hash[i]; f != NULL; f = f_next) {
+            f_next = f->hash_next;
+            h = f->fid & (new_size - 1);
+            f->hash_next = new_hash[h];
+            new_hash[h] = f;
+        }
+    }
+    free(s->fid_hash);
+    s->fid_hash = new_hash;
+    s->fid_hash_size = new_size;
+}
+
 static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
 {
-    struct list_head *el;
     FIDDesc *f;
 
-    list_for_each(el, &s->fid_list) {
-        f = list_entry(el, FIDDesc, link);
+    for(f = s->fid_hash[fid_hash(s, fid)]; f != NULL; f = f->hash_next) {
         if (f->fid == fid)
             return f;
     }
@@ -1711,31 +2604,49 @@ static FSFile *fid_find(VIRTIO9PDevice *s, uint32_t fid)
     return f->fd;
 }
 
+static void fid_free(VIRTIO9PDevice *s, FIDDesc *f)
+{
+    FIDDesc **pf;
+
+    for(pf = &s->fid_hash[fid_hash(s, f->fid)]; *pf != f;
+        pf = &(*pf)->hash_next)
+        continue;
+    *pf = f->hash_next;
+    s->fs->fs_delete(s->fs, f->fd);
+    list_del(&f->link);
+    free(f);
+    s->fid_count--;
+}
+
 static void fid_delete(VIRTIO9PDevice *s, uint32_t fid)
 {
     FIDDesc *f;
 
     f = fid_find1(s, fid);
-    if (f) {
-        s->fs->fs_delete(s->fs, f->fd);
-        list_del(&f->link);
-        free(f);
-    }
+    if (f)
+        fid_free(s, f);
 }
 
 static void fid_set(VIRTIO9PDevice *s, uint32_t fid, FSFile *fd)
 {
     FIDDesc *f;
+    uint32_t h;
 
     f = fid_find1(s, fid);
     if (f) {
         s->fs->fs_delete(s->fs, f->fd);
         f->fd = fd;
     } else {
+        if (s->fid_count >= s->fid_hash_size)
+            fid_hash_resize(s, s->fid_hash_size * 2);
         f = malloc(sizeof(*f));
         f->fid = fid;
         f->fd = fd;
         list_add(&f->link, &s->fid_list);
+        h = fid_hash(s, fid);
+        f->hash_next = s->fid_hash[h];
+        s->fid_hash[h] = f;
+        s->fid_count++;
     }
 }
 
@@ -1888,15 +2799,31 @@ static int marshall(VIRTIO9PDevice *s,
     return buf - buf1;
 }
 
+/* Return a pointer to 'len' bytes of the request at 'offset'. They
+   are read in place if they are in the host contiguous start of the
+   request, otherwise they are copied to 'buf'. Return NULL if the
+   request is too short. */
+static const uint8_t *get_req_data(VIRTIO9PDevice *s, uint8_t *buf,
+                                   int queue_idx, int desc_idx,
+                                   int offset, int len)
+{
+    if (offset + len <= s->req_len)
+        return s->req_buf + offset;
+    if (memcpy_from_queue((VIRTIODevice *)s, buf, queue_idx, desc_idx,
+                          offset, len))
+        return NULL;
+    return buf;
+}
+
 /* return < 0 if error */
 /* XXX: free allocated strings in case of error */
 static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
                       int desc_idx, int *poffset, const char *fmt, ...)
 {
-    VIRTIODevice *s1 = (VIRTIODevice *)s;
     va_list ap;
     int offset, c;
     uint8_t buf[16];
+    const uint8_t *p;
 
     offset = *poffset;
     va_start(ap, fmt);
@@ -1908,10 +2835,11 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'b':
             {
                 uint8_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 1))
+                p = get_req_data(s, buf, queue_idx, desc_idx, offset, 1);
+                if (!p)
                     return -1;
                 ptr = va_arg(ap, uint8_t *);
-                *ptr = buf[0];
+                *ptr = p[0];
                 offset += 1;
 #ifdef DEBUG_VIRTIO
                 if (s->common.debug & VIRTIO_DEBUG_9P)
@@ -1922,10 +2850,11 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'h':
             {
                 uint16_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
+                p = get_req_data(s, buf, queue_idx, desc_idx, offset, 2);
+                if (!p)
                     return -1;
                 ptr = va_arg(ap, uint16_t *);
-                *ptr = get_le16(buf);
+                *ptr = get_le16(p);
                 offset += 2;
 #ifdef DEBUG_VIRTIO
                 if (s->common.debug & VIRTIO_DEBUG_9P)
@@ -1936,10 +2865,11 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'w':
             {
                 uint32_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 4))
+                p = get_req_data(s, buf, queue_idx, desc_idx, offset, 4);
+                if (!p)
                     return -1;
                 ptr = va_arg(ap, uint32_t *);
-                *ptr = get_le32(buf);
+                *ptr = get_le32(p);
                 offset += 4;
 #ifdef DEBUG_VIRTIO
                 if (s->common.debug & VIRTIO_DEBUG_9P)
@@ -1950,10 +2880,11 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'd':
             {
                 uint64_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 8))
+                p = get_req_data(s, buf, queue_idx, desc_idx, offset, 8);
+                if (!p)
                     return -1;
                 ptr = va_arg(ap, uint64_t *);
-                *ptr = get_le64(buf);
+                *ptr = get_le64(p);
                 offset += 8;
 #ifdef DEBUG_VIRTIO
                 if (s->common.debug & VIRTIO_DEBUG_9P)
@@ -1966,13 +2897,20 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
                 char *str, **ptr;
                 int len;
 
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
+                p = get_req_data(s, buf, queue_idx, desc_idx, offset, 2);
+                if (!p)
                     return -1;
-                len = get_le16(buf);
+                len = get_le16(p);
                 offset += 2;
                 str = malloc(len + 1);
-                if (memcpy_from_queue(s1, str, queue_idx, desc_idx, offset, len))
+                p = get_req_data(s, (uint8_t *)str, queue_idx, desc_idx,
+                                 offset, len);
+                if (!p) {
+                    free(str);
                     return -1;
+                }
+                if (p != (uint8_t *)str)
+                    memcpy(str, p, len);
                 str[len] = '\0';
                 offset += len;
                 ptr = va_arg(ap, char **);
@@ -1992,11 +2930,13 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
     return 0;
 }
 
-static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
-                                 int desc_idx, uint8_t id, uint16_t tag, 
-                                 uint8_t *buf, int buf_len)
+/* the 'buf_len' bytes of the reply following the header are already
+   in the queue */
+static void virtio_9p_send_reply_header(VIRTIO9PDevice *s, int queue_idx,
+                                        int desc_idx, uint8_t id,
+                                        uint16_t tag, int buf_len)
 {
-    uint8_t *buf1;
+    uint8_t buf1[7];
     int len;
 
 #ifdef DEBUG_VIRTIO
@@ -2006,15 +2946,31 @@ static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
         printf("\n");
     }
 #endif
+    TRACE(p9_reply, s, id, tag, buf_len);
     len = buf_len + 7;
-    buf1 = malloc(len);
     put_le32(buf1, len);
     buf1[4] = id + 1;
     put_le16(buf1 + 5, tag);
-    memcpy(buf1 + 7, buf, buf_len);
-    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, len);
+    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, 7);
     virtio_consume_desc((VIRTIODevice *)s, queue_idx, desc_idx, len);
-    free(buf1);
+}
+
+/* copy the reply after the header unless it was directly built in
+   the guest buffer */
+static void virtio_9p_put_reply(VIRTIO9PDevice *s, int queue_idx,
+                                int desc_idx, uint8_t *buf, int buf_len)
+{
+    if (buf != s->reply_buf)
+        memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 7, buf,
+                        buf_len);
+}
+
+static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
+                                 int desc_idx, uint8_t id, uint16_t tag, 
+                                 uint8_t *buf, int buf_len)
+{
+    virtio_9p_put_reply(s, queue_idx, desc_idx, buf, buf_len);
+    virtio_9p_send_reply_header(s, queue_idx, desc_idx, id, tag, buf_len);
 }
 
 static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
@@ -2072,11 +3028,12 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                                    int write_size)
 {
     VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
-    int offset, header_len;
+    int offset, header_len, len;
     uint8_t id;
     uint16_t tag;
-    uint8_t buf[1024];
-    int buf_len, err;
+    uint8_t buf1[1024], *buf;
+    const uint8_t *p;
+    int buf_size, buf_len, err;
     FSDevice *fs = s->fs;
 
     if (queue_idx != 0)
@@ -2085,16 +3042,30 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
     if (s->req_in_progress)
         return -1;
     
+    /* The request is parsed in place if it is host contiguous. Only
+       the first page is mapped because the payload of a write is
+       accessed separately. */
+    s->req_buf = get_queue_ptr(s1, &s->req_len, queue_idx, desc_idx, 0,
+                               min_int(read_size, VIRTIO_PAGE_SIZE), FALSE);
+    /* the reply is built in the guest buffer if it is host contiguous */
+    buf_size = sizeof(buf1);
+    buf = get_queue_ptr(s1, &len, queue_idx, desc_idx, 7, buf_size, TRUE);
+    if (!buf || len != buf_size)
+        buf = buf1;
+    s->reply_buf = buf;
+
     offset = 0;
     header_len = 4 + 1 + 2;
-    if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, header_len)) {
+    p = get_req_data(s, buf1, queue_idx, desc_idx, offset, header_len);
+    if (!p) {
         tag = 0;
         goto protocol_error;
     }
-    //size = get_le32(buf);
-    id = buf[4];
-    tag = get_le16(buf + 5);
+    //size = get_le32(p);
+    id = p[4];
+    tag = get_le16(p + 5);
     offset += header_len;
+    TRACE(p9_request, s, id, tag);
     
 #ifdef DEBUG_VIRTIO
     if (s1->debug & VIRTIO_DEBUG_9P) {
@@ -2114,7 +3085,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSStatFS st;
 
             fs->fs_statfs(fs, &st);
-            buf_len = marshall(s, buf, sizeof(buf),
+            buf_len = marshall(s, buf, buf_size,
                                "wwddddddw", 
                                0,
                                st.f_bsize,
@@ -2174,7 +3145,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(name);
             if (err) 
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf),
+            buf_len = marshall(s, buf, buf_size,
                                "Qw", &qid, s->msize - 24);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
@@ -2199,7 +3170,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(symgt);
             if (err)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf),
+            buf_len = marshall(s, buf, buf_size,
                                "Q", &qid);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
@@ -2223,7 +3194,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(name);
             if (err)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf),
+            buf_len = marshall(s, buf, buf_size,
                                "Q", &qid);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
@@ -2245,7 +3216,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             }
             if (err)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf), "s", buf1);
+            buf_len = marshall(s, buf, buf_size, "s", buf1);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
         break;
@@ -2266,7 +3237,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             if (err)
                 goto error;
 
-            buf_len = marshall(s, buf, sizeof(buf),
+            buf_len = marshall(s, buf, buf_size,
                                "dQwwwddddddddddddddd", 
                                mask, &st.qid,
                                st.st_mode, st.st_uid, st.st_gid,
@@ -2312,7 +3283,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
         {
             uint32_t fid, count;
             uint64_t offs;
-            uint8_t *buf;
+            uint8_t *buf2;
             int n;
             FSFile *f;
 
@@ -2322,15 +3293,24 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf = malloc(count + 4);
-            n = fs->fs_readdir(fs, f, offs, buf + 4, count);
+            if (count > s->msize - 11)
+                count = s->msize - 11;
+            /* the entries are directly written to the guest buffer if
+               it is contiguous */
+            buf2 = get_queue_ptr(s1, &len, queue_idx, desc_idx, 11, count,
+                                 TRUE);
+            if (!buf2 || len != count)
+                buf2 = s->iobuf;
+            n = fs->fs_readdir(fs, f, offs, buf2, count);
             if (n < 0) {
                 err = n;
                 goto error;
             }
+            if (buf2 == s->iobuf)
+                memcpy_to_queue(s1, queue_idx, desc_idx, 11, s->iobuf, n);
             put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
+            virtio_9p_put_reply(s, queue_idx, desc_idx, buf, 4);
+            virtio_9p_send_reply_header(s, queue_idx, desc_idx, id, tag, n + 4);
         }
         break;
     case 50: /* fsync */
@@ -2362,7 +3342,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(lock.client_id);
             if (err < 0)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf), "b", err);
+            buf_len = marshall(s, buf, buf_size, "b", err);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
         break;
@@ -2386,7 +3366,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                 free(lock.client_id);
                 goto error;
             }
-            buf_len = marshall(s, buf, sizeof(buf), "bddws",
+            buf_len = marshall(s, buf, buf_size, "bddws",
                                &lock.type,
                                &lock.start, &lock.length,
                                &lock.proc_id, &lock.client_id);
@@ -2432,7 +3412,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             err = fs->fs_mkdir(fs, &qid, f, name, mode, gid);
             if (err != 0)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
+            buf_len = marshall(s, buf, buf_size, "Q", &qid);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
         break;
@@ -2487,10 +3467,20 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             if (unmarshall(s, queue_idx, desc_idx, &offset, 
                            "ws", &msize, &version))
                 goto protocol_error;
+            if (msize < P9_MSIZE_MIN) {
+                free(version);
+                goto protocol_error;
+            }
+            if (msize > P9_MSIZE_MAX)
+                msize = P9_MSIZE_MAX;
+            if (msize > s->msize) {
+                free(s->iobuf);
+                s->iobuf = malloc(msize);
+            }
             s->msize = msize;
             //            printf("version: msize=%d version=%s\n", msize, version);
             free(version);
-            buf_len = marshall(s, buf, sizeof(buf), "ws", s->msize, "9P2000.L");
+            buf_len = marshall(s, buf, buf_size, "ws", s->msize, "9P2000.L");
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
         break;
@@ -2510,7 +3500,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             fid_set(s, fid, f);
             free(uname);
             free(aname);
-            buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
+            buf_len = marshall(s, buf, buf_size, "Q", &qid);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
         break;
@@ -2528,19 +3518,20 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
         {
             uint32_t fid, newfid;
             uint16_t nwname;
-            FSQID *qids;
-            char **names;
+            FSQID qids[P9_MAXWELEM];
+            char *names[P9_MAXWELEM];
             FSFile *f;
             int i;
 
             if (unmarshall(s, queue_idx, desc_idx, &offset, 
                            "wwh", &fid, &newfid, &nwname))
                 goto protocol_error;
+            if (nwname > P9_MAXWELEM)
+                goto protocol_error;
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            names = mallocz(sizeof(names[0]) * nwname);
-            qids = malloc(sizeof(qids[0]) * nwname);
+            memset(names, 0, sizeof(names[0]) * nwname);
             for(i = 0; i < nwname; i++) {
                 if (unmarshall(s, queue_idx, desc_idx, &offset, 
                                "s", &names[i])) {
@@ -2553,17 +3544,13 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             for(i = 0; i < nwname; i++) {
                 free(names[i]);
             }
-            free(names);
-            if (err < 0) {
-                free(qids);
+            if (err < 0)
                 goto error;
-            }
-            buf_len = marshall(s, buf, sizeof(buf), "h", err);
+            buf_len = marshall(s, buf, buf_size, "h", err);
             for(i = 0; i < err; i++) {
-                buf_len += marshall(s, buf + buf_len, sizeof(buf) - buf_len,
+                buf_len += marshall(s, buf + buf_len, buf_size - buf_len,
                                     "Q", &qids[i]);
             }
-            free(qids);
             fid_set(s, newfid, f);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
@@ -2572,8 +3559,8 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
         {
             uint32_t fid, count;
             uint64_t offs;
-            uint8_t *buf;
-            int n;
+            uint8_t *buf1;
+            int n, l, len, ret;
             FSFile *f;
 
             if (unmarshall(s, queue_idx, desc_idx, &offset,
@@ -2582,16 +3569,42 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf = malloc(count + 4);
-            n = fs->fs_read(fs, f, offs, buf + 4, count);
-            if (n < 0) {
-                err = n;
-                free(buf);
-                goto error;
+            if (count > s->msize - 11)
+                count = s->msize - 11;
+            /* The data is directly read to the guest buffer. The first
+               page is read separately so that small reads do not need
+               to map the whole buffer. If the rest is fragmented, a
+               single read followed by a copy is faster than one read
+               per page. */
+            n = 0;
+            l = min_int(count, VIRTIO_PAGE_SIZE);
+            while (n < count) {
+                buf1 = get_queue_ptr(s1, &len, queue_idx, desc_idx,
+                                     11 + n, l, TRUE);
+                if (buf1 && len == l) {
+                    ret = fs->fs_read(fs, f, offs + n, buf1, l);
+                } else {
+                    l = count - n;
+                    ret = fs->fs_read(fs, f, offs + n, s->iobuf, l);
+                    if (ret > 0)
+                        memcpy_to_queue(s1, queue_idx, desc_idx, 11 + n,
+                                        s->iobuf, ret);
+                }
+                if (ret < 0) {
+                    if (n == 0) {
+                        err = ret;
+                        goto error;
+                    }
+                    break;
+                }
+                n += ret;
+                if (ret < l)
+                    break;
+                l = count - n;
             }
             put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
+            virtio_9p_put_reply(s, queue_idx, desc_idx, buf, 4);
+            virtio_9p_send_reply_header(s, queue_idx, desc_idx, id, tag, n + 4);
         }
         break;
     case 118: /* write */
@@ -2599,28 +3612,33 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             uint32_t fid, count;
             uint64_t offs;
             uint8_t *buf1;
-            int n;
+            int n, len;
             FSFile *f;
 
             if (unmarshall(s, queue_idx, desc_idx, &offset,
                            "wdw", &fid, &offs, &count))
                 goto protocol_error;
+            if (count > s->msize)
+                goto protocol_error;
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf1 = malloc(count);
-            if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
-                                  count)) {
-                free(buf1);
-                goto protocol_error;
+            /* the data is directly written from the guest buffer if
+               it is contiguous */
+            buf1 = get_queue_ptr(s1, &len, queue_idx, desc_idx,
+                                 offset, count, FALSE);
+            if (!buf1 || len != count) {
+                buf1 = s->iobuf;
+                if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
+                                      count))
+                    goto protocol_error;
             }
             n = fs->fs_write(fs, f, offs, buf1, count);
-            free(buf1);
             if (n < 0) {
                 err = n;
                 goto error;
             }
-            buf_len = marshall(s, buf, sizeof(buf), "w", n);
+            buf_len = marshall(s, buf, buf_size, "w", n);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
         break;
@@ -2649,6 +3667,25 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
     goto error;
 }
 
+static BOOL virtio_9p_is_busy(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    return s->req_in_progress;
+}
+
+/* the fids do not survive a reset */
+static void virtio_9p_reset(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    struct list_head *el, *el1;
+    FIDDesc *f;
+
+    list_for_each_safe(el, el1, &s->fid_list) {
+        f = list_entry(el, FIDDesc, link);
+        fid_free(s, f);
+    }
+}
+
 VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
                              const char *mount_tag)
 
@@ -2662,6 +3699,10 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
     virtio_init(&s->common, bus,
                 9, 2 + len, virtio_9p_recv_request);
     s->common.device_features = 1 << 0;
+    s->common.queue_num_max = P9_QUEUE_NUM;
+    virtio_reset(&s->common);
+    s->common.device_is_busy = virtio_9p_is_busy;
+    s->common.device_reset = virtio_9p_reset;
 
     /* set the mount tag */
     cfg = s->common.config_space;
@@ -2671,7 +3712,10 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
 
     s->fs = fs;
     s->msize = 8192;
+    s->iobuf = malloc(s->msize);
     init_list_head(&s->fid_list);
+    s->fid_hash_size = 64;
+    s->fid_hash = mallocz(sizeof(s->fid_hash[0]) * s->fid_hash_size);
     
     return (VIRTIODevice *)s;
 }
@@ -58,6 +58,8 @@ typedef struct VIRTIODevice VIRTIODevice;
 #define VIRTIO_DEBUG_9P (1 << 1)
 
 void virtio_set_debug(VIRTIODevice *s, int debug_flags);
+BOOL virtio_is_busy(VIRTIODevice *s);
+void virtio_reset_device(VIRTIODevice *s);
 
 /* block device */
 
@@ -111,6 +113,9 @@ typedef struct {
     void *opaque;
     void (*write_data)(void *opaque, const uint8_t *buf, int len);
     int (*read_data)(void *opaque, uint8_t *buf, int len);
+    /* optional: number of bytes write_data() can accept without
+       losing data */
+    int (*get_write_space)(void *opaque);
 } CharacterDevice;
 
 VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice *cs);
@@ -118,6 +123,9 @@ BOOL virtio_console_can_write_data(VIRTIODevice *s);
 int virtio_console_get_write_len(VIRTIODevice *s);
 int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len);
 void virtio_console_resize_event(VIRTIODevice *s, int width, int height);
+void virtio_console_write_space_event(VIRTIODevice *s);
+int virtio_console_add_port(VIRTIODevice *s, const char *name,
+                            CharacterDevice *cs);
 
 /* input device */
 
@@ -136,6 +144,19 @@ int virtio_input_send_mouse_event(VIRTIODevice *s, int dx, int dy, int dz,
 
 VIRTIODevice *virtio_input_init(VIRTIOBusDef *bus, VirtioInputTypeEnum type);
 
+/* vhost-user devices */
+
+#ifdef CONFIG_VHOST_USER
+VIRTIODevice *virtio_vhost_user_init(VIRTIOBusDef *bus, int device_id,
+                                     const char *path);
+void virtio_vhost_user_set_fdset(int *pfd_max, fd_set *rfds);
+void virtio_vhost_user_poll(fd_set *rfds);
+#endif
+
+/* entropy device */
+
+VIRTIODevice *virtio_rng_init(VIRTIOBusDef *bus, RNGDevice *rs);
+
 /* 9p filesystem device */
 
 #include "fs.h"
@@ -2077,6 +2077,10 @@ static VirtMachine *pc_machine_init(const VirtMachineParams *p)
     if (p->console) {
         /* virtio console */
         s->common.console_dev = virtio_console_init(vbus, p->console);
+        if (p->log_console) {
+            virtio_console_add_port(s->common.console_dev, VM_LOG_PORT_NAME,
+                                    p->log_console);
+        }
     }
     
     /* block devices */
@@ -2095,6 +2099,9 @@ static VirtMachine *pc_machine_init(const VirtMachineParams *p)
                 tab_bs[1] = p->tab_drive[i++].block_dev;
             ide_init(s->port_map, 0x1f0, 0x3f6, &s->pic_irq[14], tab_bs);
             piix3_ide_init(pci_bus, piix3_devfn + 1);
+        } else {
+            vm_error("unsupported drive device: %s\n", de->device);
+            exit(1);
         }
     }
     
@@ -2148,6 +2155,11 @@ static VirtMachine *pc_machine_init(const VirtMachineParams *p)
     
     /* virtio net device */
     for(i = 0; i < p->eth_count; i++) {
+        if (!p->tab_eth[i].net) {
+            vm_error("unsupported network driver: %s\n",
+                     p->tab_eth[i].driver);
+            exit(1);
+        }
         virtio_net_init(vbus, p->tab_eth[i].net);
         s->common.net = p->tab_eth[i].net;
     }